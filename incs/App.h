@@ -0,0 +1,34 @@
+#ifndef APP_H
+#define APP_H
+
+#include "USB.h"
+#include "Sim.h"
+
+// cmdREBOOT to application enumeration
+#define APP_TIMEOUT_MS 5000
+
+/*
+ * Post reboot check, the application's vid:pid or, with app_gone,
+ * only that the bootloader stays off the bus until the timeout.
+ */
+typedef struct
+{
+  int enabled;
+  int app_gone;
+  unsigned int vid;
+  unsigned int pid;
+  int timeout_ms;
+  libusb_context *ctx;  // NULL = the default context
+  const TUsbTopo *port; // only the board on this port counts, NULL = any
+  int quiet;            // only failures are reported, on stderr
+  TUsbWait app;
+  TUsbWait boot;
+} TAppCheck;
+
+int app_check_parse(TAppCheck *check, const char *arg);
+void app_check_arm(TAppCheck *check);
+void app_check_disarm(TAppCheck *check);
+int app_check_wait(TAppCheck *check, double reboot_ms);
+int app_check_sim(TAppCheck *check, TSim *sim);
+
+#endif
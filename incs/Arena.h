@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "Types.h"
+#include "Sim.h"
+
+// every block starts on this boundary
+#define ARENA_ALIGN 16
+
+// resident set an arena soak may grow by once warmed up
+#define ARENA_RSS_SLACK_KB 1024
+
+// sessions an arena soak runs before it takes the warm RSS
+#define ARENA_WARMUP 10
+
+/*
+ * One block sized from the device geometry, carved up by a session
+ * and reset in one go when the session is released, so a process
+ * flashing board after board allocates its images once
+ */
+typedef struct TArena
+{
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  size_t high;     // most ever used
+  uint32_t resets;
+} TArena;
+
+struct TBootSession;
+
+size_t arena_session_size(const TBootInfo *bootinfo);
+int arena_reserve(TArena *arena, size_t size);
+void *arena_alloc(TArena *arena, size_t len);
+void arena_rewind(TArena *arena, size_t mark);
+void arena_reset(TArena *arena);
+void arena_free(TArena *arena);
+
+int heap_counted(void);
+uint64_t heap_allocations(void);
+int arena_soak(const TSimConfig *cfg, const struct TBootSession *proto, int iterations, FILE *out);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "Types.h"
+#include "HexFile.h"
+
+// bound on the conditioned images kept, oldest used go first
+#define IMAGE_CACHE_MAX_MB 64
+
+// temporary files of a writer that died are removed after this long
+#define IMAGE_CACHE_STALE_S 3600
+
+// images start page aligned after the header so prg maps aligned
+#define IMAGE_CACHE_DATA_OFFSET 4096
+
+/*
+ * Where conditioned images live and how much of the disk they get,
+ * shared read only by the sessions of one process
+ */
+typedef struct TImageCache
+{
+  char dir[400];
+  uint64_t max_bytes;
+} TImageCache;
+
+int image_cache_open(TImageCache *cache, const char *dir, uint64_t max_bytes);
+int image_cache_key(char **paths, int path_count, const TBootInfo *bootinfo, uint64_t *key);
+uint64_t image_geometry_key(const TBootInfo *bootinfo);
+int image_cache_load(const TImageCache *cache, uint64_t key, const TBootInfo *bootinfo, THexImage *image);
+int image_cache_store(const TImageCache *cache, uint64_t key, const TBootInfo *bootinfo, const THexImage *image);
+void image_cache_unmap(THexImage *image);
+
+#endif
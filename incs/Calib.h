@@ -0,0 +1,50 @@
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "USB.h"
+#include "Types.h"
+
+// scratch pages erased and written when --calibrate names none
+#define CALIB_PAGES 4
+#define CALIB_MAX_PAGES 16
+
+// repetitions of the single page erase and single row write
+#define CALIB_ROUNDS 5
+
+// per transfer, as long as the engine waits
+#define CALIB_TIMEOUT_MS 5000
+
+/*
+ * Measured speed of one board and bootloader revision, stored as
+ * json per sDevDsc and uiBootRev
+ */
+typedef struct
+{
+  char dev_dsc[MAX_STRING_FIELD_LENGTH + 1];
+  uint16_t boot_rev;
+  uint32_t mcu_size;
+  uint16_t erase_block;
+  uint16_t write_block;
+
+  double erase_page_ms;       // single page erase, p50
+  double erase_page_p99_ms;
+  double erase_batch_page_ms; // per page of a multi page erase
+  double row_ms;              // committing one write row, p50
+  double row_p99_ms;
+  double report_ms;           // one data report absorbed, p50
+  double report_p99_ms;
+  double sustained_kbs;       // long write, command to acknowledge
+
+  uint32_t scratch;
+  uint32_t pages;
+} TCalProfile;
+
+int calib_parse_region(const char *text, uint32_t *address, uint32_t *pages);
+int calib_run(TTransport *tp, uint32_t address, uint32_t pages, TCalProfile *profile, FILE *out);
+int calib_save(const TCalProfile *profile, const char *dir, char *path, size_t len);
+int calib_load(TCalProfile *profile, const char *dir, const TBootInfo *bootinfo);
+double calib_estimate_ms(const TCalProfile *profile, uint32_t pages, uint32_t bytes);
+
+#endif
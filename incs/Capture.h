@@ -0,0 +1,27 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include "USB.h"
+#include "Sim.h"
+
+#define CAPTURE_MAGIC "# mikro_hb capture 1"
+
+/*
+ * Records every transfer of the wrapped transport, both directions,
+ * one line each:  start_us duration_us OUT|IN kind result length hex
+ */
+typedef struct
+{
+  TTransport *inner;
+  FILE *fp;
+  double start_ms;
+  TFrameTracker frame;
+} TCapture;
+
+int capture_open(TTransport *tp, TCapture *cap, TTransport *inner, const char *path);
+void capture_close(TCapture *cap);
+
+int replay_load(TSimConfig *cfg, const char *path, double *recorded_ms);
+
+#endif
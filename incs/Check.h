@@ -0,0 +1,43 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "Sim.h"
+
+// files one check run takes
+#define CHECK_MAX_FILES 4096
+
+// worker threads at most, 0 on the command line = one per cpu
+#define CHECK_MAX_JOBS 64
+
+/*
+ * What a hex file holds and what flashing it would do on the checked
+ * geometry, addresses are physical, the ends exclusive
+ */
+typedef struct
+{
+  const char *path;
+  int result;              // 0 = fits and parses clean
+  uint32_t records;
+  uint32_t bad_checksums;
+  uint32_t malformed;      // lines that are not a valid record
+  uint32_t first_bad_line;
+  int eof;                 // end of file record seen
+  uint32_t prg_start;      // program flash data, prg_end 0 = none
+  uint32_t prg_end;
+  uint32_t conf_start;     // config flash data, conf_end 0 = none
+  uint32_t conf_end;
+  uint32_t prg_bytes;      // data bytes in program flash
+  uint32_t conf_bytes;
+  uint32_t outside;        // data bytes the engine can not place
+  uint32_t erase_end;      // end of the program erase pages written
+  uint32_t app_limit;      // boot vector page or ulBootStart, the lower
+  uint32_t reports;        // OUT reports a session sends, 0 = not run
+  char problem[96];
+  double ms;
+} TCheckResult;
+
+int check_run(char **paths, int count, const TSimConfig *geometry, int jobs, FILE *out);
+
+#endif
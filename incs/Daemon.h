@@ -0,0 +1,15 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+// default socket of the flash job server
+#define DAEMON_SOCKET_PATH "/tmp/mikro_hb.sock"
+
+// permissions of the socket, anyone who can connect can flash
+#define DAEMON_SOCKET_MODE 0600
+
+// conditioned images kept resident between jobs
+#define DAEMON_IMAGE_CACHE 8
+
+int run_daemon(const char *socket_path, unsigned int socket_mode, int schedule, double hub_kbs);
+
+#endif
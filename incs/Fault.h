@@ -0,0 +1,84 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <stdint.h>
+#include "USB.h"
+#include "HexFile.h"
+
+// entries one fault plan can hold
+#define FAULT_MAX 32
+
+#define FAULT_OUT 0
+#define FAULT_IN 1
+
+typedef enum
+{
+  faultDROP,       // OUT never reaches the device, IN response is lost
+  faultDELAY,      // transfer held back for ms, a timeout if that is too long
+  faultCORRUPT,    // one byte of the report flipped
+  faultFAIL,       // transfer returns code without touching the device
+  faultDISCONNECT, // device gone from here on
+  faultKINDS
+} TFaultKind;
+
+/*
+ * One entry of a plan, fires at transfer index of its direction or,
+ * with rate > 0, on each transfer with that probability
+ */
+typedef struct
+{
+  TFaultKind kind;
+  int dir;
+  uint32_t index;
+  double rate;
+  double delay_ms;
+  int code;
+} TFault;
+
+typedef struct
+{
+  uint64_t seed;
+  TFault faults[FAULT_MAX];
+  int count;
+} TFaultPlan;
+
+/*
+ * Transport between the engine and the device that applies a plan,
+ * transfers are counted per direction from 0
+ */
+typedef struct
+{
+  TTransport *inner;
+  TFaultPlan plan;
+  uint64_t rng;
+  uint32_t index[2];
+  int disconnected;
+
+  // what was injected
+  uint32_t injected;
+  double first_ms; // time_now_ms() of the first fault, 0 none
+  char first[48];  // description of the first fault
+} TFaultShim;
+
+/*
+ * Device the soak loop flashes over and over, open hands out a fresh
+ * transport (new simulated device, reopened usb handle), verify
+ * returns 1 when the device holds the reference image, 0 when it does
+ * not, -1 when that cannot be told
+ */
+typedef struct
+{
+  TTransport *(*open)(void *ctx);
+  void (*close)(void *ctx);
+  int (*verify)(void *ctx);
+  void *ctx;
+} TSoakTarget;
+
+const char *fault_kind_name(TFaultKind kind);
+int fault_parse_line(TFaultPlan *plan, const char *line);
+int fault_load(TFaultPlan *plan, const char *path);
+void fault_transport(TTransport *tp, TFaultShim *shim, TTransport *inner, const TFaultPlan *plan);
+void fault_report(TFaultShim *shim, FILE *out);
+int fault_soak(TSoakTarget *target, const TFaultPlan *plan, TBootSession *proto, int iterations, FILE *out);
+
+#endif
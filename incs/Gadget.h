@@ -0,0 +1,21 @@
+#ifndef GADGET_H
+#define GADGET_H
+
+#include <stdio.h>
+#include "Sim.h"
+
+// dummy_hcd's gadget side, what --gadget binds to unless told otherwise
+#define GADGET_UDC_DRIVER "dummy_udc"
+#define GADGET_UDC_DEVICE "dummy_udc.0"
+
+// serial number the gadget enumerates with
+#define GADGET_SERIAL "MIKRO-HB-GADGET"
+
+/*
+ * Present the simulated bootloader on a UDC through raw-gadget, so the
+ * host side flashes it through usbfs and the kernel's URB path like a
+ * board. Serves one session, returns 0 once cmdREBOOT came in.
+ */
+int gadget_run(const TSimConfig *cfg, const char *driver, const char *device, FILE *out);
+
+#endif
@@ -4,17 +4,193 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "USB.h"
+#include "Types.h"
+#include "Trace.h"
+#include "Calib.h"
+#include "Regions.h"
+#include "Pack.h"
+#include "Verify.h"
+#include "Arena.h"
+#include "Prefix.h"
 
 #define V2P 0x1FFFFFFF
 
 #define MZ1024 0x100000
 #define MZ2048 0x200000
 
+// maximum number of hex files merged into one flashing session
+#define MAX_HEX_FILES 8
+
+// config flash image size, the bootloader never writes more than this
+#define CONF_IMAGE_SIZE 0xffff
+
+extern const uint32_t _PIC32Mn_STARTFLASH;
+extern const uint32_t _PIC32Mn_STARTCONF;
+
+/*
+ * Conditioned image, built once from the hex files for a device
+ * geometry and only read while flashing, so it can be shared.
+ */
+typedef struct
+{
+  uint8_t *prg;            // program flash image, mcu_size bytes
+  uint8_t *boot;           // boot vector page, boot_size bytes
+  uint8_t *conf;           // config flash image
+  uint32_t prg_mem_count;  // bytes of program flash to write
+  uint32_t conf_mem_count; // bytes of config flash found in the hex
+  uint32_t mcu_size;
+  uint32_t boot_size;
+  uint32_t file_size;      // hex text parsed, 0 = conditioning failed
+  uint8_t first_instruction[4];
+  void *map;               // image_cache mapping the buffers live in, NULL = malloc'd
+  size_t map_len;
+  TArena *arena;           // arena the buffers were carved from, NULL = malloc'd
+} THexImage;
+
+typedef struct TBootSession TBootSession;
+typedef struct THexStream THexStream;
+struct TImageCache;
+
+/*
+ * Everything one flashing run needs, the engine keeps no state of
+ * its own so sessions on different devices can run concurrently.
+ */
+struct TBootSession
+{
+  TTransport *transport;
+  char **paths;
+  int path_count;
+
+  // optional provider of an already conditioned image, called once the
+  // INFO record is known, NULL = condition paths into own_image
+  THexImage *(*image_source)(TBootSession *session, void *ctx);
+  void *image_ctx;
+
+  // optional progress report, NULL = progress bar on stdout
+  void (*on_progress)(TBootSession *session, uint32_t done, uint32_t total);
+  void *user;
+  int quiet;
+
+  // optional timeline of states, transfers and host work, NULL = off
+  TTraceTrack *trace;
+
+  // where calibration profiles are looked up for an ETA, NULL = none
+  const char *calib_dir;
+
+  // > 0 streams a single address ordered hex file through this many
+  // erase pages instead of conditioning a flash sized image
+  int stream_window;
+
+  // REGION_* bits to flash, 0 = all of them, or program flash alone
+  // with a range. app_only leaves out the boot vector page and config
+  // when they hold what the record in state_dir says was flashed last
+  int regions;
+  int app_only;
+
+  // program flash span, the erase pages covering [range_start,
+  // range_end) are flashed, range_end 0 = up to prg_mem_count
+  uint32_t range_start;
+  uint32_t range_end;
+
+  // runs of program flash erase pages flashed instead of a range, in
+  // address order, each erased and written on its own, 0 = none
+  const TPageRun *runs;
+  int run_count;
+
+  // where the record of flashed regions is kept per device model and
+  // device_id (a usb port), NULL = no record
+  const char *state_dir;
+  const char *device_id;
+
+  // conditioned images by content, NULL = always condition paths
+  const struct TImageCache *cache;
+
+  // the image is carved from this arena and the arena reset on
+  // release, NULL = malloc'd per session
+  TArena *arena;
+
+  // boot page and config go out whole instead of only their write
+  // rows holding data
+  int full_pages;
+
+  // send data as cmdPACKED when the bootloader's uiBootRev takes it
+  int packed;
+
+  // CRC what was written before the final REBOOT and rewrite the pages
+  // that differ, when the bootloader's uiBootRev answers cmdCRC
+  int verify;
+
+  // per-board records written over copies of the program flash pages
+  // they touch, the image itself is left alone, NULL = none
+  const struct TInjectSet *inject;
+
+  // where the INFO record of each device is kept, the image is then
+  // conditioned for it while the handshake runs, NULL = after INFO
+  const char *info_dir;
+
+  // INFO, BOOT and SYNC go out back to back, answers read after
+  int pipeline;
+
+  TBootInfo bootinfo;
+  THexImage *image;
+  THexImage own_image;
+  int cache_hit;
+  THexStream *stream;
+  uint32_t stream_offset;
+  TCalProfile calib;
+  int have_calib;
+  int flash_mask;
+  uint32_t prg_offset;
+  uint32_t range_pages;
+  int run_next;
+  TRegionRecord flashed;
+  int pack_active;
+  uint32_t pack_left;   // decoded bytes of the region still to send
+  uint32_t stage_pos;   // staged source, consumed up to stage_pos
+  uint32_t stage_len;
+  uint32_t pack_reports;
+  uint8_t pack_stage[PACK_STAGE];
+  int verify_active;
+  uint32_t region_offset; // bytes of the region sent so far
+  uint32_t row_base;      // boot page or config written row by row from here
+  uint32_t row_next;      // next row with data, row_end = done
+  uint32_t row_end;       // rows in the region, 0 = written in one go
+  int row_first;
+  TVerify verify_state;
+  struct TOverlay *overlay;
+  TPrefix prefix;
+  void *planner;        // conditioning ahead of INFO, NULL = none
+  uint32_t piped;       // bit per command sent whose answer is still to be read
+
+  // streaming place holders and region tracking
+  uint8_t *prg_ptr;
+  uint8_t *conf_ptr;
+  uint32_t prg_mem_count;
+  uint32_t bootaddress_space;
+  int vector_index;
+  uint32_t total_bytes_to_write;
+  uint32_t bytes_written;
+
+  // time_now_ms() when the final cmdREBOOT went out, 0 before that
+  double reboot_ms;
+
+  char data_in[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+  char data_out[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+};
+
 void bootInfo_buffer(void *boot_info, const void *buffer);
-void setupChiptoBoot(struct libusb_device_handle *devh, char *path);
+int setupChiptoBoot(TBootSession *session);
+void release_boot_session(TBootSession *session);
+void print_progress_bar(const char *label, uint32_t current, uint32_t total);
+uint32_t condition_hexfile_data(char **paths, int path_count, TBootInfo *bootinfo, THexImage *image);
+uint32_t condition_session_image(TBootSession *session, TBootInfo *bootinfo, uint64_t *cache_key);
+uint32_t condition_hexfile_arena(char **paths, int path_count, TBootInfo *bootinfo, THexImage *image, TArena *arena);
+void free_hex_image(THexImage *image);
+void overwrite_bootflash_program(THexImage *image, uint32_t page_size);
+void overwrite_config_program(THexImage *image);
 
 // function prototypes file handling
-void load_hex_buffer(char *data, uint16_t iterable);
+void load_hex_buffer(TBootSession *session, char *data, uint16_t iterable);
 uint32_t file_byte_count(FILE *fp);
 void file_extract_line(FILE *fp, char *buf, int fp_result);
 int16_t get_data_array(FILE *fp, uint8_t *bytes);
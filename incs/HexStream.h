@@ -0,0 +1,44 @@
+#ifndef HEX_STREAM_H
+#define HEX_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "HexFile.h"
+
+// erase pages held in memory while streaming
+#define HEX_STREAM_WINDOW 2
+
+// longest data record, the byte count field is one byte
+#define HEX_RECORD_MAX 255
+
+/*
+ * Program flash fed page by page from the hex file while it is sent.
+ * A record may land behind the parser by less than the window, it is
+ * patched into a page not sent yet. The boot page and config flash
+ * are small and built up front like the buffered path does.
+ */
+struct THexStream
+{
+  FILE *fp;
+  THexImage image; // prg stays NULL, the rest as conditioned
+  uint32_t page_size;
+  int window;
+  uint8_t *pages;  // window pages, page p in slot p % window
+  uint32_t base;   // lowest page held
+  uint32_t root;   // extended linear address while parsing
+  int eof;
+
+  // parsed record that lies past the window, placed once it slides
+  int pending;
+  uint32_t pending_offset;
+  uint32_t pending_count;
+  uint8_t pending_data[HEX_RECORD_MAX];
+
+  uint32_t patched; // records that went back into the window
+};
+
+THexStream *hex_stream_open(const char *path, TBootInfo *bootinfo, int window, int *fallback);
+void hex_stream_read(THexStream *stream, uint32_t offset, char *data, uint32_t length);
+void hex_stream_close(THexStream *stream);
+
+#endif
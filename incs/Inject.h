@@ -0,0 +1,82 @@
+#ifndef INJECT_H
+#define INJECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Types.h"
+
+// --inject records one session takes
+#define INJECT_MAX_RECORDS 16
+
+// bytes one record writes, a calibration blob of a page at most
+#define INJECT_MAX_BYTES 4096
+
+// erase pages the records of one board may touch
+#define INJECT_MAX_PAGES 16
+
+// text of one record, template or hex bytes
+#define INJECT_TEXT_SIZE 256
+
+enum
+{
+  INJECT_BYTES = 0, // hex bytes or the contents of a file
+  INJECT_TEXT,      // text with {n} replaced by the counter, no terminator
+  INJECT_NUMBER     // little or big endian integer, counter added with +n
+};
+
+/*
+ * What one board gets written at address on top of the shared image
+ */
+typedef struct
+{
+  uint32_t address;       // physical
+  int kind;               // INJECT_*
+  uint8_t *bytes;         // INJECT_BYTES, malloc'd
+  uint32_t len;
+  char text[INJECT_TEXT_SIZE];
+  int width;              // INJECT_NUMBER, bytes
+  int big_endian;
+  int add_counter;
+  uint64_t base;
+} TInjectRecord;
+
+typedef struct TInjectSet
+{
+  TInjectRecord records[INJECT_MAX_RECORDS];
+  int count;
+  uint64_t counter;       // {n} and +n of this board
+} TInjectSet;
+
+/*
+ * Erase pages of the shared image copied and patched for one board
+ */
+typedef struct
+{
+  uint32_t offset;        // from the start of program flash
+  uint8_t *data;          // one erase page
+} TOverlayPage;
+
+struct TArena;
+
+typedef struct TOverlay
+{
+  TOverlayPage pages[INJECT_MAX_PAGES];
+  int count;
+  uint32_t page_size;
+  uint32_t end;           // offset past the last patched page
+  uint32_t bytes;         // record bytes written over the image
+  struct TArena *arena;   // carved from it, NULL = malloc'd
+} TOverlay;
+
+int inject_parse(TInjectSet *set, const char *spec);
+void inject_free(TInjectSet *set);
+int inject_counter_next(const char *path, uint64_t *counter);
+
+size_t overlay_arena_size(const TBootInfo *bootinfo);
+TOverlay *overlay_build(const TInjectSet *set, const uint8_t *prg, const TBootInfo *bootinfo, struct TArena *arena);
+const uint8_t *overlay_source(const TOverlay *overlay, const uint8_t *prg, uint32_t offset);
+void overlay_copy(const TOverlay *overlay, const uint8_t *prg, uint32_t offset, uint8_t *dst, uint32_t len);
+int overlay_within(const TOverlay *overlay, uint32_t start, uint32_t end);
+void overlay_free(TOverlay *overlay);
+
+#endif
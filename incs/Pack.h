@@ -0,0 +1,39 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "USB.h"
+#include "Sim.h"
+
+// bootloaders from this uiBootRev take cmdPACKED writes
+#define BOOT_REV_PACKED 0x0200
+
+/*
+ * A packed data report is [decoded length lo][hi] and tokens:
+ *   0x00..0x7f  literal, the next t + 1 bytes
+ *   0x80..0xfe  run, (t & 0x7f) + PACK_MIN_RUN times the next byte
+ *   0xff        long run, 16 bit count then the byte
+ * A report decodes on its own, the zero fill after the tokens is
+ * ignored.
+ */
+#define PACK_HEADER 2
+#define PACK_MIN_RUN 3
+#define PACK_MAX_LITERAL 0x80
+#define PACK_MAX_SHORT_RUN (0x7e + PACK_MIN_RUN)
+#define PACK_LONG_RUN 0xff
+
+// decoded bytes one report may carry, the rows a device commits per
+// report stay bounded
+#define PACK_MAX_SPAN 0x4000
+
+// source bytes the host stages ahead of the encoder
+#define PACK_STAGE (2 * PACK_MAX_SPAN)
+
+int pack_report(const uint8_t *src, uint32_t len, uint8_t *report, uint32_t *consumed);
+int unpack_report(const uint8_t *report, uint8_t *out, uint32_t room);
+
+struct TBootSession;
+int pack_bench(const TSimConfig *base, const struct TBootSession *proto, FILE *out);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef PREFIX_H
+#define PREFIX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * When each step ahead of the first data report was through, in ms
+ * after the session started, 0 = not reached
+ */
+typedef struct
+{
+  double start_ms;  // time_now_ms() the session started
+  double info_ms;
+  double boot_ms;
+  double image_ms;  // conditioned and planned
+  double sync_ms;
+  double erase_ms;
+  double data_ms;   // first data report out
+  int planned;      // conditioned from the kept INFO record while the handshake ran
+  int stale;        // the kept INFO record differed from the live one
+  int piped;        // INFO, BOOT and SYNC went out back to back
+} TPrefix;
+
+struct TBootSession;
+
+void prefix_start(struct TBootSession *session);
+void prefix_mark(struct TBootSession *session, int cmd);
+void prefix_info(struct TBootSession *session, const char *info);
+int prefix_join(struct TBootSession *session, uint64_t *cache_key);
+void prefix_release(struct TBootSession *session);
+void prefix_report(const struct TBootSession *session, FILE *out);
+
+#endif
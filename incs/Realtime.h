@@ -0,0 +1,79 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "USB.h"
+#include "Sim.h"
+
+// data report gaps kept for the percentiles, one per report of a 4 MB image
+#define RT_MAX_GAPS (1 << 16)
+
+// priority given with a bare --realtime, middle of the SCHED_FIFO range
+#define RT_DEFAULT_PRIORITY 50
+
+// how often the progress thread redraws the bar
+#define RT_RENDER_MS 100
+
+// a gap longer than this counts as a stall in the report
+#define RT_STALL_MS 1.0
+
+enum
+{
+  RT_OFF = 0,
+  RT_FIFO,
+  RT_RR
+};
+
+typedef struct
+{
+  int policy;   // RT_*, RT_OFF only measures the gaps
+  int priority;
+  int cpu;      // pinned to this cpu while streaming, -1 = any
+} TRtConfig;
+
+struct TBootSession;
+
+/*
+ * Transport between the engine and a device that moves the calling
+ * thread to a real-time policy once the image is conditioned, locks
+ * the image and the report buffers in memory and hands progress and
+ * logging to another thread until the final REBOOT. Every run records
+ * the host gap in front of each data report that follows another one.
+ */
+typedef struct
+{
+  TTransport *inner;
+  TRtConfig cfg;
+  struct TBootSession *session;
+  TFrameTracker frame;
+
+  int active;           // streaming on the real-time policy
+  int finished;         // final REBOOT gone out
+  int saved_quiet;
+  int saved_policy;
+  int saved_priority;
+  void *saved_cpus;     // affinity before streaming, NULL = not changed
+  char refused[96];     // first of policy, cpu or lock not granted, "" = none
+  size_t locked;        // bytes mlock'd
+
+  double *gaps;
+  uint32_t gap_count;
+  uint32_t gaps_dropped;
+  double last_end_ms;   // previous transfer done, 0 = none
+  int last_data;        // previous transfer was a data report
+
+  void *render;         // progress thread, NULL = not running
+  uint32_t done;        // progress handed over by the engine
+  uint32_t total;
+  int stop;
+} TRtShim;
+
+int rt_parse(const char *spec, TRtConfig *cfg);
+int rt_open(TTransport *tp, TRtShim *rt, TTransport *inner, const TRtConfig *cfg);
+void rt_progress(struct TBootSession *session, uint32_t done, uint32_t total);
+void rt_close(TRtShim *rt);
+void rt_report(TRtShim *rt, FILE *out);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef REGIONS_H
+#define REGIONS_H
+
+#include <stdint.h>
+
+// the flash regions of a session, bit n is vector[n]
+#define REGION_PROGRAM 0x1
+#define REGION_BOOTPAGE 0x2
+#define REGION_CONFIG 0x4
+#define REGION_ALL 0x7
+
+// runs of program flash pages one session flashes at most
+#define REGION_MAX_RUNS 128
+
+// bytes one run writes at most, the bootloader counts a write in 16 bits
+#define REGION_RUN_BYTES 0x8000
+
+/*
+ * What was last flashed to the boot vector page and config flash of
+ * one device, 0 = not known
+ */
+typedef struct
+{
+  uint64_t boot;
+  uint64_t conf;
+} TRegionRecord;
+
+/*
+ * Consecutive program flash erase pages, offset from the start of
+ * program flash
+ */
+typedef struct
+{
+  uint32_t offset;
+  uint32_t pages;
+} TPageRun;
+
+struct TBootSession;
+
+int region_parse_list(const char *text, int *mask);
+int region_parse_range(const char *text, uint32_t *start, uint32_t *end);
+int region_plan(struct TBootSession *session);
+int region_record_save(struct TBootSession *session);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdio.h>
+#include "HexFile.h"
+#include "Sim.h"
+#include "Sched.h"
+
+// simulated devices one step can run
+#define SCALE_MAX_SESSIONS 256
+
+// steps in one --scale list
+#define SCALE_MAX_STEPS 16
+
+// device latencies spread +-SCALE_SPREAD around the base model
+#define SCALE_SPREAD 0.25
+
+// a hub carrying more streams than it has room for loses this share
+// of its bandwidth per extra stream to retries
+#define SCALE_THRASH 0.1
+
+/*
+ * Synthetic fixture, device i hangs off hub i % hubs, a hub carries
+ * streams full rate data streams before frames slow down
+ */
+typedef struct
+{
+  int hubs;
+  int streams;
+} TScaleTopo;
+
+/*
+ * One flashing session of a scale step, on its own thread against its
+ * own simulated device
+ */
+typedef struct
+{
+  TSimConfig cfg;
+  TSim sim;
+  TTransport tp;
+  TBootSession session;
+
+  // synthetic topology, hub < 0 when flat
+  int hub;
+  int hub_streams;
+  int streaming;
+  TFrameTracker frame;
+  TTransport hub_tp;
+  TUsbTopo topo;
+  TSchedShim shim;
+  TTransport sched_tp;
+
+  int result;
+  int mismatch;    // flash differs from the reference for its geometry
+  double wall_ms;  // setupChiptoBoot() start to return
+  double cpu_ms;   // thread cpu time
+  double lock_ms;  // waiting on the shared progress lock
+  uint32_t progress_calls;
+} TScaleSession;
+
+int scale_parse_counts(const char *list, int *counts, int max);
+int scale_parse_topology(const char *text, TScaleTopo *topo);
+int scale_run(const TSimConfig *base, TBootSession *proto, const int *counts, int steps, const TScaleTopo *topo,
+              double hub_kbs, FILE *out);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "USB.h"
+#include "Sim.h"
+
+// hubs and root ports one scheduler tracks
+#define SCHED_MAX_GROUPS 64
+
+// budget of a hub until one is measured, about what a full speed
+// transaction translator moves in interrupt transfers
+#define SCHED_HUB_KBS 1000.0
+
+// a stream slower than this share of the solo rate was contended
+#define SCHED_CONTENDED 0.8
+
+// clean streams on a full group before it is given one more
+#define SCHED_PROBE 4
+
+// data of a group's first stream that measures its solo rate, the
+// group opens to the rest after that
+#define SCHED_SOLO_BYTES 4096
+
+typedef struct TSched TSched;
+typedef struct TSchedGroup TSchedGroup;
+
+/*
+ * Slot one data stream holds, on its root port and on the hub it
+ * hangs off (one group for a device on a root port)
+ */
+typedef struct
+{
+  TSchedGroup *groups[2];
+  int count;
+  int peers;       // streams on the busiest group, this one included
+  int sampled;     // sched_sample() had this stream
+  double start_ms; // slot granted
+} TSchedTicket;
+
+/*
+ * Transport between the engine and a device that takes a slot for
+ * every cmdWRITE data stream and gives it back when the stream ends
+ */
+typedef struct
+{
+  TTransport *inner;
+  TSched *sched;
+  TUsbTopo topo;
+  TFrameTracker frame;
+  TSchedTicket ticket;
+  uint32_t bytes;  // data of the stream holding the slot
+  uint32_t streams;
+  double wait_ms;  // queued for slots, all streams
+} TSchedShim;
+
+TSched *sched_create(double hub_kbs);
+void sched_destroy(TSched *sched);
+void sched_acquire(TSched *sched, const TUsbTopo *topo, TSchedTicket *ticket);
+void sched_sample(TSched *sched, TSchedTicket *ticket, uint32_t bytes);
+void sched_release(TSched *sched, TSchedTicket *ticket, uint32_t bytes);
+void sched_transport(TTransport *tp, TSchedShim *shim, TTransport *inner, TSched *sched, const TUsbTopo *topo);
+void sched_shim_end(TSchedShim *shim);
+void sched_report(TSched *sched, FILE *out);
+
+#endif
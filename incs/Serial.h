@@ -0,0 +1,15 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stddef.h>
+
+#define SERIAL_DEFAULT_BAUD 115200
+
+// sent to the application to make it jump to the bootloader
+#define SERIAL_DEFAULT_TRIGGER "BOOT\r\n"
+
+int serial_send_trigger(const char *port, int baud, const char *trigger, size_t len);
+int serial_open_pty(char *slave_name, size_t len);
+size_t serial_unescape(const char *in, char *out, size_t len);
+
+#endif
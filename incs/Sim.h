@@ -0,0 +1,132 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "USB.h"
+#include "Types.h"
+
+// latency series are indexed by TCmd, data reports use cmdHEX
+#define SIM_KINDS 32
+
+// commands a frame tracker remembers as not answered yet
+#define FRAME_ASKED 4
+
+// answers the simulated device holds for the host, one in the IN
+// endpoint, one the firmware waits to hand over, one report taken in
+#define SIM_ANSWERS 3
+
+// what came back on the bus after cmdREBOOT
+#define SIM_BOOT_APP 0
+#define SIM_BOOT_LOADER 1
+
+// recorded latencies handed out in order, wrapping at the end
+typedef struct
+{
+  double *ms;
+  int count;
+  int next;
+} TLatencySeries;
+
+/*
+ * Simulated MikroC HID bootloader, geometry and timing
+ */
+typedef struct
+{
+  // geometry reported in the INFO record
+  uint32_t mcu_size;
+  uint16_t erase_block;
+  uint16_t write_block;
+  uint16_t boot_rev;
+  uint32_t boot_start;
+  char dev_dsc[MAX_STRING_FIELD_LENGTH];
+
+  // raw INFO response used instead of one built from the fields above
+  uint8_t info[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+  int have_info;
+
+  // latency model in ms
+  double frame_ms;      // one report on the wire
+  double cmd_ms;        // command turn around
+  double erase_page_ms; // per erased page
+  double row_write_ms;  // per committed write row
+  double unpack_kb_ms;  // per KB of cmdPACKED data decoded
+  double crc_kb_ms;     // per KB of flash a cmdCRC covers
+  double weak;          // chance a committed row keeps one bit unprogrammed
+  double enum_ms;       // serial trigger to bootloader on the bus
+  double app_ms;        // cmdREBOOT to application on the bus
+  int fallback;         // application never starts, bootloader comes back
+
+  // recorded latencies, used instead of the model when present
+  TLatencySeries out[SIM_KINDS];
+  TLatencySeries in[SIM_KINDS];
+} TSimConfig;
+
+/*
+ * Follows the command/data framing of the OUT stream the way the
+ * device does, after cmdWRITE the next size bytes are data. The
+ * commands sent and not answered yet are kept oldest first, so a
+ * pipelined handshake reads each answer as the command it is for.
+ */
+typedef struct
+{
+  int data_mode;
+  int packed;
+  int32_t remaining;
+  int asked[FRAME_ASKED];
+  int asked_count;
+  int answered;   // command the last answer was for
+} TFrameTracker;
+
+// one IN report queued by the simulated device
+typedef struct
+{
+  uint8_t data[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+  int cmd;
+  double latency;
+  double due_ms;  // when the device has it ready
+} TSimAnswer;
+
+typedef struct
+{
+  TSimConfig cfg;
+  TFrameTracker frame;
+  uint8_t *flash; // program flash, mcu_size bytes
+  uint8_t *conf;  // config flash
+  uint32_t write_addr;
+  TSimAnswer answers[SIM_ANSWERS];
+  int answer_head;
+  int answer_count;
+  uint64_t weak_state;
+  int rebooted;
+  double reboot_ms;
+
+  // statistics
+  uint32_t reports;
+  uint32_t erased_pages;
+  uint32_t bytes_written;
+  uint32_t write_errors;
+  uint32_t weak_bits;
+  uint32_t crc_bytes;
+  double device_ms;
+} TSim;
+
+void sim_default_config(TSimConfig *cfg, uint32_t mcu_size);
+void sim_zero_latency(TSimConfig *cfg);
+int sim_parse_spec(TSimConfig *cfg, const char *spec);
+void sim_free_config(TSimConfig *cfg);
+int sim_open(TSim *sim, const TSimConfig *cfg);
+void sim_close(TSim *sim);
+void sim_transport(TTransport *tp, TSim *sim);
+void sim_report(TSim *sim, FILE *out);
+int sim_compare(const TSim *a, const TSim *b);
+int sim_wait_boot(TSim *sim, double deadline_ms, double *arrived_ms);
+void sim_reset(TSim *sim);
+int sim_wait_trigger(TSim *sim, int fd, const char *trigger, size_t len, double deadline_ms, double *arrived_ms);
+
+int frame_classify(TFrameTracker *frame, const uint8_t *report);
+int frame_answer(TFrameTracker *frame);
+const char *frame_kind_name(int kind);
+int frame_kind_from_name(const char *name);
+
+#endif
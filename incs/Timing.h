@@ -0,0 +1,56 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "USB.h"
+#include "Sim.h"
+
+// recent latencies kept per transfer kind
+#define TIMING_SAMPLES 128
+
+// samples needed before a learned timeout replaces the fixed one
+#define TIMING_MIN_SAMPLES 5
+
+// learned timeout = p99 * TIMING_MARGIN + TIMING_SLACK_MS
+#define TIMING_MARGIN 4.0
+#define TIMING_SLACK_MS 25.0
+
+typedef struct
+{
+  double ms[TIMING_SAMPLES];
+  int count;
+  int next;
+  int fresh;         // samples since timeout_ms was worked out
+  double timeout_ms; // 0 = not enough samples yet
+} TTimingSeries;
+
+/*
+ * Transport wrapper learning per command latencies of one device
+ * model (sDevDsc + ulMcuSize) and running each transfer with a
+ * timeout taken from them. The model is read from the INFO response
+ * going past, its profile is loaded then and saved by timing_close().
+ * IN ERASE latencies are kept per erased page.
+ */
+typedef struct
+{
+  TTransport *inner;
+  char dir[400];
+  char path[512]; // profile of the current model, "" before INFO
+  char model[MAX_STRING_FIELD_LENGTH + 1];
+  uint32_t mcu_size;
+
+  TTimingSeries out[SIM_KINDS];
+  TTimingSeries in[SIM_KINDS];
+  TFrameTracker frame;
+  uint16_t erase_pages;
+
+  uint32_t adapted; // transfers run with a learned timeout
+  uint32_t expired; // of those, the ones that timed out
+} TTiming;
+
+int timing_open(TTransport *tp, TTiming *timing, TTransport *inner, const char *dir);
+int timing_close(TTiming *timing);
+void timing_report(TTiming *timing, FILE *out);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "USB.h"
+#include "Sim.h"
+
+// sessions (devices) one trace file can hold
+#define TRACE_MAX_TRACKS 64
+
+// lanes of a track, the thread rows Perfetto shows under each device
+#define TRACE_LANE_SESSION 1
+#define TRACE_LANE_USB 2
+#define TRACE_LANE_HOST 3
+
+/*
+ * Complete ("X") event, times in ms on the time_now_ms() clock
+ */
+typedef struct
+{
+  const char *name;
+  const char *cat;
+  int lane;
+  double start_ms;
+  double end_ms;
+  char args[64]; // body of the args object, "" for none
+} TTraceEvent;
+
+typedef struct TTrace TTrace;
+
+/*
+ * One session's row group, events are appended without locking so
+ * a track belongs to exactly one thread while the session runs
+ */
+typedef struct
+{
+  TTrace *trace;
+  int id;
+  char name[64];
+  TTraceEvent *events;
+  int count;
+  int capacity;
+
+  // open state span on the session lane
+  const char *state;
+  int state_region;
+  double state_ms;
+} TTraceTrack;
+
+struct TTrace
+{
+  double origin_ms;
+  TTraceTrack *tracks[TRACE_MAX_TRACKS];
+  int track_count;
+};
+
+/*
+ * Transport wrapper putting every transfer on the usb lane, from
+ * submit to completion
+ */
+typedef struct
+{
+  TTransport *inner;
+  TTraceTrack *track;
+  TFrameTracker frame;
+} TTraceUsb;
+
+void trace_open(TTrace *trace);
+TTraceTrack *trace_add_track(TTrace *trace, const char *name);
+void trace_span(TTraceTrack *track, int lane, const char *cat, const char *name, double start_ms, double end_ms, const char *args);
+void trace_state(TTraceTrack *track, int cmd, int region);
+void trace_transport(TTransport *tp, TTraceUsb *usb, TTransport *inner, TTraceTrack *track);
+int trace_write(TTrace *trace, const char *path);
+void trace_close(TTrace *trace);
+
+#endif
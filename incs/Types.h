@@ -49,6 +49,8 @@ typedef enum
   cmdBOOT,       // Go to bootloader mode.
   cmdREBOOT,     // Restart MCU.
   cmdWRITE = 11, // Write to MCU flash.
+  cmdPACKED,     // Write packed data to MCU flash, uiBootRev >= BOOT_REV_PACKED.
+  cmdCRC,        // CRC-32 of flash spans, uiBootRev >= BOOT_REV_CRC.
   cmdERASE = 21, // Erase MCU flash.
   cmdHEX = 31
 } TCmd;
@@ -8,8 +8,74 @@
 #define MAX_INTERRUPT_IN_TRANSFER_SIZE 64
 #define MAX_INTERRUPT_OUT_TRANSFER_SIZE 64
 
+// Vendor and product id of the MikroC HID bootloader
+#define BOOTLOADER_VID 0x2dbc
+#define BOOTLOADER_PID 0x0001
+
 extern const int INTERFACE_NUMBER;
 
+/*
+ * Transport between the engine and a bootloader. Normally a libusb
+ * handle, the capture, replay and simulated device plug in here.
+ * write/read return a libusb error code, bytes moved in *transferred.
+ */
+typedef struct TTransport TTransport;
+struct TTransport
+{
+  int (*write)(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout);
+  int (*read)(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout);
+  void (*close)(TTransport *tp);
+  void *ctx;
+};
+
+/*
+ * Where a device hangs off the bus, root port first, as libusb and
+ * sysfs (1-2.3) number it. Devices below one hub share its bandwidth.
+ */
+#define USB_MAX_PORT_DEPTH 7
+
+typedef struct
+{
+  uint8_t bus;
+  uint8_t ports[USB_MAX_PORT_DEPTH];
+  int depth;
+} TUsbTopo;
+
+/*
+ * Wait for a vid:pid to arrive on or leave the bus. Armed before the
+ * action that makes the device (re)enumerate so no event is missed,
+ * libusb hotplug where available, enumeration every USB_WAIT_POLL_MS
+ * otherwise (Windows).
+ */
+#define USB_WAIT_POLL_MS 20
+
+typedef struct
+{
+  libusb_context *ctx;
+  uint16_t vid;
+  uint16_t pid;
+  TUsbTopo port;     // only a device on this port counts, depth 0 = any
+  libusb_hotplug_callback_handle handle;
+  int hotplug;
+  int present; // last poll, without hotplug
+  volatile int arrived;
+  volatile int left;
+  double arrived_ms; // time_now_ms() of the event
+  double left_ms;
+} TUsbWait;
+
 // function prototypes usb handling
-int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *data_out, uint8_t out_only);
+void usb_transport(TTransport *tp, libusb_device_handle *devh);
+int boot_interrupt_transfers(TTransport *tp, char *data_in, char *data_out, uint8_t out_only);
+int boot_interrupt_answer(TTransport *tp, char *data_in);
+libusb_device_handle *usb_open_bootloader(libusb_context *ctx, const char *selector);
+int usb_selector_direct(const char *selector);
+void usb_close_bootloader(libusb_device_handle *devh);
+int usb_wait_arm(TUsbWait *w, libusb_context *ctx, uint16_t vid, uint16_t pid);
+int usb_wait_arm_port(TUsbWait *w, libusb_context *ctx, uint16_t vid, uint16_t pid, const TUsbTopo *port);
+int usb_wait_for(TUsbWait *w, libusb_hotplug_event event, double deadline_ms);
+int usb_wait_first(TUsbWait **waits, int count, libusb_hotplug_event event, double deadline_ms);
+void usb_wait_disarm(TUsbWait *w);
+int usb_topology(libusb_device_handle *devh, TUsbTopo *topo);
+void usb_topo_name(const TUsbTopo *topo, int depth, char *out, size_t len);
 #endif
\ No newline at end of file
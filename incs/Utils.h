@@ -1,10 +1,39 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 int16_t swap_bytes(uint8_t *bytes, int16_t num);
 uint16_t swap_wordbytes(uint16_t wb);
 uint8_t transform_char_bin(unsigned char c);
 uint8_t transform_2chars_1bin(uint8_t var[]);
 uint32_t transform_2words_long(uint16_t a, uint16_t b);
 
+double time_now_ms(void);
+void sleep_ms(double ms);
+
+int make_dir_path(const char *path);
+int user_dir(const char *xdg_env, const char *home_default, char *out, size_t len);
+
+double percentile(double *values, int count, double p);
+uint64_t rand_next(uint64_t *state);
+
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+uint64_t fnv1a_64(const void *data, size_t len, uint64_t hash);
+int fnv1a_64_file(const char *path, uint64_t *hash);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+int json_get_string(const char *json, const char *key, char *out, size_t len);
+int json_get_long(const char *json, const char *key, long *out);
+int json_get_double(const char *json, const char *key, double *out);
+int json_get_string_at(const char *json, const char *key, int index, char *out, size_t len);
+int json_get_object(const char *json, const char *key, char *out, size_t len);
+int json_key_at(const char *json, int index, char *out, size_t len);
+void json_escape(const char *in, char *out, size_t len);
+
+void error_report(const char *fmt, ...);
+void error_clear(void);
+const char *error_first(void);
+
 #endif
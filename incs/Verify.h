@@ -0,0 +1,50 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdint.h>
+
+// bootloaders from this uiBootRev answer cmdCRC
+#define BOOT_REV_CRC 0x0201
+
+// pages a session tracks, 4 MB of 16 KB erase pages
+#define VERIFY_MAX_PAGES 256
+
+// CRCs one IN report carries after [0x0f][cmdCRC][count 2]
+#define VERIFY_PER_REPORT 15
+
+// rewrite passes before a page counts as bad
+#define VERIFY_ROUNDS 3
+
+/*
+ * One span the device is asked to CRC, the CRC of what was sent for
+ * it accumulated while it went out
+ */
+typedef struct
+{
+  uint32_t address;
+  uint32_t span;
+  uint32_t filled;
+  uint32_t crc;
+  uint8_t region;
+  uint8_t bad;
+} TVerifyPage;
+
+typedef struct
+{
+  TVerifyPage pages[VERIFY_MAX_PAGES];
+  int count;
+  int first;     // first page of the region being written
+  int overflow;  // more pages than tracked, nothing is verified
+  uint32_t checked;
+  uint32_t rewritten;
+  double ms;
+} TVerify;
+
+struct TBootSession;
+
+void verify_reset(TVerify *verify);
+void verify_region(TVerify *verify, int region, uint32_t address, uint32_t size, uint32_t span);
+void verify_feed(TVerify *verify, uint32_t offset, const char *data, uint32_t len);
+int verify_repair(struct TBootSession *session);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "HexFile.h"
+
+// quiet after the last write to a watched file before the build counts as done
+#define WATCH_SETTLE_MS 50
+
+/*
+ * The board between builds. open hands out a transport to it back in
+ * its bootloader, NULL when it did not come, running waits for the
+ * application after the final REBOOT at reboot_ms and puts when it was
+ * up in *running_ms, 0 or -1, NULL = the REBOOT counts as running
+ */
+typedef struct
+{
+  TTransport *(*open)(void *ctx);
+  void (*close)(void *ctx);
+  int (*running)(void *ctx, double reboot_ms, double *running_ms);
+  void *ctx;
+} TWatchTarget;
+
+int watch_diff(const THexImage *old, const THexImage *image, const TBootInfo *bootinfo, TPageRun *runs, int *run_count,
+               uint32_t *changed);
+int watch_run(TWatchTarget *target, TBootSession *proto, FILE *out);
+
+#endif
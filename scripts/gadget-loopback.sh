@@ -0,0 +1,65 @@
+#!/bin/bash
+# MikroC USB HID Bootloader - Loopback Gadget Harness
+# Flashes a simulated bootloader presented on dummy_hcd through raw-gadget,
+# so the host side runs the real usbfs/URB path with no board attached.
+#
+# Usage: sudo scripts/gadget-loopback.sh [mikro_hb options] firmware.hex
+#
+# Environment:
+#   SIM=mz1024,erase=20  --sim spec of the emulated bootloader (default: mz2048)
+#   STRACE=1             count the host's syscalls into gadget-strace.txt
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(cd "$SCRIPT_DIR/.." && pwd)"
+BIN="${BIN:-$PROJECT_ROOT/bins/mikro_hb}"
+SIM="${SIM:-mz2048}"
+LOG="$(mktemp /tmp/mikro_hb-gadget.XXXXXX)"
+
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 [mikro_hb options] firmware.hex"
+    exit 1
+fi
+if [ ! -x "$BIN" ]; then
+    echo "ERROR: $BIN not found, run make first"
+    exit 1
+fi
+
+# a full speed host port like the board's, and the userspace gadget driver
+modprobe dummy_hcd is_high_speed=0
+modprobe raw_gadget
+
+"$BIN" --gadget --sim "$SIM" > "$LOG" 2>&1 &
+GADGET_PID=$!
+trap 'kill $GADGET_PID 2>/dev/null || true; rm -f "$LOG"' EXIT
+
+# enumerated once a device with our vid:pid shows up in sysfs
+for i in $(seq 50); do
+    if grep -qs 2dbc /sys/bus/usb/devices/*/idVendor; then
+        break
+    fi
+    if ! kill -0 $GADGET_PID 2>/dev/null; then
+        cat "$LOG"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+status=0
+if [ -n "$STRACE" ]; then
+    strace -f -c -o gadget-strace.txt "$BIN" --gaps --serial-number MIKRO-HB-GADGET "$@" || status=$?
+else
+    "$BIN" --gaps --serial-number MIKRO-HB-GADGET "$@" || status=$?
+fi
+
+# a failed session leaves the gadget waiting for reports that never come
+if [ $status -ne 0 ]; then
+    kill $GADGET_PID 2>/dev/null || true
+fi
+wait $GADGET_PID || status=1
+cat "$LOG"
+if [ -n "$STRACE" ]; then
+    cat gadget-strace.txt
+fi
+exit $status
@@ -0,0 +1,134 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#include <string.h>
+#include <stdio.h>
+
+#include "App.h"
+#include "Utils.h"
+
+/*
+ * Application check
+ *
+ * After the final cmdREBOOT the board either starts the image, and
+ * the application enumerates, or falls back into the bootloader. Both
+ * are watched on hotplug events armed while the bootloader is still
+ * open, whichever arrives first decides.
+ */
+
+int app_check_parse(TAppCheck *check, const char *arg)
+{
+    check->enabled = 1;
+    if (strcmp(arg, "gone") == 0)
+    {
+        check->app_gone = 1;
+        return 0;
+    }
+    if (sscanf(arg, "%x:%x", &check->vid, &check->pid) != 2)
+    {
+        fprintf(stderr, "--app wants vid:pid in hex or gone, not %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Armed while the bootloader is still open, whatever is on the bus
+ * now does not count, only enumerations after the reboot do
+ */
+void app_check_arm(TAppCheck *check)
+{
+    usb_wait_arm_port(&check->boot, check->ctx, BOOTLOADER_VID, BOOTLOADER_PID, check->port);
+    check->boot.arrived = 0;
+    if (!check->app_gone)
+    {
+        usb_wait_arm_port(&check->app, check->ctx, (uint16_t)check->vid, (uint16_t)check->pid, check->port);
+        check->app.arrived = 0;
+    }
+}
+
+// the session ended without a reboot to wait for
+void app_check_disarm(TAppCheck *check)
+{
+    usb_wait_disarm(&check->boot);
+    if (!check->app_gone)
+        usb_wait_disarm(&check->app);
+}
+
+static int app_check_report(TAppCheck *check, int outcome, double boot_ms)
+{
+    if (outcome == 0 && !check->app_gone)
+    {
+        if (!check->quiet)
+            printf("Application %04x:%04x enumerated %.1f ms after reboot\n", check->vid, check->pid, boot_ms);
+        return 0;
+    }
+    if (outcome == 1)
+    {
+        error_report("Board fell back into the bootloader %.1f ms after reboot, the image did not start\n", boot_ms);
+        return -1;
+    }
+    if (check->app_gone)
+    {
+        if (!check->quiet)
+            printf("Bootloader stayed off the bus for %d ms after reboot\n", check->timeout_ms);
+        return 0;
+    }
+    error_report("Application %04x:%04x did not enumerate within %d ms of reboot\n", check->vid, check->pid, check->timeout_ms);
+    return -1;
+}
+
+/*
+ * Wait for the application or the bootloader, whichever enumerates
+ * first after the final cmdREBOOT at reboot_ms
+ */
+int app_check_wait(TAppCheck *check, double reboot_ms)
+{
+    TUsbWait *waits[2] = {&check->app, &check->boot};
+    double deadline_ms = reboot_ms + check->timeout_ms;
+    int result = 0;
+
+    if (check->app_gone)
+        result = usb_wait_first(&waits[1], 1, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, deadline_ms) == 0 ? 1 : -1;
+    else
+        result = usb_wait_first(waits, 2, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, deadline_ms);
+
+    app_check_disarm(check);
+
+    if (check->boot.left && !check->quiet)
+        printf("Bootloader left the bus %.1f ms after reboot\n", check->boot.left_ms - reboot_ms);
+    if (result == 0)
+        return app_check_report(check, 0, check->app.arrived_ms - reboot_ms);
+    if (result == 1)
+        return app_check_report(check, 1, check->boot.arrived_ms - reboot_ms);
+    return app_check_report(check, -1, 0.0);
+}
+
+/*
+ * Same check against the simulated device
+ */
+int app_check_sim(TAppCheck *check, TSim *sim)
+{
+    double arrived_ms = 0.0;
+    int result = sim_wait_boot(sim, sim->reboot_ms + check->timeout_ms, &arrived_ms);
+
+    if (result == SIM_BOOT_APP && check->app_gone)
+    {
+        // the bootloader has to stay away for the whole window
+        sleep_ms(sim->reboot_ms + check->timeout_ms - time_now_ms());
+        return app_check_report(check, -1, 0.0);
+    }
+    if (result == SIM_BOOT_APP)
+        return app_check_report(check, 0, arrived_ms - sim->reboot_ms);
+    if (result == SIM_BOOT_LOADER)
+        return app_check_report(check, 1, arrived_ms - sim->reboot_ms);
+    return app_check_report(check, -1, 0.0);
+}
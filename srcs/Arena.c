@@ -0,0 +1,306 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "Arena.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Session arena
+ *
+ * condition_hexfile_data() used to malloc a flash sized image, the
+ * config image, the boot page and two ownership maps for every
+ * session. With an arena the engine reserves one block sized from
+ * the INFO geometry before conditioning, carves the image out of it,
+ * hands the ownership maps back once merged and release resets it.
+ * The next session on the same arena allocates nothing, the pages
+ * stay resident instead of going back and forth to the allocator.
+ */
+
+// data carved from an arena at most, image and merge maps, each padded
+#define ARENA_BLOCKS 6
+
+size_t arena_session_size(const TBootInfo *bootinfo)
+{
+    size_t mcu = bootinfo->ulMcuSize.fValue;
+
+    // prg and its owner map, conf and its owner map, the boot page
+    return 2 * mcu + 2 * (size_t)CONF_IMAGE_SIZE + bootinfo->uiEraseBlock.fValue.intVal +
+           ARENA_BLOCKS * ARENA_ALIGN;
+}
+
+/*
+ * Make room for size bytes, only an empty arena can grow, returns -1
+ * when it is in use or the memory is not there
+ */
+int arena_reserve(TArena *arena, size_t size)
+{
+    uint8_t *base = NULL;
+
+    if (size <= arena->size)
+        return 0;
+    if (arena->used > 0)
+        return -1;
+    base = malloc(size);
+    if (base == NULL)
+        return -1;
+    free(arena->base);
+    arena->base = base;
+    arena->size = size;
+    return 0;
+}
+
+void *arena_alloc(TArena *arena, size_t len)
+{
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (arena->base == NULL || start + len > arena->size)
+        return NULL;
+    arena->used = start + len;
+    if (arena->used > arena->high)
+        arena->high = arena->used;
+    return arena->base + start;
+}
+
+// give back everything carved since used was mark
+void arena_rewind(TArena *arena, size_t mark)
+{
+    if (mark < arena->used)
+        arena->used = mark;
+}
+
+void arena_reset(TArena *arena)
+{
+    arena->used = 0;
+    arena->resets++;
+}
+
+void arena_free(TArena *arena)
+{
+    free(arena->base);
+    memset(arena, 0, sizeof(TArena));
+}
+
+/*
+ * Heap allocations of mikro_hb's own code, counted in a build made
+ * with HEAP_COUNT=1, which links every allocator entry point through
+ * these with -Wl,--wrap. The shipped binary leaves the allocator alone.
+ */
+#if defined(HEAP_COUNT) && !defined(_WIN32)
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t count, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+extern void *__real_reallocarray(void *ptr, size_t count, size_t size);
+extern void *__real_aligned_alloc(size_t alignment, size_t size);
+extern void *__real_memalign(size_t alignment, size_t size);
+extern int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+
+static uint64_t heap_count;
+
+static void heap_count_one(void)
+{
+    __atomic_add_fetch(&heap_count, 1, __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size)
+{
+    heap_count_one();
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    heap_count_one();
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    heap_count_one();
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_reallocarray(void *ptr, size_t count, size_t size)
+{
+    heap_count_one();
+    return __real_reallocarray(ptr, count, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size)
+{
+    heap_count_one();
+    return __real_aligned_alloc(alignment, size);
+}
+
+void *__wrap_memalign(size_t alignment, size_t size)
+{
+    heap_count_one();
+    return __real_memalign(alignment, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    heap_count_one();
+    return __real_posix_memalign(ptr, alignment, size);
+}
+
+int heap_counted(void)
+{
+    return 1;
+}
+
+uint64_t heap_allocations(void)
+{
+    return __atomic_load_n(&heap_count, __ATOMIC_RELAXED);
+}
+
+#else
+
+int heap_counted(void)
+{
+    return 0;
+}
+
+uint64_t heap_allocations(void)
+{
+    return 0;
+}
+
+#endif
+
+// resident set in KB, 0 where it can't be read
+static uint64_t rss_kb(void)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    unsigned long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%lu %lu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+#endif
+}
+
+/*
+ * Allocations seen from the first data report to the last, the
+ * erase/write/data loop of every region after the first page
+ */
+typedef struct
+{
+    uint64_t first;
+    uint64_t last;
+    int seen;
+} TLoopProbe;
+
+static void probe_progress(TBootSession *session, uint32_t done, uint32_t total)
+{
+    TLoopProbe *probe = session->user;
+    uint64_t now = heap_allocations();
+
+    (void)done;
+    (void)total;
+    if (!probe->seen)
+        probe->first = now;
+    probe->last = now;
+    probe->seen = 1;
+}
+
+/*
+ * Flash iterations zero latency simulated devices one after the other
+ * through one arena, count heap allocations inside the data loop and
+ * follow the resident set. 0 when the loop never allocates and the
+ * resident set stays flat once warm.
+ */
+int arena_soak(const TSimConfig *base, const TBootSession *proto, int iterations, FILE *out)
+{
+    TSimConfig cfg = *base;
+    TArena arena = {0};
+    uint64_t loop_max = 0, session_max = 0;
+    uint64_t rss_first = 0, rss_warm = 0, rss_last = 0;
+    double start = time_now_ms();
+    int failed = 0;
+
+    sim_zero_latency(&cfg);
+    for (int i = 0; i < iterations; i++)
+    {
+        TSim sim = {0};
+        TTransport tp = {0};
+        TBootSession session = *proto;
+        TLoopProbe probe = {0};
+        uint64_t before = 0;
+        int result = -1;
+
+        if (sim_open(&sim, &cfg) != 0)
+        {
+            fprintf(out, "arena: no simulated device\n");
+            return -1;
+        }
+        sim_transport(&tp, &sim);
+        session.transport = &tp;
+        session.quiet = 1;
+        session.trace = NULL;
+        session.arena = &arena;
+        session.on_progress = probe_progress;
+        session.user = &probe;
+
+        before = heap_allocations();
+        result = setupChiptoBoot(&session);
+        release_boot_session(&session);
+        if (heap_allocations() - before > session_max)
+            session_max = heap_allocations() - before;
+        sim_close(&sim);
+
+        if (result != 0 || sim.write_errors > 0)
+            failed++;
+        if (probe.last - probe.first > loop_max)
+            loop_max = probe.last - probe.first;
+        if (i == 0)
+            rss_first = rss_kb();
+        if (i == ARENA_WARMUP - 1 || (i == 0 && iterations < ARENA_WARMUP))
+            rss_warm = rss_kb();
+    }
+    rss_last = rss_kb();
+
+    fprintf(out, "arena: %d sessions of %s in %.1f s, %d failed, arena %.1f KB, %.1f KB used at most\n", iterations,
+            cfg.dev_dsc, (time_now_ms() - start) / 1000.0, failed, arena.size / 1024.0, arena.high / 1024.0);
+    if (heap_counted())
+        fprintf(out, "arena: heap allocations, %llu in the data loop, %llu per session at most\n",
+                (unsigned long long)loop_max, (unsigned long long)session_max);
+    else
+        fprintf(out, "arena: heap allocations are counted in a HEAP_COUNT=1 build only\n");
+    if (rss_last > 0)
+        fprintf(out, "arena: resident %llu KB after 1, %llu KB after %d, %llu KB after %d\n",
+                (unsigned long long)rss_first, (unsigned long long)rss_warm,
+                (iterations < ARENA_WARMUP) ? 1 : ARENA_WARMUP, (unsigned long long)rss_last, iterations);
+    arena_free(&arena);
+
+    if (failed > 0 || loop_max > 0 || rss_last > rss_warm + ARENA_RSS_SLACK_KB)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,389 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "Cache.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Conditioned image cache
+ *
+ * Conditioning walks every hex record into a flash sized image, for a
+ * release file flashed again and again that is the same work each
+ * time. The result is kept in $XDG_CACHE_HOME/mikro_hb/images, one
+ * file per hash of the hex contents and the device geometry:
+ *
+ *   [header][pad to IMAGE_CACHE_DATA_OFFSET][prg mcu_size][boot][conf]
+ *
+ * A hit maps the file read only instead of parsing. Writers fill a
+ * temporary file and rename() it in place, so a reader sees a whole
+ * image or none, and a file evicted while mapped stays readable until
+ * unmapped. A hit touches the mtime, once the directory is over its
+ * bound the least recently used images are removed, by whichever
+ * process holds the lock on .lock.
+ */
+
+#define IMAGE_CACHE_MAGIC "mikro_hb image 1"
+
+typedef struct
+{
+    char magic[16];
+    uint64_t key;
+    uint32_t mcu_size;
+    uint32_t erase_block;
+    uint32_t write_block;
+    uint32_t boot_start;
+    uint32_t boot_size;
+    uint32_t conf_size;
+    uint32_t prg_mem_count;
+    uint32_t conf_mem_count;
+    uint32_t file_size;
+    uint8_t first_instruction[4];
+} TCacheHeader;
+
+static void cache_header(TCacheHeader *header, uint64_t key, const TBootInfo *bootinfo)
+{
+    memset(header, 0, sizeof(TCacheHeader));
+    memcpy(header->magic, IMAGE_CACHE_MAGIC, sizeof(header->magic));
+    header->key = key;
+    header->mcu_size = bootinfo->ulMcuSize.fValue;
+    header->erase_block = bootinfo->uiEraseBlock.fValue.intVal;
+    header->write_block = bootinfo->uiWriteBlock.fValue.intVal;
+    header->boot_start = bootinfo->ulBootStart.fValue;
+    header->boot_size = header->erase_block;
+    header->conf_size = CONF_IMAGE_SIZE;
+}
+
+static size_t cache_file_size(const TCacheHeader *header)
+{
+    return IMAGE_CACHE_DATA_OFFSET + (size_t)header->mcu_size + header->boot_size + header->conf_size;
+}
+
+static void cache_path(const TImageCache *cache, uint64_t key, uint32_t mcu_size, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%016llx-%x.img", cache->dir, (unsigned long long)key, mcu_size);
+}
+
+/*
+ * Cache in dir, NULL = the per user cache directory
+ */
+int image_cache_open(TImageCache *cache, const char *dir, uint64_t max_bytes)
+{
+    char base[sizeof(cache->dir) - 8];
+
+    memset(cache, 0, sizeof(TImageCache));
+    cache->max_bytes = (max_bytes > 0) ? max_bytes : (uint64_t)IMAGE_CACHE_MAX_MB << 20;
+    if (dir != NULL)
+        snprintf(base, sizeof(base), "%s", dir);
+    else if (user_dir("XDG_CACHE_HOME", ".cache", base, sizeof(base)) != 0)
+        return -1;
+    snprintf(cache->dir, sizeof(cache->dir), "%s/images", base);
+    return make_dir_path(cache->dir);
+}
+
+/*
+ * Key of the hex contents, in order, and the geometry they are
+ * conditioned for, -1 when a file can't be read
+ */
+int image_cache_key(char **paths, int path_count, const TBootInfo *bootinfo, uint64_t *key)
+{
+    TCacheHeader header;
+    uint64_t hash = FNV1A_64_INIT;
+
+    for (int i = 0; i < path_count; i++)
+    {
+        if (fnv1a_64_file(paths[i], &hash) != 0)
+            return -1;
+        // file boundaries count, a.hex b.hex is not ab.hex
+        hash = fnv1a_64("\n", 1, hash);
+    }
+    cache_header(&header, 0, bootinfo);
+    hash = fnv1a_64(&header, sizeof(header), hash);
+    *key = hash;
+    return 0;
+}
+
+/*
+ * Everything of the INFO geometry a conditioned image depends on, two
+ * devices with the same key take the same image
+ */
+uint64_t image_geometry_key(const TBootInfo *bootinfo)
+{
+    TCacheHeader header;
+
+    cache_header(&header, 0, bootinfo);
+    return fnv1a_64(&header, sizeof(header), FNV1A_64_INIT);
+}
+
+#ifdef _WIN32
+
+// no mapping on Windows yet, every run conditions
+int image_cache_load(const TImageCache *cache, uint64_t key, const TBootInfo *bootinfo, THexImage *image)
+{
+    (void)cache;
+    (void)key;
+    (void)bootinfo;
+    (void)image;
+    return -1;
+}
+
+int image_cache_store(const TImageCache *cache, uint64_t key, const TBootInfo *bootinfo, const THexImage *image)
+{
+    (void)cache;
+    (void)key;
+    (void)bootinfo;
+    (void)image;
+    return 0;
+}
+
+void image_cache_unmap(THexImage *image)
+{
+    (void)image;
+}
+
+#else
+
+/*
+ * Map the image for key, -1 on a miss
+ */
+int image_cache_load(const TImageCache *cache, uint64_t key, const TBootInfo *bootinfo, THexImage *image)
+{
+    char path[512];
+    TCacheHeader want, *have = NULL;
+    struct stat st;
+    size_t len = 0;
+    uint8_t *map = NULL;
+    int fd = -1;
+
+    cache_header(&want, key, bootinfo);
+    len = cache_file_size(&want);
+    cache_path(cache, key, want.mcu_size, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != len)
+    {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // geometry and key have to agree, the counts are the image's own
+    have = (TCacheHeader *)map;
+    if (memcmp(have, &want, offsetof(TCacheHeader, prg_mem_count)) != 0 || have->file_size == 0)
+    {
+        munmap(map, len);
+        close(fd);
+        return -1;
+    }
+
+    // recently used, for eviction
+    futimens(fd, NULL);
+    close(fd);
+
+    memset(image, 0, sizeof(THexImage));
+    image->prg = map + IMAGE_CACHE_DATA_OFFSET;
+    image->boot = image->prg + have->mcu_size;
+    image->conf = image->boot + have->boot_size;
+    image->prg_mem_count = have->prg_mem_count;
+    image->conf_mem_count = have->conf_mem_count;
+    image->mcu_size = have->mcu_size;
+    image->boot_size = have->boot_size;
+    image->file_size = have->file_size;
+    memcpy(image->first_instruction, have->first_instruction, sizeof(image->first_instruction));
+    image->map = map;
+    image->map_len = len;
+    return 0;
+}
+
+void image_cache_unmap(THexImage *image)
+{
+    if (image->map != NULL)
+        munmap(image->map, image->map_len);
+    image->map = NULL;
+    image->map_len = 0;
+    image->prg = image->boot = image->conf = NULL;
+}
+
+typedef struct
+{
+    char name[64];
+    time_t mtime;
+    off_t size;
+} TCacheEntry;
+
+static int compare_entry(const void *a, const void *b)
+{
+    const TCacheEntry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/*
+ * Least recently used images out until the directory is within its
+ * bound, keep stays. One process at a time, the others skip it.
+ */
+static void cache_evict(const TImageCache *cache, const char *keep)
+{
+    char path[512];
+    TCacheEntry *entries = NULL;
+    int count = 0, room = 0;
+    uint64_t total = 0;
+    struct dirent *ent = NULL;
+    DIR *dir = NULL;
+    int lock = -1;
+
+    snprintf(path, sizeof(path), "%s/.lock", cache->dir);
+    lock = open(path, O_RDWR | O_CREAT, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) != 0)
+        goto done;
+    dir = opendir(cache->dir);
+    if (dir == NULL)
+        goto done;
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        size_t n = strlen(ent->d_name);
+
+        if (n >= sizeof(entries[0].name) || ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+
+        // left behind by a writer that died
+        if (strstr(ent->d_name, ".tmp") != NULL)
+        {
+            if (time(NULL) - st.st_mtime > IMAGE_CACHE_STALE_S)
+                unlink(path);
+            continue;
+        }
+        if (n < 4 || strcmp(ent->d_name + n - 4, ".img") != 0)
+            continue;
+
+        if (count == room)
+        {
+            TCacheEntry *grown = realloc(entries, (room ? room * 2 : 32) * sizeof(TCacheEntry));
+            if (grown == NULL)
+                goto done;
+            entries = grown;
+            room = room ? room * 2 : 32;
+        }
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", ent->d_name);
+        entries[count].mtime = st.st_mtime;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(TCacheEntry), compare_entry);
+    for (int i = 0; i < count && total > cache->max_bytes; i++)
+    {
+        if (strcmp(entries[i].name, keep) == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+        if (unlink(path) == 0 || errno == ENOENT)
+            total -= entries[i].size;
+    }
+
+done:
+    free(entries);
+    if (dir != NULL)
+        closedir(dir);
+    if (lock >= 0)
+        close(lock);
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Keep a freshly conditioned image, a failure only costs the next run
+ * a parse
+ */
+int image_cache_store(const TImageCache *cache, uint64_t key, const TBootInfo *bootinfo, const THexImage *image)
+{
+    char path[512], tmp[540];
+    uint8_t head[IMAGE_CACHE_DATA_OFFSET] = {0};
+    TCacheHeader header;
+    int fd = -1;
+
+    if (image->file_size == 0 || image->prg == NULL || image->mcu_size != bootinfo->ulMcuSize.fValue)
+        return -1;
+    cache_header(&header, key, bootinfo);
+    header.prg_mem_count = image->prg_mem_count;
+    header.conf_mem_count = image->conf_mem_count;
+    header.file_size = image->file_size;
+    memcpy(header.first_instruction, image->first_instruction, sizeof(header.first_instruction));
+    memcpy(head, &header, sizeof(header));
+
+    cache_path(cache, key, header.mcu_size, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp%ld", path, (long)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write_all(fd, head, sizeof(head)) != 0 || write_all(fd, image->prg, header.mcu_size) != 0 ||
+        write_all(fd, image->boot, header.boot_size) != 0 || write_all(fd, image->conf, header.conf_size) != 0)
+    {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    cache_evict(cache, strrchr(path, '/') + 1);
+    return 0;
+}
+
+#endif
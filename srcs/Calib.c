@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "Calib.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Device calibration
+ *
+ * Erase and write experiments on a scratch region the user gives,
+ * below the bootloader at ulBootStart and off the boot vector page:
+ *
+ *   - every scratch page erased alone CALIB_ROUNDS times, then all of
+ *     them in one command
+ *   - CALIB_ROUNDS single row writes, WRITE to acknowledge, the data
+ *     reports that do not finish a row are the report rate
+ *   - one long write over the scratch, the sustained rate
+ *
+ * The scratch is left erased. The profile goes to
+ * <dir>/<sDevDsc>-rev<uiBootRev>.json, sessions on that board take
+ * their ETA from it and --adaptive its first timeouts.
+ */
+
+// a WRITE length field is 16 bits
+#define CALIB_STREAM_MAX 0x8000
+
+// "0x1d100000" or "0x1d100000:8"
+int calib_parse_region(const char *text, uint32_t *address, uint32_t *pages)
+{
+    char *end = NULL;
+    unsigned long value = strtoul(text, &end, 0);
+
+    *pages = CALIB_PAGES;
+    if (end == text)
+        goto bad;
+    *address = (uint32_t)value & V2P;
+    if (*end == ':')
+    {
+        const char *count = end + 1;
+        *pages = (uint32_t)strtoul(count, &end, 0);
+        if (end == count)
+            goto bad;
+    }
+    if (*end != '\0' || *pages < 1 || *pages > CALIB_MAX_PAGES)
+        goto bad;
+    return 0;
+
+bad:
+    fprintf(stderr, "--calibrate takes a scratch address and optional page count, e.g. 0x1d100000:%d (1..%d pages)\n",
+            CALIB_PAGES, CALIB_MAX_PAGES);
+    return -1;
+}
+
+/*
+ * Command report, the reply read into in when in is not NULL
+ */
+static int calib_command(TTransport *tp, int cmd, uint32_t address, uint16_t count, char *in, double *ms)
+{
+    char out[MAX_INTERRUPT_OUT_TRANSFER_SIZE] = {0};
+    double start = time_now_ms();
+    int transferred = 0;
+    int result = 0;
+
+    out[0] = 0x0f;
+    out[1] = (char)cmd;
+    memcpy(out + 2, &address, sizeof(uint32_t));
+    memcpy(out + 6, &count, sizeof(uint16_t));
+    result = tp->write(tp, out, sizeof(out), &transferred, CALIB_TIMEOUT_MS);
+    if (result >= 0 && in != NULL)
+        result = tp->read(tp, in, MAX_INTERRUPT_IN_TRANSFER_SIZE, &transferred, CALIB_TIMEOUT_MS);
+    if (ms != NULL)
+        *ms = time_now_ms() - start;
+    if (result < 0)
+        fprintf(stderr, "calibrate: command %d at %08x failed %d\n", cmd, address, result);
+    return result;
+}
+
+/*
+ * WRITE size bytes of a pattern at address up to the acknowledge.
+ * Latencies of data reports that do not finish a row go to reports.
+ */
+static int calib_write(TTransport *tp, uint32_t address, uint32_t size, uint16_t row, double *reports, int *count,
+                       int max, double *total_ms)
+{
+    char data[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    char in[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+    double start = time_now_ms();
+    int transferred = 0;
+    int result = calib_command(tp, cmdWRITE, address, (uint16_t)size, NULL, NULL);
+
+    memset(data, 0xa5, sizeof(data));
+    for (uint32_t sent = 0; result >= 0 && sent < size; sent += sizeof(data))
+    {
+        double report_ms = time_now_ms();
+        result = tp->write(tp, data, sizeof(data), &transferred, CALIB_TIMEOUT_MS);
+        report_ms = time_now_ms() - report_ms;
+        if (((sent + sizeof(data)) % row) != 0 && *count < max)
+            reports[(*count)++] = report_ms;
+    }
+    if (result >= 0)
+        result = tp->read(tp, in, sizeof(in), &transferred, CALIB_TIMEOUT_MS);
+    *total_ms = time_now_ms() - start;
+    if (result < 0)
+        fprintf(stderr, "calibrate: write at %08x failed %d\n", address, result);
+    return result;
+}
+
+/*
+ * Refuse a scratch that is not page aligned program flash or that
+ * reaches into the bootloader or the boot vector page
+ */
+static int calib_check_scratch(const TBootInfo *bootinfo, uint32_t address, uint32_t pages)
+{
+    uint32_t page = bootinfo->uiEraseBlock.fValue.intVal;
+    uint32_t boot_start = bootinfo->ulBootStart.fValue & V2P;
+    uint32_t vector_page = _PIC32Mn_STARTFLASH + (bootinfo->ulMcuSize.fValue - 0x10000);
+    uint32_t end = address + pages * page;
+
+    if (page == 0 || address < _PIC32Mn_STARTFLASH || (address - _PIC32Mn_STARTFLASH) % page != 0)
+    {
+        fprintf(stderr, "calibrate: scratch %08x is not on a 0x%x page boundary of program flash\n", address, page);
+        return -1;
+    }
+    if (end > boot_start)
+    {
+        fprintf(stderr, "calibrate: scratch %08x..%08x reaches the bootloader at %08x\n", address, end, boot_start);
+        return -1;
+    }
+    if (address < vector_page + page && end > vector_page)
+    {
+        fprintf(stderr, "calibrate: scratch %08x..%08x holds the boot vector page %08x\n", address, end, vector_page);
+        return -1;
+    }
+    return 0;
+}
+
+int calib_run(TTransport *tp, uint32_t address, uint32_t pages, TCalProfile *profile, FILE *out)
+{
+    char in[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+    TBootInfo bootinfo = {0};
+    double erase[CALIB_ROUNDS * CALIB_MAX_PAGES];
+    double rows[CALIB_ROUNDS];
+    double reports[CALIB_STREAM_MAX / MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    int report_count = 0;
+    double ms = 0.0;
+    uint32_t page = 0, row = 0, stream = 0;
+
+    memset(profile, 0, sizeof(TCalProfile));
+    if (calib_command(tp, cmdINFO, 0, 0, in, NULL) < 0)
+        return -1;
+    bootInfo_buffer(&bootinfo, in);
+    page = bootinfo.uiEraseBlock.fValue.intVal;
+    row = bootinfo.uiWriteBlock.fValue.intVal;
+    if (calib_check_scratch(&bootinfo, address, pages) != 0 || row < MAX_INTERRUPT_OUT_TRANSFER_SIZE || page < row)
+        return -1;
+    if (calib_command(tp, cmdBOOT, 0, 0, in, NULL) < 0)
+        return -1;
+
+    memcpy(profile->dev_dsc, bootinfo.sDevDsc.fValue, MAX_STRING_FIELD_LENGTH);
+    profile->boot_rev = bootinfo.uiBootRev.fValue.intVal;
+    profile->mcu_size = bootinfo.ulMcuSize.fValue;
+    profile->erase_block = (uint16_t)page;
+    profile->write_block = (uint16_t)row;
+    profile->scratch = address;
+    profile->pages = pages;
+    fprintf(out, "calibrate: %s rev %u, scratch %08x, %u pages of 0x%x, rows of 0x%x\n", profile->dev_dsc,
+            profile->boot_rev, address, pages, page, row);
+
+    // single pages
+    for (int round = 0; round < CALIB_ROUNDS; round++)
+    {
+        for (uint32_t p = 0; p < pages; p++)
+        {
+            if (calib_command(tp, cmdERASE, address + p * page, 1, in, &erase[round * pages + p]) < 0)
+                return -1;
+        }
+    }
+
+    // single rows, each on flash the erase above left blank
+    for (int round = 0; round < CALIB_ROUNDS; round++)
+    {
+        uint32_t at = address + (uint32_t)((round * row) % (pages * page));
+        if (calib_write(tp, at, row, (uint16_t)row, reports, &report_count, (int)(sizeof(reports) / sizeof(double)),
+                        &rows[round]) < 0)
+            return -1;
+    }
+
+    // all pages in one command, then one long write over them
+    if (calib_command(tp, cmdERASE, address, (uint16_t)pages, in, &ms) < 0)
+        return -1;
+    profile->erase_batch_page_ms = ms / pages;
+
+    stream = pages * page;
+    if (stream > CALIB_STREAM_MAX)
+        stream = CALIB_STREAM_MAX;
+    stream -= stream % row;
+    if (calib_write(tp, address, stream, (uint16_t)row, reports, &report_count, (int)(sizeof(reports) / sizeof(double)),
+                    &ms) < 0)
+        return -1;
+    profile->sustained_kbs = (ms > 0.0) ? stream / ms * 1000.0 / 1024.0 : 0.0;
+
+    // leave the scratch blank
+    if (calib_command(tp, cmdERASE, address, (uint16_t)pages, in, NULL) < 0)
+        return -1;
+
+    profile->erase_page_ms = percentile(erase, CALIB_ROUNDS * pages, 50);
+    profile->erase_page_p99_ms = percentile(erase, CALIB_ROUNDS * pages, 99);
+    profile->report_ms = percentile(reports, report_count, 50);
+    profile->report_p99_ms = percentile(reports, report_count, 99);
+
+    // what a row takes beyond getting its reports across
+    profile->row_ms = percentile(rows, CALIB_ROUNDS, 50) - (row / MAX_INTERRUPT_OUT_TRANSFER_SIZE) * profile->report_ms;
+    profile->row_p99_ms = percentile(rows, CALIB_ROUNDS, 99) - (row / MAX_INTERRUPT_OUT_TRANSFER_SIZE) * profile->report_ms;
+    if (profile->row_ms < 0.0)
+        profile->row_ms = 0.0;
+    if (profile->row_p99_ms < profile->row_ms)
+        profile->row_p99_ms = profile->row_ms;
+
+    fprintf(out, "calibrate: erase %.2f ms/page p50, %.2f p99, %.2f ms/page batched\n", profile->erase_page_ms,
+            profile->erase_page_p99_ms, profile->erase_batch_page_ms);
+    fprintf(out, "calibrate: row %.2f ms p50, %.2f p99, report %.3f ms p50, %.3f p99, sustained %.1f KB/s\n",
+            profile->row_ms, profile->row_p99_ms, profile->report_ms, profile->report_p99_ms, profile->sustained_kbs);
+    return 0;
+}
+
+static void calib_path(const char *dir, const char *dev_dsc, unsigned int boot_rev, char *path, size_t len)
+{
+    char name[MAX_STRING_FIELD_LENGTH + 1];
+
+    for (int i = 0; i <= MAX_STRING_FIELD_LENGTH; i++)
+    {
+        char c = (i < MAX_STRING_FIELD_LENGTH) ? dev_dsc[i] : '\0';
+        name[i] = (c == '\0') ? '\0' : (isalnum((unsigned char)c) ? c : '_');
+        if (c == '\0')
+            break;
+    }
+    snprintf(path, len, "%s/%s-rev%u.json", dir, name, boot_rev);
+}
+
+int calib_save(const TCalProfile *profile, const char *dir, char *path, size_t len)
+{
+    char escaped[2 * MAX_STRING_FIELD_LENGTH + 1];
+    FILE *fp = NULL;
+
+    calib_path(dir, profile->dev_dsc, profile->boot_rev, path, len);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not save calibration %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    json_escape(profile->dev_dsc, escaped, sizeof(escaped));
+    fprintf(fp, "{\"device\":\"%s\",\"boot_rev\":%u,\"mcu_size\":%u,\"erase_block\":%u,\"write_block\":%u,\n",
+            escaped, profile->boot_rev, profile->mcu_size, profile->erase_block, profile->write_block);
+    fprintf(fp, " \"erase_page_ms\":%.3f,\"erase_page_p99_ms\":%.3f,\"erase_batch_page_ms\":%.3f,\n",
+            profile->erase_page_ms, profile->erase_page_p99_ms, profile->erase_batch_page_ms);
+    fprintf(fp, " \"row_ms\":%.3f,\"row_p99_ms\":%.3f,\"report_ms\":%.4f,\"report_p99_ms\":%.4f,\"sustained_kbs\":%.2f,\n",
+            profile->row_ms, profile->row_p99_ms, profile->report_ms, profile->report_p99_ms, profile->sustained_kbs);
+    fprintf(fp, " \"scratch\":%u,\"pages\":%u}\n", profile->scratch, profile->pages);
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Profile of the board an INFO record describes, -1 when it was
+ * never calibrated
+ */
+int calib_load(TCalProfile *profile, const char *dir, const TBootInfo *bootinfo)
+{
+    char path[512];
+    char json[1024];
+    char dev_dsc[MAX_STRING_FIELD_LENGTH + 1] = {0};
+    size_t n = 0;
+    long value = 0;
+    FILE *fp = NULL;
+
+    memcpy(dev_dsc, bootinfo->sDevDsc.fValue, MAX_STRING_FIELD_LENGTH);
+    calib_path(dir, dev_dsc, bootinfo->uiBootRev.fValue.intVal, path, sizeof(path));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    n = fread(json, 1, sizeof(json) - 1, fp);
+    json[n] = '\0';
+    fclose(fp);
+
+    memset(profile, 0, sizeof(TCalProfile));
+    if (json_get_string(json, "device", profile->dev_dsc, sizeof(profile->dev_dsc)) != 0 ||
+        strcmp(profile->dev_dsc, dev_dsc) != 0 ||
+        json_get_double(json, "erase_batch_page_ms", &profile->erase_batch_page_ms) != 0 ||
+        json_get_double(json, "sustained_kbs", &profile->sustained_kbs) != 0 || profile->sustained_kbs <= 0.0)
+        return -1;
+    json_get_double(json, "erase_page_ms", &profile->erase_page_ms);
+    json_get_double(json, "erase_page_p99_ms", &profile->erase_page_p99_ms);
+    json_get_double(json, "row_ms", &profile->row_ms);
+    json_get_double(json, "row_p99_ms", &profile->row_p99_ms);
+    json_get_double(json, "report_ms", &profile->report_ms);
+    json_get_double(json, "report_p99_ms", &profile->report_p99_ms);
+    if (json_get_long(json, "boot_rev", &value) == 0)
+        profile->boot_rev = (uint16_t)value;
+    if (json_get_long(json, "write_block", &value) == 0)
+        profile->write_block = (uint16_t)value;
+    if (json_get_long(json, "erase_block", &value) == 0)
+        profile->erase_block = (uint16_t)value;
+    profile->mcu_size = bootinfo->ulMcuSize.fValue;
+    return 0;
+}
+
+/*
+ * Time to erase pages and stream bytes on a calibrated board
+ */
+double calib_estimate_ms(const TCalProfile *profile, uint32_t pages, uint32_t bytes)
+{
+    return pages * profile->erase_batch_page_ms + bytes / (profile->sustained_kbs * 1.024);
+}
@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Capture.h"
+#include "Types.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Session capture and replay
+ *
+ * A capture wraps the real transport and writes every transfer with
+ * its start time and duration. Replay turns a capture back into a
+ * simulated device: the INFO record is served as recorded and each
+ * OUT/IN transfer kind gets the latencies observed on hardware, in
+ * the order they were seen, so a host side change can be timed
+ * against real device behaviour with no board attached.
+ */
+
+static void capture_line(TCapture *cap, double start, const char *dir, int kind, int result, const char *data, int length)
+{
+    fprintf(cap->fp, "%.0f %.0f %s %s %d %d ", (start - cap->start_ms) * 1000.0,
+            (time_now_ms() - start) * 1000.0, dir, frame_kind_name(kind), result, length);
+    for (int i = 0; i < length; i++)
+        fprintf(cap->fp, "%02x", data[i] & 0xff);
+    fprintf(cap->fp, "%s\n", (length > 0) ? "" : "-");
+}
+
+static int capture_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TCapture *cap = tp->ctx;
+    double start = time_now_ms();
+    int kind = frame_classify(&cap->frame, (uint8_t *)data);
+    int result = cap->inner->write(cap->inner, data, length, transferred, timeout);
+
+    capture_line(cap, start, "OUT", kind, result, data, (result >= 0) ? *transferred : 0);
+    return result;
+}
+
+static int capture_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TCapture *cap = tp->ctx;
+    double start = time_now_ms();
+    int result = cap->inner->read(cap->inner, data, length, transferred, timeout);
+
+    capture_line(cap, start, "IN", frame_answer(&cap->frame), result, data, (result >= 0) ? *transferred : 0);
+    return result;
+}
+
+static void capture_transport_close(TTransport *tp)
+{
+    capture_close(tp->ctx);
+}
+
+/*
+ * Wrap inner in a capturing transport tp, writing to path
+ */
+int capture_open(TTransport *tp, TCapture *cap, TTransport *inner, const char *path)
+{
+    memset(cap, 0, sizeof(TCapture));
+    cap->fp = fopen(path, "w");
+    if (cap->fp == NULL)
+    {
+        fprintf(stderr, "Could not create capture %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    cap->inner = inner;
+    cap->start_ms = time_now_ms();
+    fprintf(cap->fp, "%s\n# start_us duration_us dir kind result length data\n", CAPTURE_MAGIC);
+
+    tp->write = capture_write;
+    tp->read = capture_read;
+    tp->close = capture_transport_close;
+    tp->ctx = cap;
+    return 0;
+}
+
+void capture_close(TCapture *cap)
+{
+    if (cap->fp != NULL)
+        fclose(cap->fp);
+    cap->fp = NULL;
+}
+
+static void series_add(TLatencySeries *series, double ms)
+{
+    if ((series->count & 63) == 0)
+        series->ms = realloc(series->ms, (series->count + 64) * sizeof(double));
+    series->ms[series->count++] = ms;
+}
+
+/*
+ * Build a simulated device from a capture, recorded_ms returns the
+ * wall time of the recorded session for comparison
+ */
+int replay_load(TSimConfig *cfg, const char *path, double *recorded_ms)
+{
+    char line[512];
+    char dir[8], kind_name[16], hex[260];
+    double start_us = 0.0, duration_us = 0.0;
+    double first_us = -1.0, last_us = 0.0;
+    int result = 0, length = 0, records = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open capture %s\n", path);
+        return -1;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0)
+    {
+        fprintf(stderr, "%s is not a mikro_hb capture\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    sim_default_config(cfg, MZ2048);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        int kind = cmdNON;
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%lf %lf %7s %15s %d %d %259s", &start_us, &duration_us, dir, kind_name, &result, &length, hex) != 7)
+            continue;
+
+        kind = frame_kind_from_name(kind_name);
+        if (strcmp(dir, "OUT") == 0)
+        {
+            series_add(&cfg->out[kind], duration_us / 1000.0);
+        }
+        else
+        {
+            series_add(&cfg->in[kind], duration_us / 1000.0);
+
+            // the first INFO answer is served as recorded
+            if (kind == cmdINFO && !cfg->have_info && result >= 0 && length > 0)
+            {
+                for (int i = 0; i < length && i < MAX_INTERRUPT_IN_TRANSFER_SIZE; i++)
+                {
+                    unsigned int byte = 0;
+                    sscanf(hex + i * 2, "%2x", &byte);
+                    cfg->info[i] = (uint8_t)byte;
+                }
+                cfg->have_info = 1;
+            }
+        }
+
+        if (first_us < 0.0)
+            first_us = start_us;
+        last_us = start_us + duration_us;
+        records++;
+    }
+    fclose(fp);
+
+    if (records == 0 || !cfg->have_info)
+    {
+        fprintf(stderr, "%s holds no INFO record to replay\n", path);
+        sim_free_config(cfg);
+        return -1;
+    }
+    if (recorded_ms != NULL)
+        *recorded_ms = (last_us - first_us) / 1000.0;
+    return 0;
+}
@@ -0,0 +1,392 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "Check.h"
+#include "HexFile.h"
+#include "Types.h"
+#include "Utils.h"
+
+/*
+ * Device-less check
+ *
+ * Every file gets a pass of its own over the records: checksums,
+ * syntax and where the data lands, the way condition_hexfile_data()
+ * places it. Only a file that parses clean and stays below the boot
+ * vector page and ulBootStart is conditioned and flashed, by the
+ * engine itself, to a simulated device of the checked geometry with
+ * every latency at zero, so the report count is what a real session
+ * sends. Files are spread over a pool of threads, results are printed
+ * in command line order.
+ */
+
+// binary record condition_hexfile_data() has room for, count, address,
+// type, data and checksum
+#define CHECK_LINE_BYTES 64
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static void check_problem(TCheckResult *r, const char *text, uint32_t line)
+{
+    if (r->problem[0] == '\0')
+    {
+        if (line > 0)
+            snprintf(r->problem, sizeof(r->problem), "line %u: %s", line, text);
+        else
+            snprintf(r->problem, sizeof(r->problem), "%s", text);
+    }
+    if (line > 0 && r->first_bad_line == 0)
+        r->first_bad_line = line;
+}
+
+// data bytes of one record at address into the ranges
+static void check_place(TCheckResult *r, const TSimConfig *cfg, uint32_t address, uint32_t count, uint32_t line)
+{
+    uint32_t end = address + count;
+
+    if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF)
+    {
+        if (end > _PIC32Mn_STARTFLASH + cfg->mcu_size)
+        {
+            r->outside += count;
+            check_problem(r, "program data past the end of flash", line);
+            return;
+        }
+        if (r->prg_end == 0 || address < r->prg_start)
+            r->prg_start = address;
+        if (end > r->prg_end)
+            r->prg_end = end;
+        r->prg_bytes += count;
+    }
+    else if (address >= _PIC32Mn_STARTCONF && end <= _PIC32Mn_STARTCONF + CONF_IMAGE_SIZE)
+    {
+        if (r->conf_end == 0 || address < r->conf_start)
+            r->conf_start = address;
+        if (end > r->conf_end)
+            r->conf_end = end;
+        r->conf_bytes += count;
+    }
+    else
+    {
+        r->outside += count;
+        check_problem(r, "data outside program and config flash", line);
+    }
+}
+
+/*
+ * Records of one file, returns -1 when it can't be read
+ */
+static int check_records(TCheckResult *r, const TSimConfig *cfg)
+{
+    char text[2 * (255 + 5) + 8];
+    uint8_t rec[255 + 5];
+    uint32_t root = 0, line = 0;
+    FILE *fp = fopen(r->path, "r");
+
+    if (fp == NULL)
+    {
+        check_problem(r, strerror(errno), 0);
+        return -1;
+    }
+
+    while (fgets(text, sizeof(text), fp) != NULL)
+    {
+        size_t len = strcspn(text, "\r\n");
+        uint32_t n = 0;
+        uint8_t sum = 0;
+
+        line++;
+        if (text[len] == '\0' && !feof(fp))
+        {
+            // longer than any record, drop the rest of the line
+            int c = 0;
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                ;
+            r->malformed++;
+            check_problem(r, "line too long", line);
+            continue;
+        }
+        text[len] = '\0';
+        if (len == 0 || r->eof)
+            continue;
+
+        for (n = 0; 2 + 2 * n <= len && n < sizeof(rec); n++)
+        {
+            int hi = hex_nibble(text[1 + 2 * n]), lo = hex_nibble(text[2 + 2 * n]);
+            if (hi < 0 || lo < 0)
+                break;
+            rec[n] = (uint8_t)(hi << 4 | lo);
+            sum += rec[n];
+        }
+        if (text[0] != ':' || 1 + 2 * n != len || n < 5 || n != 5u + rec[0] || rec[3] > 0x05)
+        {
+            r->malformed++;
+            check_problem(r, "not an intel hex record", line);
+            continue;
+        }
+        r->records++;
+        if (sum != 0)
+        {
+            r->bad_checksums++;
+            check_problem(r, "checksum", line);
+            continue;
+        }
+        if (n > CHECK_LINE_BYTES)
+        {
+            r->malformed++;
+            check_problem(r, "record longer than the parser takes", line);
+            continue;
+        }
+
+        if (rec[3] == 0x02 || rec[3] == 0x04)
+            root = transform_2words_long((uint16_t)(rec[4] << 8 | rec[5]), (uint16_t)(rec[1] << 8 | rec[2]));
+        else if (rec[3] == 0x00 && rec[0] > 0)
+            check_place(r, cfg, root + (uint16_t)(rec[1] << 8 | rec[2]), rec[0], line);
+        else if (rec[3] == 0x01)
+            r->eof = 1;
+    }
+    fclose(fp);
+
+    if (!r->eof)
+        check_problem(r, "no end of file record", 0);
+    return 0;
+}
+
+static THexImage *check_image(TBootSession *session, void *ctx)
+{
+    (void)session;
+    return (THexImage *)ctx;
+}
+
+/*
+ * Condition the file and flash it to a simulated device that takes no
+ * time, the reports it saw are the prediction
+ */
+static int check_dry_run(TCheckResult *r, const TSimConfig *geometry)
+{
+    TSimConfig cfg = *geometry;
+    TSim sim = {0};
+    TTransport tp = {0};
+    TBootSession session = {0};
+    TBootInfo bootinfo = {0};
+    THexImage image = {0};
+    char *path = (char *)r->path;
+    int result = -1;
+
+    sim_zero_latency(&cfg);
+
+    bootinfo.ulMcuSize.fValue = cfg.mcu_size;
+    bootinfo.uiEraseBlock.fValue.intVal = cfg.erase_block;
+    bootinfo.uiWriteBlock.fValue.intVal = cfg.write_block;
+    bootinfo.ulBootStart.fValue = cfg.boot_start;
+    if (condition_hexfile_data(&path, 1, &bootinfo, &image) == 0)
+    {
+        check_problem(r, "conditioning failed", 0);
+        free_hex_image(&image);
+        return -1;
+    }
+
+    if (sim_open(&sim, &cfg) == 0)
+    {
+        sim_transport(&tp, &sim);
+        session.transport = &tp;
+        session.paths = &path;
+        session.path_count = 1;
+        session.image_source = check_image;
+        session.image_ctx = &image;
+        session.quiet = 1;
+        result = setupChiptoBoot(&session);
+        r->reports = sim.reports;
+        if (result != 0 || sim.write_errors > 0)
+            check_problem(r, "simulated session failed", 0);
+        release_boot_session(&session);
+        sim_close(&sim);
+    }
+    else
+    {
+        check_problem(r, "no simulated device", 0);
+    }
+    free_hex_image(&image);
+    return (result == 0 && sim.write_errors == 0) ? 0 : -1;
+}
+
+static void check_file(TCheckResult *r, const TSimConfig *cfg)
+{
+    double start = time_now_ms();
+    uint32_t boot_page = _PIC32Mn_STARTFLASH + (cfg->mcu_size - 0x10000);
+
+    // the engine writes whole erase pages from the start of flash up to
+    // the last program byte, they must end below the boot vector page
+    // it writes itself and below the bootloader
+    r->app_limit = (cfg->boot_start != 0 && cfg->boot_start < boot_page) ? cfg->boot_start : boot_page;
+    if (check_records(r, cfg) == 0 && r->prg_end > 0)
+    {
+        uint32_t span = r->prg_end - _PIC32Mn_STARTFLASH;
+        r->erase_end = _PIC32Mn_STARTFLASH + (span + cfg->erase_block - 1) / cfg->erase_block * cfg->erase_block;
+        if (r->erase_end > r->app_limit)
+            check_problem(r, (r->erase_end > cfg->boot_start) ? "erase pages reach the bootloader"
+                                                              : "erase pages reach the boot vector page", 0);
+    }
+    else if (r->problem[0] == '\0')
+    {
+        check_problem(r, "no program data", 0);
+    }
+
+    if (r->problem[0] == '\0')
+        check_dry_run(r, cfg);
+    r->result = (r->problem[0] == '\0') ? 0 : -1;
+    r->ms = time_now_ms() - start;
+}
+
+typedef struct
+{
+    TCheckResult *results;
+    int count;
+    const TSimConfig *cfg;
+    int next;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} TCheckPool;
+
+static int check_take(TCheckPool *pool)
+{
+    int index = 0;
+#ifndef _WIN32
+    pthread_mutex_lock(&pool->lock);
+#endif
+    index = pool->next++;
+#ifndef _WIN32
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    return (index < pool->count) ? index : -1;
+}
+
+static void *check_worker(void *arg)
+{
+    TCheckPool *pool = arg;
+    int index = 0;
+
+    while ((index = check_take(pool)) >= 0)
+        check_file(&pool->results[index], pool->cfg);
+    return NULL;
+}
+
+static void check_print(const TCheckResult *r, FILE *out)
+{
+    fprintf(out, "%-4s %s", (r->result == 0) ? "ok" : "FAIL", r->path);
+    if (r->prg_end > 0)
+    {
+        uint32_t written = r->erase_end - _PIC32Mn_STARTFLASH;
+        fprintf(out, ", prg %08x-%08x %u bytes %.1f%% filled", r->prg_start, r->prg_end, r->prg_bytes,
+                (written > 0) ? 100.0 * r->prg_bytes / written : 0.0);
+    }
+    if (r->conf_end > 0)
+        fprintf(out, ", conf %08x-%08x", r->conf_start, r->conf_end);
+    if (r->erase_end > 0)
+        fprintf(out, ", %u bytes below %08x", (r->app_limit > r->erase_end) ? r->app_limit - r->erase_end : 0,
+                r->app_limit);
+    if (r->reports > 0)
+        fprintf(out, ", %u reports", r->reports);
+    if (r->bad_checksums > 0 || r->malformed > 0)
+        fprintf(out, ", %u of %u records bad", r->bad_checksums + r->malformed, r->records + r->malformed);
+    if (r->result != 0)
+        fprintf(out, "\n     %s", r->problem);
+    fprintf(out, "\n");
+}
+
+/*
+ * Check count files against geometry on jobs threads, 0 = one per cpu.
+ * Returns how many failed, -1 when the run could not start.
+ */
+int check_run(char **paths, int count, const TSimConfig *geometry, int jobs, FILE *out)
+{
+    TCheckPool pool = {0};
+    double start = time_now_ms();
+    int failed = 0;
+
+    if (count > CHECK_MAX_FILES)
+    {
+        fprintf(stderr, "check takes up to %d files\n", CHECK_MAX_FILES);
+        return -1;
+    }
+    pool.results = calloc(count, sizeof(TCheckResult));
+    if (pool.results == NULL)
+        return -1;
+    pool.count = count;
+    pool.cfg = geometry;
+    for (int i = 0; i < count; i++)
+        pool.results[i].path = paths[i];
+
+#ifdef _WIN32
+    jobs = 1;
+    check_worker(&pool);
+#else
+    if (jobs <= 0)
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > CHECK_MAX_JOBS)
+        jobs = CHECK_MAX_JOBS;
+    if (jobs > count)
+        jobs = count;
+    if (jobs < 1)
+        jobs = 1;
+    pthread_mutex_init(&pool.lock, NULL);
+    {
+        pthread_t threads[CHECK_MAX_JOBS];
+        int started = 0;
+
+        for (; started < jobs - 1; started++)
+        {
+            if (pthread_create(&threads[started], NULL, check_worker, &pool) != 0)
+                break;
+        }
+        // the calling thread works the queue too, nothing is lost if
+        // no thread could be started
+        check_worker(&pool);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        jobs = started + 1;
+    }
+    pthread_mutex_destroy(&pool.lock);
+#endif
+
+    for (int i = 0; i < count; i++)
+    {
+        check_print(&pool.results[i], out);
+        failed += (pool.results[i].result != 0);
+    }
+    fprintf(out, "check: %s, %d files, %d ok, %d failed, %.1f ms on %d threads\n", geometry->dev_dsc, count,
+            count - failed, failed, time_now_ms() - start, jobs);
+    free(pool.results);
+    return failed;
+}
@@ -0,0 +1,988 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Daemon.h"
+
+#ifdef _WIN32
+
+int run_daemon(const char *socket_path, unsigned int socket_mode, int schedule, double hub_kbs)
+{
+    fprintf(stderr, "Daemon mode needs unix domain sockets, not available on Windows\n");
+    return -1;
+}
+
+#else
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "Types.h"
+#include "USB.h"
+#include "HexFile.h"
+#include "Utils.h"
+#include "Sched.h"
+#include "Inject.h"
+#include "Arena.h"
+#include "Regions.h"
+#include "App.h"
+#include "Cache.h"
+
+/*
+ * Flash job server
+ *
+ * Keeps the libusb context and conditioned images resident and takes
+ * jobs over a unix domain socket, one json object per line:
+ *
+ *   {"cmd":"flash","image":"app.hex","device":"any","tag":"A12"}
+ *   {"cmd":"flash","images":["app.hex","cal.hex"],"device":"1:7"}
+ *   {"cmd":"flash","hash":"<image hash from an earlier job>","device":"1:9"}
+ *   {"cmd":"flash","hash":"<hash>","inject":["0x9d0ff000=text:SN-{n:06}"],"counter":1042}
+ *   {"cmd":"flash","image":"app.hex","options":{"regions":"program","verify":true,"app":"04d8:000a"}}
+ *   {"cmd":"status"}
+ *   {"cmd":"shutdown"}
+ *
+ * Every device selector gets its own queue and worker thread, jobs on
+ * one device run in order, different devices are flashed concurrently.
+ * A job's inject records are written over copies of the pages of the
+ * shared image they touch, the image is parsed once for the batch.
+ * A job's "options" are the flags of the same name: "regions" and
+ * "range" (strings as on the command line), "verify", "packed",
+ * "full_pages" and "pipeline" (true/false), "app" ("vid:pid" or
+ * "gone") and "app_timeout" (ms). The app check only counts the
+ * board on the port the job flashed. An unknown option rejects it.
+ * Job state (queued, running, progress, done/failed) and timing are sent
+ * back as json lines on the connection that submitted the job, a
+ * failed job's "error" is the first error the engine reported.
+ *
+ * Devices behind one hub share its bandwidth. With schedule every data
+ * stream of a job holds a slot of the topology scheduler on its hub
+ * and root port, a full hub holds streams back instead of thrashing
+ * timeouts.
+ */
+
+#define DAEMON_LINE_SIZE 4096
+#define DAEMON_PATH_SIZE 256
+#define DAEMON_DEVICE_SIZE 64
+#define DAEMON_TAG_SIZE 64
+
+// enqueue_job() after a shutdown command
+#define DAEMON_SHUTTING_DOWN -2
+
+typedef struct
+{
+    int fd;
+    int refs;
+    pthread_mutex_t lock;
+} TDaemonClient;
+
+typedef struct TFlashJob
+{
+    unsigned long id;
+    TDaemonClient *client;
+    char tag[2 * DAEMON_TAG_SIZE];             // json escaped, only sent back
+    char device[DAEMON_DEVICE_SIZE];
+    char device_json[2 * DAEMON_DEVICE_SIZE];  // device, json escaped
+    char path[MAX_HEX_FILES][DAEMON_PATH_SIZE];
+    char *paths[MAX_HEX_FILES];
+    int path_count;
+    uint64_t hash;
+    TInjectSet *inject;   // this board's records, NULL = none
+
+    // "options", the session fields the CLI flags of the same name set
+    int regions;
+    uint32_t range_start;
+    uint32_t range_end;
+    int verify;
+    int packed;
+    int full_pages;
+    int pipeline;
+    TAppCheck app;
+
+    // filled in while the job runs
+    struct TImageEntry *entry;
+    int cached;
+    int last_percent;
+    double submit_ms;
+    double parse_ms;
+    struct TFlashJob *next;
+} TFlashJob;
+
+typedef struct TImageEntry
+{
+    uint64_t hash;
+    uint64_t geometry;    // image_geometry_key() of the INFO it was conditioned for
+    char path[MAX_HEX_FILES][DAEMON_PATH_SIZE];
+    int path_count;
+    THexImage image;
+    int refs;
+    double last_used_ms;
+    struct TImageEntry *next;
+} TImageEntry;
+
+typedef struct TDeviceQueue
+{
+    char device[DAEMON_DEVICE_SIZE];
+    TFlashJob *head;
+    TFlashJob *tail;
+    int pending;
+    int busy;
+    pthread_cond_t wake;
+    pthread_t worker;
+    TArena arena;       // the worker's jobs carve their inject pages from it, reset after each
+    struct TDeviceQueue *next;
+} TDeviceQueue;
+
+// one lock covers queues and the image cache, nothing slow runs under it
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static TDeviceQueue *queues = NULL;
+static TImageEntry *images = NULL;
+static unsigned long next_job_id = 1;
+static volatile int shutting_down = 0;
+static int listen_fd = -1;
+static libusb_context *usb_ctx = NULL;
+static TSched *sched = NULL;
+
+static void client_release(TDaemonClient *client)
+{
+    int refs;
+    pthread_mutex_lock(&client->lock);
+    refs = --client->refs;
+    pthread_mutex_unlock(&client->lock);
+
+    if (refs == 0)
+    {
+        if (client->fd >= 0)
+            close(client->fd);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+    }
+}
+
+/*
+ * Send one json line to a client, a client that went away is ignored
+ */
+static void client_send(TDaemonClient *client, const char *fmt, ...)
+{
+    char line[DAEMON_LINE_SIZE];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line) - 1, fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+
+    pthread_mutex_lock(&client->lock);
+    if (client->fd >= 0 && send(client->fd, line, len, MSG_NOSIGNAL) != len)
+    {
+        shutdown(client->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+/*
+ * Image source for the engine, returns the cached image for this
+ * hash and device geometry (flash size, erase and write blocks, boot
+ * start) or conditions and caches a new one
+ */
+static THexImage *daemon_image_source(TBootSession *session, void *ctx)
+{
+    TFlashJob *job = ctx;
+    TImageEntry *entry = NULL;
+    TImageEntry *fresh = NULL;
+    uint64_t geometry = image_geometry_key(&session->bootinfo);
+    double start = time_now_ms();
+
+    pthread_mutex_lock(&daemon_lock);
+    for (entry = images; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == job->hash && entry->geometry == geometry)
+            break;
+    }
+    if (entry != NULL)
+    {
+        entry->refs++;
+        entry->last_used_ms = start;
+        job->cached = 1;
+    }
+    pthread_mutex_unlock(&daemon_lock);
+
+    if (entry == NULL)
+    {
+        fresh = calloc(1, sizeof(TImageEntry));
+        if (fresh == NULL)
+        {
+            error_report("No memory for the image of job %lu\n", job->id);
+            job->parse_ms = time_now_ms() - start;
+            return NULL;
+        }
+        fresh->hash = job->hash;
+        fresh->geometry = geometry;
+        fresh->path_count = job->path_count;
+        memcpy(fresh->path, job->path, sizeof(fresh->path));
+        if (condition_hexfile_data(job->paths, job->path_count, &session->bootinfo, &fresh->image) == 0)
+        {
+            free_hex_image(&fresh->image);
+            free(fresh);
+            job->parse_ms = time_now_ms() - start;
+            return NULL;
+        }
+
+        pthread_mutex_lock(&daemon_lock);
+        // another worker may have conditioned the same image meanwhile
+        for (entry = images; entry != NULL; entry = entry->next)
+        {
+            if (entry->hash == job->hash && entry->geometry == geometry)
+                break;
+        }
+        if (entry == NULL)
+        {
+            int count = 0;
+            TImageEntry **oldest = NULL;
+
+            // make room, least recently used image nobody is flashing
+            for (TImageEntry **e = &images; *e != NULL; e = &(*e)->next)
+            {
+                count++;
+                if ((*e)->refs == 0 && (oldest == NULL || (*e)->last_used_ms < (*oldest)->last_used_ms))
+                    oldest = e;
+            }
+            if (count >= DAEMON_IMAGE_CACHE && oldest != NULL)
+            {
+                TImageEntry *victim = *oldest;
+                *oldest = victim->next;
+                free_hex_image(&victim->image);
+                free(victim);
+            }
+
+            fresh->next = images;
+            images = fresh;
+            entry = fresh;
+            fresh = NULL;
+        }
+        entry->refs++;
+        entry->last_used_ms = time_now_ms();
+        pthread_mutex_unlock(&daemon_lock);
+
+        if (fresh != NULL)
+        {
+            free_hex_image(&fresh->image);
+            free(fresh);
+        }
+    }
+
+    job->entry = entry;
+    job->parse_ms = time_now_ms() - start;
+    return &entry->image;
+}
+
+static void daemon_progress(TBootSession *session, uint32_t done, uint32_t total)
+{
+    TFlashJob *job = session->user;
+    int percent = (total > 0) ? (int)((uint64_t)done * 100 / total) : 0;
+
+    if (percent / 10 != job->last_percent / 10 || percent == 100)
+    {
+        if (percent != job->last_percent)
+            client_send(job->client, "{\"job\":%lu,\"state\":\"progress\",\"region\":%d,\"percent\":%d}",
+                        job->id, session->vector_index, percent);
+        job->last_percent = percent;
+    }
+}
+
+static void free_job(TFlashJob *job)
+{
+    if (job->inject != NULL)
+    {
+        inject_free(job->inject);
+        free(job->inject);
+    }
+    free(job);
+}
+
+static void run_job(TFlashJob *job, TArena *arena)
+{
+    TBootSession session = {0};
+    TTransport transport = {0};
+    TUsbTopo topo;
+    TSchedShim shim;
+    TTransport sched_tp = {0};
+    libusb_device_handle *devh = NULL;
+    double start_ms = time_now_ms();
+    double open_ms = 0.0, end_ms = 0.0, app_start_ms = 0.0;
+    char escaped[512];
+    char reason[sizeof(escaped) + 16] = "";
+    int result = -1;
+
+    error_clear();
+    client_send(job->client, "{\"job\":%lu,\"state\":\"running\",\"device\":\"%s\"}", job->id, job->device_json);
+
+    devh = usb_open_bootloader(usb_ctx, job->device);
+    open_ms = time_now_ms() - start_ms;
+    if (devh == NULL)
+    {
+        client_send(job->client, "{\"job\":%lu,\"state\":\"failed\",\"error\":\"device %s not found\",\"tag\":\"%s\"}",
+                    job->id, job->device_json, job->tag);
+        return;
+    }
+
+    job->last_percent = -1;
+    usb_transport(&transport, devh);
+    usb_topology(devh, &topo);
+    sched_transport(&sched_tp, &shim, &transport, sched, &topo);
+    session.transport = &sched_tp;
+    session.paths = job->paths;
+    session.path_count = job->path_count;
+    session.image_source = daemon_image_source;
+    session.image_ctx = job;
+    session.on_progress = daemon_progress;
+    session.user = job;
+    session.quiet = 1;
+    session.inject = job->inject;
+    session.arena = arena;
+    session.regions = job->regions;
+    session.range_start = job->range_start;
+    session.range_end = job->range_end;
+    session.verify = job->verify;
+    session.packed = job->packed;
+    session.full_pages = job->full_pages;
+    session.pipeline = job->pipeline;
+    if (job->app.enabled)
+    {
+        job->app.ctx = usb_ctx;
+        job->app.port = &topo;
+        job->app.quiet = 1;
+        app_check_arm(&job->app);
+    }
+
+    result = setupChiptoBoot(&session);
+    sched_shim_end(&shim);
+    // the inject overlay and anything else the session allocated, the cached image stays
+    release_boot_session(&session);
+    usb_close_bootloader(devh);
+    if (job->app.enabled && result == 0)
+    {
+        app_start_ms = time_now_ms();
+        result = app_check_wait(&job->app, session.reboot_ms);
+        app_start_ms = time_now_ms() - app_start_ms;
+    }
+    else if (job->app.enabled)
+    {
+        app_check_disarm(&job->app);
+    }
+    end_ms = time_now_ms();
+
+    // what the engine said first, on this worker's thread
+    if (result != 0)
+    {
+        json_escape((error_first()[0] != '\0') ? error_first() : "flash failed", escaped, sizeof(escaped));
+        snprintf(reason, sizeof(reason), ",\"error\":\"%s\"", escaped);
+    }
+
+    if (job->entry != NULL)
+    {
+        pthread_mutex_lock(&daemon_lock);
+        job->entry->refs--;
+        pthread_mutex_unlock(&daemon_lock);
+    }
+
+    client_send(job->client,
+                "{\"job\":%lu,\"state\":\"%s\",\"tag\":\"%s\",\"device\":\"%s\",\"hash\":\"%016llx\",\"cached\":%s,"
+                "\"queued_ms\":%.1f,\"open_ms\":%.1f,\"hub_ms\":%.1f,\"parse_ms\":%.1f,\"first_data_ms\":%.1f,\"flash_ms\":%.1f,"
+                "\"app_ms\":%.1f,\"total_ms\":%.1f%s}",
+                job->id, (result == 0) ? "done" : "failed", job->tag, job->device_json,
+                (unsigned long long)job->hash, job->cached ? "true" : "false",
+                start_ms - job->submit_ms, open_ms, shim.wait_ms, job->parse_ms,
+                (session.prefix.data_ms > 0.0) ? session.prefix.data_ms - session.prefix.start_ms : 0.0,
+                end_ms - start_ms - open_ms - shim.wait_ms - job->parse_ms - app_start_ms, app_start_ms,
+                end_ms - job->submit_ms, reason);
+}
+
+static void *device_worker(void *arg)
+{
+    TDeviceQueue *queue = arg;
+
+    for (;;)
+    {
+        TFlashJob *job = NULL;
+
+        pthread_mutex_lock(&daemon_lock);
+        while (queue->head == NULL && !shutting_down)
+            pthread_cond_wait(&queue->wake, &daemon_lock);
+        job = queue->head;
+        if (job != NULL)
+        {
+            queue->head = job->next;
+            if (queue->head == NULL)
+                queue->tail = NULL;
+            queue->pending--;
+            queue->busy = 1;
+        }
+        pthread_mutex_unlock(&daemon_lock);
+
+        // queued jobs are still run on shutdown, then the worker ends
+        if (job == NULL)
+            break;
+
+        run_job(job, &queue->arena);
+        client_release(job->client);
+        free_job(job);
+
+        pthread_mutex_lock(&daemon_lock);
+        queue->busy = 0;
+        pthread_mutex_unlock(&daemon_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Add a job to its device queue, the queue and its worker are
+ * created the first time a device selector is seen. The queued
+ * reply is written to queued while the worker can't have the job
+ * yet. Returns its length, -1 without a worker or DAEMON_SHUTTING_DOWN
+ */
+static int enqueue_job(TFlashJob *job, char *queued, size_t len)
+{
+    TDeviceQueue *queue = NULL;
+    int position = 0;
+    int written = 0;
+
+    pthread_mutex_lock(&daemon_lock);
+    // the workers may be gone already
+    if (shutting_down)
+    {
+        pthread_mutex_unlock(&daemon_lock);
+        return DAEMON_SHUTTING_DOWN;
+    }
+    job->id = next_job_id++;
+    for (queue = queues; queue != NULL; queue = queue->next)
+    {
+        if (strcmp(queue->device, job->device) == 0)
+            break;
+    }
+    if (queue == NULL)
+    {
+        queue = calloc(1, sizeof(TDeviceQueue));
+        if (queue == NULL)
+        {
+            pthread_mutex_unlock(&daemon_lock);
+            return -1;
+        }
+        strcpy(queue->device, job->device);
+        pthread_cond_init(&queue->wake, NULL);
+        if (pthread_create(&queue->worker, NULL, device_worker, queue) != 0)
+        {
+            pthread_mutex_unlock(&daemon_lock);
+            free(queue);
+            return -1;
+        }
+        queue->next = queues;
+        queues = queue;
+    }
+
+    if (queue->tail != NULL)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    queue->pending++;
+    position = queue->pending + queue->busy;
+    written = snprintf(queued, len, "{\"job\":%lu,\"state\":\"queued\",\"tag\":\"%s\",\"device\":\"%s\",\"hash\":\"%016llx\",\"position\":%d}\n",
+                      job->id, job->tag, job->device_json, (unsigned long long)job->hash, position);
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&daemon_lock);
+
+    return (written < (int)len) ? written : (int)len - 1;
+}
+
+/*
+ * The job's "inject" records and "counter", -1 when one does not parse
+ */
+static int job_inject(TFlashJob *job, const char *line)
+{
+    char spec[DAEMON_PATH_SIZE + 32];
+    long counter = 0;
+
+    for (int i = 0; json_get_string_at(line, "inject", i, spec, sizeof(spec)) == 0; i++)
+    {
+        if (job->inject == NULL && (job->inject = calloc(1, sizeof(TInjectSet))) == NULL)
+            return -1;
+        if (inject_parse(job->inject, spec) != 0)
+            return -1;
+    }
+    if (job->inject != NULL && json_get_long(line, "counter", &counter) == 0)
+        job->inject->counter = (uint64_t)counter;
+    return 0;
+}
+
+/*
+ * The job's "options", -1 with the one that is unknown or does not
+ * parse in bad
+ */
+static int job_options(TFlashJob *job, const char *line, char *bad, size_t len)
+{
+    char options[DAEMON_LINE_SIZE];
+    char key[32];
+    char value[DAEMON_PATH_SIZE];
+    long number = 0;
+    int result = json_get_object(line, "options", options, sizeof(options));
+
+    job->app.timeout_ms = APP_TIMEOUT_MS;
+    if (result == -1)
+        return 0;
+    snprintf(bad, len, "options");
+    if (result != 0)
+        return -1;
+
+    for (int i = 0; json_key_at(options, i, key, sizeof(key)) == 0; i++)
+    {
+        int *flag = NULL;
+
+        snprintf(bad, len, "%s", key);
+        if (strcmp(key, "verify") == 0)
+            flag = &job->verify;
+        else if (strcmp(key, "packed") == 0)
+            flag = &job->packed;
+        else if (strcmp(key, "full_pages") == 0)
+            flag = &job->full_pages;
+        else if (strcmp(key, "pipeline") == 0)
+            flag = &job->pipeline;
+
+        if (flag != NULL)
+        {
+            if (json_get_long(options, key, &number) != 0)
+                return -1;
+            *flag = (number != 0);
+        }
+        else if (strcmp(key, "app_timeout") == 0)
+        {
+            if (json_get_long(options, key, &number) != 0 || number <= 0)
+                return -1;
+            job->app.timeout_ms = (int)number;
+        }
+        else if (json_get_string(options, key, value, sizeof(value)) != 0)
+        {
+            return -1;
+        }
+        else if (strcmp(key, "regions") == 0)
+        {
+            if (region_parse_list(value, &job->regions) != 0)
+                return -1;
+        }
+        else if (strcmp(key, "range") == 0)
+        {
+            if (region_parse_range(value, &job->range_start, &job->range_end) != 0)
+                return -1;
+        }
+        else if (strcmp(key, "app") == 0)
+        {
+            if (app_check_parse(&job->app, value) != 0)
+                return -1;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Hash the contents of the job's files, so a rebuilt hex is never
+ * served from the cache, -1 with the file that can't be read
+ */
+static int job_hash(const TFlashJob *job, uint64_t *hash, int *unreadable)
+{
+    *hash = FNV1A_64_INIT;
+    for (int i = 0; i < job->path_count; i++)
+    {
+        if (fnv1a_64_file(job->path[i], hash) != 0)
+        {
+            *unreadable = i;
+            return -1;
+        }
+        *hash = fnv1a_64("\n", 1, *hash);
+    }
+    return 0;
+}
+
+static void handle_flash(TDaemonClient *client, const char *line)
+{
+    TFlashJob *job = calloc(1, sizeof(TFlashJob));
+    char tag[DAEMON_TAG_SIZE] = {0};
+    char hash[32] = {0};
+    char option[32] = {0};
+    char escaped[DAEMON_PATH_SIZE * 2];
+    uint64_t current = 0;
+    int unreadable = 0;
+    char queued[DAEMON_LINE_SIZE];
+    int queued_len = 0;
+
+    if (job == NULL)
+    {
+        client_send(client, "{\"state\":\"rejected\",\"error\":\"out of memory\"}");
+        return;
+    }
+
+    // tag and device go back in every reply, a quote in them must not end the string
+    if (json_get_string(line, "tag", tag, sizeof(tag)) == 0)
+        json_escape(tag, job->tag, sizeof(job->tag));
+    if (json_get_string(line, "device", job->device, sizeof(job->device)) != 0 || job->device[0] == '\0')
+        strcpy(job->device, "any");
+    json_escape(job->device, job->device_json, sizeof(job->device_json));
+
+    if (json_get_string(line, "image", job->path[0], DAEMON_PATH_SIZE) == 0)
+    {
+        job->path_count = 1;
+    }
+    else
+    {
+        while (job->path_count < MAX_HEX_FILES &&
+               json_get_string_at(line, "images", job->path_count, job->path[job->path_count], DAEMON_PATH_SIZE) == 0)
+            job->path_count++;
+    }
+
+    if (job->path_count == 0 && json_get_string(line, "hash", hash, sizeof(hash)) == 0)
+    {
+        // an image seen before, reuse its paths so other geometries can be conditioned
+        job->hash = strtoull(hash, NULL, 16);
+        pthread_mutex_lock(&daemon_lock);
+        for (TImageEntry *entry = images; entry != NULL; entry = entry->next)
+        {
+            if (entry->hash == job->hash)
+            {
+                memcpy(job->path, entry->path, sizeof(job->path));
+                job->path_count = entry->path_count;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&daemon_lock);
+        if (job->path_count == 0)
+        {
+            json_escape(hash, escaped, sizeof(escaped));
+            client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"unknown image hash %s\"}", job->tag,
+                        escaped);
+            free(job);
+            return;
+        }
+
+        // the files may have been rebuilt since, their new contents are not this image
+        if (job_hash(job, &current, &unreadable) != 0 || current != job->hash)
+        {
+            client_send(client,
+                        "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"the files of image %016llx changed, "
+                        "submit them by path\"}",
+                        job->tag, (unsigned long long)job->hash);
+            free(job);
+            return;
+        }
+    }
+    else if (job_hash(job, &job->hash, &unreadable) != 0)
+    {
+        json_escape(job->path[unreadable], escaped, sizeof(escaped));
+        client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"can't read %s\"}", job->tag, escaped);
+        free(job);
+        return;
+    }
+
+    if (job->path_count == 0)
+    {
+        client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"no image or hash given\"}", job->tag);
+        free(job);
+        return;
+    }
+
+    for (int i = 0; i < job->path_count; i++)
+        job->paths[i] = job->path[i];
+
+    if (job_inject(job, line) != 0)
+    {
+        client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"bad inject record\"}", job->tag);
+        free_job(job);
+        return;
+    }
+
+    if (job_options(job, line, option, sizeof(option)) != 0)
+    {
+        json_escape(option, escaped, sizeof(escaped));
+        client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"bad or unknown option %s\"}", job->tag,
+                    escaped);
+        free_job(job);
+        return;
+    }
+
+    pthread_mutex_lock(&client->lock);
+    client->refs++;
+    pthread_mutex_unlock(&client->lock);
+    job->client = client;
+    job->submit_ms = time_now_ms();
+
+    // the worker's running line waits for the queued one
+    pthread_mutex_lock(&client->lock);
+    queued_len = enqueue_job(job, queued, sizeof(queued));
+    if (queued_len > 0 && client->fd >= 0 && send(client->fd, queued, queued_len, MSG_NOSIGNAL) != queued_len)
+        shutdown(client->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&client->lock);
+
+    if (queued_len == DAEMON_SHUTTING_DOWN)
+    {
+        client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"shutting down\"}", job->tag);
+        client_release(client);
+        free_job(job);
+        return;
+    }
+    if (queued_len < 0)
+    {
+        client_send(client, "{\"state\":\"rejected\",\"tag\":\"%s\",\"error\":\"no worker for %s\"}", job->tag, job->device_json);
+        client_release(client);
+        free_job(job);
+        return;
+    }
+}
+
+static void handle_status(TDaemonClient *client)
+{
+    char line[DAEMON_LINE_SIZE];
+    char device[2 * DAEMON_DEVICE_SIZE];
+    int len = 0;
+    int cached = 0;
+
+    pthread_mutex_lock(&daemon_lock);
+    len += snprintf(line + len, sizeof(line) - len, "{\"state\":\"status\",\"queues\":[");
+    for (TDeviceQueue *queue = queues; queue != NULL && len < (int)sizeof(line) - 256; queue = queue->next)
+    {
+        json_escape(queue->device, device, sizeof(device));
+        len += snprintf(line + len, sizeof(line) - len, "%s{\"device\":\"%s\",\"pending\":%d,\"busy\":%s}",
+                        (queue == queues) ? "" : ",", device, queue->pending, queue->busy ? "true" : "false");
+    }
+    for (TImageEntry *entry = images; entry != NULL; entry = entry->next)
+        cached++;
+    pthread_mutex_unlock(&daemon_lock);
+
+    snprintf(line + len, sizeof(line) - len, "],\"images\":%d}", cached);
+    client_send(client, "%s", line);
+}
+
+static void *client_thread(void *arg)
+{
+    TDaemonClient *client = arg;
+    char buf[DAEMON_LINE_SIZE];
+    size_t used = 0;
+    ssize_t n = 0;
+
+    while ((n = recv(client->fd, buf + used, sizeof(buf) - 1 - used, 0)) > 0)
+    {
+        char *line = buf;
+        char *nl = NULL;
+        char cmd[32] = {0};
+
+        used += n;
+        buf[used] = '\0';
+
+        while ((nl = strchr(line, '\n')) != NULL)
+        {
+            *nl = '\0';
+            if (json_get_string(line, "cmd", cmd, sizeof(cmd)) != 0)
+            {
+                if (line[0] != '\0' && line[0] != '\r')
+                    client_send(client, "{\"state\":\"rejected\",\"error\":\"missing cmd\"}");
+            }
+            else if (strcmp(cmd, "flash") == 0)
+            {
+                handle_flash(client, line);
+            }
+            else if (strcmp(cmd, "status") == 0)
+            {
+                handle_status(client);
+            }
+            else if (strcmp(cmd, "shutdown") == 0)
+            {
+                client_send(client, "{\"state\":\"shutdown\"}");
+                pthread_mutex_lock(&daemon_lock);
+                shutting_down = 1;
+                pthread_mutex_unlock(&daemon_lock);
+                shutdown(listen_fd, SHUT_RDWR);
+            }
+            else
+            {
+                char escaped[2 * sizeof(cmd)];
+                json_escape(cmd, escaped, sizeof(escaped));
+                client_send(client, "{\"state\":\"rejected\",\"error\":\"unknown cmd %s\"}", escaped);
+            }
+            line = nl + 1;
+        }
+
+        // keep a partial line for the next read, drop lines that don't fit
+        used = strlen(line);
+        if (used >= sizeof(buf) - 1)
+            used = 0;
+        memmove(buf, line, used);
+    }
+
+    client_release(client);
+    return NULL;
+}
+
+/*
+ * Clear the way for the socket, 0 when the path is free or held by a
+ * socket nobody answers on (a daemon that died), -1 when a daemon is
+ * listening there or the path is something else
+ */
+static int daemon_claim(const struct sockaddr_un *addr)
+{
+    struct stat st;
+    int fd = -1;
+    int answered = 0;
+
+    if (lstat(addr->sun_path, &st) != 0)
+        return (errno == ENOENT) ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "%s exists and is not a socket\n", addr->sun_path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    answered = (fd >= 0 && connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0);
+    if (fd >= 0)
+        close(fd);
+    if (answered)
+    {
+        fprintf(stderr, "A daemon is already listening on %s\n", addr->sun_path);
+        return -1;
+    }
+    return unlink(addr->sun_path);
+}
+
+int run_daemon(const char *socket_path, unsigned int socket_mode, int schedule, double hub_kbs)
+{
+    struct sockaddr_un addr = {0};
+    pthread_t thread;
+    mode_t mask;
+    int bound = -1;
+
+    if (socket_path == NULL)
+        socket_path = DAEMON_SOCKET_PATH;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+
+    if (libusb_init_context(&usb_ctx, NULL, 0) < 0)
+    {
+        fprintf(stderr, "Unable to initialize libusb.\n");
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (daemon_claim(&addr) != 0)
+    {
+        libusb_exit(usb_ctx);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    // a NULL scheduler lets every stream run as it comes
+    sched = schedule ? sched_create(hub_kbs) : NULL;
+
+    // nobody but the owner can connect before the mode is set
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mask = umask(0177);
+    if (listen_fd >= 0)
+        bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0 || chmod(socket_path, socket_mode) < 0 || listen(listen_fd, 16) < 0)
+    {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        if (bound == 0)
+            unlink(socket_path);
+        if (listen_fd >= 0)
+            close(listen_fd);
+        sched_destroy(sched);
+        libusb_exit(usb_ctx);
+        return -1;
+    }
+    printf("mikro_hb daemon listening on %s\n", socket_path);
+    fflush(stdout);
+
+    while (!shutting_down)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        TDaemonClient *client = calloc(1, sizeof(TDaemonClient));
+        if (client == NULL)
+        {
+            static const char reply[] = "{\"state\":\"rejected\",\"error\":\"out of memory\"}\n";
+            send(fd, reply, sizeof(reply) - 1, MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->refs = 1;
+        pthread_mutex_init(&client->lock, NULL);
+        if (pthread_create(&thread, NULL, client_thread, client) != 0)
+        {
+            close(fd);
+            pthread_mutex_destroy(&client->lock);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // let every queue drain, then tear down
+    pthread_mutex_lock(&daemon_lock);
+    shutting_down = 1;
+    for (TDeviceQueue *queue = queues; queue != NULL; queue = queue->next)
+        pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&daemon_lock);
+
+    for (TDeviceQueue *queue = queues; queue != NULL; queue = queue->next)
+    {
+        pthread_join(queue->worker, NULL);
+        arena_free(&queue->arena);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    sched_report(sched, stdout);
+    sched_destroy(sched);
+    libusb_exit(usb_ctx);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,459 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Fault.h"
+#include "Types.h"
+#include "Utils.h"
+
+/*
+ * Fault injection
+ *
+ * A plan file lists faults to apply to the transfers between the
+ * engine and the device, real or simulated:
+ *
+ *   # comment
+ *   seed 1234
+ *   drop out 120          OUT report 120 never reaches the device
+ *   delay in 3 250        IN transfer 3 held back 250 ms
+ *   corrupt out rate=0.001  flip a byte in 0.1% of OUT reports
+ *   fail out 400 -1       OUT report 400 returns LIBUSB_ERROR_IO
+ *   disconnect out 700    device gone from OUT report 700 on
+ *
+ * Timeouts cost what they cost on the bus: a lost response or a delay
+ * past the transfer timeout waits out the full timeout.
+ *
+ * The soak loop flashes the device once clean for reference, then
+ * once per fault with a single plan entry at a random transfer index,
+ * retrying after each failure to measure what recovery costs.
+ */
+
+// clean sessions tried after a failed one before giving up
+#define SOAK_RETRIES 3
+
+static const char *kind_names[faultKINDS] = {
+    [faultDROP] = "drop",
+    [faultDELAY] = "delay",
+    [faultCORRUPT] = "corrupt",
+    [faultFAIL] = "fail",
+    [faultDISCONNECT] = "disconnect"};
+
+const char *fault_kind_name(TFaultKind kind)
+{
+    return (kind >= 0 && kind < faultKINDS) ? kind_names[kind] : "?";
+}
+
+/*
+ * Add one plan line, blank lines and comments are skipped
+ */
+int fault_parse_line(TFaultPlan *plan, const char *line)
+{
+    char kind[16], dir[8], where[32];
+    double arg = 0.0;
+    int fields = 0;
+    unsigned long long seed = 0;
+    TFault *fault = NULL;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line == '\0' || *line == '\n' || *line == '\r' || *line == '#')
+        return 0;
+
+    if (sscanf(line, "seed %llu", &seed) == 1)
+    {
+        plan->seed = seed;
+        return 0;
+    }
+
+    fields = sscanf(line, "%15s %7s %31s %lf", kind, dir, where, &arg);
+    if (fields < 3 || plan->count >= FAULT_MAX)
+    {
+        fprintf(stderr, "Bad fault line: %s", line);
+        return -1;
+    }
+
+    fault = &plan->faults[plan->count];
+    memset(fault, 0, sizeof(TFault));
+    fault->kind = faultKINDS;
+    for (int i = 0; i < faultKINDS; i++)
+    {
+        if (strcmp(kind, kind_names[i]) == 0)
+            fault->kind = (TFaultKind)i;
+    }
+    if (fault->kind == faultKINDS || (strcmp(dir, "out") != 0 && strcmp(dir, "in") != 0))
+    {
+        fprintf(stderr, "Bad fault line: %s", line);
+        return -1;
+    }
+    fault->dir = (strcmp(dir, "in") == 0) ? FAULT_IN : FAULT_OUT;
+
+    if (strncmp(where, "rate=", 5) == 0)
+        fault->rate = strtod(where + 5, NULL);
+    else
+        fault->index = (uint32_t)strtoul(where, NULL, 10);
+
+    fault->delay_ms = (fields == 4) ? arg : 0.0;
+    fault->code = (fields == 4 && fault->kind == faultFAIL) ? (int)arg : LIBUSB_ERROR_IO;
+    plan->count++;
+    return 0;
+}
+
+int fault_load(TFaultPlan *plan, const char *path)
+{
+    char line[256];
+    FILE *fp = fopen(path, "r");
+
+    memset(plan, 0, sizeof(TFaultPlan));
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open fault plan %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (fault_parse_line(plan, line) != 0)
+        {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    if (plan->count == 0)
+    {
+        fprintf(stderr, "Fault plan %s has no faults\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void fault_describe(const TFault *fault, uint32_t index, char *out, size_t len)
+{
+    snprintf(out, len, "%s %s #%u", fault_kind_name(fault->kind), (fault->dir == FAULT_IN) ? "in" : "out", index);
+}
+
+/*
+ * Next transfer in dir, returns the plan entry that fires on it
+ */
+static const TFault *fault_due(TFaultShim *shim, int dir)
+{
+    uint32_t index = shim->index[dir]++;
+
+    for (int i = 0; i < shim->plan.count; i++)
+    {
+        const TFault *fault = &shim->plan.faults[i];
+        int fires = 0;
+
+        if (fault->dir != dir)
+            continue;
+        if (fault->rate > 0.0)
+            fires = (double)(rand_next(&shim->rng) >> 11) / 9007199254740992.0 < fault->rate;
+        else
+            fires = (fault->index == index);
+
+        if (fires)
+        {
+            shim->injected++;
+            if (shim->first_ms == 0.0)
+            {
+                shim->first_ms = time_now_ms();
+                fault_describe(fault, index, shim->first, sizeof(shim->first));
+            }
+            return fault;
+        }
+    }
+    return NULL;
+}
+
+static void corrupt_byte(TFaultShim *shim, char *data, int length)
+{
+    uint64_t r = rand_next(&shim->rng);
+
+    if (length > 0)
+        data[r % length] ^= (char)(((r >> 32) % 255) + 1);
+}
+
+static int fault_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TFaultShim *shim = tp->ctx;
+    const TFault *fault = NULL;
+    char copy[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+
+    *transferred = 0;
+    if (shim->disconnected)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    fault = fault_due(shim, FAULT_OUT);
+    if (fault == NULL)
+        return shim->inner->write(shim->inner, data, length, transferred, timeout);
+
+    switch (fault->kind)
+    {
+    case faultDROP:
+        // the host thinks it went out
+        *transferred = length;
+        return 0;
+    case faultDELAY:
+        if (fault->delay_ms >= timeout)
+        {
+            sleep_ms(timeout);
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        sleep_ms(fault->delay_ms);
+        return shim->inner->write(shim->inner, data, length, transferred, timeout);
+    case faultCORRUPT:
+        // the engine's buffer stays intact, only the wire sees the flip
+        length = (length < (int)sizeof(copy)) ? length : (int)sizeof(copy);
+        memcpy(copy, data, length);
+        corrupt_byte(shim, copy, length);
+        return shim->inner->write(shim->inner, copy, length, transferred, timeout);
+    case faultFAIL:
+        return fault->code;
+    default:
+        shim->disconnected = 1;
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+}
+
+static int fault_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TFaultShim *shim = tp->ctx;
+    const TFault *fault = NULL;
+    int result = 0;
+
+    *transferred = 0;
+    if (shim->disconnected)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    fault = fault_due(shim, FAULT_IN);
+    if (fault == NULL)
+        return shim->inner->read(shim->inner, data, length, transferred, timeout);
+
+    switch (fault->kind)
+    {
+    case faultDROP:
+        // response consumed and lost, the host waits the timeout out
+        result = shim->inner->read(shim->inner, data, length, transferred, timeout);
+        if (result < 0)
+            return result;
+        *transferred = 0;
+        sleep_ms(timeout);
+        return LIBUSB_ERROR_TIMEOUT;
+    case faultDELAY:
+        // a late response stays queued for the next read
+        if (fault->delay_ms >= timeout)
+        {
+            sleep_ms(timeout);
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        sleep_ms(fault->delay_ms);
+        return shim->inner->read(shim->inner, data, length, transferred, timeout);
+    case faultCORRUPT:
+        result = shim->inner->read(shim->inner, data, length, transferred, timeout);
+        if (result >= 0)
+            corrupt_byte(shim, data, *transferred);
+        return result;
+    case faultFAIL:
+        return fault->code;
+    default:
+        shim->disconnected = 1;
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+}
+
+/*
+ * Wrap inner in a transport tp applying plan
+ */
+void fault_transport(TTransport *tp, TFaultShim *shim, TTransport *inner, const TFaultPlan *plan)
+{
+    memset(shim, 0, sizeof(TFaultShim));
+    shim->inner = inner;
+    shim->plan = *plan;
+    shim->rng = plan->seed;
+
+    tp->write = fault_write;
+    tp->read = fault_read;
+    tp->close = NULL;
+    tp->ctx = shim;
+}
+
+void fault_report(TFaultShim *shim, FILE *out)
+{
+    if (shim->injected == 0)
+    {
+        fprintf(out, "faults: none injected in %u OUT / %u IN transfers\n", shim->index[FAULT_OUT], shim->index[FAULT_IN]);
+        return;
+    }
+    fprintf(out, "faults: %u injected in %u OUT / %u IN transfers, first %s\n", shim->injected,
+            shim->index[FAULT_OUT], shim->index[FAULT_IN], shim->first);
+}
+
+/*
+ * Per plan entry results of a soak
+ */
+typedef struct
+{
+    int fired;
+    int absorbed;  // session still completed, image good
+    int silent;    // session completed with a bad image
+    int failed;    // session reported the fault
+    int recovered; // a clean retry succeeded afterwards
+    double *detect_ms;
+    double *recover_ms;
+    int detect_count;
+    int recover_count;
+} TSoakStats;
+
+static THexImage *soak_image(TBootSession *session, void *ctx)
+{
+    return ctx;
+}
+
+/*
+ * One session over tp, the image is shared from the reference run
+ */
+static int soak_session(TBootSession *proto, THexImage *image, TTransport *tp)
+{
+    TBootSession session = *proto;
+    int result = 0;
+
+    session.transport = tp;
+    session.quiet = 1;
+    if (image != NULL)
+    {
+        session.image_source = soak_image;
+        session.image_ctx = image;
+    }
+    result = setupChiptoBoot(&session);
+    release_boot_session(&session);
+    return result;
+}
+
+int fault_soak(TSoakTarget *target, const TFaultPlan *plan, TBootSession *proto, int iterations, FILE *out)
+{
+    TSoakStats stats[FAULT_MAX];
+    TBootSession reference = *proto;
+    TTransport shim_tp = {0};
+    TFaultShim shim;
+    TFaultPlan clean = {0};
+    TTransport *tp = NULL;
+    uint64_t rng = plan->seed;
+    uint32_t transfers[2] = {0};
+    double ref_ms = 0.0;
+    int fired = 0, succeeded = 0;
+
+    // reference run conditions the image and counts the transfers
+    tp = target->open(target->ctx);
+    if (tp == NULL)
+        return -1;
+    fault_transport(&shim_tp, &shim, tp, &clean);
+    reference.transport = &shim_tp;
+    reference.quiet = 1;
+    ref_ms = time_now_ms();
+    if (setupChiptoBoot(&reference) != 0)
+    {
+        fprintf(stderr, "soak: reference session failed\n");
+        target->close(target->ctx);
+        release_boot_session(&reference);
+        return -1;
+    }
+    ref_ms = time_now_ms() - ref_ms;
+    target->close(target->ctx);
+    transfers[FAULT_OUT] = shim.index[FAULT_OUT];
+    transfers[FAULT_IN] = shim.index[FAULT_IN];
+
+    memset(stats, 0, sizeof(stats));
+    for (int i = 0; i < plan->count; i++)
+    {
+        stats[i].detect_ms = malloc(iterations * sizeof(double));
+        stats[i].recover_ms = malloc(iterations * sizeof(double));
+    }
+
+    for (int n = 0; n < iterations; n++)
+    {
+        int entry = n % plan->count;
+        TSoakStats *st = &stats[entry];
+        TFaultPlan one = {0};
+        double end_ms = 0.0;
+        int result = 0, verified = 0;
+
+        one.seed = plan->seed + n + 1;
+        one.count = 1;
+        one.faults[0] = plan->faults[entry];
+        if (one.faults[0].rate == 0.0)
+            one.faults[0].index = (uint32_t)(rand_next(&rng) % transfers[one.faults[0].dir]);
+
+        tp = target->open(target->ctx);
+        if (tp == NULL)
+            break;
+        fault_transport(&shim_tp, &shim, tp, &one);
+        result = soak_session(proto, reference.image, &shim_tp);
+        end_ms = time_now_ms();
+        verified = (result == 0 && target->verify != NULL) ? target->verify(target->ctx) : -1;
+        target->close(target->ctx);
+
+        if (shim.injected == 0)
+            continue;
+        st->fired++;
+        fired++;
+
+        if (result == 0)
+        {
+            if (verified == 0)
+            {
+                st->silent++;
+                continue;
+            }
+            st->absorbed++;
+            succeeded++;
+            st->recover_ms[st->recover_count++] = end_ms - shim.first_ms;
+            continue;
+        }
+
+        st->failed++;
+        st->detect_ms[st->detect_count++] = end_ms - shim.first_ms;
+        for (int retry = 0; retry < SOAK_RETRIES; retry++)
+        {
+            tp = target->open(target->ctx);
+            if (tp == NULL)
+                break;
+            result = soak_session(proto, reference.image, tp);
+            target->close(target->ctx);
+            if (result == 0)
+            {
+                st->recovered++;
+                succeeded++;
+                st->recover_ms[st->recover_count++] = time_now_ms() - shim.first_ms;
+                break;
+            }
+        }
+    }
+
+    fprintf(out, "soak: %d faults fired of %d runs, reference session %.1f ms, %u OUT / %u IN transfers\n",
+            fired, iterations, ref_ms, transfers[FAULT_OUT], transfers[FAULT_IN]);
+    fprintf(out, "%-14s %6s %8s %6s %6s %9s %7s %10s %10s %10s %10s %10s\n", "fault", "fired", "absorbed", "silent",
+            "failed", "recovered", "ok %", "detect p50", "recov p50", "recov p90", "recov p99", "recov max");
+    for (int i = 0; i < plan->count; i++)
+    {
+        TSoakStats *st = &stats[i];
+        char name[32];
+
+        snprintf(name, sizeof(name), "%s %s", fault_kind_name(plan->faults[i].kind), (plan->faults[i].dir == FAULT_IN) ? "in" : "out");
+        fprintf(out, "%-14s %6d %8d %6d %6d %9d %6.1f%% %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, st->fired,
+                st->absorbed, st->silent, st->failed, st->recovered,
+                st->fired ? 100.0 * (st->absorbed + st->recovered) / st->fired : 0.0,
+                percentile(st->detect_ms, st->detect_count, 50),
+                percentile(st->recover_ms, st->recover_count, 50),
+                percentile(st->recover_ms, st->recover_count, 90),
+                percentile(st->recover_ms, st->recover_count, 99),
+                percentile(st->recover_ms, st->recover_count, 100));
+        free(st->detect_ms);
+        free(st->recover_ms);
+    }
+    fprintf(out, "soak: %.1f%% of faulted sessions ended with a good image\n", fired ? 100.0 * succeeded / fired : 0.0);
+
+    release_boot_session(&reference);
+    return 0;
+}
@@ -0,0 +1,430 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Gadget.h"
+#include "Types.h"
+#include "Utils.h"
+
+/*
+ * Loopback gadget
+ *
+ * --sim answers the engine inside the process, so usbfs, URB
+ * submission, unbinding usbhid and claiming the interface never run.
+ * With dummy_hcd loaded the kernel has a host controller and a device
+ * controller wired to each other. --gadget drives the device side
+ * through raw-gadget: it enumerates as 0x2dbc:0x0001 with one HID
+ * interface and interrupt endpoints 0x81 and 0x01 like the board,
+ * hands every OUT report to the simulated bootloader and writes its
+ * answers to the IN endpoint. An unmodified mikro_hb in another
+ * process then finds and flashes it like hardware.
+ *
+ * USB frame timing comes from dummy_hcd, the sim's frame latency is
+ * dropped, its erase, row and command times are kept.
+ */
+
+#ifdef _WIN32
+
+int gadget_run(const TSimConfig *cfg, const char *driver, const char *device, FILE *out)
+{
+    fprintf(stderr, "--gadget needs Linux raw-gadget, not available on Windows\n");
+    return -1;
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define GADGET_EP0_MAX 512
+
+// the sim's answer is never late for the gadget, the host times out on its own
+#define GADGET_TIMEOUT_MS 60000
+
+// HID class requests and descriptors
+#define GADGET_HID_DT_HID 0x21
+#define GADGET_HID_DT_REPORT 0x22
+#define GADGET_HID_SET_IDLE 0x0a
+
+// raw-gadget headers end in a flexible array, their payload follows in these
+#define GADGET_WORDS(bytes) (((bytes) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+typedef uint64_t TGadgetEvent[GADGET_WORDS(sizeof(struct usb_raw_event) + sizeof(struct usb_ctrlrequest))];
+typedef uint64_t TGadgetIo[GADGET_WORDS(sizeof(struct usb_raw_ep_io) + GADGET_EP0_MAX)];
+
+typedef struct
+{
+    int fd;
+    int ep_in;
+    int ep_out;
+    int configured; // endpoints enabled, under lock
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    const char *product;
+} TGadget;
+
+// vendor defined 64 byte input and output report, as the bootloader
+static const uint8_t gadget_report_desc[] = {
+    0x06, 0x00, 0xff, // usage page (vendor)
+    0x09, 0x01,       // usage 1
+    0xa1, 0x01,       // collection (application)
+    0x19, 0x01, 0x29, MAX_INTERRUPT_IN_TRANSFER_SIZE,
+    0x15, 0x00, 0x26, 0xff, 0x00,
+    0x75, 0x08, 0x95, MAX_INTERRUPT_IN_TRANSFER_SIZE,
+    0x81, 0x02,       // input
+    0x19, 0x01, 0x29, MAX_INTERRUPT_OUT_TRANSFER_SIZE,
+    0x75, 0x08, 0x95, MAX_INTERRUPT_OUT_TRANSFER_SIZE,
+    0x91, 0x02,       // output
+    0xc0,
+};
+
+static const struct usb_device_descriptor gadget_device_desc = {
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = 0x0200,
+    .bMaxPacketSize0 = 64,
+    .idVendor = BOOTLOADER_VID,
+    .idProduct = BOOTLOADER_PID,
+    .bcdDevice = 0x0100,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 3,
+    .bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor gadget_ep_in = {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_DIR_IN | 1,
+    .bmAttributes = USB_ENDPOINT_XFER_INT,
+    .wMaxPacketSize = MAX_INTERRUPT_IN_TRANSFER_SIZE,
+    .bInterval = 1,
+};
+
+static const struct usb_endpoint_descriptor gadget_ep_out = {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_DIR_OUT | 1,
+    .bmAttributes = USB_ENDPOINT_XFER_INT,
+    .wMaxPacketSize = MAX_INTERRUPT_OUT_TRANSFER_SIZE,
+    .bInterval = 1,
+};
+
+// configuration, interface, HID and both endpoint descriptors
+static int gadget_config_desc(uint8_t *buf)
+{
+    struct usb_config_descriptor config = {
+        .bLength = USB_DT_CONFIG_SIZE,
+        .bDescriptorType = USB_DT_CONFIG,
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+        .bMaxPower = 50,
+    };
+    struct usb_interface_descriptor intf = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = INTERFACE_NUMBER,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_HID,
+    };
+    const uint8_t hid[9] = {9, GADGET_HID_DT_HID, 0x11, 0x01, 0, 1, GADGET_HID_DT_REPORT,
+                            sizeof(gadget_report_desc) & 0xff, sizeof(gadget_report_desc) >> 8};
+    int len = 0;
+
+    len += USB_DT_CONFIG_SIZE;
+    memcpy(buf + len, &intf, USB_DT_INTERFACE_SIZE);
+    len += USB_DT_INTERFACE_SIZE;
+    memcpy(buf + len, hid, sizeof(hid));
+    len += sizeof(hid);
+    memcpy(buf + len, &gadget_ep_in, USB_DT_ENDPOINT_SIZE);
+    len += USB_DT_ENDPOINT_SIZE;
+    memcpy(buf + len, &gadget_ep_out, USB_DT_ENDPOINT_SIZE);
+    len += USB_DT_ENDPOINT_SIZE;
+
+    config.wTotalLength = len;
+    memcpy(buf, &config, USB_DT_CONFIG_SIZE);
+    return len;
+}
+
+// string descriptor index into buf, -1 for one there is not
+static int gadget_string_desc(TGadget *gadget, int index, uint8_t *buf)
+{
+    const char *text = NULL;
+    int len = 0;
+
+    if (index == 0)
+    {
+        const uint8_t langs[4] = {4, USB_DT_STRING, 0x09, 0x04};
+        memcpy(buf, langs, sizeof(langs));
+        return sizeof(langs);
+    }
+    text = (index == 1) ? "mikro_hb" : (index == 2) ? gadget->product : (index == 3) ? GADGET_SERIAL : NULL;
+    if (text == NULL)
+        return -1;
+
+    // UTF-16LE of an ASCII string
+    for (len = 0; text[len] != '\0' && 2 + 2 * len + 2 <= 255; len++)
+    {
+        buf[2 + 2 * len] = (uint8_t)text[len];
+        buf[3 + 2 * len] = 0;
+    }
+    buf[0] = (uint8_t)(2 + 2 * len);
+    buf[1] = USB_DT_STRING;
+    return buf[0];
+}
+
+static int gadget_enable(TGadget *gadget)
+{
+    gadget->ep_in = ioctl(gadget->fd, USB_RAW_IOCTL_EP_ENABLE, &gadget_ep_in);
+    gadget->ep_out = ioctl(gadget->fd, USB_RAW_IOCTL_EP_ENABLE, &gadget_ep_out);
+    if (gadget->ep_in < 0 || gadget->ep_out < 0)
+    {
+        fprintf(stderr, "gadget: the UDC has no interrupt endpoints 0x81 and 0x01: %s\n", strerror(errno));
+        return -1;
+    }
+    ioctl(gadget->fd, USB_RAW_IOCTL_VBUS_DRAW, 50);
+    ioctl(gadget->fd, USB_RAW_IOCTL_CONFIGURE, 0);
+    return 0;
+}
+
+/*
+ * Answer one control request, the length of the IN data in io, 0 for
+ * a request without data, -1 to stall
+ */
+static int gadget_control(TGadget *gadget, const struct usb_ctrlrequest *ctrl, struct usb_raw_ep_io *io)
+{
+    int type = ctrl->bRequestType & USB_TYPE_MASK;
+    int len = -1;
+
+    if (type == USB_TYPE_CLASS)
+        return (ctrl->bRequest == GADGET_HID_SET_IDLE) ? 0 : -1;
+    if (type != USB_TYPE_STANDARD)
+        return -1;
+
+    switch (ctrl->bRequest)
+    {
+    case USB_REQ_GET_DESCRIPTOR:
+        switch (ctrl->wValue >> 8)
+        {
+        case USB_DT_DEVICE:
+            memcpy(io->data, &gadget_device_desc, USB_DT_DEVICE_SIZE);
+            len = USB_DT_DEVICE_SIZE;
+            break;
+        case USB_DT_CONFIG:
+            len = gadget_config_desc(io->data);
+            break;
+        case USB_DT_STRING:
+            len = gadget_string_desc(gadget, ctrl->wValue & 0xff, io->data);
+            break;
+        case GADGET_HID_DT_REPORT:
+            memcpy(io->data, gadget_report_desc, sizeof(gadget_report_desc));
+            len = sizeof(gadget_report_desc);
+            break;
+        default:
+            break;
+        }
+        break;
+    case USB_REQ_SET_CONFIGURATION:
+        pthread_mutex_lock(&gadget->lock);
+        if (!gadget->configured && ctrl->wValue == 1)
+        {
+            gadget->failed = gadget_enable(gadget) != 0;
+            gadget->configured = 1;
+            pthread_cond_signal(&gadget->ready);
+        }
+        pthread_mutex_unlock(&gadget->lock);
+        len = 0;
+        break;
+    case USB_REQ_SET_INTERFACE:
+        len = 0;
+        break;
+    case USB_REQ_GET_STATUS:
+        io->data[0] = 1; // self powered
+        io->data[1] = 0;
+        len = 2;
+        break;
+    default:
+        break;
+    }
+    if (len > ctrl->wLength)
+        len = ctrl->wLength;
+    return len;
+}
+
+/*
+ * ep0 for as long as the process lives, the host may come back with
+ * control requests at any point
+ */
+static void *gadget_ep0(void *arg)
+{
+    TGadget *gadget = arg;
+    TGadgetEvent event_buf;
+    TGadgetIo io_buf;
+    struct usb_raw_event *event = (struct usb_raw_event *)event_buf;
+    struct usb_ctrlrequest *ctrl = (struct usb_ctrlrequest *)event->data;
+    struct usb_raw_ep_io *io = (struct usb_raw_ep_io *)io_buf;
+
+    for (;;)
+    {
+        int len = 0;
+
+        memset(event_buf, 0, sizeof(event_buf));
+        event->length = sizeof(struct usb_ctrlrequest);
+        if (ioctl(gadget->fd, USB_RAW_IOCTL_EVENT_FETCH, event) < 0)
+            break;
+        if (event->type != USB_RAW_EVENT_CONTROL)
+            continue;
+
+        memset(io_buf, 0, sizeof(io_buf));
+        len = gadget_control(gadget, ctrl, io);
+        if (len < 0)
+        {
+            ioctl(gadget->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+            continue;
+        }
+        io->ep = 0;
+        if (ctrl->bRequestType & USB_DIR_IN)
+        {
+            io->length = len;
+            ioctl(gadget->fd, USB_RAW_IOCTL_EP0_WRITE, io);
+        }
+        else
+        {
+            // status stage, and whatever data came with the request
+            io->length = (ctrl->wLength < GADGET_EP0_MAX) ? ctrl->wLength : GADGET_EP0_MAX;
+            ioctl(gadget->fd, USB_RAW_IOCTL_EP0_READ, io);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * OUT reports into the simulated bootloader, its answers out on IN,
+ * until cmdREBOOT
+ */
+static int gadget_serve(TGadget *gadget, TSim *sim, FILE *out)
+{
+    TTransport tp;
+    TGadgetIo io_buf;
+    struct usb_raw_ep_io *io = (struct usb_raw_ep_io *)io_buf;
+    double first_ms = 0.0;
+
+    sim_transport(&tp, sim);
+    while (!sim->rebooted)
+    {
+        int transferred = 0;
+        int len = 0;
+
+        io->ep = gadget->ep_out;
+        io->flags = 0;
+        io->length = MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+        if ((len = ioctl(gadget->fd, USB_RAW_IOCTL_EP_READ, io)) < 0)
+        {
+            fprintf(stderr, "gadget: OUT endpoint: %s\n", strerror(errno));
+            return -1;
+        }
+        if (first_ms == 0.0)
+            first_ms = time_now_ms();
+        if (len < MAX_INTERRUPT_OUT_TRANSFER_SIZE)
+            memset(io->data + len, 0, MAX_INTERRUPT_OUT_TRANSFER_SIZE - len);
+        tp.write(&tp, (char *)io->data, MAX_INTERRUPT_OUT_TRANSFER_SIZE, &transferred, GADGET_TIMEOUT_MS);
+        if (sim->answer_count == 0)
+            continue;
+
+        tp.read(&tp, (char *)io->data, MAX_INTERRUPT_IN_TRANSFER_SIZE, &transferred, GADGET_TIMEOUT_MS);
+        io->ep = gadget->ep_in;
+        io->length = MAX_INTERRUPT_IN_TRANSFER_SIZE;
+        if (ioctl(gadget->fd, USB_RAW_IOCTL_EP_WRITE, io) < 0)
+        {
+            fprintf(stderr, "gadget: IN endpoint: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    fprintf(out, "gadget: session of %.1f ms on the bus\n", time_now_ms() - first_ms);
+    return 0;
+}
+
+int gadget_run(const TSimConfig *cfg, const char *driver, const char *device, FILE *out)
+{
+    TGadget gadget;
+    TSimConfig sim_cfg = *cfg;
+    TSim sim;
+    struct usb_raw_init init;
+    pthread_t ep0;
+    int result = -1;
+
+    memset(&gadget, 0, sizeof(gadget));
+    pthread_mutex_init(&gadget.lock, NULL);
+    pthread_cond_init(&gadget.ready, NULL);
+    gadget.product = cfg->dev_dsc;
+
+    // frames are the host controller's now
+    sim_cfg.frame_ms = 0.0;
+    if (sim_open(&sim, &sim_cfg) != 0)
+        return -1;
+
+    if ((gadget.fd = open("/dev/raw-gadget", O_RDWR)) < 0)
+    {
+        fprintf(stderr, "gadget: /dev/raw-gadget: %s (modprobe raw_gadget)\n", strerror(errno));
+        sim_close(&sim);
+        return -1;
+    }
+    memset(&init, 0, sizeof(init));
+    snprintf((char *)init.driver_name, UDC_NAME_LENGTH_MAX, "%s", driver);
+    snprintf((char *)init.device_name, UDC_NAME_LENGTH_MAX, "%s", device);
+    init.speed = USB_SPEED_FULL;
+    if (ioctl(gadget.fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(gadget.fd, USB_RAW_IOCTL_RUN, 0) < 0)
+    {
+        fprintf(stderr, "gadget: %s/%s: %s (modprobe dummy_hcd)\n", driver, device, strerror(errno));
+        close(gadget.fd);
+        sim_close(&sim);
+        return -1;
+    }
+    if (pthread_create(&ep0, NULL, gadget_ep0, &gadget) != 0)
+    {
+        close(gadget.fd);
+        sim_close(&sim);
+        return -1;
+    }
+    pthread_detach(ep0);
+    fprintf(out, "gadget: %s on %s as %04x:%04x, waiting for the host\n", cfg->dev_dsc, device, BOOTLOADER_VID,
+            BOOTLOADER_PID);
+    fflush(out);
+
+    pthread_mutex_lock(&gadget.lock);
+    while (!gadget.configured)
+        pthread_cond_wait(&gadget.ready, &gadget.lock);
+    pthread_mutex_unlock(&gadget.lock);
+
+    if (!gadget.failed)
+        result = gadget_serve(&gadget, &sim, out);
+    sim_report(&sim, out);
+
+    // ep0 stays blocked on the fd, the process exit takes both down
+    sim_close(&sim);
+    return result;
+}
+
+#endif
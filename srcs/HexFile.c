@@ -22,6 +22,9 @@
 #endif
 
 #include "HexFile.h"
+#include "HexStream.h"
+#include "Cache.h"
+#include "Inject.h"
 #include "Types.h"
 #include "Utils.h"
 
@@ -44,31 +47,8 @@ const uint32_t _PIC32Mn_STARTFLASH = 0x1D000000;
 const uint32_t _PIC32Mn_STARTCONF = 0x1FC00000;
 const uint32_t vector[] = {_PIC32Mn_STARTFLASH, _PIC32Mn_STARTFLASH, _PIC32Mn_STARTCONF};
 
-// memory to hold flash data and maintain initial pointers addresses
-uint8_t *prg_ptr = 0;
-uint8_t *prg_ptr_start = 0;
-uint8_t *conf_ptr = 0;
-uint8_t *conf_ptr_start = 0;
-
-// Save first instruction from program flash before it gets overwritten
-uint8_t first_instruction[4] = {0};
-
-// write program memor variable
-uint32_t bootaddress_space = 0;
-
-// keep track of how many bytes have been extracted form each line
-uint32_t prg_mem_count = 0;
-uint32_t conf_mem_count = 0;
-
-// Progress tracking
-static uint32_t total_bytes_to_write = 0;
-static uint32_t bytes_written = 0;
-
-// iterate the vector array in state machine
-int vector_index = 0;
-
-void overwrite_bootflash_program(void);
 uint32_t page_iteration_calc(uint16_t row_page_size, uint32_t mem_quantity);
+static void load_packed_buffer(TBootSession *session, char *data);
 
 // Progress bar function
 void print_progress_bar(const char *label, uint32_t current, uint32_t total)
@@ -101,6 +81,87 @@ void print_progress_bar(const char *label, uint32_t current, uint32_t total)
  * Find the file to send
  */
 
+/*
+ * Byte ownership maps used when several hex files are merged into
+ * one image, each byte holds the 1 based index of the file that
+ * wrote it (0 = not written yet) so overlaps can be reported.
+ */
+typedef struct
+{
+    uint8_t *prg_owner;
+    uint8_t *conf_owner;
+    char **paths;
+
+    // run of overlapping bytes currently being collected for the report
+    uint32_t overlap_start;
+    uint32_t overlap_end;
+    uint8_t overlap_first;
+    uint8_t overlap_second;
+    uint32_t overlap_total;
+
+    // bytes of records that fall outside the image buffers
+    uint32_t outside_total;
+} THexMerge;
+
+/*
+ * Print the pending overlap run, if any
+ */
+static void flush_overlap(THexMerge *merge)
+{
+    if (merge->overlap_end > merge->overlap_start)
+    {
+        error_report("Error: 0x%08x-0x%08x (%u bytes) in %s overlaps %s\n",
+                merge->overlap_start, merge->overlap_end - 1, merge->overlap_end - merge->overlap_start,
+                merge->paths[merge->overlap_second - 1], merge->paths[merge->overlap_first - 1]);
+    }
+    merge->overlap_start = merge->overlap_end = 0;
+}
+
+/*
+ * Place one byte in a merged image, collecting contiguous overlaps
+ * between the same two files into a single reported range
+ */
+static void merge_byte(THexMerge *merge, uint8_t *buf, uint8_t *owner, uint32_t offset, uint32_t address, uint8_t value, uint8_t file_no)
+{
+    if (owner[offset] != 0 && owner[offset] != file_no)
+    {
+        if (address != merge->overlap_end || owner[offset] != merge->overlap_first || file_no != merge->overlap_second)
+        {
+            flush_overlap(merge);
+            merge->overlap_start = address;
+            merge->overlap_first = owner[offset];
+            merge->overlap_second = file_no;
+        }
+        merge->overlap_end = address + 1;
+        merge->overlap_total++;
+        return;
+    }
+
+    owner[offset] = file_no;
+    *(buf + offset) = value;
+}
+
+/*
+ * A record of count bytes at offset that does not fit a buffer of
+ * size is reported and left out, nothing past the buffer is touched
+ */
+static int merge_fits(THexMerge *merge, uint32_t offset, uint32_t count, uint32_t size, uint32_t address, int file_no,
+                      const char *region)
+{
+    if (offset <= size && count <= size - offset)
+        return 1;
+    error_report("Error: 0x%08x-0x%08x (%u bytes) in %s is outside %s flash\n", address, address + count - 1, count,
+            merge->paths[file_no - 1], region);
+    merge->outside_total += count;
+    return 0;
+}
+
+// image buffers from the arena when there is one
+static void *image_alloc(TArena *arena, size_t len)
+{
+    return (arena != NULL) ? arena_alloc(arena, len) : malloc(len);
+}
+
 /***************************************************
  * Open the hex file extract each line and iterate
  * over the data from each line, the data is ASCII,
@@ -112,10 +173,17 @@ void print_progress_bar(const char *label, uint32_t current, uint32_t total)
  * 2 buffers are used
  *  1) program data,
  *  2) configuration data
+ * Several files are merged into the same buffers,
+ * any byte written by more than one file is an error.
+ * The boot vector page and the config flash vectors
+ * are synthesized here as well, after this the image
+ * is only read so sessions can share it.
+ * With an arena that has room for the geometry the
+ * buffers are carved from it, malloc'd otherwise.
  ***************************************************/
-uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo)
+uint32_t condition_hexfile_arena(char **paths, int path_count, TBootInfo *bootinfo, THexImage *image, TArena *arena)
 {
-    uint32_t count = 0;
+    uint32_t size = 0;
     uint32_t address = 0;
     uint32_t root_address = 0;
     uint32_t prg_min_addr = 0xFFFFFFFF;
@@ -130,111 +198,168 @@ uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo)
     // temp struct of type hex descriptors
     _HEX_ hex = {0};
 
-    // get file size to allocate memory
     FILE *fp = NULL;
-    if (fp == NULL)
-    {
-        fp = fopen(path, "r");
-        if (fp == NULL)
-        {
-            fprintf(stderr, "Could not find or open a file!!\n");
-            return 0;
-        }
-    }
+    THexMerge merge = {0};
+    size_t merge_mark = 0;
 
-    // need the size ofthe file to allocate memory for linear buffer
-    uint32_t size = file_byte_count(fp);
+    if (arena != NULL && arena->size - arena->used < arena_session_size(bootinfo))
+        arena = NULL;
 
-#if DEBUG == 4
-    printf("fc = %u\n", size);
-#endif
+    memset(image, 0, sizeof(THexImage));
+    image->mcu_size = bootinfo->ulMcuSize.fValue;
+    image->boot_size = bootinfo->uiEraseBlock.fValue.intVal;
+    image->arena = arena;
 
-    // allocate memory to prg_ptr to the size of chars in the file,
-    // this isn't quite correct as it will over allocate by the
-    // size of 12 bytes "[1][4][2][4]....[1]" I may want to save
-    // space later by using this value
-    prg_ptr = (uint8_t *)malloc(bootinfo->ulMcuSize.fValue);
-    memset(prg_ptr, 0xff, bootinfo->ulMcuSize.fValue);
-    prg_ptr_start = prg_ptr;
+    // allocate memory to prg to the size of the mcu flash,
+    // every input file is written into this one image
+    image->prg = (uint8_t *)image_alloc(arena, image->mcu_size);
+    memset(image->prg, 0xff, image->mcu_size);
 
     // allocate memory for configuration data, use size for now,
     // once I know how many bytes are allocated to configuration
     // I can reduce this size.
-    conf_ptr = (uint8_t *)malloc(0xffff); // bootinfo->uiWriteBlock.fValue.intVal + 1);
-    memset(conf_ptr, 0xff, 0xffff);
-    conf_ptr_start = conf_ptr;
+    image->conf = (uint8_t *)image_alloc(arena, CONF_IMAGE_SIZE); // bootinfo->uiWriteBlock.fValue.intVal + 1);
+    memset(image->conf, 0xff, CONF_IMAGE_SIZE);
 
-    // make sure file starts from begining
-    fseek(fp, 0, SEEK_SET);
+    // boot vector page, one erase block
+    image->boot = (uint8_t *)image_alloc(arena, image->boot_size);
 
-    // rest the counters if they hold values?
-    prg_mem_count = conf_mem_count = 0;
+    // ownership maps only live until the files are merged
+    if (arena != NULL)
+    {
+        merge_mark = arena->used;
+        merge.prg_owner = arena_alloc(arena, image->mcu_size);
+        merge.conf_owner = arena_alloc(arena, CONF_IMAGE_SIZE);
+        memset(merge.prg_owner, 0, image->mcu_size);
+        memset(merge.conf_owner, 0, CONF_IMAGE_SIZE);
+    }
+    else
+    {
+        merge.prg_owner = (uint8_t *)calloc(image->mcu_size, 1);
+        merge.conf_owner = (uint8_t *)calloc(CONF_IMAGE_SIZE, 1);
+    }
+    merge.paths = paths;
 
-    // iterate through file line by line
-    while (c_ != EOF)
+    for (int file_no = 1; file_no <= path_count; file_no++)
     {
-        file_extract_line(fp, line, c_);
+        fp = fopen(paths[file_no - 1], "r");
+        if (fp == NULL)
+        {
+            error_report("Could not find or open a file!! %s\n", paths[file_no - 1]);
+            size = 0;
+            break;
+        }
 
-        // extract byte count and address and report type
-        memcpy((uint8_t *)&hex, &line, sizeof(_HEX_));
+        // need the size ofthe file for the transfer report
+        size += file_byte_count(fp);
 
-        hex.report.add_lsw = swap_wordbytes(hex.report.add_lsw);
+#if DEBUG == 4
+        printf("fc = %u\n", size);
+#endif
 
-        // intel hex report type 02 and 04 are Address data types
-        if (hex.report.report == 0x02 | hex.report.report == 0x04)
-        {
-            hex.add_msw = swap_wordbytes(hex.add_msw);
-            root_address = transform_2words_long(hex.add_msw, hex.report.add_lsw);
-        }
-        else if (hex.report.report == 00)
+        // make sure file starts from begining
+        fseek(fp, 0, SEEK_SET);
+        root_address = 0;
+
+        // iterate through file line by line
+        while (c_ != EOF && !feof(fp))
         {
-            address = root_address + hex.report.add_lsw;
+            file_extract_line(fp, line, c_);
+
+            // extract byte count and address and report type
+            memcpy((uint8_t *)&hex, &line, sizeof(_HEX_));
+
+            hex.report.add_lsw = swap_wordbytes(hex.report.add_lsw);
+
+            // intel hex report type 02 and 04 are Address data types
+            if (hex.report.report == 0x02 | hex.report.report == 0x04)
+            {
+                hex.add_msw = swap_wordbytes(hex.add_msw);
+                root_address = transform_2words_long(hex.add_msw, hex.report.add_lsw);
+            }
+            else if (hex.report.report == 00)
+            {
+                address = root_address + hex.report.add_lsw;
 
 #if DEBUG == 6 // 6 to output memory address read from hex file
-            printf("%08x\n", address);
+                printf("%08x\n", address);
 #endif
-            if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF)
-            {
-                uint32_t temp_prg_add = (address - _PIC32Mn_STARTFLASH);
-                uint32_t data_quant = (uint32_t)hex.report.data_quant;
-                
-                // Write data at exact offset from hex file
-                for (uint32_t k = 0; k < data_quant; k++)
+                if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF)
                 {
-                    *(prg_ptr + temp_prg_add + k) = line[k + sizeof(_HEX_REPORT_)];
+                    uint32_t temp_prg_add = (address - _PIC32Mn_STARTFLASH);
+                    uint32_t data_quant = (uint32_t)hex.report.data_quant;
+
+                    if (!merge_fits(&merge, temp_prg_add, data_quant, image->mcu_size, address, file_no, "program"))
+                        continue;
+
+                    // Write data at exact offset from hex file
+                    for (uint32_t k = 0; k < data_quant; k++)
+                    {
+                        merge_byte(&merge, image->prg, merge.prg_owner, temp_prg_add + k, address + k,
+                                   line[k + sizeof(_HEX_REPORT_)], (uint8_t)file_no);
+                    }
+
+                    // Track the full address range: minimum and maximum addresses
+                    if (temp_prg_add < prg_min_addr)
+                        prg_min_addr = temp_prg_add;
+
+                    uint32_t end_of_record = temp_prg_add + data_quant;
+                    if (end_of_record > prg_max_addr)
+                        prg_max_addr = end_of_record;
                 }
-                
-                // Track the full address range: minimum and maximum addresses
-                if (temp_prg_add < prg_min_addr)
-                    prg_min_addr = temp_prg_add;
-                
-                uint32_t end_of_record = temp_prg_add + data_quant;
-                if (end_of_record > prg_max_addr)
-                    prg_max_addr = end_of_record;
-            }
-            else if (address >= _PIC32Mn_STARTCONF)
-            {
-                uint32_t temp_add = address - _PIC32Mn_STARTCONF;
-                uint32_t data_quant = (uint32_t)hex.report.data_quant;
-                
-                // Write data at exact offset from hex file
-                for (uint32_t k = 0; k < data_quant; k++)
+                else if (address >= _PIC32Mn_STARTCONF)
                 {
-                    *(conf_ptr + temp_add + k) = line[k + sizeof(_HEX_REPORT_)];
+                    uint32_t temp_add = address - _PIC32Mn_STARTCONF;
+                    uint32_t data_quant = (uint32_t)hex.report.data_quant;
+
+                    if (!merge_fits(&merge, temp_add, data_quant, CONF_IMAGE_SIZE, address, file_no, "config"))
+                        continue;
+
+                    // Write data at exact offset from hex file
+                    for (uint32_t k = 0; k < data_quant; k++)
+                    {
+                        merge_byte(&merge, image->conf, merge.conf_owner, temp_add + k, address + k,
+                                   line[k + sizeof(_HEX_REPORT_)], (uint8_t)file_no);
+                    }
+
+                    // Track the full address range: minimum and maximum addresses
+                    if (temp_add < conf_min_addr)
+                        conf_min_addr = temp_add;
+
+                    uint32_t end_of_record = temp_add + data_quant;
+                    if (end_of_record > conf_max_addr)
+                        conf_max_addr = end_of_record;
                 }
-                
-                // Track the full address range: minimum and maximum addresses
-                if (temp_add < conf_min_addr)
-                    conf_min_addr = temp_add;
-                
-                uint32_t end_of_record = temp_add + data_quant;
-                if (end_of_record > conf_max_addr)
-                    conf_max_addr = end_of_record;
             }
+
+            if (hex.report.report == 0x01)
+                break;
         }
 
-        if (hex.report.report == 0x01)
-            break;
+        fclose(fp);
+    }
+
+    flush_overlap(&merge);
+    if (arena != NULL)
+    {
+        arena_rewind(arena, merge_mark);
+    }
+    else
+    {
+        free(merge.prg_owner);
+        free(merge.conf_owner);
+    }
+
+    if (merge.overlap_total > 0)
+    {
+        error_report("Error: input files overlap by %u bytes, nothing programmed\n", merge.overlap_total);
+        size = 0;
+    }
+    if (merge.outside_total > 0)
+    {
+        error_report("Error: %u bytes of the input files are outside the device flash, nothing programmed\n",
+                merge.outside_total);
+        size = 0;
     }
 
     // Calculate the full memory span from minimum to maximum address
@@ -243,47 +368,165 @@ uint32_t condition_hexfile_data(char *path, TBootInfo *bootinfo)
     // We write from address 0 up to the highest address written
     if (prg_max_addr > 0)
     {
-        prg_mem_count = prg_max_addr;  // Total bytes from 0 to highest address
-        // Do NOT adjust prg_ptr_start - keep it at the base
+        image->prg_mem_count = prg_max_addr;  // Total bytes from 0 to highest address
+        // Do NOT adjust the prg base - keep it at the start of flash
     }
     
     if (conf_max_addr > 0)
     {
-        conf_mem_count = conf_max_addr;  // Total bytes from 0 to highest address
-        // Do NOT adjust conf_ptr_start - keep it at the base
+        image->conf_mem_count = conf_max_addr;  // Total bytes from 0 to highest address
+        // Do NOT adjust the conf base - keep it at the start of config flash
     }
 
+    // Save first instruction from program flash, config flash starts with it
+    memcpy(image->first_instruction, image->prg, 4);
+
+    // pre-condition the boot vector page and config flash for bootloading
+    overwrite_bootflash_program(image, image->boot_size);
+    overwrite_config_program(image);
+    image->file_size = size;
+
 #if DEBUG_PRINT == 1
     // Debug: check if data at 0x0600 was parsed correctly
-    printf("Program memory range: 0x%x to 0x%x, total = %u bytes (0x%x)\n", prg_min_addr, prg_max_addr, prg_mem_count, prg_mem_count);
-    printf("Config memory range: 0x%x to 0x%x, total = %u bytes (0x%x)\n", conf_min_addr, conf_max_addr, conf_mem_count, conf_mem_count);
+    printf("Program memory range: 0x%x to 0x%x, total = %u bytes (0x%x)\n", prg_min_addr, prg_max_addr, image->prg_mem_count, image->prg_mem_count);
+    printf("Config memory range: 0x%x to 0x%x, total = %u bytes (0x%x)\n", conf_min_addr, conf_max_addr, image->conf_mem_count, image->conf_mem_count);
     printf("Data at offset 0x0600: %02x %02x %02x %02x %02x %02x %02x %02x\n",
-           *(prg_ptr + 0x600), *(prg_ptr + 0x601), *(prg_ptr + 0x602), *(prg_ptr + 0x603),
-           *(prg_ptr + 0x604), *(prg_ptr + 0x605), *(prg_ptr + 0x606), *(prg_ptr + 0x607));
+           *(image->prg + 0x600), *(image->prg + 0x601), *(image->prg + 0x602), *(image->prg + 0x603),
+           *(image->prg + 0x604), *(image->prg + 0x605), *(image->prg + 0x606), *(image->prg + 0x607));
 #endif
 
     return size;
 }
 
+uint32_t condition_hexfile_data(char **paths, int path_count, TBootInfo *bootinfo, THexImage *image)
+{
+    return condition_hexfile_arena(paths, path_count, bootinfo, image, NULL);
+}
+
+/*
+ * The session's paths for bootinfo into own_image, mapped from the
+ * cache when it holds them, returns the hex text parsed
+ */
+uint32_t condition_session_image(TBootSession *session, TBootInfo *bootinfo, uint64_t *cache_key)
+{
+    *cache_key = 0;
+    session->cache_hit = 0;
+
+    // the same files for the same geometry condition to the same image
+    if (session->cache != NULL && image_cache_key(session->paths, session->path_count, bootinfo, cache_key) == 0)
+        session->cache_hit = (image_cache_load(session->cache, *cache_key, bootinfo, &session->own_image) == 0);
+    if (!session->cache_hit)
+    {
+        // sized once from the geometry, later sessions on the arena reuse it
+        if (session->arena != NULL)
+            arena_reserve(session->arena, arena_session_size(bootinfo));
+        condition_hexfile_arena(session->paths, session->path_count, bootinfo, &session->own_image, session->arena);
+        if (session->cache != NULL && *cache_key != 0)
+            image_cache_store(session->cache, *cache_key, bootinfo, &session->own_image);
+    }
+    return session->own_image.file_size;
+}
+
+/*
+ * Release the buffers of a conditioned image
+ */
+void free_hex_image(THexImage *image)
+{
+    if (image->map != NULL)
+    {
+        image_cache_unmap(image);
+        return;
+    }
+    if (image->arena != NULL)
+    {
+        // reclaimed when the arena is reset
+        image->prg = image->boot = image->conf = NULL;
+        image->arena = NULL;
+        return;
+    }
+    free(image->prg);
+    free(image->boot);
+    free(image->conf);
+    image->prg = image->boot = image->conf = NULL;
+}
+
+/*
+ * First write row at or after row holding anything but 0xFF, rows
+ * when the rest of the region is blank
+ */
+static uint32_t next_data_row(const uint8_t *src, uint32_t row, uint32_t rows, uint32_t row_size)
+{
+    for (; row < rows; row++)
+    {
+        const uint8_t *p = src + row * row_size;
+        for (uint32_t i = 0; i < row_size; i++)
+        {
+            if (p[i] != 0xff)
+                return row;
+        }
+    }
+    return rows;
+}
+
+/*
+ * Write rows of the boot page (region 1) or config (region 2) that
+ * hold data, 0 = the region goes out in one write
+ */
+static uint32_t region_data_rows(TBootSession *session, int region)
+{
+    uint32_t row_size = session->bootinfo.uiWriteBlock.fValue.intVal;
+    uint32_t rows = (region == 1) ? session->bootinfo.uiEraseBlock.fValue.intVal / row_size : 3;
+    const uint8_t *src = (region == 1) ? session->image->boot : session->image->conf;
+    uint32_t count = 0;
+
+    for (uint32_t row = next_data_row(src, 0, rows, row_size); row < rows; row = next_data_row(src, row + 1, rows, row_size))
+        count++;
+    return count;
+}
+
+/*
+ * INFO in data_out, BOOT and SYNC out after it without waiting for
+ * answers, none of them depends on what INFO says
+ */
+static int handshake_pipelined(TBootSession *session)
+{
+    static const TCmd ahead[] = {cmdINFO, cmdBOOT, cmdSYNC};
+    char *data_out = session->data_out;
+
+    for (size_t i = 0; i < sizeof(ahead) / sizeof(ahead[0]); i++)
+    {
+        memset(data_out + 1, 0, MAX_INTERRUPT_OUT_TRANSFER_SIZE - 1);
+        data_out[1] = (char)ahead[i];
+        if (boot_interrupt_transfers(session->transport, session->data_in, data_out, 1) != 0)
+            return -1;
+        session->piped |= 1u << ahead[i];
+    }
+    session->prefix.piped = 1;
+    memset(data_out + 1, 0, MAX_INTERRUPT_OUT_TRANSFER_SIZE - 1);
+    data_out[1] = (char)cmdINFO;
+    return 0;
+}
+
 /*
  * Work engine of bootloader
  *
- * Args: usb_device_handle = from libusb device attach
- *       path = the folder/file path of the hexfile to be loaded
+ * Args: session = device transport, hex file paths and per run state,
+ *       see TBootSession. Nothing in here is shared between sessions
+ *       so several devices can be flashed from different threads.
  *
- * return: nothing
+ * return: 0 on success, -1 when the image or a usb transfer failed
  */
-void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
+int setupChiptoBoot(TBootSession *session)
 {
 
     // utils
-    static int8_t trigger = 0;
+    int8_t trigger = 0;
     int16_t result = 0;
     uint8_t _out_only = 0;
 
     // Reset progress counters
-    bytes_written = 0;
-    total_bytes_to_write = 0;
+    session->bytes_written = 0;
+    session->total_bytes_to_write = 0;
 
     // flash size
     uint32_t size = 0;
@@ -294,7 +537,7 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
     uint16_t _blocks_to_flash_ = 0, modulo = 0; //(uint32_t)(size / bootinfo_t.ulMcuSize.fValue);
     double _blocks_temp = 0.0, fractional = 0.0, integer = 0.0, _write_row_error = 0.0;
     TCmd tcmd_t = cmdINFO;
-    TBootInfo bootinfo_t = {0};
+    TBootInfo *bootinfo = &session->bootinfo;
 
     // hex loading
     uint32_t load_calc_result = 0;
@@ -303,15 +546,31 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
     uint16_t hex_load_modulo = 0;
     uint32_t hex_load_page_tracking = 0;
 
-    // file handling
-    FILE *fp = NULL;
-
     // usb specific data
-    static char data_in[MAX_INTERRUPT_IN_TRANSFER_SIZE];
-    static char data_out[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    char *data_in = session->data_in;
+    char *data_out = session->data_out;
+
+    // last state put on the trace
+    TCmd traced_cmd = cmdDONE;
+    int traced_region = -1;
+    double parse_ms = 0.0;
+    int fallback = 0;
+    uint64_t cache_key = 0;
+    int synced = 0;
+
+    // planning from the kept INFO record starts right away
+    session->piped = 0;
+    prefix_start(session);
 
     while (tcmd_t != cmdDONE)
     {
+        if (session->trace != NULL && (tcmd_t != traced_cmd || session->vector_index != traced_region))
+        {
+            trace_state(session->trace, tcmd_t, session->vector_index);
+            traced_cmd = tcmd_t;
+            traced_region = session->vector_index;
+        }
+
         /*
          * main state mc to handle the sequence need by
          * MikroC bootloader firmware, I believe this conforms
@@ -341,12 +600,25 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                 {
                     data_out[i] = 0x0;
                 }
+                if (session->pipeline && handshake_pipelined(session) != 0)
+                    return -1;
             }
             break;
             case cmdBOOT:
             {
                 _out_only = 0;
-                bootInfo_buffer(&bootinfo_t, data_in);
+                prefix_info(session, data_in);
+                bootInfo_buffer(bootinfo, data_in);
+                if (session->calib_dir != NULL)
+                    session->have_calib = (calib_load(&session->calib, session->calib_dir, bootinfo) == 0);
+                session->pack_active = session->packed && bootinfo->uiBootRev.fValue.intVal >= BOOT_REV_PACKED;
+                session->pack_reports = 0;
+                if (session->packed && !session->pack_active && !session->quiet)
+                    printf("Bootloader rev %04x has no packed writes, sending raw data\n", bootinfo->uiBootRev.fValue.intVal);
+                session->verify_active = session->verify && bootinfo->uiBootRev.fValue.intVal >= BOOT_REV_CRC;
+                verify_reset(&session->verify_state);
+                if (session->verify && !session->verify_active && !session->quiet)
+                    printf("Bootloader rev %04x has no CRC command, not verifying\n", bootinfo->uiBootRev.fValue.intVal);
                 data_out[0] = 0x0f;
                 data_out[1] = (char)cmdBOOT;
                 for (int i = 2; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
@@ -354,7 +626,7 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                     data_out[i] = 0x0;
                 }
                 // start at address space 1d00
-                vector_index = 0;
+                session->vector_index = 0;
             }
             break;
             case cmdNON: // A wait state between commands
@@ -363,102 +635,148 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                 _out_only = 0;
 
                 // handle address space from vector array, 1st 1d00 then 1fc0
-                if (vector_index == 1) // boot startup page
+                if (session->vector_index == 1) // boot startup page
                 {
-                    prg_ptr = prg_ptr_start; // reset place holder
-
-                    // pre-condition the hex file for bootloading
-                    // This fills buffer with 0xFF then places boot vector at end (offset 0x3FF0)
-                    overwrite_bootflash_program();
-
-                    prg_ptr = prg_ptr_start;                      // reset place holder
-                    size = bootinfo_t.uiEraseBlock.fValue.intVal; // 0x4000
+                    // boot vector page was pre-conditioned with the image,
+                    // 0xFF fill with the boot vector at the end (offset 0x3FF0)
+                    session->prg_ptr = session->image->boot; // reset place holder
+                    size = bootinfo->uiEraseBlock.fValue.intVal; // 0x4000
 
                     // Calculate boot vector location: MCU_SIZE - 0x10000
                     // For MZ1024 (0x100000): 0x1D000000 + 0xF0000 = 0x1D0F0000
-                    _boot_flash_start = _PIC32Mn_STARTFLASH + (bootinfo_t.ulMcuSize.fValue - 0x10000);
+                    _boot_flash_start = _PIC32Mn_STARTFLASH + (bootinfo->ulMcuSize.fValue - 0x10000);
 
                     // erase a whole page 0x4000 for boot vector
-                    hex_load_limit = (bootinfo_t.uiEraseBlock.fValue.intVal / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
+                    hex_load_limit = (bootinfo->uiEraseBlock.fValue.intVal / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
 
                     _temp_flash_erase_ = (_boot_flash_start);
 
 #if DEBUG == 4
-                    printf("%08x : %08x : %08x\n", vector[vector_index], _boot_flash_start, _temp_flash_erase_);
+                    printf("%08x : %08x : %08x\n", vector[session->vector_index], _boot_flash_start, _temp_flash_erase_);
 #endif
                     // pages to flash
                     _blocks_to_flash_ = 1;
                     // write hex data from address
-                    bootaddress_space = _boot_flash_start;
+                    session->bootaddress_space = _boot_flash_start;
+
+                    // after the erase only the rows with data, the vector row at the end
+                    session->row_base = _boot_flash_start;
+                    session->row_end = session->full_pages ? 0 : bootinfo->uiEraseBlock.fValue.intVal / bootinfo->uiWriteBlock.fValue.intVal;
+                    session->row_next = next_data_row(session->image->boot, 0, session->row_end, bootinfo->uiWriteBlock.fValue.intVal);
                 }
-                else if (vector_index == 2) // config data
+                else if (session->vector_index == 2) // config data
                 {
-                    // reset place holders to load from the begining
-                    prg_ptr = prg_ptr_start;
-                    conf_ptr = conf_ptr_start;
-
-                    // Copy ONLY the first instruction (4 bytes) from saved copy (not corrupted buffer)
-                    // The PIC32MZ boots from config flash at reset
-#if DEBUG_PRINT == 1
-                    printf("Using first_instruction: %02x %02x %02x %02x\n", 
-                           first_instruction[0], first_instruction[1], first_instruction[2], first_instruction[3]);
-#endif
-                    memcpy(conf_ptr, first_instruction, 4);
-                    
-                    // Fill the rest of the first 64 bytes with nop instructions
-                    uint32_t nop = 0x70000000;  // nop instruction (little-endian: 0x00 0x00 0x00 0x70)
-                    for (int i = 1; i < 16; i++)
-                    {
-                        memcpy(conf_ptr + (i * 4), &nop, 4);
-                    }
-                    
-                    // After first 64 bytes, add the boot vector (jumps to bootloader at BD0F4000)
-                    uint8_t boot_vector[16] = {
-                        0x0F, 0xBD, 0x1E, 0x3C,  // lui $30, 0xBD0F
-                        0x00, 0x40, 0xDE, 0x37,  // ori $30, $30, 0x4000
-                        0x08, 0x00, 0xC0, 0x03,  // jr $30
-                        0x00, 0x00, 0x00, 0x70   // nop (delay slot)
-                    };
-                    memcpy(conf_ptr + 64, boot_vector, 16);
-                    
-                    // For config flash, we'll use conf_ptr directly in load_hex_buffer
-                    // Don't copy to prg_ptr - that would overwrite program flash data!
+                    // reset place holders to load from the begining, the first
+                    // instruction, nop fill and bootloader jump vector were
+                    // placed in the config image when it was conditioned
+                    session->conf_ptr = session->image->conf;
 
                     // Config flash write is 0x1800 (6144 bytes) = 3 write blocks = 96 packets
                     // hex_load_limit = (0xffff + 1) / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
-                    hex_load_limit = ((bootinfo_t.uiWriteBlock.fValue.intVal * 3) / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
+                    hex_load_limit = ((bootinfo->uiWriteBlock.fValue.intVal * 3) / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
 
                     // set the start address to flash erase
-                    _temp_flash_erase_ = (vector[vector_index]);
+                    _temp_flash_erase_ = (vector[session->vector_index]);
 
                     // set erase block to multiple pages of data [1page = 0x4000 for mz]
                     //_blocks_to_flash_ = (0xffff + 1) / 0x4000;
                     _blocks_to_flash_ = 1;
 
                     // set the write hex data address space
-                    bootaddress_space = vector[vector_index];
+                    session->bootaddress_space = vector[session->vector_index];
+
+                    // the rows of the three with data, the first one holds the vectors
+                    session->row_base = session->bootaddress_space;
+                    session->row_end = session->full_pages ? 0 : 3;
+                    session->row_next = next_data_row(session->image->conf, 0, session->row_end, bootinfo->uiWriteBlock.fValue.intVal);
                 }
                 else // program flash region
                 {
-                    // open hexx file read it line for line and extract the data according
-                    //  to the address, buffer offset is indexed by address
-                    size = condition_hexfile_data(path, &bootinfo_t);
-
-                    // Save first instruction before it gets overwritten by boot vector processing
-                    memcpy(first_instruction, prg_ptr_start, 4);
-                    
-#if DEBUG_PRINT == 1
-                    printf("Saved first_instruction: %02x %02x %02x %02x\n", 
-                           first_instruction[0], first_instruction[1], first_instruction[2], first_instruction[3]);
-#endif
+                    // open hexx files read them line for line and extract the data according
+                    //  to the address, buffer offset is indexed by address,
+                    //  unless the caller already holds a conditioned image
+                    parse_ms = time_now_ms();
+                    if (session->image_source != NULL)
+                    {
+                        session->image = session->image_source(session, session->image_ctx);
+                    }
+                    else if (prefix_join(session, &cache_key) == 0)
+                    {
+                        // conditioned while the handshake ran
+                        session->image = &session->own_image;
+                        if (session->cache_hit && !session->quiet)
+                            printf("Conditioned image from cache %016llx\n", (unsigned long long)cache_key);
+                    }
+                    else if (session->stream_window > 0 && session->path_count == 1 && session->range_end == 0 && session->run_count == 0 &&
+                             (session->stream = hex_stream_open(session->paths[0], bootinfo, session->stream_window, &fallback)) != NULL)
+                    {
+                        // program flash is parsed while it is sent
+                        session->image = &session->stream->image;
+                        if (!session->quiet)
+                            printf("Streaming %s through %d pages, %u records patched back\n",
+                                   session->paths[0], session->stream->window, session->stream->patched);
+                    }
+                    else
+                    {
+                        if (session->stream_window > 0 && !session->quiet)
+                            printf("Not streaming, %s\n", (session->path_count != 1) ? "more than one hex file"
+                                                          : (session->range_end > 0 || session->run_count > 0) ? "flashing a range"
+                                                          : fallback ? "records go back further than the window"
+                                                                     : "file could not be read");
+                        condition_session_image(session, bootinfo, &cache_key);
+                        if (session->cache_hit && !session->quiet)
+                            printf("Conditioned image from cache %016llx\n", (unsigned long long)cache_key);
+                        session->image = &session->own_image;
+                    }
+                    trace_span(session->trace, TRACE_LANE_HOST, "host",
+                               (session->image_source != NULL) ? "image" : (session->stream != NULL) ? "scan hex"
+                                                                         : session->prefix.planned ? "planned image wait"
+                                                                         : session->cache_hit ? "cached image" : "parse hex",
+                               parse_ms, time_now_ms(), NULL);
+                    size = (session->image != NULL) ? session->image->file_size : 0;
+                    if (size == 0 || region_plan(session) != 0)
+                    {
+                        // no point in continuing if the file is empty
+                        return -1;
+                    }
 
                     // reset place holder
-                    prg_ptr = prg_ptr_start;
+                    session->prg_ptr = session->image->prg;
+                    session->prg_mem_count = session->image->prg_mem_count;
+                    session->row_end = 0;
+
+                    // this board's records on copies of the pages they touch
+                    if (session->inject != NULL && session->inject->count > 0)
+                    {
+                        uint32_t range_end = session->prg_offset + session->range_pages * bootinfo->uiEraseBlock.fValue.intVal;
+                        if (session->stream != NULL || !(session->flash_mask & REGION_PROGRAM))
+                        {
+                            error_report("inject: needs program flash flashed from a conditioned image\n");
+                            return -1;
+                        }
+                        // an arena nothing was carved from yet (a daemon worker's) holds the pages
+                        if (session->arena != NULL && session->arena->used == 0)
+                            arena_reserve(session->arena, overlay_arena_size(bootinfo));
+                        session->overlay = overlay_build(session->inject, session->image->prg, bootinfo, session->arena);
+                        if (session->overlay == NULL)
+                            return -1;
+                        if (session->range_pages > 0 && !overlay_within(session->overlay, session->prg_offset, range_end))
+                        {
+                            error_report("inject: records outside --range\n");
+                            return -1;
+                        }
+                        if (session->overlay->end > session->prg_mem_count)
+                            session->prg_mem_count = session->overlay->end;
+                        if (!session->quiet)
+                            printf("Injected %u bytes for board %llu into %d pages\n", session->overlay->bytes,
+                                   (unsigned long long)session->inject->counter, session->overlay->count);
+                    }
+                    prefix_mark(session, cmdNON);
 
                     // hex page tracking works out how many pages will be loaded into PFM 1 page at a time
                     // bootload firmware has 16bit int so can't load more than 0x8000 bytes at a time
                     // calculate size of erasing preperation
-                    _pages_to_flash = page_iteration_calc(bootinfo_t.uiEraseBlock.fValue.intVal, prg_mem_count);
+                    _pages_to_flash = page_iteration_calc(bootinfo->uiEraseBlock.fValue.intVal, session->prg_mem_count);
 
                     // set how many iterations of 64byte packets to send over wire with row boundry
                     //_write_row_error = (double)prg_mem_count / (double)bootinfo_t.uiWriteBlock.fValue.intVal;
@@ -467,31 +785,64 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                     // load_calc_result += (uint32_t)integer;
                     if (_pages_to_flash == 1)
                     {
-                        load_calc_result = page_iteration_calc(bootinfo_t.uiWriteBlock.fValue.intVal, prg_mem_count);
-                        prg_mem_count = bootinfo_t.uiWriteBlock.fValue.intVal * load_calc_result;
+                        load_calc_result = page_iteration_calc(bootinfo->uiWriteBlock.fValue.intVal, session->prg_mem_count);
+                        session->prg_mem_count = bootinfo->uiWriteBlock.fValue.intVal * load_calc_result;
 
-                        load_calc_result = (prg_mem_count / MAX_INTERRUPT_OUT_TRANSFER_SIZE); // + load_calc_result;
+                        load_calc_result = (session->prg_mem_count / MAX_INTERRUPT_OUT_TRANSFER_SIZE); // + load_calc_result;
                         hex_load_limit = load_calc_result - 1;                                // size / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
 #if DEBUG == 2
-                        printf("[%u] : [%02f] [%02f] [%u] [%u]\n", _pages_to_flash, _write_row_error, integer, load_calc_result, prg_mem_count);
+                        printf("[%u] : [%02f] [%02f] [%u] [%u]\n", _pages_to_flash, _write_row_error, integer, load_calc_result, session->prg_mem_count);
 #endif
                     }
                     else
                     {
                         // load the full page into the chip
-                        hex_load_limit = (bootinfo_t.uiEraseBlock.fValue.intVal - MAX_INTERRUPT_OUT_TRANSFER_SIZE) / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+                        hex_load_limit = (bootinfo->uiEraseBlock.fValue.intVal - MAX_INTERRUPT_OUT_TRANSFER_SIZE) / MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+                    }
+
+                    // only the erase pages covering --range
+                    if (session->range_pages > 0)
+                    {
+                        _pages_to_flash = session->range_pages;
+                        session->prg_ptr = session->image->prg + session->prg_offset;
+                        session->prg_mem_count = _pages_to_flash * bootinfo->uiEraseBlock.fValue.intVal;
                     }
 
-                    printf("%u : %u : %u : %d\n", _pages_to_flash, prg_mem_count, load_calc_result, _blocks_to_flash_);
+                    if (!session->quiet)
+                        printf("%u : %u : %u : %d\n", _pages_to_flash, session->prg_mem_count, load_calc_result, _blocks_to_flash_);
+
+                    // program pages, boot vector page and config, as measured by --calibrate
+                    if (session->have_calib && !session->quiet)
+                    {
+                        uint32_t eta_pages = 0, eta_bytes = 0;
+                        if (session->flash_mask & REGION_PROGRAM)
+                        {
+                            eta_pages += (_pages_to_flash > 0) ? _pages_to_flash : 1;
+                            eta_bytes += session->prg_mem_count;
+                        }
+                        if (session->flash_mask & REGION_BOOTPAGE)
+                        {
+                            eta_pages++;
+                            eta_bytes += session->full_pages ? bootinfo->uiEraseBlock.fValue.intVal
+                                                             : region_data_rows(session, 1) * bootinfo->uiWriteBlock.fValue.intVal;
+                        }
+                        if (session->flash_mask & REGION_CONFIG)
+                        {
+                            eta_pages++;
+                            eta_bytes += (session->full_pages ? 3 : region_data_rows(session, 2)) * bootinfo->uiWriteBlock.fValue.intVal;
+                        }
+                        printf("ETA %.1f s (calibrated %s rev %u)\n", calib_estimate_ms(&session->calib, eta_pages, eta_bytes) / 1000.0,
+                               session->calib.dev_dsc, session->calib.boot_rev);
+                    }
 
                     // erase at least 1 page if there are zero blocks to flash.
                     _blocks_to_flash_ = _pages_to_flash;
                     if (_blocks_to_flash_ == 0)
                         _blocks_to_flash_ = 1;
 
-                    bootaddress_space = vector[vector_index];
+                    session->bootaddress_space = vector[session->vector_index] + session->prg_offset;
 
-                    _temp_flash_erase_ = (vector[vector_index]); // Start address for erase, not end
+                    _temp_flash_erase_ = (vector[session->vector_index] + session->prg_offset); // Start address for erase, not end
                 }
 
 #if DEBUG == 4
@@ -501,19 +852,32 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                 if (size > 0)
                 {
                     trigger = 1;
-                    // reset flash pointer to start
-                    prg_ptr = prg_ptr_start;
                 }
                 else
                 {
                     // no point in continuing if the file is empty
-                    exit(EXIT_FAILURE);
+                    return -1;
                 }
 
+                // a region left out of this session keeps what the device
+                // holds, straight on to the next one without a transfer
+                if (!(session->flash_mask & (1 << session->vector_index)))
+                {
+                    trigger = 0;
+                    _out_only = 1;
+                    tcmd_t = cmdREBOOT;
+                    session->row_end = 0;
+                }
+                session->row_first = 1;
+
+                // a blank region still gets its first row written
+                if (session->row_end > 0 && session->row_next == session->row_end)
+                    session->row_next = 0;
+
 #if DEBUG == 3
-                printf("vector indexed at [%02x]\n", vector_index);
+                printf("vector indexed at [%02x]\n", session->vector_index);
 #elif DEBUG == 4
-                printf("bootaddress_space [%08x]\tflash erase start [%08x]\tblock to flash [%04x]\n", bootaddress_space, _temp_flash_erase_, _blocks_to_flash_);
+                printf("bootaddress_space [%08x]\tflash erase start [%08x]\tblock to flash [%04x]\n", session->bootaddress_space, _temp_flash_erase_, _blocks_to_flash_);
 #endif
             }
             break;
@@ -539,37 +903,96 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                 // expect no data back continously stream data.
                 _out_only = 1;
 
-                if (vector_index == 2)
+                if (session->row_end > 0)
                 {
-                    size = bootinfo_t.uiWriteBlock.fValue.intVal * 3; // 0x1800 (6144 bytes) - three write blocks for config
+                    // one row with data of the boot page or config, the
+                    // erased rows around it stay blank
+                    uint32_t row_size = bootinfo->uiWriteBlock.fValue.intVal;
+                    uint32_t row = session->row_next;
+                    const uint8_t *src = (session->vector_index == 2) ? session->image->conf : session->image->boot;
+
+                    size = row_size;
+                    session->bootaddress_space = session->row_base + row * row_size;
+                    if (session->vector_index == 2)
+                        session->conf_ptr = session->image->conf + row * row_size;
+                    else
+                        session->prg_ptr = session->image->boot + row * row_size;
+                    session->row_next = next_data_row(src, row + 1, session->row_end, row_size);
+                }
+                else if (session->vector_index == 2)
+                {
+                    size = bootinfo->uiWriteBlock.fValue.intVal * 3; // 0x1800 (6144 bytes) - three write blocks for config
                 }
-                else if (vector_index == 1)
+                else if (session->vector_index == 1)
                 {
-                    size = bootinfo_t.uiEraseBlock.fValue.intVal; // 0x4000 - full boot vector page
+                    size = bootinfo->uiEraseBlock.fValue.intVal; // 0x4000 - full boot vector page
                 }
                 else // Program flash - send total size for ALL data, not per-page
                 {
-                    size = prg_mem_count; // Total program flash data size
+                    size = session->prg_mem_count; // Total program flash data size
                 }
 
                 hex_load_tracking = 0;
                 data_out[0] = 0x0f;
                 data_out[1] = (char)cmdWRITE;
-                memcpy(data_out + 2, &bootaddress_space, sizeof(uint32_t));
+                memcpy(data_out + 2, &session->bootaddress_space, sizeof(uint32_t));
                 memcpy(data_out + 6, &size, sizeof(int16_t));
                 for (int i = 9; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
                 {
                     data_out[i] = 0x0;
                 }
 
+                // what goes out is CRCed per erase page, config in one span
+                if (session->row_end > 0)
+                {
+                    // the whole region once, rows skipped are fed blank from the image
+                    uint32_t row_size = bootinfo->uiWriteBlock.fValue.intVal;
+                    uint32_t offset = session->bootaddress_space - session->row_base;
+                    const uint8_t *src = (session->vector_index == 2) ? session->image->conf : session->image->boot;
+
+                    if (session->row_first)
+                    {
+                        session->region_offset = 0;
+                        if (session->verify_active)
+                            verify_region(&session->verify_state, session->vector_index, session->row_base,
+                                          session->row_end * row_size,
+                                          (session->vector_index == 2) ? session->row_end * row_size : bootinfo->uiEraseBlock.fValue.intVal);
+                        session->row_first = 0;
+                    }
+                    if (session->verify_active && offset > session->region_offset)
+                        verify_feed(&session->verify_state, session->region_offset, (const char *)src + session->region_offset,
+                                    offset - session->region_offset);
+                    session->region_offset = offset;
+                }
+                else
+                {
+                    session->region_offset = 0;
+                    if (session->verify_active)
+                        verify_region(&session->verify_state, session->vector_index, session->bootaddress_space, size,
+                                      (session->vector_index == 2) ? size : bootinfo->uiEraseBlock.fValue.intVal);
+                }
+
+                // packed data carries the full 32 bit size
+                if (session->pack_active)
+                {
+                    data_out[1] = (char)cmdPACKED;
+                    memcpy(data_out + 6, &size, sizeof(uint32_t));
+                    session->pack_left = size;
+                    session->stage_pos = session->stage_len = 0;
+                }
+
                 // Calculate total packets to send for this region (all pages at once)
                 hex_load_limit = (size / MAX_INTERRUPT_OUT_TRANSFER_SIZE) - 1;
 
                 // Accumulate total for progress tracking
-                total_bytes_to_write += size;
+                session->total_bytes_to_write += size;
 
                 // Reset the pointer position
-                prg_ptr = prg_ptr_start;
+                if (session->vector_index == 0)
+                {
+                    session->prg_ptr = session->image->prg + session->prg_offset;
+                    session->stream_offset = 0;
+                }
             }
             break;
             case cmdHEX:
@@ -579,6 +1002,18 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
 
                 hex_load_tracking++;
 
+                if (session->pack_active)
+                {
+                    // as much of the region as one report decodes to
+                    load_packed_buffer(session, data_out);
+                    if (session->pack_left == 0)
+                    {
+                        tcmd_t = cmdREBOOT;
+                        _out_only = 0;
+                    }
+                    break;
+                }
+
                 // use the flash buffer to stream 64 byte slices at a time
                 if (hex_load_tracking > hex_load_limit)
                 {
@@ -587,39 +1022,57 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
                     _out_only = 0;
                 }
 
-                load_hex_buffer(data_out, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+                load_hex_buffer(session, data_out, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
             }
             break;
             case cmdREBOOT:
             {
+                // the next row with data of the same region
+                if (session->row_end > 0 && session->row_next < session->row_end)
+                {
+                    tcmd_t = cmdWRITE;
+                    continue;
+                }
+
+                // the next run of program pages, erased and written the same way
+                if (session->vector_index == 0 && (session->flash_mask & REGION_PROGRAM) &&
+                    session->run_next + 1 < session->run_count)
+                {
+                    const TPageRun *run = &session->runs[++session->run_next];
+
+                    session->prg_offset = run->offset;
+                    session->range_pages = run->pages;
+                    session->prg_mem_count = run->pages * bootinfo->uiEraseBlock.fValue.intVal;
+                    session->bootaddress_space = vector[session->vector_index] + run->offset;
+                    _temp_flash_erase_ = session->bootaddress_space;
+                    _blocks_to_flash_ = (uint16_t)run->pages;
+                    tcmd_t = cmdERASE;
+                    continue;
+                }
+
                 _out_only = 2;
 
 #if DEBUG == 0
-                printf("%u : %u\n", prg_mem_count, conf_mem_count);
+                if (!session->quiet)
+                    printf("%u : %u\n", session->prg_mem_count, session->image->conf_mem_count);
 #endif
 
-                // free memory created for flas_pointer
-
                 /*
                  * re-boot command will cause the app to exit due to timeout from
                  * usb response, may want to set _out_only to 1 to sto exception.
                  * extra handling of usb may be needed if _out_only set to 1.
                  */
 
-                vector_index++;
-                if (vector_index > 2)
+                session->vector_index++;
+                if (session->vector_index > 2)
                 {
-                    if (prg_ptr != NULL)
-                    {
-                        prg_ptr = prg_ptr_start;
-                        // free(flash_ptr);
-                        // flash_ptr = flash_ptr_start = NULL;
-                    }
+                    if (session->verify_active && verify_repair(session) != 0)
+                        return -1;
+
                     data_out[0] = 0x0f;
                     data_out[1] = (char)cmdREBOOT;
                     for (int i = 2; i < MAX_INTERRUPT_OUT_TRANSFER_SIZE; i++)
                     {
-                        // prg_ptr = prg_ptr_start;
                         data_out[i] = 0x0;
                     }
                     // After sending final reboot command, we'll exit the loop
@@ -639,10 +1092,22 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
         // Sendin the data via usb
         if (tcmd_t != cmdNON && !(tcmd_t == cmdREBOOT && _out_only == 1))
         {
-            if (boot_interrupt_transfers(devh, data_in, data_out, _out_only))
+            // sent ahead with the handshake, only its answer is left
+            uint32_t piped = (tcmd_t > 0 && tcmd_t < 32) ? session->piped & (1u << tcmd_t) : 0;
+
+            session->piped &= ~piped;
+            if (piped ? boot_interrupt_answer(session->transport, data_in)
+                      : boot_interrupt_transfers(session->transport, data_in, data_out, _out_only))
             {
                 fprintf(stderr, "Transfered data complete...\n");
-                exit(EXIT_FAILURE);
+                return -1;
+            }
+            if (session->prefix.data_ms == 0.0)
+                prefix_mark(session, tcmd_t);
+            if (tcmd_t == cmdREBOOT && session->vector_index > 2)
+            {
+                session->reboot_ms = time_now_ms();
+                region_record_save(session);
             }
         }
 
@@ -662,10 +1127,12 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
             case cmdNON:
                 if (trigger == 1)
                 {
-                    if (vector_index == 0)
+                    // SYNC ahead of the first region flashed
+                    if (!synced)
                         tcmd_t = cmdSYNC;
                     else
                         tcmd_t = cmdERASE;
+                    synced = 1;
                     trigger = 0;
                 }
                 break;
@@ -693,7 +1160,7 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
             case cmdREBOOT:
                 // Only exit loop when vector_index > 2 (final reboot sent)
                 // If vector_index <= 2, cmdREBOOT sets tcmd_t = cmdNON to continue
-                if (vector_index > 2)
+                if (session->vector_index > 2)
                 {
                     tcmd_t = cmdDONE;
                 }
@@ -703,6 +1170,28 @@ void setupChiptoBoot(struct libusb_device_handle *devh, char *path)
             }
         }
     }
+    trace_state(session->trace, cmdDONE, 0);
+    if (session->pack_active && !session->quiet)
+        printf("\npacked: %u bytes in %u reports, %u raw\n", session->bytes_written, session->pack_reports,
+               session->bytes_written / MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+    return 0;
+}
+
+/*
+ * Release what a session allocated for itself, an image handed
+ * in through image_source belongs to the caller.
+ */
+void release_boot_session(TBootSession *session)
+{
+    prefix_release(session);
+    free_hex_image(&session->own_image);
+    if (session->arena != NULL)
+        arena_reset(session->arena);
+    hex_stream_close(session->stream);
+    session->stream = NULL;
+    overlay_free(session->overlay);
+    session->overlay = NULL;
+    session->image = NULL;
 }
 
 /*Display the boot info need for erase and write data*/
@@ -724,41 +1213,93 @@ void bootInfo_buffer(void *boot_info, const void *buffer)
 #endif
 }
 
-/*
- * @param uint32_t size
- *
- * Stream the data 64 byte slices using
- *
- * return none
- */
-void load_hex_buffer(char *data, uint16_t iterable)
+// next bytes of the region being written
+static void load_region(TBootSession *session, char *data, uint32_t iterable)
 {
-    uint32_t i = 0;
-    
     // Use conf_ptr for config flash (vector_index == 2), prg_ptr for everything else
-    if (vector_index == 2)
+    if (session->vector_index == 2)
     {
-        for (i = 0; i < iterable; i++)
-        {
-            *(data + i) = *(conf_ptr++);
-        }
+        memcpy(data, session->conf_ptr, iterable);
+        session->conf_ptr += iterable;
+    }
+    else if (session->vector_index == 0 && session->stream != NULL)
+    {
+        hex_stream_read(session->stream, session->stream_offset, data, iterable);
+        session->stream_offset += iterable;
+    }
+    else if (session->vector_index == 0 && session->overlay != NULL)
+    {
+        overlay_copy(session->overlay, session->image->prg, (uint32_t)(session->prg_ptr - session->image->prg),
+                     (uint8_t *)data, iterable);
+        session->prg_ptr += iterable;
     }
     else
     {
-        for (i = 0; i < iterable; i++)
-        {
-            *(data + i) = *(prg_ptr++);
-        }
+        memcpy(data, session->prg_ptr, iterable);
+        session->prg_ptr += iterable;
+    }
+    if (session->verify_active)
+        verify_feed(&session->verify_state, session->region_offset, data, iterable);
+    session->region_offset += iterable;
+}
+
+static void report_progress(TBootSession *session, uint32_t iterable)
+{
+    double progress_ms = (session->trace != NULL) ? time_now_ms() : 0.0;
+    session->bytes_written += iterable;
+    if (session->on_progress != NULL)
+    {
+        session->on_progress(session, session->bytes_written, session->total_bytes_to_write);
     }
-    
-    // Update progress
-    bytes_written += iterable;
 #if DEBUG_PRINT == 0
-    if (total_bytes_to_write > 0)
+    else if (session->total_bytes_to_write > 0 && !session->quiet)
     {
-        print_progress_bar("Programming", bytes_written, total_bytes_to_write);
+        print_progress_bar("Programming", session->bytes_written, session->total_bytes_to_write);
     }
 #endif
+    if (session->trace != NULL)
+        trace_span(session->trace, TRACE_LANE_HOST, "host", "progress", progress_ms, time_now_ms(), NULL);
+}
+
+/*
+ * @param uint32_t size
+ *
+ * Stream the data 64 byte slices using
+ *
+ * return none
+ */
+void load_hex_buffer(TBootSession *session, char *data, uint16_t iterable)
+{
+    load_region(session, data, iterable);
+    report_progress(session, iterable);
+}
+
+/*
+ * One cmdPACKED report from the staged region, topped up from the
+ * image once less than a report's span is left
+ */
+static void load_packed_buffer(TBootSession *session, char *data)
+{
+    uint32_t consumed = 0;
+    uint32_t staged = session->stage_len - session->stage_pos;
+
+    if (staged < PACK_MAX_SPAN && staged < session->pack_left)
+    {
+        uint32_t want = PACK_STAGE - staged;
+        if (want > session->pack_left - staged)
+            want = session->pack_left - staged;
+        memmove(session->pack_stage, session->pack_stage + session->stage_pos, staged);
+        load_region(session, (char *)session->pack_stage + staged, want);
+        session->stage_pos = 0;
+        session->stage_len = staged + want;
+    }
+
+    pack_report(session->pack_stage + session->stage_pos, session->stage_len - session->stage_pos,
+                (uint8_t *)data, &consumed);
+    session->stage_pos += consumed;
+    session->pack_left -= consumed;
+    session->pack_reports++;
+    report_progress(session, consumed);
 }
 
 /*
@@ -786,6 +1327,12 @@ void file_extract_line(FILE *fp, char *buf, int fp_result)
     while (fp_result = fgetc(fp))
     {
 
+        // a file without an end of file record stops here
+        if (fp_result == EOF)
+        {
+            break;
+        }
+
         c = (unsigned char)fp_result;
 
         // make sure we dont capture new line
@@ -815,9 +1362,8 @@ void file_extract_line(FILE *fp, char *buf, int fp_result)
     }
 }
 
-void overwrite_bootflash_program(void)
+void overwrite_bootflash_program(THexImage *image, uint32_t page_size)
 {
-    int i = 0;
     // Default PIC32 boot vector - jumps to 0xBFC00050 (default boot flash)
     uint8_t default_boot_vector[16] = {
         0xC0, 0xBF, 0x1E, 0x3C,  // lui $30, 0xBFC0
@@ -827,13 +1373,37 @@ void overwrite_bootflash_program(void)
     };
     
     // Fill entire boot vector page with 0xFF
-    for (i = 0; i < (0x4000 - 16); i++)
+    memset(image->boot, 0xff, page_size - 16);
+    
+    // Place default boot vector at end (offset 0x3FF0)
+    memcpy(image->boot + page_size - 16, default_boot_vector, 16);
+}
+
+void overwrite_config_program(THexImage *image)
+{
+    // Copy ONLY the first instruction (4 bytes) from saved copy (not corrupted buffer)
+    // The PIC32MZ boots from config flash at reset
+#if DEBUG_PRINT == 1
+    printf("Using first_instruction: %02x %02x %02x %02x\n", 
+           image->first_instruction[0], image->first_instruction[1], image->first_instruction[2], image->first_instruction[3]);
+#endif
+    memcpy(image->conf, image->first_instruction, 4);
+    
+    // Fill the rest of the first 64 bytes with nop instructions
+    uint32_t nop = 0x70000000;  // nop instruction (little-endian: 0x00 0x00 0x00 0x70)
+    for (int i = 1; i < 16; i++)
     {
-        *(prg_ptr++) = 0xff;
+        memcpy(image->conf + (i * 4), &nop, 4);
     }
     
-    // Place default boot vector at end (offset 0x3FF0)
-    memcpy(prg_ptr, default_boot_vector, 16);
+    // After first 64 bytes, add the boot vector (jumps to bootloader at BD0F4000)
+    uint8_t boot_vector[16] = {
+        0x0F, 0xBD, 0x1E, 0x3C,  // lui $30, 0xBD0F
+        0x00, 0x40, 0xDE, 0x37,  // ori $30, $30, 0x4000
+        0x08, 0x00, 0xC0, 0x03,  // jr $30
+        0x00, 0x00, 0x00, 0x70   // nop (delay slot)
+    };
+    memcpy(image->conf + 64, boot_vector, 16);
 }
 
 uint32_t page_iteration_calc(uint16_t row_page_size, uint32_t mem_quantity)
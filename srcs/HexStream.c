@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "HexStream.h"
+#include "Types.h"
+#include "Utils.h"
+
+/*
+ * Streaming program flash
+ *
+ * XC32 writes hex records in ascending address order, so program
+ * flash does not need a flash sized buffer: a first pass over the
+ * file finds the extent of program flash, builds the config and boot
+ * pages and checks every record lands less than the window behind
+ * the furthest page seen. The second pass runs while the data reports
+ * go out, a page is final once a record past the window shows up.
+ * A file that jumps back further than the window is left to the
+ * buffered path. Memory is the window plus the boot page and config
+ * image whatever the device size.
+ */
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Next record, addresses worked out the way condition_hexfile_data()
+ * does. Returns the record type, -1 at the end of the file.
+ */
+static int next_record(FILE *fp, uint32_t *root, uint32_t *address, uint8_t *data, uint32_t *count)
+{
+    char text[2 * (HEX_RECORD_MAX + 5) + 8];
+    uint8_t line[HEX_RECORD_MAX + 5];
+
+    while (fgets(text, sizeof(text), fp) != NULL)
+    {
+        char *p = strchr(text, ':');
+        uint32_t n = 0;
+
+        if (p == NULL)
+            continue;
+        for (p++; n < sizeof(line) && hex_nibble(p[0]) >= 0 && hex_nibble(p[1]) >= 0; p += 2)
+            line[n++] = (uint8_t)(hex_nibble(p[0]) << 4 | hex_nibble(p[1]));
+        if (n < 4 || n < 4u + line[0])
+            continue;
+
+        if (line[3] == 0x02 || line[3] == 0x04)
+        {
+            *root = transform_2words_long((uint16_t)(line[4] << 8 | line[5]), (uint16_t)(line[1] << 8 | line[2]));
+        }
+        else if (line[3] == 0x00)
+        {
+            *address = *root + (uint16_t)(line[1] << 8 | line[2]);
+            *count = line[0];
+            memcpy(data, line + 4, line[0]);
+        }
+        return line[3];
+    }
+    return -1;
+}
+
+/*
+ * First pass: program flash extent, config image, first instruction
+ * and whether the records stay within the window. Returns 1 when
+ * they do not.
+ */
+static int stream_scan(THexStream *stream)
+{
+    uint8_t data[HEX_RECORD_MAX];
+    uint32_t address = 0, count = 0;
+    uint32_t prg_max = 0, conf_max = 0;
+    uint32_t frontier = 0;
+    int type = 0, seen = 0;
+
+    stream->root = 0;
+    while ((type = next_record(stream->fp, &stream->root, &address, data, &count)) >= 0 && type != 0x01)
+    {
+        if (type != 0x00 || count == 0)
+            continue;
+
+        if (address >= _PIC32Mn_STARTFLASH && address < _PIC32Mn_STARTCONF)
+        {
+            uint32_t offset = address - _PIC32Mn_STARTFLASH;
+            uint32_t first = offset / stream->page_size;
+            uint32_t last = (offset + count - 1) / stream->page_size;
+
+            if (offset + count > stream->image.mcu_size)
+                continue;
+
+            // behind the window the page has already gone out
+            if (seen && first + stream->window <= frontier)
+                return 1;
+            if (seen && first < frontier)
+                stream->patched++;
+            if (!seen || last > frontier)
+                frontier = last;
+            seen = 1;
+
+            for (uint32_t k = 0; k < count; k++)
+            {
+                if (offset + k < sizeof(stream->image.first_instruction))
+                    stream->image.first_instruction[offset + k] = data[k];
+            }
+            if (offset + count > prg_max)
+                prg_max = offset + count;
+        }
+        else if (address >= _PIC32Mn_STARTCONF)
+        {
+            uint32_t offset = address - _PIC32Mn_STARTCONF;
+
+            for (uint32_t k = 0; k < count && offset + k < CONF_IMAGE_SIZE; k++)
+                stream->image.conf[offset + k] = data[k];
+            if (offset + count > conf_max)
+                conf_max = offset + count;
+        }
+    }
+
+    stream->image.prg_mem_count = prg_max;
+    stream->image.conf_mem_count = conf_max;
+    return 0;
+}
+
+/*
+ * Open path for streaming. NULL with *fallback set when the file has to
+ * go through condition_hexfile_data(), NULL alone when it cannot be read.
+ */
+THexStream *hex_stream_open(const char *path, TBootInfo *bootinfo, int window, int *fallback)
+{
+    THexStream *stream = calloc(1, sizeof(THexStream));
+
+    *fallback = 0;
+    if (stream == NULL)
+        return NULL;
+
+    stream->fp = fopen(path, "r");
+    if (stream->fp == NULL)
+    {
+        fprintf(stderr, "Could not find or open a file!! %s\n", path);
+        free(stream);
+        return NULL;
+    }
+
+    stream->window = (window > 0) ? window : HEX_STREAM_WINDOW;
+    stream->page_size = bootinfo->uiEraseBlock.fValue.intVal;
+    stream->image.mcu_size = bootinfo->ulMcuSize.fValue;
+    stream->image.boot_size = stream->page_size;
+    stream->image.file_size = file_byte_count(stream->fp);
+    fseek(stream->fp, 0, SEEK_SET);
+
+    stream->image.conf = malloc(CONF_IMAGE_SIZE);
+    stream->image.boot = malloc(stream->page_size);
+    stream->pages = malloc((size_t)stream->window * stream->page_size);
+    if (stream->image.conf == NULL || stream->image.boot == NULL || stream->pages == NULL)
+    {
+        hex_stream_close(stream);
+        return NULL;
+    }
+    memset(stream->image.conf, 0xff, CONF_IMAGE_SIZE);
+    memset(stream->image.first_instruction, 0xff, sizeof(stream->image.first_instruction));
+    memset(stream->pages, 0xff, (size_t)stream->window * stream->page_size);
+
+    if (stream_scan(stream) != 0)
+    {
+        *fallback = 1;
+        hex_stream_close(stream);
+        return NULL;
+    }
+
+    overwrite_bootflash_program(&stream->image, stream->page_size);
+    overwrite_config_program(&stream->image);
+
+    // second pass feeds the window as the data goes out
+    fseek(stream->fp, 0, SEEK_SET);
+    stream->root = 0;
+    return stream;
+}
+
+static uint8_t *stream_slot(THexStream *stream, uint32_t page)
+{
+    return stream->pages + (size_t)(page % stream->window) * stream->page_size;
+}
+
+/*
+ * Copy a record into the window, 0 when it lies past it
+ */
+static int stream_place(THexStream *stream, uint32_t offset, const uint8_t *data, uint32_t count)
+{
+    if ((offset + count - 1) / stream->page_size >= stream->base + stream->window)
+        return 0;
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        uint32_t page = (offset + k) / stream->page_size;
+
+        // the scan ruled this out, unless the file changed under us
+        if (page < stream->base)
+            continue;
+        stream_slot(stream, page)[(offset + k) % stream->page_size] = data[k];
+    }
+    return 1;
+}
+
+/*
+ * Parse until a record falls past the window or the file ends
+ */
+static void stream_fill(THexStream *stream)
+{
+    uint32_t address = 0;
+    int type = 0;
+
+    if (stream->pending)
+    {
+        if (!stream_place(stream, stream->pending_offset, stream->pending_data, stream->pending_count))
+            return;
+        stream->pending = 0;
+    }
+
+    while (!stream->eof)
+    {
+        type = next_record(stream->fp, &stream->root, &address, stream->pending_data, &stream->pending_count);
+        if (type < 0 || type == 0x01)
+        {
+            stream->eof = 1;
+            break;
+        }
+        if (type != 0x00 || stream->pending_count == 0 || address < _PIC32Mn_STARTFLASH || address >= _PIC32Mn_STARTCONF)
+            continue;
+
+        stream->pending_offset = address - _PIC32Mn_STARTFLASH;
+        if (stream->pending_offset + stream->pending_count > stream->image.mcu_size)
+            continue;
+        if (!stream_place(stream, stream->pending_offset, stream->pending_data, stream->pending_count))
+        {
+            stream->pending = 1;
+            break;
+        }
+    }
+}
+
+/*
+ * Program flash bytes at offset, reads go forward through the image
+ */
+void hex_stream_read(THexStream *stream, uint32_t offset, char *data, uint32_t length)
+{
+    while (length > 0)
+    {
+        uint32_t page = offset / stream->page_size;
+        uint32_t in_page = offset % stream->page_size;
+        uint32_t chunk = stream->page_size - in_page;
+
+        // pages behind the reader are done, their slots take new pages
+        while (stream->base < page)
+        {
+            memset(stream_slot(stream, stream->base), 0xff, stream->page_size);
+            stream->base++;
+        }
+        stream_fill(stream);
+
+        if (chunk > length)
+            chunk = length;
+        memcpy(data, stream_slot(stream, page) + in_page, chunk);
+        data += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+void hex_stream_close(THexStream *stream)
+{
+    if (stream == NULL)
+        return;
+    if (stream->fp != NULL)
+        fclose(stream->fp);
+    free(stream->pages);
+    free(stream->image.boot);
+    free(stream->image.conf);
+    free(stream);
+}
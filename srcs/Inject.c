@@ -0,0 +1,515 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+#include "Inject.h"
+#include "Arena.h"
+#include "Utils.h"
+
+/*
+ * Per-board data injection
+ *
+ * A batch flashes one release image to many boards, each of which
+ * wants its own serial number, MAC address or calibration blob. The
+ * image is conditioned once (or comes out of the cache or the daemon's
+ * shared entries, read only) and every board's records are written
+ * over copies of only the erase pages they touch:
+ *
+ *   --inject 0x1D0FF000=text:SN-{n:06}
+ *   --inject 0x1D0FF010=u48be:0x0004A3000000+n
+ *   --inject 0x1D0FF020=DEADBEEF
+ *   --inject 0x1D0FF100=@cal/board.bin
+ *
+ * {n} and +n are the board's counter, from --inject-counter or taken
+ * and incremented in a --counter-file under a lock so parallel
+ * stations never hand out the same number. The engine reads program
+ * flash through the overlay, so what is sent, the CRCs --verify
+ * compares and the pages it rewrites are the patched ones, and the
+ * shared image is never written.
+ */
+
+static int inject_hex_bytes(const char *text, uint8_t *out, uint32_t room, uint32_t *len)
+{
+    uint32_t n = 0;
+    int high = -1;
+
+    if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+        text += 2;
+    for (; *text != '\0'; text++)
+    {
+        int v = 0;
+        if (*text == ':' || *text == '-' || *text == ' ')
+        {
+            if (high >= 0)
+                return -1;
+            continue;
+        }
+        if (!isxdigit((unsigned char)*text))
+            return -1;
+        v = isdigit((unsigned char)*text) ? *text - '0' : (tolower((unsigned char)*text) - 'a' + 10);
+        if (high < 0)
+        {
+            high = v;
+            continue;
+        }
+        if (n >= room)
+            return -1;
+        out[n++] = (uint8_t)((high << 4) | v);
+        high = -1;
+    }
+    if (high >= 0 || n == 0)
+        return -1;
+    *len = n;
+    return 0;
+}
+
+static int inject_file_bytes(const char *path, TInjectRecord *record)
+{
+    FILE *fp = fopen(path, "rb");
+    long size = 0;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "--inject %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) <= 0 || size > INJECT_MAX_BYTES ||
+        fseek(fp, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "--inject %s: empty or over %d bytes\n", path, INJECT_MAX_BYTES);
+        fclose(fp);
+        return -1;
+    }
+    record->bytes = malloc((size_t)size);
+    if (record->bytes == NULL || fread(record->bytes, 1, (size_t)size, fp) != (size_t)size)
+    {
+        fprintf(stderr, "--inject %s: could not be read\n", path);
+        fclose(fp);
+        return -1;
+    }
+    record->len = (uint32_t)size;
+    fclose(fp);
+    return 0;
+}
+
+// "u32le:", "u48be:", "u8:" into width and order, the spec after it
+static const char *inject_number_kind(const char *value, TInjectRecord *record)
+{
+    char *end = NULL;
+    long bits = 0;
+
+    if (value[0] != 'u' || !isdigit((unsigned char)value[1]))
+        return NULL;
+    bits = strtol(value + 1, &end, 10);
+    if (bits < 8 || bits > 64 || bits % 8 != 0)
+        return NULL;
+    record->width = (int)(bits / 8);
+    record->big_endian = 0;
+    if (strncmp(end, "be", 2) == 0)
+    {
+        record->big_endian = 1;
+        end += 2;
+    }
+    else if (strncmp(end, "le", 2) == 0)
+    {
+        end += 2;
+    }
+    else if (record->width > 1)
+    {
+        return NULL;
+    }
+    return (*end == ':') ? end + 1 : NULL;
+}
+
+/*
+ * One "<address>=<value>" record into set, 0 or -1
+ */
+int inject_parse(TInjectSet *set, const char *spec)
+{
+    TInjectRecord *record = NULL;
+    const char *value = strchr(spec, '=');
+    const char *number = NULL;
+    char *end = NULL;
+    unsigned long address = 0;
+
+    if (set->count >= INJECT_MAX_RECORDS)
+    {
+        fprintf(stderr, "--inject takes at most %d records\n", INJECT_MAX_RECORDS);
+        return -1;
+    }
+    address = strtoul(spec, &end, 0);
+    if (value == NULL || end != value || end == spec)
+    {
+        fprintf(stderr, "--inject takes <address>=<value>, e.g. 0x1D0FF000=text:SN-{n:06}\n");
+        return -1;
+    }
+    value++;
+
+    record = &set->records[set->count];
+    memset(record, 0, sizeof(TInjectRecord));
+    record->address = (uint32_t)address & 0x1FFFFFFF;
+
+    if (value[0] == '@')
+    {
+        record->kind = INJECT_BYTES;
+        if (inject_file_bytes(value + 1, record) != 0)
+        {
+            free(record->bytes);
+            record->bytes = NULL;
+            return -1;
+        }
+    }
+    else if (strncmp(value, "text:", 5) == 0)
+    {
+        record->kind = INJECT_TEXT;
+        if (value[5] == '\0' || strlen(value + 5) >= sizeof(record->text))
+        {
+            fprintf(stderr, "--inject text is empty or over %d characters\n", INJECT_TEXT_SIZE - 1);
+            return -1;
+        }
+        snprintf(record->text, sizeof(record->text), "%s", value + 5);
+    }
+    else if ((number = inject_number_kind(value, record)) != NULL)
+    {
+        record->kind = INJECT_NUMBER;
+        errno = 0;
+        record->base = strtoull(number, &end, 0);
+        if (strcmp(end, "+n") == 0)
+        {
+            record->add_counter = 1;
+            end += 2;
+        }
+        if (end == number || *end != '\0' || errno != 0 ||
+            (record->width < 8 && record->base >> (record->width * 8) != 0))
+        {
+            fprintf(stderr, "--inject %s is not a %d bit value or value+n\n", number, record->width * 8);
+            return -1;
+        }
+        record->len = (uint32_t)record->width;
+    }
+    else
+    {
+        uint8_t bytes[INJECT_TEXT_SIZE];
+        record->kind = INJECT_BYTES;
+        if (inject_hex_bytes(value, bytes, sizeof(bytes), &record->len) != 0)
+        {
+            fprintf(stderr, "--inject %s is not hex bytes, text:, u<bits>le:, u<bits>be: or @file\n", value);
+            return -1;
+        }
+        record->bytes = malloc(record->len);
+        if (record->bytes == NULL)
+            return -1;
+        memcpy(record->bytes, bytes, record->len);
+    }
+    set->count++;
+    return 0;
+}
+
+void inject_free(TInjectSet *set)
+{
+    for (int i = 0; i < set->count; i++)
+    {
+        free(set->records[i].bytes);
+        set->records[i].bytes = NULL;
+    }
+    set->count = 0;
+}
+
+#ifdef _WIN32
+
+int inject_counter_next(const char *path, uint64_t *counter)
+{
+    (void)path;
+    (void)counter;
+    fprintf(stderr, "--counter-file needs flock, not available on Windows, use --inject-counter\n");
+    return -1;
+}
+
+#else
+
+/*
+ * The number in path into counter and the one after it back, under
+ * an exclusive lock, a missing file starts at 0
+ */
+int inject_counter_next(const char *path, uint64_t *counter)
+{
+    char text[32];
+    ssize_t n = 0;
+    int len = 0;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0 || flock(fd, LOCK_EX) != 0)
+    {
+        fprintf(stderr, "--counter-file %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    n = read(fd, text, sizeof(text) - 1);
+    text[(n > 0) ? n : 0] = '\0';
+    *counter = strtoull(text, NULL, 0);
+
+    len = snprintf(text, sizeof(text), "%llu\n", (unsigned long long)(*counter + 1));
+    if (lseek(fd, 0, SEEK_SET) != 0 || ftruncate(fd, 0) != 0 || write(fd, text, (size_t)len) != len ||
+        fsync(fd) != 0)
+    {
+        fprintf(stderr, "--counter-file %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+#endif
+
+// text with every {n}, {n:06} or {n:08x} replaced, no terminator
+static uint32_t inject_render_text(const char *text, uint64_t counter, uint8_t *out, uint32_t room)
+{
+    uint32_t n = 0;
+
+    while (*text != '\0' && n < room)
+    {
+        const char *close = NULL;
+        if (text[0] == '{' && text[1] == 'n' && (text[2] == '}' || text[2] == ':') &&
+            (close = strchr(text, '}')) != NULL && close - text < 16)
+        {
+            char format[24], digits[32];
+            int width = 0;
+            const char *spec = (text[2] == ':') ? text + 3 : close;
+            int hex = (close > spec && (close[-1] == 'x' || close[-1] == 'X'));
+            int zero = (spec < close && *spec == '0');
+
+            width = atoi(spec);
+            snprintf(format, sizeof(format), "%%%s%dll%c", zero ? "0" : "", width,
+                     hex ? close[-1] : 'u');
+            snprintf(digits, sizeof(digits), format, (unsigned long long)counter);
+            for (const char *d = digits; *d != '\0' && n < room; d++)
+                out[n++] = (uint8_t)*d;
+            text = close + 1;
+            continue;
+        }
+        out[n++] = (uint8_t)*text++;
+    }
+    return n;
+}
+
+// bytes record writes for counter into out
+static uint32_t inject_render(const TInjectRecord *record, uint64_t counter, uint8_t *out)
+{
+    if (record->kind == INJECT_TEXT)
+        return inject_render_text(record->text, counter, out, INJECT_MAX_BYTES);
+    if (record->kind == INJECT_NUMBER)
+    {
+        uint64_t value = record->base + (record->add_counter ? counter : 0);
+        for (int i = 0; i < record->width; i++)
+        {
+            int shift = record->big_endian ? (record->width - 1 - i) * 8 : i * 8;
+            out[i] = (uint8_t)(value >> shift);
+        }
+        return (uint32_t)record->width;
+    }
+    memcpy(out, record->bytes, record->len);
+    return record->len;
+}
+
+static TOverlayPage *overlay_page(TOverlay *overlay, const uint8_t *prg, uint32_t offset)
+{
+    uint32_t base = (offset / overlay->page_size) * overlay->page_size;
+    TOverlayPage *page = NULL;
+
+    for (int i = 0; i < overlay->count; i++)
+        if (overlay->pages[i].offset == base)
+            return &overlay->pages[i];
+    if (overlay->count >= INJECT_MAX_PAGES)
+        return NULL;
+    page = &overlay->pages[overlay->count];
+    page->data = (overlay->arena != NULL) ? arena_alloc(overlay->arena, overlay->page_size) : malloc(overlay->page_size);
+    if (page->data == NULL)
+        return NULL;
+    memcpy(page->data, prg + base, overlay->page_size);
+    page->offset = base;
+    overlay->count++;
+    if (base + overlay->page_size > overlay->end)
+        overlay->end = base + overlay->page_size;
+    return page;
+}
+
+// an overlay carved from an arena, the record scratch and every page it may copy
+size_t overlay_arena_size(const TBootInfo *bootinfo)
+{
+    return sizeof(TOverlay) + INJECT_MAX_BYTES + (size_t)INJECT_MAX_PAGES * bootinfo->uiEraseBlock.fValue.intVal +
+           (INJECT_MAX_PAGES + 2) * ARENA_ALIGN;
+}
+
+/*
+ * Copies of the erase pages of prg the records of set touch, patched
+ * for set->counter. NULL when a record is outside the application's
+ * program flash, overlaps another or there was no memory. Carved from
+ * arena when it has room for the largest overlay, it goes with the
+ * next reset then.
+ */
+TOverlay *overlay_build(const TInjectSet *set, const uint8_t *prg, const TBootInfo *bootinfo, TArena *arena)
+{
+    uint32_t boot_page = _PIC32Mn_STARTFLASH + (bootinfo->ulMcuSize.fValue - 0x10000);
+    uint32_t boot_start = bootinfo->ulBootStart.fValue & 0x1FFFFFFF;
+    uint32_t limit = (boot_start > _PIC32Mn_STARTFLASH && boot_start < boot_page) ? boot_start : boot_page;
+    uint32_t starts[INJECT_MAX_RECORDS], ends[INJECT_MAX_RECORDS];
+    uint8_t *bytes = NULL;
+    TOverlay *overlay = NULL;
+
+    if (arena != NULL && arena->size - arena->used < overlay_arena_size(bootinfo))
+        arena = NULL;
+    if (arena != NULL)
+    {
+        overlay = arena_alloc(arena, sizeof(TOverlay));
+        memset(overlay, 0, sizeof(TOverlay));
+        overlay->arena = arena;
+        bytes = arena_alloc(arena, INJECT_MAX_BYTES);
+    }
+    else
+    {
+        overlay = calloc(1, sizeof(TOverlay));
+        bytes = malloc(INJECT_MAX_BYTES);
+    }
+
+    if (bytes == NULL || overlay == NULL || bootinfo->uiEraseBlock.fValue.intVal == 0)
+        goto fail;
+    overlay->page_size = bootinfo->uiEraseBlock.fValue.intVal;
+
+    for (int i = 0; i < set->count; i++)
+    {
+        const TInjectRecord *record = &set->records[i];
+        uint32_t len = inject_render(record, set->counter, bytes);
+        uint32_t offset = record->address - _PIC32Mn_STARTFLASH;
+        uint32_t done = 0;
+
+        starts[i] = record->address;
+        ends[i] = record->address + len;
+        if (len == 0 || record->address < _PIC32Mn_STARTFLASH || ends[i] > limit)
+        {
+            error_report("inject: %08x+%u is outside program flash %08x:%08x\n", record->address, len,
+                    _PIC32Mn_STARTFLASH, limit);
+            goto fail;
+        }
+        for (int j = 0; j < i; j++)
+        {
+            if (starts[i] < ends[j] && starts[j] < ends[i])
+            {
+                error_report("inject: %08x+%u overlaps the record at %08x\n", record->address, len, starts[j]);
+                goto fail;
+            }
+        }
+
+        // a record may straddle erase pages
+        while (done < len)
+        {
+            TOverlayPage *page = overlay_page(overlay, prg, offset + done);
+            uint32_t at = 0, chunk = 0;
+
+            if (page == NULL)
+            {
+                error_report("inject: records touch more than %d erase pages\n", INJECT_MAX_PAGES);
+                goto fail;
+            }
+            at = offset + done - page->offset;
+            chunk = overlay->page_size - at;
+            if (chunk > len - done)
+                chunk = len - done;
+            memcpy(page->data + at, bytes + done, chunk);
+            done += chunk;
+        }
+        overlay->bytes += len;
+    }
+    if (arena == NULL)
+        free(bytes);
+    return overlay;
+
+fail:
+    if (arena == NULL)
+        free(bytes);
+    overlay_free(overlay);
+    return NULL;
+}
+
+/*
+ * Where the byte at offset of program flash is read from, prg or a
+ * patched page. The span read from it must not cross an erase page
+ */
+const uint8_t *overlay_source(const TOverlay *overlay, const uint8_t *prg, uint32_t offset)
+{
+    if (overlay != NULL)
+    {
+        uint32_t base = (offset / overlay->page_size) * overlay->page_size;
+        for (int i = 0; i < overlay->count; i++)
+            if (overlay->pages[i].offset == base)
+                return overlay->pages[i].data + (offset - base);
+    }
+    return prg + offset;
+}
+
+/*
+ * len bytes of program flash from offset into dst, through the
+ * patched pages
+ */
+void overlay_copy(const TOverlay *overlay, const uint8_t *prg, uint32_t offset, uint8_t *dst, uint32_t len)
+{
+    while (len > 0)
+    {
+        uint32_t chunk = len;
+        if (overlay != NULL)
+        {
+            uint32_t left = overlay->page_size - offset % overlay->page_size;
+            if (chunk > left)
+                chunk = left;
+        }
+        memcpy(dst, overlay_source(overlay, prg, offset), chunk);
+        dst += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+/*
+ * 1 when every patched page lies in [start, end) of program flash
+ */
+int overlay_within(const TOverlay *overlay, uint32_t start, uint32_t end)
+{
+    for (int i = 0; i < overlay->count; i++)
+        if (overlay->pages[i].offset < start || overlay->pages[i].offset + overlay->page_size > end)
+            return 0;
+    return 1;
+}
+
+void overlay_free(TOverlay *overlay)
+{
+    // an arena's overlay is reclaimed when the arena is reset
+    if (overlay == NULL || overlay->arena != NULL)
+        return;
+    for (int i = 0; i < overlay->count; i++)
+        free(overlay->pages[i].data);
+    free(overlay);
+}
@@ -43,6 +43,7 @@ Use the -I option if needed to specify the path to the libusb.h header file. For
 #ifndef _WIN32
 #include <linux/types.h>
 #include <linux/input.h>
+#include <unistd.h>
 #endif
 
 // Values for bmRequestType in the Setup transaction's Data packet.
@@ -50,37 +51,482 @@ Use the -I option if needed to specify the path to the libusb.h header file. For
 #include "HexFile.h"
 #include "Utils.h"
 #include "USB.h"
+#include "Daemon.h"
+#include "Sim.h"
+#include "Capture.h"
+#include "Serial.h"
+#include "Fault.h"
+#include "Timing.h"
+#include "HexStream.h"
+#include "Scale.h"
+#include "Calib.h"
+#include "Regions.h"
+#include "Pack.h"
+#include "Verify.h"
+#include "Cache.h"
+#include "Check.h"
+#include "Arena.h"
+#include "Realtime.h"
+#include "Gadget.h"
+#include "Inject.h"
+#include "Watch.h"
+#include "App.h"
 
 const int INTERFACE_NUMBER = 0;
 
+// serial trigger to bootloader enumeration
+#define ENUM_TIMEOUT_MS 5000
+
 void print_usage(const char *prog_name)
 {
-	printf("Usage: %s [OPTIONS] <hexfile>\n", prog_name);
+	printf("Usage: %s [OPTIONS] <hexfile> [hexfile...]\n", prog_name);
 	printf("\nOptions:\n");
 	printf("  --v2              Use new dynamic region-based bootloader (recommended)\n");
 	printf("  --verbose         Show detailed hex data transfer (for debugging)\n");
 	printf("  --serial <port>   Send serial trigger sequence before USB (e.g., COM5 or /dev/ttyUSB0)\n");
+	printf("  --device <sel>    Bootloader to open: /dev/bus/usb/BBB/DDD, fd:N, bus:addr, port:P, serial:SN\n");
+	printf("  --port <1-4.2>    Bootloader on this usb port, as sysfs names it\n");
+	printf("  --serial-number <sn> Bootloader with this usb serial number\n");
 	printf("  --baud <rate>     Serial baud rate (default: 115200)\n");
+	printf("  --trigger <text>  Serial trigger, \\r \\n \\xHH escapes (default: BOOT\\r\\n)\n");
+	printf("  --enum-timeout <ms> Wait for the bootloader after the trigger (default: %d)\n", ENUM_TIMEOUT_MS);
+	printf("  --app <vid:pid>   After reboot wait for the application to enumerate, fail on bootloader\n");
+	printf("  --app gone        After reboot only check the bootloader does not come back\n");
+	printf("  --app-timeout <ms> Wait for the application after reboot (default: %d)\n", APP_TIMEOUT_MS);
+	printf("  --sim <spec>      Flash a simulated bootloader (mz2048, mz1024[,erase=ms,row=ms,...])\n");
+	printf("  --trace <file>    Write a Chrome/Perfetto trace of states, transfers and parsing\n");
+	printf("  --record <file>   Capture every usb transfer, both directions, with timing\n");
+	printf("  --replay <file>   Flash a simulated device replaying a capture's INFO and latencies\n");
+	printf("  --calibrate <addr[:pages]> Measure erase, row write and report rates on a scratch region\n");
+	printf("  --adaptive        Time transfers out from latencies learned per device model\n");
+	printf("  --profile-dir <dir> Where learned timing profiles live (default: $XDG_STATE_HOME/mikro_hb)\n");
+	printf("  --stream          Parse an address ordered hex file while flashing, bounded memory\n");
+	printf("  --stream-window <pages> Erase pages held back for out of order records (default: %d)\n", HEX_STREAM_WINDOW);
+	printf("  --regions <list>  Flash only program, bootpage and/or config (default: all)\n");
+	printf("  --app-only        Skip boot page and config when they hold what was flashed last\n");
+	printf("  --range <start:end> Flash only the program erase pages covering start..end\n");
+	printf("  --packed          Send run length packed data to bootloaders that take it (uiBootRev >= %04x)\n", BOOT_REV_PACKED);
+	printf("  --full-pages      Write the whole boot page and config, not only their rows holding data\n");
+	printf("  --verify          CRC every page written and rewrite the ones that differ (uiBootRev >= %04x)\n", BOOT_REV_CRC);
+	printf("  --no-cache        Condition the hex files even when the image is cached\n");
+	printf("  --cache-size <MB> Bound on cached images, least recently used go first (default: %d)\n", IMAGE_CACHE_MAX_MB);
+	printf("  --inject <addr=value> Write this board's bytes, text:SN-{n:06}, u48be:0x0004a3000000+n or @file at addr\n");
+	printf("  --inject-counter <n> The board number {n} and +n stand for (default: 0)\n");
+	printf("  --counter-file <path> Take the board number from path and store the next one, locked\n");
+	printf("  --pipeline        Send INFO, BOOT and SYNC back to back, for bootloaders holding an answer\n");
+	printf("  --watch           Stay up and flash the erase pages that changed whenever the hex files are rebuilt\n");
+	printf("  --realtime <fifo|rr[:prio]> Stream on a real-time policy, image locked, progress drawn elsewhere\n");
+	printf("  --cpu <n>         With --realtime, pin the streaming thread to cpu n\n");
+	printf("  --gaps            Report host gaps between data reports, p50 to max\n");
+	printf("  --pack-bench      Flash a simulated device raw and packed, report effective rates\n");
+	printf("  --arena-soak <n>  Flash n zero latency simulated devices through one arena, count heap allocations\n");
+	printf("  --faults <plan>   Inject drops, delays, corruption, failures, disconnects from a plan file\n");
+	printf("  --soak <n>        Flash n times with one fault from the plan each, report recovery cost\n");
+	printf("  --scale <n,...>   Flash n simulated devices at once per step, report throughput and tails\n");
+	printf("  --topology <h:s>  With --scale, devices on h synthetic hubs of s streams, run free and scheduled\n");
+	printf("  --schedule        With --daemon, hold data streams back per hub and root port\n");
+	printf("  --hub-budget <KB/s> Fixed bandwidth per hub for the scheduler (default: learned), implies --schedule\n");
+	printf("  --gadget          Be a simulated bootloader (--sim spec) on a raw-gadget UDC for another mikro_hb\n");
+	printf("  --udc <drv:dev>   UDC for --gadget (default: %s:%s)\n", GADGET_UDC_DRIVER, GADGET_UDC_DEVICE);
+	printf("  --daemon          Run as flash job server, jobs are json lines on a unix socket\n");
+	printf("  --socket <path>   Daemon socket (default: %s)\n", DAEMON_SOCKET_PATH);
+	printf("  --socket-mode <octal> Permissions of the daemon socket (default: %04o)\n", DAEMON_SOCKET_MODE);
 	printf("  --help            Show this help message\n");
+	printf("\nCommands:\n");
+	printf("  check [--geometry <spec>] [--jobs <n>] <files>  Validate hex files for a device model, no device needed\n");
+	printf("\nSeveral hex files (application, calibration data, config bits...) are merged\n");
+	printf("into one image and flashed in a single session, overlapping bytes are an error.\n");
 	printf("\nExamples:\n");
 	printf("  %s firmware.hex\n", prog_name);
 	printf("  %s --v2 firmware.hex\n", prog_name);
 	printf("  %s --v2 --verbose firmware.hex\n", prog_name);
 	printf("  %s --serial COM5 --v2 firmware.hex\n", prog_name);
+	printf("  %s --sim mz2048,enum=300 --serial pty firmware.hex\n", prog_name);
+	printf("  %s app.hex calibration.hex config.hex\n", prog_name);
+	printf("  %s --app 04d8:000a firmware.hex\n", prog_name);
+	printf("  %s --daemon --socket /run/mikro_hb.sock\n", prog_name);
+	printf("  %s --record board.cap firmware.hex\n", prog_name);
+	printf("  %s --replay board.cap firmware.hex\n", prog_name);
+	printf("  %s --trace flash.json firmware.hex\n", prog_name);
+	printf("  %s --sim mz2048,frame=0.1 --faults faults.txt --soak 1000 firmware.hex\n", prog_name);
+	printf("  %s --calibrate 0x1d100000:4\n", prog_name);
+	printf("  %s --device /dev/bus/usb/001/007 firmware.hex\n", prog_name);
+	printf("  %s --realtime fifo:80 --cpu 3 firmware.hex\n", prog_name);
+	printf("  %s --app-only firmware.hex\n", prog_name);
+	printf("  %s --pack-bench firmware.hex\n", prog_name);
+	printf("  %s --sim mz2048,rev=0x201,weak=0.01 --verify firmware.hex\n", prog_name);
+	printf("  %s --range 0x9d004000:0x9d00a000 firmware.hex\n", prog_name);
+	printf("  %s --watch --serial /dev/ttyUSB0 --app 04d8:000a build/firmware.hex\n", prog_name);
+	printf("  %s --counter-file boards.txt --inject 0x9d0ff000=text:SN-{n:06} firmware.hex\n", prog_name);
+	printf("  %s check --geometry mz1024 build/*.hex\n", prog_name);
+	printf("  %s --scale 1,8,32 firmware.hex\n", prog_name);
+	printf("  %s --scale 32 --topology 4:3 firmware.hex\n", prog_name);
+}
+
+/*
+ * Send the serial trigger and wait for the bootloader to enumerate,
+ * the hotplug callback is armed first so a fast board is not missed.
+ * Returns an open handle, NULL when the deadline passes.
+ */
+static libusb_device_handle *trigger_bootloader(const char *port, int baud, const char *trigger, size_t len, int timeout_ms,
+                                                const char *selector)
+{
+	libusb_device_handle *devh = NULL;
+	TUsbWait wait;
+	double trigger_ms = 0.0;
+	double deadline_ms = 0.0;
+
+	usb_wait_arm(&wait, NULL, BOOTLOADER_VID, BOOTLOADER_PID);
+	if (wait.arrived && (devh = usb_open_bootloader(NULL, selector)) != NULL)
+	{
+		// already in the bootloader, the trigger would only reach a stopped uart
+		usb_wait_disarm(&wait);
+		printf("Bootloader already on the bus, trigger not sent\n");
+		return devh;
+	}
+
+	if (serial_send_trigger(port, baud, trigger, len) != 0)
+	{
+		usb_wait_disarm(&wait);
+		return NULL;
+	}
+	trigger_ms = time_now_ms();
+	deadline_ms = trigger_ms + timeout_ms;
+
+	if (usb_wait_for(&wait, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, deadline_ms) != 0)
+	{
+		usb_wait_disarm(&wait);
+		fprintf(stderr, "Bootloader did not enumerate within %d ms of the trigger on %s\n", timeout_ms, port);
+		return NULL;
+	}
+	usb_wait_disarm(&wait);
+	printf("Bootloader enumerated %.1f ms after the serial trigger\n", wait.arrived_ms - trigger_ms);
+
+	// udev may still be fixing up permissions on the fresh node
+	while ((devh = usb_open_bootloader(NULL, selector)) == NULL && time_now_ms() < deadline_ms)
+		sleep_ms(USB_WAIT_POLL_MS);
+	return devh;
+}
+
+/*
+ * Simulated trigger, the sim listens on the master of a pty pair and
+ * the trigger goes through the termios path on the slave
+ */
+static int trigger_sim(TSim *sim, const char *port, int baud, const char *trigger, size_t len, int timeout_ms)
+{
+	char slave[64];
+	double trigger_ms = 0.0;
+	double arrived_ms = 0.0;
+	int master = -1;
+	int result = 0;
+
+	if (strcmp(port, "pty") != 0)
+	{
+		fprintf(stderr, "With a simulated device --serial must be pty\n");
+		return -1;
+	}
+	if ((master = serial_open_pty(slave, sizeof(slave))) < 0)
+		return -1;
+
+	result = serial_send_trigger(slave, baud, trigger, len);
+	trigger_ms = time_now_ms();
+	if (result == 0)
+		result = sim_wait_trigger(sim, master, trigger, len, trigger_ms + timeout_ms, &arrived_ms);
+#ifndef _WIN32
+	close(master);
+#endif
+	if (result != 0)
+	{
+		fprintf(stderr, "Simulated bootloader did not enumerate within %d ms of the trigger on %s\n", timeout_ms, slave);
+		return -1;
+	}
+	printf("Bootloader enumerated %.1f ms after the serial trigger (%s)\n", arrived_ms - trigger_ms, slave);
+	return 0;
+}
+
+/*
+ * Soak targets, a fresh simulated device per session or the board
+ * back in its bootloader. The first simulated device to finish is
+ * kept as the reference the others are compared against.
+ */
+typedef struct
+{
+	TSimConfig *cfg;
+	TSim sim;
+	TSim reference;
+	int have_reference;
+	TTransport tp;
+} TSimTarget;
+
+static TTransport *sim_target_open(void *ctx)
+{
+	TSimTarget *target = ctx;
+
+	if (sim_open(&target->sim, target->cfg) != 0)
+		return NULL;
+	sim_transport(&target->tp, &target->sim);
+	return &target->tp;
+}
+
+static void sim_target_close(void *ctx)
+{
+	TSimTarget *target = ctx;
+
+	if (!target->have_reference)
+	{
+		target->reference = target->sim;
+		target->have_reference = 1;
+		return;
+	}
+	sim_close(&target->sim);
+}
+
+static int sim_target_verify(void *ctx)
+{
+	TSimTarget *target = ctx;
+	return target->have_reference ? (sim_compare(&target->sim, &target->reference) == 0) : -1;
+}
+
+typedef struct
+{
+	libusb_device_handle *devh;
+	TTransport tp;
+	const char *serial_port;
+	int baud;
+	const char *trigger;
+	size_t trigger_len;
+	int enum_timeout;
+	const char *selector;
+} TUsbTarget;
+
+static TTransport *usb_target_open(void *ctx)
+{
+	TUsbTarget *target = ctx;
+
+	if (target->serial_port != NULL)
+	{
+		target->devh = trigger_bootloader(target->serial_port, target->baud, target->trigger, target->trigger_len,
+		                                  target->enum_timeout, target->selector);
+	}
+	else
+	{
+		// a board that rebooted into its application has to find its own way back
+		TUsbWait wait;
+		usb_wait_arm(&wait, NULL, BOOTLOADER_VID, BOOTLOADER_PID);
+		usb_wait_for(&wait, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, time_now_ms() + target->enum_timeout);
+		usb_wait_disarm(&wait);
+		target->devh = usb_open_bootloader(NULL, target->selector);
+	}
+	if (target->devh == NULL)
+	{
+		fprintf(stderr, "Bootloader not back on the bus\n");
+		return NULL;
+	}
+	usb_transport(&target->tp, target->devh);
+	return &target->tp;
+}
+
+static void usb_target_close(void *ctx)
+{
+	TUsbTarget *target = ctx;
+
+	usb_close_bootloader(target->devh);
+	target->devh = NULL;
+}
+
+/*
+ * Watch target, the board back in its bootloader after each build,
+ * reopened under the shims the first session went through. The
+ * simulated one keeps its flash.
+ */
+typedef struct
+{
+	TUsbTarget usb;
+	TTransport *device_tp;
+	TTransport *transport;
+	TSim *sim;
+	TAppCheck *check;
+} TWatchBoard;
+
+static TTransport *watch_board_open(void *ctx)
+{
+	TWatchBoard *board = ctx;
+
+	if (board->sim != NULL)
+	{
+		if (board->usb.serial_port != NULL)
+		{
+			if (trigger_sim(board->sim, board->usb.serial_port, board->usb.baud, board->usb.trigger,
+			                board->usb.trigger_len, board->usb.enum_timeout) != 0)
+				return NULL;
+		}
+		else
+		{
+			// reset by hand
+			sleep_ms(board->sim->cfg.enum_ms);
+		}
+		sim_reset(board->sim);
+		return board->transport;
+	}
+
+	if (usb_target_open(&board->usb) == NULL)
+		return NULL;
+	usb_transport(board->device_tp, board->usb.devh);
+	if (board->check->enabled)
+		app_check_arm(board->check);
+	return board->transport;
+}
+
+static void watch_board_close(void *ctx)
+{
+	TWatchBoard *board = ctx;
+
+	if (board->sim == NULL)
+		usb_target_close(&board->usb);
+}
+
+static int watch_board_running(void *ctx, double reboot_ms, double *running_ms)
+{
+	TWatchBoard *board = ctx;
+	int result = (board->sim != NULL) ? app_check_sim(board->check, board->sim) : app_check_wait(board->check, reboot_ms);
+
+	*running_ms = board->check->app_gone ? reboot_ms : time_now_ms();
+	return result;
+}
+
+/*
+ * mikro_hb check [--geometry <spec>] [--jobs <n>] file.hex ...
+ * no device involved, exit status 1 when any file fails
+ */
+static int check_main(int argc, char **argv)
+{
+	TSimConfig geometry;
+	const char *spec = "mz2048";
+	int jobs = 0;
+	int arg_idx = 0;
+
+	while (arg_idx < argc && strncmp(argv[arg_idx], "--", 2) == 0)
+	{
+		if (strcmp(argv[arg_idx], "--geometry") == 0 && arg_idx + 1 < argc)
+		{
+			spec = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--jobs") == 0 && arg_idx + 1 < argc)
+		{
+			jobs = atoi(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
+		else
+		{
+			fprintf(stderr, "check: unknown option %s\n", argv[arg_idx]);
+			return 2;
+		}
+	}
+	if (arg_idx == argc)
+	{
+		fprintf(stderr, "check: no hex files\n");
+		return 2;
+	}
+	if (sim_parse_spec(&geometry, spec) != 0)
+		return 2;
+	return (check_run(argv + arg_idx, argc - arg_idx, &geometry, jobs, stdout) == 0) ? 0 : 1;
 }
 
 int main(int argc, char **argv)
 {
 	// Change these as needed to match idVendor and idProduct in your device's device descriptor.
 	libusb_device ***list_;
-	static const int VENDOR_ID = 0x2dbc;
-	static const int PRODUCT_ID = 0x0001;
+	static const int VENDOR_ID = BOOTLOADER_VID;
+	static const int PRODUCT_ID = BOOTLOADER_PID;
 
 	struct libusb_device_handle *devh = NULL;
 	struct libusb_init_option *opts = {0};
 	int device_ready = 0;
 	int result = 0;
-	char _path[250] = {0};
+	char _path[MAX_HEX_FILES][250] = {{0}};
+	char *_paths[MAX_HEX_FILES] = {0};
+	int path_count = 0;
+	int daemon_mode = 0;
+	int gadget_mode = 0;
+	char udc_driver[128] = GADGET_UDC_DRIVER;
+	char udc_device[128] = GADGET_UDC_DEVICE;
+	const char *socket_path = DAEMON_SOCKET_PATH;
+	unsigned int socket_mode = DAEMON_SOCKET_MODE;
+	const char *sim_spec = NULL;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	const char *trace_path = NULL;
+	const char *faults_path = NULL;
+	int adaptive = 0;
+	int stream_window = 0;
+	int regions = 0;
+	int app_only = 0;
+	int packed = 0;
+	int verify = 0;
+	int pipeline = 0;
+	int watch = 0;
+	int full_pages = 0;
+	int use_cache = 1;
+	uint64_t cache_mb = IMAGE_CACHE_MAX_MB;
+	TImageCache cache;
+	TRtConfig rt_cfg = {RT_OFF, 0, -1};
+	int measure_gaps = 0;
+	TRtShim rt;
+	TTransport rt_tp = {0};
+	int pack_bench_mode = 0;
+	int arena_soak_runs = 0;
+	TArena arena = {0};
+	uint32_t range_start = 0;
+	uint32_t range_end = 0;
+	TInjectSet inject = {0};
+	const char *counter_path = NULL;
+	char port_name[32] = {0};
+	const char *profile_dir = NULL;
+	char state_dir[400] = {0};
+	int calibrate = 0;
+	uint32_t calib_address = 0;
+	uint32_t calib_pages = 0;
+	TTiming timing;
+	TTransport timing_tp = {0};
+	int soak = 0;
+	int scale_counts[SCALE_MAX_STEPS];
+	int scale_steps = 0;
+	TScaleTopo scale_topo = {0};
+	double hub_kbs = 0.0;
+	int schedule = 0;
+	TFaultPlan fault_plan;
+	TFaultShim fault_shim;
+	TTransport fault_tp = {0};
+	const char *serial_port = NULL;
+	int baud = SERIAL_DEFAULT_BAUD;
+	char trigger[64];
+	size_t trigger_len = serial_unescape(SERIAL_DEFAULT_TRIGGER, trigger, sizeof(trigger));
+	int enum_timeout = ENUM_TIMEOUT_MS;
+	const char *device_sel = NULL;
+	char device_arg[300];
+	struct libusb_init_option no_discovery = {LIBUSB_OPTION_NO_DEVICE_DISCOVERY, {0}};
+	int direct = 0;
+	TAppCheck app_check = {0};
+
+	TTransport device_tp = {0};
+	TTransport capture_tp = {0};
+	TTransport trace_tp = {0};
+	TTraceUsb trace_usb;
+	TTrace trace;
+	TTraceTrack *track = NULL;
+	TTransport *transport = NULL;
+	TCapture capture;
+	TSimConfig sim_cfg;
+	TSim sim;
+	double recorded_ms = 0.0;
+	double start_ms = 0.0;
+
+	app_check.timeout_ms = APP_TIMEOUT_MS;
+
+	// device-less validation of release artifacts
+	if (argc > 1 && strcmp(argv[1], "check") == 0)
+		return check_main(argc - 2, argv + 2);
 
 	// Parse command line arguments
 	int arg_idx = 1;
@@ -91,6 +537,279 @@ int main(int argc, char **argv)
 			// g_verbose_mode = 1;
 			arg_idx++;
 		}
+		else if (strcmp(argv[arg_idx], "--v2") == 0)
+		{
+			// region based loader is the only one left, accepted for old scripts
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--gadget") == 0)
+		{
+			gadget_mode = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--udc") == 0 && arg_idx + 1 < argc)
+		{
+			// driver:device, or a device of the dummy_udc driver
+			const char *colon = strchr(argv[arg_idx + 1], ':');
+			if (colon != NULL)
+			{
+				snprintf(udc_driver, sizeof(udc_driver), "%.*s", (int)(colon - argv[arg_idx + 1]), argv[arg_idx + 1]);
+				snprintf(udc_device, sizeof(udc_device), "%s", colon + 1);
+			}
+			else
+			{
+				snprintf(udc_device, sizeof(udc_device), "%s", argv[arg_idx + 1]);
+			}
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--daemon") == 0)
+		{
+			daemon_mode = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--socket") == 0 && arg_idx + 1 < argc)
+		{
+			socket_path = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--socket-mode") == 0 && arg_idx + 1 < argc)
+		{
+			socket_mode = (unsigned int)strtoul(argv[arg_idx + 1], NULL, 8) & 0777;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--sim") == 0 && arg_idx + 1 < argc)
+		{
+			sim_spec = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--record") == 0 && arg_idx + 1 < argc)
+		{
+			record_path = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--adaptive") == 0)
+		{
+			adaptive = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--calibrate") == 0 && arg_idx + 1 < argc)
+		{
+			if (calib_parse_region(argv[arg_idx + 1], &calib_address, &calib_pages) != 0)
+				return 1;
+			calibrate = 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--profile-dir") == 0 && arg_idx + 1 < argc)
+		{
+			profile_dir = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--stream") == 0)
+		{
+			stream_window = HEX_STREAM_WINDOW;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--stream-window") == 0 && arg_idx + 1 < argc)
+		{
+			stream_window = atoi(argv[arg_idx + 1]);
+			if (stream_window < 1)
+			{
+				fprintf(stderr, "--stream-window needs at least one page\n");
+				return 1;
+			}
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--regions") == 0 && arg_idx + 1 < argc)
+		{
+			if (region_parse_list(argv[arg_idx + 1], &regions) != 0)
+				return 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--packed") == 0)
+		{
+			packed = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--full-pages") == 0)
+		{
+			full_pages = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--verify") == 0)
+		{
+			verify = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--pipeline") == 0)
+		{
+			pipeline = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--watch") == 0)
+		{
+			watch = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--no-cache") == 0)
+		{
+			use_cache = 0;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--cache-size") == 0 && arg_idx + 1 < argc)
+		{
+			cache_mb = strtoull(argv[arg_idx + 1], NULL, 0);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--realtime") == 0 && arg_idx + 1 < argc)
+		{
+			if (rt_parse(argv[arg_idx + 1], &rt_cfg) != 0)
+				return 1;
+			measure_gaps = 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--cpu") == 0 && arg_idx + 1 < argc)
+		{
+			rt_cfg.cpu = atoi(argv[arg_idx + 1]);
+			if (rt_cfg.cpu < 0)
+			{
+				fprintf(stderr, "--cpu takes a cpu number\n");
+				return 1;
+			}
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--gaps") == 0)
+		{
+			measure_gaps = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--pack-bench") == 0)
+		{
+			pack_bench_mode = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--app-only") == 0)
+		{
+			app_only = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--range") == 0 && arg_idx + 1 < argc)
+		{
+			if (region_parse_range(argv[arg_idx + 1], &range_start, &range_end) != 0)
+				return 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--inject") == 0 && arg_idx + 1 < argc)
+		{
+			if (inject_parse(&inject, argv[arg_idx + 1]) != 0)
+				return 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--inject-counter") == 0 && arg_idx + 1 < argc)
+		{
+			inject.counter = strtoull(argv[arg_idx + 1], NULL, 0);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--counter-file") == 0 && arg_idx + 1 < argc)
+		{
+			counter_path = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--faults") == 0 && arg_idx + 1 < argc)
+		{
+			faults_path = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--arena-soak") == 0 && arg_idx + 1 < argc)
+		{
+			arena_soak_runs = atoi(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--soak") == 0 && arg_idx + 1 < argc)
+		{
+			soak = atoi(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--scale") == 0 && arg_idx + 1 < argc)
+		{
+			scale_steps = scale_parse_counts(argv[arg_idx + 1], scale_counts, SCALE_MAX_STEPS);
+			if (scale_steps <= 0)
+				return 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--topology") == 0 && arg_idx + 1 < argc)
+		{
+			if (scale_parse_topology(argv[arg_idx + 1], &scale_topo) != 0)
+				return 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--schedule") == 0)
+		{
+			schedule = 1;
+			arg_idx++;
+		}
+		else if (strcmp(argv[arg_idx], "--hub-budget") == 0 && arg_idx + 1 < argc)
+		{
+			hub_kbs = atof(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--trace") == 0 && arg_idx + 1 < argc)
+		{
+			trace_path = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--replay") == 0 && arg_idx + 1 < argc)
+		{
+			replay_path = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--device") == 0 && arg_idx + 1 < argc)
+		{
+			device_sel = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--port") == 0 && arg_idx + 1 < argc)
+		{
+			snprintf(device_arg, sizeof(device_arg), "port:%s", argv[arg_idx + 1]);
+			device_sel = device_arg;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--serial-number") == 0 && arg_idx + 1 < argc)
+		{
+			snprintf(device_arg, sizeof(device_arg), "serial:%s", argv[arg_idx + 1]);
+			device_sel = device_arg;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--serial") == 0 && arg_idx + 1 < argc)
+		{
+			serial_port = argv[arg_idx + 1];
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--baud") == 0 && arg_idx + 1 < argc)
+		{
+			baud = atoi(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--trigger") == 0 && arg_idx + 1 < argc)
+		{
+			trigger_len = serial_unescape(argv[arg_idx + 1], trigger, sizeof(trigger));
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--enum-timeout") == 0 && arg_idx + 1 < argc)
+		{
+			enum_timeout = atoi(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--app") == 0 && arg_idx + 1 < argc)
+		{
+			if (app_check_parse(&app_check, argv[arg_idx + 1]) != 0)
+				return 1;
+			arg_idx += 2;
+		}
+		else if (strcmp(argv[arg_idx], "--app-timeout") == 0 && arg_idx + 1 < argc)
+		{
+			app_check.timeout_ms = atoi(argv[arg_idx + 1]);
+			arg_idx += 2;
+		}
 		else if (strcmp(argv[arg_idx], "--help") == 0 || strcmp(argv[arg_idx], "-h") == 0)
 		{
 			print_usage(argv[0]);
@@ -103,56 +822,237 @@ int main(int argc, char **argv)
 		}
 		else
 		{
-			// This should be the hex file path
+			// This should be a hex file path, all of them are merged into one image
+			if (path_count >= MAX_HEX_FILES)
+			{
+				fprintf(stderr, "Error: At most %d hex files can be merged!\n", MAX_HEX_FILES);
+				return 1;
+			}
 			size_t len_s = strlen(argv[arg_idx]);
 			if (len_s > 0 && (argv[arg_idx][len_s - 1] == '\r' || argv[arg_idx][len_s - 1] == '\n'))
 			{
 				argv[arg_idx][len_s - 1] = '\0';
 			}
-			strcpy(_path, argv[arg_idx]);
-			break;
+			strncpy(_path[path_count], argv[arg_idx], sizeof(_path[0]) - 1);
+			_paths[path_count] = _path[path_count];
+			path_count++;
+			arg_idx++;
 		}
 	}
 
-	// Validate hex file path
-	if (strlen(_path) == 0)
+	// a streamed image is parsed as it goes out, on the real-time thread
+	if (rt_cfg.policy != RT_OFF && stream_window > 0)
+	{
+		fprintf(stderr, "--realtime conditions the image before streaming, it does not go with --stream\n");
+		return 1;
+	}
+
+	// records go over pages of a conditioned image
+	if (inject.count > 0 && stream_window > 0)
+	{
+		fprintf(stderr, "--inject patches pages of the conditioned image, it does not go with --stream\n");
+		return 1;
+	}
+
+	// the same image is flashed build after build, only its changed pages
+	if (watch && (stream_window > 0 || inject.count > 0))
+	{
+		fprintf(stderr, "--watch compares conditioned images, it does not go with --stream or --inject\n");
+		return 1;
+	}
+
+	// the files are written when the session ends, a watch does not end
+	if (watch && (record_path != NULL || trace_path != NULL || measure_gaps))
+	{
+		fprintf(stderr, "--watch runs until interrupted, it does not go with --record, --trace, --gaps or --realtime\n");
+		return 1;
+	}
+
+	// a board named by its node needs no enumeration, hotplug after a
+	// serial trigger does and so does waiting for the application
+	if ((direct = usb_selector_direct(device_sel)) < 0)
+	{
+		fprintf(stderr, "Unknown device selector %s\n", device_sel);
+		return 1;
+	}
+	if (serial_port != NULL || watch || app_check.enabled)
+		direct = 0;
+
+	// the device side of a loopback test, the host is another mikro_hb
+	if (gadget_mode)
+	{
+		if (sim_parse_spec(&sim_cfg, (sim_spec != NULL) ? sim_spec : "mz2048") != 0)
+			return 1;
+		result = gadget_run(&sim_cfg, udc_driver, udc_device, stdout);
+		sim_free_config(&sim_cfg);
+		return (result == 0) ? 0 : 1;
+	}
+
+	// hex files come with each job in daemon mode
+	if (daemon_mode)
+	{
+		// a fixed budget only means something to the scheduler
+		return (run_daemon(socket_path, socket_mode, schedule || hub_kbs > 0.0, hub_kbs) == 0) ? 0 : 1;
+	}
+
+	// profiles of this board, calibrated or learned
+	if (profile_dir != NULL)
+	{
+		snprintf(state_dir, sizeof(state_dir), "%s", profile_dir);
+		if (make_dir_path(state_dir) != 0)
+			state_dir[0] = '\0';
+	}
+	else if (user_dir("XDG_STATE_HOME", ".local/state", state_dir, sizeof(state_dir)) != 0)
+	{
+		state_dir[0] = '\0';
+	}
+
+	// Validate hex file path, calibration writes its own pattern
+	if (path_count == 0 && !calibrate)
 	{
 		fprintf(stderr, "Error: No hex file specified!\n\n");
 		print_usage(argv[0]);
 		return 1;
 	}
 
-	printf("\t*** %s ***\n", _path);
+	for (int i = 0; i < path_count; i++)
+		printf("\t*** %s ***\n", _path[i]);
 	// printf("\tVerbose: %s\n", g_verbose_mode ? "ON (hex debug)" : "OFF (progress bar)");
 	printf("\n");
 
-	result = libusb_init_context(NULL, NULL, 0);
+	if (faults_path != NULL && fault_load(&fault_plan, faults_path) != 0)
+	{
+		return 1;
+	}
+	if (pack_bench_mode)
+	{
+		// raw and packed on the same simulated device
+		TBootSession proto = {0};
 
-	if (result >= 0)
+		if (sim_parse_spec(&sim_cfg, sim_spec) != 0)
+			return 1;
+		proto.paths = _paths;
+		proto.path_count = path_count;
+		result = pack_bench(&sim_cfg, &proto, stdout);
+		sim_free_config(&sim_cfg);
+		return (result == 0) ? 0 : 1;
+	}
+	if (arena_soak_runs > 0)
 	{
+		// one arena through many sessions, nothing allocated per report
+		TBootSession proto = {0};
 
-		devh = libusb_open_device_with_vid_pid(NULL, VENDOR_ID, PRODUCT_ID);
+		if (sim_parse_spec(&sim_cfg, sim_spec) != 0)
+			return 1;
+		proto.paths = _paths;
+		proto.path_count = path_count;
+		proto.packed = packed;
+		proto.verify = verify;
+		result = arena_soak(&sim_cfg, &proto, arena_soak_runs, stdout);
+		sim_free_config(&sim_cfg);
+		return (result == 0) ? 0 : 1;
+	}
+	if (scale_steps > 0)
+	{
+		// simulated devices only, a step needs no usb hardware
+		TBootSession proto = {0};
+
+		if (sim_parse_spec(&sim_cfg, sim_spec) != 0)
+			return 1;
+		proto.paths = _paths;
+		proto.path_count = path_count;
+		proto.stream_window = stream_window;
+		result = scale_run(&sim_cfg, &proto, scale_counts, scale_steps,
+						   (scale_topo.hubs > 0) ? &scale_topo : NULL, hub_kbs, stdout);
+		sim_free_config(&sim_cfg);
+		return (result == 0) ? 0 : 1;
+	}
+	if (soak > 0)
+	{
+		TBootSession proto = {0};
+		TSoakTarget target = {0};
+		TSimTarget sim_target = {0};
+		TUsbTarget usb_target = {0};
+
+		if (faults_path == NULL)
+		{
+			fprintf(stderr, "--soak needs a --faults plan\n");
+			return 1;
+		}
+		proto.paths = _paths;
+		proto.path_count = path_count;
+		proto.stream_window = stream_window;
+
+		if (sim_spec != NULL || replay_path != NULL)
+		{
+			result = (replay_path != NULL) ? replay_load(&sim_cfg, replay_path, &recorded_ms) : sim_parse_spec(&sim_cfg, sim_spec);
+			if (result != 0)
+				return 1;
+			sim_target.cfg = &sim_cfg;
+			target.open = sim_target_open;
+			target.close = sim_target_close;
+			target.verify = sim_target_verify;
+			target.ctx = &sim_target;
+			result = fault_soak(&target, &fault_plan, &proto, soak, stdout);
+			if (sim_target.have_reference)
+				sim_close(&sim_target.reference);
+			sim_free_config(&sim_cfg);
+			return (result == 0) ? 0 : 1;
+		}
+
+		if (libusb_init_context(NULL, NULL, 0) < 0)
+		{
+			fprintf(stderr, "Unable to initialize libusb.\n");
+			return 1;
+		}
+		usb_target.serial_port = serial_port;
+		usb_target.baud = baud;
+		usb_target.trigger = trigger;
+		usb_target.trigger_len = trigger_len;
+		usb_target.enum_timeout = enum_timeout;
+		usb_target.selector = device_sel;
+		target.open = usb_target_open;
+		target.close = usb_target_close;
+		target.ctx = &usb_target;
+		result = fault_soak(&target, &fault_plan, &proto, soak, stdout);
+		libusb_exit(NULL);
+		return (result == 0) ? 0 : 1;
+	}
+
+	if (sim_spec != NULL || replay_path != NULL)
+	{
+		// simulated bootloader, nothing on the bus is touched
+		if (replay_path != NULL)
+			result = replay_load(&sim_cfg, replay_path, &recorded_ms);
+		else
+			result = sim_parse_spec(&sim_cfg, sim_spec);
+
+		if (result != 0 || sim_open(&sim, &sim_cfg) != 0)
+		{
+			return 1;
+		}
+		if (serial_port != NULL && trigger_sim(&sim, serial_port, baud, trigger, trigger_len, enum_timeout) != 0)
+		{
+			return 1;
+		}
+		sim_transport(&device_tp, &sim);
+		transport = &device_tp;
+		device_ready = 1;
+	}
+	else if ((result = libusb_init_context(NULL, &no_discovery, direct)) >= 0)
+	{
+
+		if (serial_port != NULL)
+			devh = trigger_bootloader(serial_port, baud, trigger, trigger_len, enum_timeout, device_sel);
+		else
+			devh = usb_open_bootloader(NULL, device_sel);
 		fprintf(stderr, "devh:=  VID%x:PID%x\n", VENDOR_ID, PRODUCT_ID);
 
 		if (devh != NULL)
 		{
-			// The HID has been detected.
-			// Detach the hidusb driver from the HID to enable using libusb.
-			// Note: This is Linux-specific and not needed on Windows
-#ifndef _WIN32
-			libusb_detach_kernel_driver(devh, INTERFACE_NUMBER);
-#endif
-			{
-				result = libusb_claim_interface(devh, INTERFACE_NUMBER);
-				if (result >= 0)
-				{
-					device_ready = 1;
-				}
-				else
-				{
-					fprintf(stderr, "libusb_claim_interface error %d\n", result);
-				}
-			}
+			usb_transport(&device_tp, devh);
+			transport = &device_tp;
+			device_ready = 1;
 		}
 		else
 		{
@@ -164,14 +1064,217 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Unable to initialize libusb.\n");
 	}
 
+	// next to the device, so the gaps hold the work of every shim above
+	if (device_ready && measure_gaps)
+	{
+		if (rt_open(&rt_tp, &rt, transport, &rt_cfg) != 0)
+		{
+			return 1;
+		}
+		transport = &rt_tp;
+	}
+
+	if (device_ready && faults_path != NULL)
+	{
+		fault_transport(&fault_tp, &fault_shim, transport, &fault_plan);
+		transport = &fault_tp;
+	}
+
+	// above the fault shim, so injected timeouts last as long as learned ones
+	if (device_ready && adaptive)
+	{
+		if (timing_open(&timing_tp, &timing, transport, profile_dir) != 0)
+		{
+			return 1;
+		}
+		transport = &timing_tp;
+	}
+
+	if (device_ready && trace_path != NULL)
+	{
+		trace_open(&trace);
+		track = trace_add_track(&trace, (devh != NULL) ? "usb 2dbc:0001" : sim.cfg.dev_dsc);
+		trace_transport(&trace_tp, &trace_usb, transport, track);
+		transport = &trace_tp;
+	}
+
+	if (device_ready && record_path != NULL)
+	{
+		if (capture_open(&capture_tp, &capture, transport, record_path) != 0)
+		{
+			return 1;
+		}
+		transport = &capture_tp;
+	}
+
+	if (device_ready && calibrate)
+	{
+		TCalProfile profile;
+		char path[512];
+
+		result = calib_run(transport, calib_address, calib_pages, &profile, stdout);
+		if (result == 0 && state_dir[0] == '\0')
+		{
+			fprintf(stderr, "No directory for the calibration profile\n");
+			result = -1;
+		}
+		if (result == 0 && (result = calib_save(&profile, state_dir, path, sizeof(path))) == 0)
+			printf("calibrate: profile saved to %s\n", path);
+		if (record_path != NULL)
+			capture_close(&capture);
+		if (devh != NULL)
+		{
+			usb_close_bootloader(devh);
+			libusb_exit(NULL);
+		}
+		else
+		{
+			sim_close(&sim);
+			sim_free_config(&sim_cfg);
+		}
+		return (result == 0) ? 0 : 1;
+	}
+
 	if (device_ready)
 	{
-		setupChiptoBoot(devh, _path);
+		TBootSession session = {0};
+		session.transport = transport;
+		session.paths = _paths;
+		session.path_count = path_count;
+		session.stream_window = stream_window;
+		session.trace = track;
+		session.calib_dir = (state_dir[0] != '\0') ? state_dir : NULL;
+		session.regions = regions;
+		session.app_only = app_only;
+		session.packed = packed;
+		session.verify = verify;
+		session.pipeline = pipeline;
+		session.full_pages = full_pages;
+		session.range_start = range_start;
+		session.range_end = range_end;
+		session.arena = &arena;
+		if (inject.count > 0)
+			session.inject = &inject;
+		if (use_cache && image_cache_open(&cache, NULL, cache_mb << 20) == 0)
+			session.cache = &cache;
+		if (measure_gaps)
+		{
+			rt.session = &session;
+			if (rt_cfg.policy != RT_OFF)
+			{
+				session.on_progress = rt_progress;
+				session.user = &rt;
+			}
+		}
+
+		// a simulated device starts out erased, only real boards keep a
+		// record of what their boot page and config hold
+		if (devh != NULL && state_dir[0] != '\0')
+		{
+			TUsbTopo topo;
+			if (usb_topology(devh, &topo) == 0)
+			{
+				usb_topo_name(&topo, topo.depth, port_name, sizeof(port_name));
+				session.device_id = port_name;
+			}
+			session.state_dir = state_dir;
+		}
+		if (state_dir[0] != '\0')
+			session.info_dir = state_dir;
+		else if (app_only)
+		{
+			printf("Nothing known about what the device holds, flashing boot page and config\n");
+		}
+
+		if (app_check.enabled && devh != NULL)
+			app_check_arm(&app_check);
+
+		// the number is taken once a board is there, a session failing
+		// after this leaves a gap in the sequence, never a duplicate
+		if (counter_path != NULL && inject_counter_next(counter_path, &inject.counter) != 0)
+			exit(EXIT_FAILURE);
+
+		if (watch)
+		{
+			// returns only when the hex files can no longer be watched
+			TWatchBoard board = {0};
+			TWatchTarget target = {watch_board_open, watch_board_close, NULL, &board};
+
+			board.usb.devh = devh;
+			board.usb.serial_port = serial_port;
+			board.usb.baud = baud;
+			board.usb.trigger = trigger;
+			board.usb.trigger_len = trigger_len;
+			board.usb.enum_timeout = enum_timeout;
+			board.usb.selector = device_sel;
+			board.device_tp = &device_tp;
+			board.transport = transport;
+			board.sim = (devh == NULL) ? &sim : NULL;
+			board.check = &app_check;
+			if (app_check.enabled)
+				target.running = watch_board_running;
+			watch_run(&target, &session, stdout);
+			exit(EXIT_FAILURE);
+		}
+
+		start_ms = time_now_ms();
+		result = setupChiptoBoot(&session);
+		if (measure_gaps)
+		{
+			rt_report(&rt, stdout);
+			rt_close(&rt);
+		}
+		if (trace_path != NULL)
+		{
+			// written for failed sessions too, that is where the gaps matter
+			trace_write(&trace, trace_path);
+			trace_close(&trace);
+		}
+		if (adaptive)
+		{
+			timing_report(&timing, stdout);
+			timing_close(&timing);
+		}
+		if (faults_path != NULL)
+		{
+			fault_report(&fault_shim, stdout);
+			if (result != 0 && fault_shim.injected > 0)
+				printf("faults: session failed %.1f ms after the first fault\n", time_now_ms() - fault_shim.first_ms);
+		}
+		if (result != 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		prefix_report(&session, stdout);
+		release_boot_session(&session);
+		arena_free(&arena);
+		inject_free(&inject);
+
+		if (record_path != NULL)
+			capture_close(&capture);
+
+		if (app_check.enabled)
+		{
+			result = (devh != NULL) ? app_check_wait(&app_check, session.reboot_ms) : app_check_sim(&app_check, &sim);
+			if (result != 0)
+			{
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (sim_spec != NULL || replay_path != NULL)
+		{
+			sim_report(&sim, stdout);
+			if (replay_path != NULL)
+				printf("replay: host %.1f ms, recorded session %.1f ms\n", time_now_ms() - start_ms, recorded_ms);
+			sim_close(&sim);
+			sim_free_config(&sim_cfg);
+			return 0;
+		}
 		
 		// Finished using the device.
-		libusb_release_interface(devh, 0);
+		usb_close_bootloader(devh);
 	}
-	libusb_close(devh);
 	libusb_exit(NULL);
 	return 0;
-}
+}
\ No newline at end of file
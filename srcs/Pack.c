@@ -0,0 +1,239 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Pack.h"
+#include "Sim.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Packed data reports
+ *
+ * Program images are mostly 0xFF fill, padding and constant tables,
+ * raw cmdWRITE data moves all of it 64 bytes a report. A bootloader
+ * reporting uiBootRev >= BOOT_REV_PACKED also takes
+ *
+ *   [0x0f][cmdPACKED][address 4][decoded size 4]
+ *
+ * followed by reports of literal and run tokens, each decoding on its
+ * own into at most PACK_MAX_SPAN bytes so the device needs nothing
+ * beyond its row buffer. The last report is acknowledged like WRITE.
+ * The decoder is a few lines of C on the PIC32, unpack_report() is
+ * the reference the simulated device runs.
+ */
+
+static uint32_t run_length(const uint8_t *src, uint32_t len, uint32_t limit)
+{
+    uint32_t n = 1;
+
+    if (limit > len)
+        limit = len;
+    while (n < limit && src[n] == src[0])
+        n++;
+    return n;
+}
+
+/*
+ * Encode the start of src into one report, returns the token bytes
+ * used, *consumed the source bytes they decode to
+ */
+int pack_report(const uint8_t *src, uint32_t len, uint8_t *report, uint32_t *consumed)
+{
+    uint32_t in = 0;
+    int out = PACK_HEADER;
+
+    memset(report, 0, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+    if (len > PACK_MAX_SPAN)
+        len = PACK_MAX_SPAN;
+
+    while (in < len)
+    {
+        int room = MAX_INTERRUPT_OUT_TRANSFER_SIZE - out;
+        uint32_t run = run_length(src + in, len - in, 0xffff);
+        uint32_t literal = 0;
+
+        if (run >= PACK_MIN_RUN)
+        {
+            if (run > PACK_MAX_SHORT_RUN && room >= 4)
+            {
+                report[out++] = PACK_LONG_RUN;
+                report[out++] = (uint8_t)(run & 0xff);
+                report[out++] = (uint8_t)(run >> 8);
+                report[out++] = src[in];
+            }
+            else if (room >= 2)
+            {
+                if (run > PACK_MAX_SHORT_RUN)
+                    run = PACK_MAX_SHORT_RUN;
+                report[out++] = (uint8_t)(0x80 | (run - PACK_MIN_RUN));
+                report[out++] = src[in];
+            }
+            else
+            {
+                break;
+            }
+            in += run;
+            continue;
+        }
+
+        // literal up to the next run worth a token
+        if (room < 2)
+            break;
+        while (in + literal < len && literal < PACK_MAX_LITERAL && (int)literal < room - 1 &&
+               run_length(src + in + literal, len - in - literal, PACK_MIN_RUN) < PACK_MIN_RUN)
+            literal++;
+        if (literal == 0)
+            literal = 1;
+        report[out++] = (uint8_t)(literal - 1);
+        memcpy(report + out, src + in, literal);
+        out += literal;
+        in += literal;
+    }
+
+    report[0] = (uint8_t)(in & 0xff);
+    report[1] = (uint8_t)(in >> 8);
+    *consumed = in;
+    return out;
+}
+
+/*
+ * Reference decoder, returns the decoded length or -1 when the
+ * report is malformed or decodes past room
+ */
+int unpack_report(const uint8_t *report, uint8_t *out, uint32_t room)
+{
+    uint32_t total = report[0] | (report[1] << 8);
+    uint32_t done = 0;
+    int p = PACK_HEADER;
+
+    if (total > room || total > PACK_MAX_SPAN)
+        return -1;
+    while (done < total)
+    {
+        uint8_t t = 0;
+        uint32_t n = 0;
+
+        if (p >= MAX_INTERRUPT_OUT_TRANSFER_SIZE)
+            return -1;
+        t = report[p++];
+        if (t < 0x80)
+        {
+            n = t + 1u;
+            if (p + (int)n > MAX_INTERRUPT_OUT_TRANSFER_SIZE || done + n > total)
+                return -1;
+            memcpy(out + done, report + p, n);
+            p += n;
+        }
+        else
+        {
+            if (t == PACK_LONG_RUN)
+            {
+                if (p + 2 >= MAX_INTERRUPT_OUT_TRANSFER_SIZE)
+                    return -1;
+                n = report[p] | (report[p + 1] << 8);
+                p += 2;
+            }
+            else
+            {
+                n = (t & 0x7fu) + PACK_MIN_RUN;
+            }
+            if (p >= MAX_INTERRUPT_OUT_TRANSFER_SIZE || done + n > total)
+                return -1;
+            memset(out + done, report[p++], n);
+        }
+        done += n;
+    }
+    return (int)done;
+}
+
+static int bench_session(const TSimConfig *cfg, const TBootSession *proto, int packed, TSim *sim,
+                         TBootSession *session, double *wall_ms)
+{
+    TTransport tp = {0};
+    double start = 0.0;
+    int result = 0;
+
+    if (sim_open(sim, cfg) != 0)
+        return -1;
+    sim_transport(&tp, sim);
+    *session = *proto;
+    session->transport = &tp;
+    session->packed = packed;
+    session->quiet = 1;
+    session->stream_window = 0;
+    start = time_now_ms();
+    result = setupChiptoBoot(session);
+    *wall_ms = time_now_ms() - start;
+    session->transport = NULL;
+    return result;
+}
+
+/*
+ * Flash the images raw and packed on a simulated device that takes
+ * both, report the effective rate of each and the codec speed
+ */
+int pack_bench(const TSimConfig *base, const TBootSession *proto, FILE *out)
+{
+    TSimConfig cfg = *base;
+    TSim raw_sim = {0}, packed_sim = {0};
+    TBootSession raw = {0}, packed = {0};
+    double raw_ms = 0.0, packed_ms = 0.0;
+    double encode_ms = 0.0, decode_ms = 0.0;
+    uint32_t image_bytes = 0, wire_bytes = 0;
+    uint8_t report[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    uint8_t *plain = NULL;
+    int result = -1;
+
+    if (cfg.boot_rev < BOOT_REV_PACKED)
+        cfg.boot_rev = BOOT_REV_PACKED;
+    if (bench_session(&cfg, proto, 0, &raw_sim, &raw, &raw_ms) != 0 ||
+        bench_session(&cfg, proto, 1, &packed_sim, &packed, &packed_ms) != 0)
+    {
+        fprintf(out, "pack: session failed\n");
+        goto done;
+    }
+
+    // the codec alone over the program image, encoded as the engine does
+    image_bytes = packed.image->prg_mem_count;
+    plain = malloc(PACK_MAX_SPAN);
+    if (plain == NULL)
+        goto done;
+    for (uint32_t in = 0; in < image_bytes;)
+    {
+        uint32_t consumed = 0;
+        double t0 = time_now_ms();
+        wire_bytes += MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+        pack_report(packed.image->prg + in, image_bytes - in, report, &consumed);
+        encode_ms += time_now_ms() - t0;
+        t0 = time_now_ms();
+        if (unpack_report(report, plain, PACK_MAX_SPAN) != (int)consumed ||
+            memcmp(plain, packed.image->prg + in, consumed) != 0)
+        {
+            fprintf(out, "pack: decode mismatch at %08x\n", in);
+            goto done;
+        }
+        decode_ms += time_now_ms() - t0;
+        in += consumed;
+    }
+
+    fprintf(out, "pack: %s, %u bytes flashed, %s\n", cfg.dev_dsc, raw.bytes_written,
+            (sim_compare(&raw_sim, &packed_sim) == 0) ? "flash identical" : "FLASH DIFFERS");
+    fprintf(out, "  raw     %6u reports %8.1f ms %8.1f KB/s\n", raw_sim.reports, raw_ms,
+            raw.bytes_written / (raw_ms * 1.024));
+    fprintf(out, "  packed  %6u reports %8.1f ms %8.1f KB/s, %.2fx\n", packed_sim.reports, packed_ms,
+            packed.bytes_written / (packed_ms * 1.024), raw_ms / packed_ms);
+    fprintf(out, "  program image %u bytes in %u bytes of reports (%.1f%%), encode %.0f MB/s, decode %.0f MB/s\n",
+            image_bytes, wire_bytes, 100.0 * wire_bytes / ((image_bytes > 0) ? image_bytes : 1),
+            image_bytes / (encode_ms * 1000.0 + 1e-9), image_bytes / (decode_ms * 1000.0 + 1e-9));
+    result = (sim_compare(&raw_sim, &packed_sim) == 0 && raw_sim.write_errors == 0 && packed_sim.write_errors == 0) ? 0 : -1;
+
+done:
+    free(plain);
+    release_boot_session(&raw);
+    release_boot_session(&packed);
+    sim_close(&raw_sim);
+    sim_close(&packed_sim);
+    return result;
+}
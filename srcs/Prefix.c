@@ -0,0 +1,330 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "Prefix.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Session prefix
+ *
+ * Everything ahead of the first data report is fixed cost: the INFO,
+ * BOOT, SYNC and ERASE round trips and conditioning the image, which
+ * waits for INFO because the image is laid out for its geometry. For
+ * a small image that is most of the session. The INFO record of each
+ * device (by port, "any" without one) is kept in
+ *
+ *   <dir>/<port>.info.json
+ *
+ * and the next session on it conditions the image for that record on
+ * a thread as soon as it starts, while the handshake is on the bus.
+ * The live INFO is compared with the kept one before anything is
+ * planned from it, a different record (another board on the port, a
+ * new bootloader) throws the image away, conditions again and keeps
+ * the new record.
+ *
+ * With --pipeline INFO, BOOT and SYNC go out back to back and their
+ * answers are read after, the bootloader has to hold an answer while
+ * it takes the next report (the simulated one holds SIM_ANSWERS).
+ */
+
+typedef struct
+{
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+    TBootSession *session;
+    TBootInfo bootinfo;
+    char info[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+    uint64_t cache_key;
+    double start_ms;
+    double end_ms;
+    int joined;
+} TPlanner;
+
+static void prefix_path(const TBootSession *session, char *path, size_t len)
+{
+    char port[64];
+    const char *id = (session->device_id != NULL) ? session->device_id : "any";
+    size_t i = 0;
+
+    for (i = 0; i + 1 < sizeof(port) && id[i] != '\0'; i++)
+        port[i] = (isalnum((unsigned char)id[i]) || id[i] == '-' || id[i] == '.') ? id[i] : '_';
+    port[i] = '\0';
+    snprintf(path, len, "%s/%s.info.json", session->info_dir, port);
+}
+
+// the kept INFO record of this device into info, 0 or -1
+static int prefix_load(const TBootSession *session, char *info)
+{
+    char path[512];
+    char json[512];
+    char hex[2 * MAX_INTERRUPT_IN_TRANSFER_SIZE + 1];
+    size_t n = 0;
+    FILE *fp = NULL;
+
+    prefix_path(session, path, sizeof(path));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    n = fread(json, 1, sizeof(json) - 1, fp);
+    json[n] = '\0';
+    fclose(fp);
+
+    if (json_get_string(json, "info", hex, sizeof(hex)) != 0 || strlen(hex) != sizeof(hex) - 1)
+        return -1;
+    for (int i = 0; i < MAX_INTERRUPT_IN_TRANSFER_SIZE; i++)
+    {
+        unsigned int byte = 0;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        info[i] = (char)byte;
+    }
+    return 0;
+}
+
+static void prefix_save(const TBootSession *session, const char *info)
+{
+    char path[512];
+    FILE *fp = NULL;
+
+    prefix_path(session, path, sizeof(path));
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return;
+    fprintf(fp, "{\"info\":\"");
+    for (int i = 0; i < MAX_INTERRUPT_IN_TRANSFER_SIZE; i++)
+        fprintf(fp, "%02x", info[i] & 0xff);
+    fprintf(fp, "\"}\n");
+    fclose(fp);
+}
+
+#ifdef _WIN32
+
+static int planner_start(TPlanner *planner)
+{
+    (void)planner;
+    return -1;
+}
+
+static void planner_join(TPlanner *planner)
+{
+    planner->joined = 1;
+}
+
+#else
+
+static void *planner_run(void *arg)
+{
+    TPlanner *planner = arg;
+
+    planner->start_ms = time_now_ms();
+    condition_session_image(planner->session, &planner->bootinfo, &planner->cache_key);
+    planner->end_ms = time_now_ms();
+    return NULL;
+}
+
+static int planner_start(TPlanner *planner)
+{
+    return (pthread_create(&planner->thread, NULL, planner_run, planner) == 0) ? 0 : -1;
+}
+
+static void planner_join(TPlanner *planner)
+{
+    if (!planner->joined)
+        pthread_join(planner->thread, NULL);
+    planner->joined = 1;
+}
+
+#endif
+
+/*
+ * A session starts, its image is conditioned from the kept INFO record
+ * of the device when there is one and nothing else provides the image
+ */
+void prefix_start(TBootSession *session)
+{
+    TPlanner *planner = NULL;
+
+    memset(&session->prefix, 0, sizeof(TPrefix));
+    session->prefix.start_ms = time_now_ms();
+    session->planner = NULL;
+    if (session->info_dir == NULL || session->image_source != NULL || session->stream_window > 0)
+        return;
+
+    planner = calloc(1, sizeof(TPlanner));
+    if (planner == NULL)
+        return;
+    if (prefix_load(session, planner->info) != 0)
+    {
+        free(planner);
+        return;
+    }
+    bootInfo_buffer(&planner->bootinfo, planner->info);
+    planner->session = session;
+    if (planner->bootinfo.uiEraseBlock.fValue.intVal == 0 || planner->bootinfo.ulMcuSize.fValue == 0 ||
+        planner_start(planner) != 0)
+    {
+        free(planner);
+        return;
+    }
+    session->planner = planner;
+}
+
+/*
+ * The bootloader's INFO record is in, a plan made from a different one
+ * is dropped and the record kept for the next session
+ */
+void prefix_info(TBootSession *session, const char *info)
+{
+    TPlanner *planner = session->planner;
+    char kept[MAX_INTERRUPT_IN_TRANSFER_SIZE];
+
+    if (session->info_dir == NULL)
+        return;
+    if (planner != NULL)
+    {
+        if (memcmp(planner->info, info, MAX_INTERRUPT_IN_TRANSFER_SIZE) == 0)
+            return;
+        planner_join(planner);
+        free_hex_image(&session->own_image);
+        if (session->arena != NULL)
+            arena_reset(session->arena);
+        session->cache_hit = 0;
+        free(planner);
+        session->planner = NULL;
+        session->prefix.stale = 1;
+        if (!session->quiet)
+            printf("INFO differs from the one kept for this device, conditioning again\n");
+    }
+    else if (prefix_load(session, kept) == 0 && memcmp(kept, info, MAX_INTERRUPT_IN_TRANSFER_SIZE) == 0)
+    {
+        return;
+    }
+    prefix_save(session, info);
+}
+
+/*
+ * Wait for the image conditioned ahead of INFO, 0 when own_image holds
+ * it, -1 when there was no plan
+ */
+int prefix_join(TBootSession *session, uint64_t *cache_key)
+{
+    TPlanner *planner = session->planner;
+
+    if (planner == NULL)
+        return -1;
+    planner_join(planner);
+    *cache_key = planner->cache_key;
+    session->prefix.planned = 1;
+    trace_span(session->trace, TRACE_LANE_HOST, "host", "planned image", planner->start_ms, planner->end_ms, NULL);
+    free(planner);
+    session->planner = NULL;
+    return 0;
+}
+
+/*
+ * A session ending before its plan was used, the thread may still be
+ * conditioning into own_image
+ */
+void prefix_release(TBootSession *session)
+{
+    TPlanner *planner = session->planner;
+
+    if (planner == NULL)
+        return;
+    planner_join(planner);
+    free(planner);
+    session->planner = NULL;
+}
+
+static void prefix_step(FILE *out, const char *name, double ms, double start_ms, int *first)
+{
+    if (ms == 0.0)
+        return;
+    fprintf(out, "%s%s %.1f", *first ? "" : ", ", name, ms - start_ms);
+    *first = 0;
+}
+
+void prefix_report(const TBootSession *session, FILE *out)
+{
+    const TPrefix *prefix = &session->prefix;
+    double ready = prefix->info_ms;
+    int first = 1;
+
+    if (prefix->data_ms == 0.0)
+        return;
+    // the first ERASE goes out once the last of these is through
+    if (prefix->boot_ms > ready)
+        ready = prefix->boot_ms;
+    if (prefix->image_ms > ready)
+        ready = prefix->image_ms;
+    if (prefix->sync_ms > ready)
+        ready = prefix->sync_ms;
+
+    fprintf(out, "prefix: first erase %.1f ms after start (", ready - prefix->start_ms);
+    prefix_step(out, "INFO", prefix->info_ms, prefix->start_ms, &first);
+    prefix_step(out, "BOOT", prefix->boot_ms, prefix->start_ms, &first);
+    prefix_step(out, "image", prefix->image_ms, prefix->start_ms, &first);
+    prefix_step(out, "SYNC", prefix->sync_ms, prefix->start_ms, &first);
+    fprintf(out, "), erased %.1f, first data %.1f ms%s%s%s\n", prefix->erase_ms - prefix->start_ms,
+            prefix->data_ms - prefix->start_ms, prefix->planned ? ", planned from the kept INFO" : "",
+            prefix->stale ? ", kept INFO was stale" : "", prefix->piped ? ", pipelined" : "");
+}
+
+/*
+ * A transfer of cmd went through, the first of each is the prefix
+ */
+void prefix_mark(TBootSession *session, int cmd)
+{
+    TPrefix *prefix = &session->prefix;
+    double *step = NULL;
+
+    switch (cmd)
+    {
+    case cmdINFO:
+        step = &prefix->info_ms;
+        break;
+    case cmdBOOT:
+        step = &prefix->boot_ms;
+        break;
+    case cmdNON:
+        step = &prefix->image_ms;
+        break;
+    case cmdSYNC:
+        step = &prefix->sync_ms;
+        break;
+    case cmdERASE:
+        step = &prefix->erase_ms;
+        break;
+    case cmdHEX:
+        step = &prefix->data_ms;
+        break;
+    default:
+        return;
+    }
+    if (*step == 0.0)
+        *step = time_now_ms();
+}
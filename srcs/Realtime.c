@@ -0,0 +1,375 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+// pthread_setaffinity_np and cpu_set_t
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#include "Realtime.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Real-time streaming
+ *
+ * Between two data reports the host does nothing but copy 64 bytes,
+ * yet on a loaded machine the flashing thread gets preempted, faults
+ * in a page of the image or waits on a terminal redrawing the bar,
+ * and the device sits idle for a scheduler tick. With --realtime the
+ * thread running the session moves to SCHED_FIFO or SCHED_RR (and to
+ * one cpu) on its first transfer after the image is conditioned, so
+ * parsing happened at normal priority. The image and the session's
+ * report buffers are locked, progress goes to a normal priority
+ * thread drawing the bar every RT_RENDER_MS and the session is quiet
+ * until the final REBOOT puts everything back.
+ *
+ * The gap in front of each data report following another one is the
+ * host's share of the stream, its percentiles are reported with and
+ * without --realtime so the two can be compared on the same machine.
+ */
+
+static const char *rt_policy_name(int policy)
+{
+    return (policy == RT_RR) ? "SCHED_RR" : "SCHED_FIFO";
+}
+
+/*
+ * "fifo", "rr", "fifo:80" or a bare priority into cfg, 0 or -1
+ */
+int rt_parse(const char *spec, TRtConfig *cfg)
+{
+    char *end = NULL;
+    long priority = RT_DEFAULT_PRIORITY;
+
+    cfg->policy = RT_FIFO;
+    if (strncmp(spec, "rr", 2) == 0)
+    {
+        cfg->policy = RT_RR;
+        spec += 2;
+    }
+    else if (strncmp(spec, "fifo", 4) == 0)
+    {
+        spec += 4;
+    }
+    if (*spec == ':')
+        spec++;
+    if (*spec != '\0')
+    {
+        priority = strtol(spec, &end, 10);
+        if (end == spec || *end != '\0' || priority < 1 || priority > 99)
+        {
+            fprintf(stderr, "--realtime takes fifo or rr and a priority of 1..99, e.g. fifo:50\n");
+            return -1;
+        }
+    }
+    cfg->priority = (int)priority;
+    return 0;
+}
+
+#ifdef _WIN32
+
+static void rt_enter(TRtShim *rt)
+{
+    rt->active = 1;
+    if (rt->cfg.policy != RT_OFF)
+        snprintf(rt->refused, sizeof(rt->refused), "real-time policies need pthreads, not available on Windows");
+}
+
+static void rt_leave(TRtShim *rt)
+{
+    if (rt->active && rt->total > 0)
+        print_progress_bar("Programming", rt->done, rt->total);
+    rt->active = 0;
+}
+
+#else
+
+static void rt_lock(TRtShim *rt, const void *addr, size_t len)
+{
+    if (addr == NULL || len == 0)
+        return;
+    if (mlock(addr, len) != 0)
+    {
+        if (rt->refused[0] == '\0')
+            snprintf(rt->refused, sizeof(rt->refused), "mlock: %s", strerror(errno));
+        return;
+    }
+    rt->locked += len;
+}
+
+static void rt_unlock(TRtShim *rt)
+{
+    TBootSession *session = rt->session;
+    THexImage *image = session->image;
+
+    if (rt->locked == 0)
+        return;
+    munlock(session, sizeof(TBootSession));
+    munlock(rt->gaps, RT_MAX_GAPS * sizeof(double));
+    if (image != NULL)
+    {
+        munlock(image->prg, image->mcu_size);
+        munlock(image->boot, image->boot_size);
+        munlock(image->conf, CONF_IMAGE_SIZE);
+    }
+    rt->locked = 0;
+}
+
+static void *rt_render(void *arg)
+{
+    TRtShim *rt = arg;
+    uint32_t drawn = 0;
+
+    for (;;)
+    {
+        int stop = __atomic_load_n(&rt->stop, __ATOMIC_ACQUIRE);
+        uint32_t done = __atomic_load_n(&rt->done, __ATOMIC_RELAXED);
+        uint32_t total = __atomic_load_n(&rt->total, __ATOMIC_RELAXED);
+
+        if (total > 0 && done != drawn)
+        {
+            print_progress_bar("Programming", done, total);
+            drawn = done;
+        }
+        if (stop)
+            break;
+        sleep_ms(RT_RENDER_MS);
+    }
+    return NULL;
+}
+
+static void rt_enter(TRtShim *rt)
+{
+    TBootSession *session = rt->session;
+    THexImage *image = session->image;
+    pthread_t self = pthread_self();
+    struct sched_param param = {0};
+
+    rt->active = 1;
+    rt->saved_quiet = session->quiet;
+    if (rt->cfg.policy == RT_OFF)
+        return;
+
+    // started first, so it keeps the normal policy and every cpu
+    if (rt->render == NULL)
+    {
+        pthread_t *thread = malloc(sizeof(pthread_t));
+        if (thread != NULL && pthread_create(thread, NULL, rt_render, rt) == 0)
+            rt->render = thread;
+        else
+            free(thread);
+    }
+    session->quiet = 1;
+
+    // what the stream touches, faulted in now rather than mid stream
+    rt_lock(rt, session, sizeof(TBootSession));
+    rt_lock(rt, rt->gaps, RT_MAX_GAPS * sizeof(double));
+    if (image != NULL)
+    {
+        rt_lock(rt, image->prg, image->mcu_size);
+        rt_lock(rt, image->boot, image->boot_size);
+        rt_lock(rt, image->conf, CONF_IMAGE_SIZE);
+    }
+
+    if (rt->cfg.cpu >= 0)
+    {
+        cpu_set_t *saved = malloc(sizeof(cpu_set_t));
+        cpu_set_t pin;
+
+        CPU_ZERO(&pin);
+        CPU_SET(rt->cfg.cpu, &pin);
+        if (saved != NULL && pthread_getaffinity_np(self, sizeof(cpu_set_t), saved) == 0 &&
+            pthread_setaffinity_np(self, sizeof(cpu_set_t), &pin) == 0)
+        {
+            rt->saved_cpus = saved;
+        }
+        else
+        {
+            free(saved);
+            if (rt->refused[0] == '\0')
+                snprintf(rt->refused, sizeof(rt->refused), "cpu %d refused", rt->cfg.cpu);
+        }
+    }
+
+    pthread_getschedparam(self, &rt->saved_policy, &param);
+    rt->saved_priority = param.sched_priority;
+    param.sched_priority = rt->cfg.priority;
+    int err = pthread_setschedparam(self, (rt->cfg.policy == RT_RR) ? SCHED_RR : SCHED_FIFO, &param);
+    if (err != 0)
+        snprintf(rt->refused, sizeof(rt->refused), "%s: %s", rt_policy_name(rt->cfg.policy), strerror(err));
+}
+
+static void rt_leave(TRtShim *rt)
+{
+    pthread_t self = pthread_self();
+    struct sched_param param = {0};
+
+    if (!rt->active)
+        return;
+    rt->active = 0;
+
+    if (rt->cfg.policy == RT_OFF)
+        return;
+
+    param.sched_priority = rt->saved_priority;
+    pthread_setschedparam(self, rt->saved_policy, &param);
+    if (rt->saved_cpus != NULL)
+    {
+        pthread_setaffinity_np(self, sizeof(cpu_set_t), rt->saved_cpus);
+        free(rt->saved_cpus);
+        rt->saved_cpus = NULL;
+    }
+    rt_unlock(rt);
+
+    if (rt->render != NULL)
+    {
+        __atomic_store_n(&rt->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(*(pthread_t *)rt->render, NULL);
+        free(rt->render);
+        rt->render = NULL;
+    }
+    rt->session->quiet = rt->saved_quiet;
+}
+
+#endif
+
+/*
+ * Progress report of a session flashing through the shim, session->user
+ * is the shim. Two stores, the drawing is done elsewhere.
+ */
+void rt_progress(TBootSession *session, uint32_t done, uint32_t total)
+{
+    TRtShim *rt = session->user;
+
+    __atomic_store_n(&rt->total, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&rt->done, done, __ATOMIC_RELAXED);
+}
+
+static int rt_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TRtShim *rt = tp->ctx;
+    int kind = frame_classify(&rt->frame, (uint8_t *)data);
+    double start = 0.0;
+    int result = 0;
+
+    // the first transfer with an image to stream
+    if (!rt->active && !rt->finished && rt->session != NULL && rt->session->image != NULL)
+        rt_enter(rt);
+
+    start = time_now_ms();
+    if (kind == cmdHEX && rt->last_data)
+    {
+        if (rt->gap_count < RT_MAX_GAPS)
+            rt->gaps[rt->gap_count++] = start - rt->last_end_ms;
+        else
+            rt->gaps_dropped++;
+    }
+
+    result = rt->inner->write(rt->inner, data, length, transferred, timeout);
+    rt->last_end_ms = time_now_ms();
+    rt->last_data = (kind == cmdHEX && result >= 0);
+
+    if (kind == cmdREBOOT && rt->active)
+    {
+        rt->finished = 1;
+        rt_leave(rt);
+    }
+    return result;
+}
+
+static int rt_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TRtShim *rt = tp->ctx;
+    int result = rt->inner->read(rt->inner, data, length, transferred, timeout);
+
+    rt->last_end_ms = time_now_ms();
+    rt->last_data = 0;
+    return result;
+}
+
+/*
+ * Stand in front of inner, rt->session is set to the session flashing
+ * through it before that starts and has its on_progress and user
+ * pointed here when real-time
+ */
+int rt_open(TTransport *tp, TRtShim *rt, TTransport *inner, const TRtConfig *cfg)
+{
+    memset(rt, 0, sizeof(TRtShim));
+    rt->inner = inner;
+    rt->cfg = *cfg;
+    rt->gaps = malloc(RT_MAX_GAPS * sizeof(double));
+    if (rt->gaps == NULL)
+    {
+        fprintf(stderr, "realtime: no memory for the gap record\n");
+        return -1;
+    }
+    tp->ctx = rt;
+    tp->write = rt_write;
+    tp->read = rt_read;
+    return 0;
+}
+
+void rt_report(TRtShim *rt, FILE *out)
+{
+    double p50 = 0.0, p99 = 0.0, p999 = 0.0, max = 0.0;
+    uint32_t stalls = 0;
+
+    rt_leave(rt);
+    if (rt->cfg.policy != RT_OFF)
+    {
+        if (rt->refused[0] != '\0')
+            fprintf(out, "realtime: %s priority %d not fully granted, %s\n", rt_policy_name(rt->cfg.policy),
+                    rt->cfg.priority, rt->refused);
+        else if (rt->cfg.cpu >= 0)
+            fprintf(out, "realtime: %s priority %d on cpu %d\n", rt_policy_name(rt->cfg.policy), rt->cfg.priority,
+                    rt->cfg.cpu);
+        else
+            fprintf(out, "realtime: %s priority %d\n", rt_policy_name(rt->cfg.policy), rt->cfg.priority);
+    }
+    if (rt->gap_count == 0)
+    {
+        fprintf(out, "gaps: no back to back data reports\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < rt->gap_count; i++)
+    {
+        if (rt->gaps[i] > RT_STALL_MS)
+            stalls++;
+        if (rt->gaps[i] > max)
+            max = rt->gaps[i];
+    }
+    p50 = percentile(rt->gaps, rt->gap_count, 50);
+    p99 = percentile(rt->gaps, rt->gap_count, 99);
+    p999 = percentile(rt->gaps, rt->gap_count, 99.9);
+    fprintf(out, "gaps: %u between data reports, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms, %u over %.1f ms\n",
+            rt->gap_count, p50, p99, p999, max, stalls, RT_STALL_MS);
+    if (rt->gaps_dropped > 0)
+        fprintf(out, "gaps: %u more not recorded\n", rt->gaps_dropped);
+}
+
+void rt_close(TRtShim *rt)
+{
+    rt_leave(rt);
+    free(rt->gaps);
+    rt->gaps = NULL;
+}
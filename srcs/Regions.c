@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "Regions.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Region selection
+ *
+ * A session walks program flash, the boot vector page and config
+ * flash. --regions names the ones to flash, --range narrows program
+ * flash to the erase pages covering a span, --watch to the runs of
+ * pages that changed since the last build. The bootloader has no
+ * read back, so for --app-only what the boot page and config hold is
+ * what this tool last flashed there, kept per model and port in
+ *
+ *   <dir>/<sDevDsc>-<port>.regions.json
+ *
+ * The record is removed before either region is erased and written
+ * again once the final REBOOT went out, an interrupted session leaves
+ * nothing that could be trusted. A board swapped on the same port is
+ * not noticed, flash everything once after swapping.
+ */
+
+static const struct
+{
+    const char *name;
+    int mask;
+} region_names[] = {
+    {"program", REGION_PROGRAM},
+    {"bootpage", REGION_BOOTPAGE},
+    {"boot", REGION_BOOTPAGE},
+    {"config", REGION_CONFIG},
+    {"conf", REGION_CONFIG},
+    {"all", REGION_ALL},
+};
+
+// "program,config"
+int region_parse_list(const char *text, int *mask)
+{
+    const char *p = text;
+
+    *mask = 0;
+    while (*p != '\0')
+    {
+        size_t len = strcspn(p, ",");
+        size_t i = 0;
+
+        for (i = 0; i < sizeof(region_names) / sizeof(region_names[0]); i++)
+        {
+            if (strlen(region_names[i].name) == len && strncmp(p, region_names[i].name, len) == 0)
+                break;
+        }
+        if (i == sizeof(region_names) / sizeof(region_names[0]))
+        {
+            fprintf(stderr, "--regions takes a list of program, bootpage and config, not %.*s\n", (int)len, p);
+            return -1;
+        }
+        *mask |= region_names[i].mask;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    if (*mask == 0)
+    {
+        fprintf(stderr, "--regions needs at least one region\n");
+        return -1;
+    }
+    return 0;
+}
+
+// "0x9d004000:0x9d00a000", virtual or physical addresses, end exclusive
+int region_parse_range(const char *text, uint32_t *start, uint32_t *end)
+{
+    char *stop = NULL;
+    const char *second = NULL;
+
+    *start = (uint32_t)strtoul(text, &stop, 0) & V2P;
+    if (stop == text || *stop != ':')
+        goto bad;
+    second = stop + 1;
+    *end = (uint32_t)strtoul(second, &stop, 0) & V2P;
+    if (stop == second || *stop != '\0' || *end <= *start)
+        goto bad;
+    return 0;
+
+bad:
+    fprintf(stderr, "--range takes start:end addresses in program flash, e.g. 0x9d004000:0x9d00a000\n");
+    return -1;
+}
+
+static void region_path(TBootSession *session, char *path, size_t len)
+{
+    char name[MAX_STRING_FIELD_LENGTH + 1];
+    char port[64];
+    const char *id = (session->device_id != NULL) ? session->device_id : "any";
+    size_t i = 0;
+
+    for (i = 0; i <= MAX_STRING_FIELD_LENGTH; i++)
+    {
+        char c = (i < MAX_STRING_FIELD_LENGTH) ? session->bootinfo.sDevDsc.fValue[i] : '\0';
+        name[i] = (c == '\0') ? '\0' : (isalnum((unsigned char)c) ? c : '_');
+        if (c == '\0')
+            break;
+    }
+    for (i = 0; i + 1 < sizeof(port) && id[i] != '\0'; i++)
+        port[i] = (isalnum((unsigned char)id[i]) || id[i] == '-' || id[i] == '.') ? id[i] : '_';
+    port[i] = '\0';
+    snprintf(path, len, "%s/%s-%s.regions.json", session->state_dir, name, port);
+}
+
+static void region_record_load(TBootSession *session, TRegionRecord *record)
+{
+    char path[512];
+    char json[512];
+    char hash[32];
+    size_t n = 0;
+    FILE *fp = NULL;
+
+    memset(record, 0, sizeof(TRegionRecord));
+    region_path(session, path, sizeof(path));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return;
+    n = fread(json, 1, sizeof(json) - 1, fp);
+    json[n] = '\0';
+    fclose(fp);
+
+    if (json_get_string(json, "boot", hash, sizeof(hash)) == 0)
+        record->boot = strtoull(hash, NULL, 16);
+    if (json_get_string(json, "config", hash, sizeof(hash)) == 0)
+        record->conf = strtoull(hash, NULL, 16);
+}
+
+/*
+ * Work out what this session flashes once the image is conditioned,
+ * -1 when the range is not in program flash
+ */
+int region_plan(TBootSession *session)
+{
+    TBootInfo *bootinfo = &session->bootinfo;
+    THexImage *image = session->image;
+    uint32_t erase = bootinfo->uiEraseBlock.fValue.intVal;
+    uint64_t boot = fnv1a_64(image->boot, image->boot_size, FNV1A_64_INIT);
+    uint64_t conf = fnv1a_64(image->conf, bootinfo->uiWriteBlock.fValue.intVal * 3, FNV1A_64_INIT);
+    TRegionRecord record = {0};
+    int mask = session->regions;
+    int unchanged = 0;
+
+    if (mask == 0)
+        mask = (session->range_end > 0 || session->run_count > 0) ? REGION_PROGRAM : REGION_ALL;
+
+    session->prg_offset = 0;
+    session->range_pages = 0;
+    session->run_next = 0;
+    if (session->run_count > 0 && (mask & REGION_PROGRAM))
+    {
+        // the first run here, the engine moves on to the others
+        const TPageRun *last = &session->runs[session->run_count - 1];
+
+        if (erase == 0 || last->offset + last->pages * erase > bootinfo->ulMcuSize.fValue - 0x10000)
+        {
+            error_report("Program pages %08x+%u are outside program flash\n", _PIC32Mn_STARTFLASH + last->offset, last->pages);
+            return -1;
+        }
+        session->prg_offset = session->runs[0].offset;
+        session->range_pages = session->runs[0].pages;
+    }
+    else if (session->range_end > 0 && (mask & REGION_PROGRAM))
+    {
+        // the boot vector page and what is above it are not program flash
+        uint32_t limit = _PIC32Mn_STARTFLASH + (bootinfo->ulMcuSize.fValue - 0x10000);
+        uint32_t first = 0, last = 0;
+
+        if (erase == 0 || session->range_start < _PIC32Mn_STARTFLASH || session->range_end > limit)
+        {
+            error_report("--range %08x:%08x is outside program flash %08x:%08x\n",
+                    session->range_start, session->range_end, _PIC32Mn_STARTFLASH, limit);
+            return -1;
+        }
+        first = ((session->range_start - _PIC32Mn_STARTFLASH) / erase) * erase;
+        last = ((session->range_end - _PIC32Mn_STARTFLASH + erase - 1) / erase) * erase;
+        session->prg_offset = first;
+        session->range_pages = (last - first) / erase;
+    }
+
+    if (session->state_dir != NULL)
+        region_record_load(session, &record);
+    if (session->app_only)
+    {
+        if ((mask & REGION_BOOTPAGE) && record.boot == boot)
+            unchanged |= REGION_BOOTPAGE;
+        if ((mask & REGION_CONFIG) && record.conf == conf)
+            unchanged |= REGION_CONFIG;
+        mask &= ~unchanged;
+    }
+
+    // what the device holds once this session is through
+    session->flashed = record;
+    if (mask & REGION_BOOTPAGE)
+        session->flashed.boot = boot;
+    if (mask & REGION_CONFIG)
+        session->flashed.conf = conf;
+    if (session->state_dir != NULL && (mask & (REGION_BOOTPAGE | REGION_CONFIG)))
+    {
+        char path[512];
+        region_path(session, path, sizeof(path));
+        remove(path);
+    }
+
+    session->flash_mask = mask;
+    if (!session->quiet && (mask != REGION_ALL || session->range_pages > 0))
+    {
+        printf("Flashing");
+        if (mask & REGION_PROGRAM)
+        {
+            if (session->run_count > 0)
+            {
+                uint32_t pages = 0;
+                for (int i = 0; i < session->run_count; i++)
+                    pages += session->runs[i].pages;
+                printf(" program %u page%s in %d run%s", pages, (pages == 1) ? "" : "s", session->run_count,
+                       (session->run_count == 1) ? "" : "s");
+            }
+            else if (session->range_pages > 0)
+                printf(" program %08x+%u pages", _PIC32Mn_STARTFLASH + session->prg_offset, session->range_pages);
+            else
+                printf(" program");
+        }
+        if (mask & REGION_BOOTPAGE)
+            printf(" bootpage");
+        if (mask & REGION_CONFIG)
+            printf(" config");
+        if (mask == 0)
+            printf(" nothing");
+        if (unchanged & REGION_BOOTPAGE)
+            printf(", bootpage unchanged");
+        if (unchanged & REGION_CONFIG)
+            printf(", config unchanged");
+        printf("\n");
+    }
+    return 0;
+}
+
+/*
+ * Remember what the boot page and config hold after a session that
+ * went through
+ */
+int region_record_save(TBootSession *session)
+{
+    char path[512];
+    FILE *fp = NULL;
+
+    if (session->state_dir == NULL || (session->flashed.boot == 0 && session->flashed.conf == 0))
+        return 0;
+    region_path(session, path, sizeof(path));
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not save region record %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "{\"boot\":\"%016llx\",\"config\":\"%016llx\"}\n",
+            (unsigned long long)session->flashed.boot, (unsigned long long)session->flashed.conf);
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,422 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Scale.h"
+#include "Utils.h"
+
+/*
+ * "4,8,16,32" into counts, number of steps or -1
+ */
+int scale_parse_counts(const char *list, int *counts, int max)
+{
+    int steps = 0;
+    char *end = NULL;
+
+    while (*list != '\0')
+    {
+        long n = strtol(list, &end, 10);
+        if (end == list || n < 1 || n > SCALE_MAX_SESSIONS || steps == max)
+        {
+            fprintf(stderr, "--scale takes up to %d session counts of 1..%d, e.g. 1,8,32\n", max, SCALE_MAX_SESSIONS);
+            return -1;
+        }
+        counts[steps++] = (int)n;
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return steps;
+}
+
+/*
+ * "<hubs>:<streams per hub>"
+ */
+int scale_parse_topology(const char *text, TScaleTopo *topo)
+{
+    if (sscanf(text, "%d:%d", &topo->hubs, &topo->streams) != 2 || topo->hubs < 1 || topo->hubs > SCALE_MAX_SESSIONS ||
+        topo->streams < 1)
+    {
+        fprintf(stderr, "--topology takes <hubs>:<streams per hub>, e.g. 4:6\n");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+
+int scale_run(const TSimConfig *base, TBootSession *proto, const int *counts, int steps, const TScaleTopo *topo,
+              double hub_kbs, FILE *out)
+{
+    fprintf(stderr, "Scale runs need pthreads, not available on Windows\n");
+    return -1;
+}
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * Scale-out harness
+ *
+ * Every step starts N simulated devices at once, each flashed by its
+ * own session on its own thread, the way a gang fixture would be. The
+ * sim sleeps its modelled latencies so sessions overlap in wall time
+ * like real devices do, the time a session takes beyond its device's
+ * latencies is host overhead. Sessions parse the hex themselves and
+ * report progress through one shared lock, as a fixture front end
+ * collecting progress would. A host that keeps up shows flat session
+ * times and overhead as N grows, cpu per session and lock wait show
+ * where it stops keeping up. Odd devices get the other flash size,
+ * all latencies are spread around the base model from a fixed seed so
+ * steps are comparable between runs.
+ *
+ * With a topology every device hangs off a synthetic hub that slows
+ * frames down once it carries more data streams than it has room
+ * for, losing SCALE_THRASH per extra stream on top. Each step then
+ * runs free and again through the topology scheduler, which keeps
+ * what it learned about the hubs from step to step.
+ */
+
+#define SCALE_SEED 0x5ca1ab1eULL
+
+// progress every session reports into
+static pthread_mutex_t board_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    uint64_t bytes;
+    uint32_t finished;
+    char line[96];
+} board;
+
+static pthread_barrier_t start_gate;
+
+// data streams each synthetic hub carries right now and when it is
+// free for the next frame
+static pthread_mutex_t hub_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hub_active[SCALE_MAX_SESSIONS];
+static double hub_free_ms[SCALE_MAX_SESSIONS];
+
+static void hub_stream(TScaleSession *s, int on)
+{
+    if (s->streaming == on)
+        return;
+    pthread_mutex_lock(&hub_lock);
+    hub_active[s->hub] += on ? 1 : -1;
+    pthread_mutex_unlock(&hub_lock);
+    s->streaming = on;
+}
+
+/*
+ * A hub moves one frame per frame_ms / streams, frames queue up behind
+ * it once more streams want more than that, and every stream beyond
+ * what it has room for costs SCALE_THRASH of each slot on top
+ */
+static int hub_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TScaleSession *s = tp->ctx;
+    int kind = frame_classify(&s->frame, (uint8_t *)data);
+
+    if (kind == cmdHEX)
+    {
+        double now = time_now_ms();
+        double slot = s->cfg.frame_ms / s->hub_streams;
+        double start = 0.0;
+
+        hub_stream(s, 1);
+        pthread_mutex_lock(&hub_lock);
+        if (hub_active[s->hub] > s->hub_streams)
+            slot *= 1.0 + SCALE_THRASH * (hub_active[s->hub] - s->hub_streams);
+        start = (hub_free_ms[s->hub] > now) ? hub_free_ms[s->hub] : now;
+        hub_free_ms[s->hub] = start + slot;
+        pthread_mutex_unlock(&hub_lock);
+        sleep_ms(start - now);
+    }
+    else if (kind != cmdNON)
+    {
+        hub_stream(s, 0);
+    }
+    return s->tp.write(&s->tp, data, length, transferred, timeout);
+}
+
+static int hub_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TScaleSession *s = tp->ctx;
+    return s->tp.read(&s->tp, data, length, transferred, timeout);
+}
+
+static double thread_cpu_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static double process_cpu_ms(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+}
+
+static void scale_progress(TBootSession *session, uint32_t done, uint32_t total)
+{
+    TScaleSession *s = session->user;
+    double wait_ms = time_now_ms();
+
+    pthread_mutex_lock(&board_lock);
+    s->lock_ms += time_now_ms() - wait_ms;
+    board.bytes += MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+    if (done >= total)
+        board.finished++;
+    snprintf(board.line, sizeof(board.line), "%llu bytes, %u regions done", (unsigned long long)board.bytes, board.finished);
+    pthread_mutex_unlock(&board_lock);
+    s->progress_calls++;
+}
+
+static void *scale_thread(void *arg)
+{
+    TScaleSession *s = arg;
+    double cpu_ms = 0.0;
+    double start_ms = 0.0;
+
+    pthread_barrier_wait(&start_gate);
+    cpu_ms = thread_cpu_ms();
+    start_ms = time_now_ms();
+    s->result = setupChiptoBoot(&s->session);
+    if (s->hub >= 0)
+    {
+        sched_shim_end(&s->shim);
+        hub_stream(s, 0);
+    }
+    s->wall_ms = time_now_ms() - start_ms;
+    s->cpu_ms = thread_cpu_ms() - cpu_ms;
+    release_boot_session(&s->session);
+    return NULL;
+}
+
+/*
+ * Device i of a step, same for every step
+ */
+static void scale_device(TSimConfig *cfg, const TSimConfig *base, int i)
+{
+    uint64_t rng = SCALE_SEED + (uint64_t)i * 0x9e3779b97f4a7c15ULL;
+    double spread[4];
+
+    *cfg = *base;
+    if ((i & 1) && !base->have_info)
+    {
+        // other flash size, the latency model of the base stays
+        sim_default_config(cfg, (base->mcu_size == MZ2048) ? MZ1024 : MZ2048);
+        cfg->frame_ms = base->frame_ms;
+        cfg->cmd_ms = base->cmd_ms;
+        cfg->erase_page_ms = base->erase_page_ms;
+        cfg->row_write_ms = base->row_write_ms;
+        cfg->boot_rev = base->boot_rev;
+        memcpy(cfg->out, base->out, sizeof(cfg->out));
+        memcpy(cfg->in, base->in, sizeof(cfg->in));
+    }
+    for (int k = 0; k < 4; k++)
+        spread[k] = 1.0 + SCALE_SPREAD * (2.0 * (double)(rand_next(&rng) >> 11) / 9007199254740992.0 - 1.0);
+    cfg->frame_ms *= spread[0];
+    cfg->cmd_ms *= spread[1];
+    cfg->erase_page_ms *= spread[2];
+    cfg->row_write_ms *= spread[3];
+}
+
+/*
+ * Run devices first..first+n-1 at once, sessions left filled in for
+ * the report
+ */
+static int scale_step(TScaleSession *sessions, int first, int n, const TSimConfig *base, TBootSession *proto,
+                      const TScaleTopo *topo, TSched *sched)
+{
+    pthread_t threads[SCALE_MAX_SESSIONS];
+    int started = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        TScaleSession *s = &sessions[i];
+
+        memset(s, 0, sizeof(TScaleSession));
+        scale_device(&s->cfg, base, first + i);
+        if (sim_open(&s->sim, &s->cfg) != 0)
+        {
+            for (int k = 0; k < i; k++)
+                sim_close(&sessions[k].sim);
+            return -1;
+        }
+        sim_transport(&s->tp, &s->sim);
+        s->session = *proto;
+        s->session.transport = &s->tp;
+        s->session.quiet = 1;
+        s->session.trace = NULL;
+        s->session.on_progress = scale_progress;
+        s->session.user = s;
+
+        s->hub = -1;
+        if (topo != NULL)
+        {
+            // bus 1, hub on root port h + 1, device on port k + 1 of it
+            s->hub = (first + i) % topo->hubs;
+            s->hub_streams = topo->streams;
+            s->topo.bus = 1;
+            s->topo.ports[0] = (uint8_t)(s->hub + 1);
+            s->topo.ports[1] = (uint8_t)((first + i) / topo->hubs + 1);
+            s->topo.depth = 2;
+            s->hub_tp.write = hub_write;
+            s->hub_tp.read = hub_read;
+            s->hub_tp.ctx = s;
+            sched_transport(&s->sched_tp, &s->shim, &s->hub_tp, sched, &s->topo);
+            s->session.transport = &s->sched_tp;
+        }
+    }
+
+    pthread_mutex_lock(&board_lock);
+    board.bytes = 0;
+    board.finished = 0;
+    pthread_mutex_unlock(&board_lock);
+
+    pthread_barrier_init(&start_gate, NULL, (unsigned)n + 1);
+    for (started = 0; started < n; started++)
+    {
+        if (pthread_create(&threads[started], NULL, scale_thread, &sessions[started]) != 0)
+            break;
+    }
+    if (started < n)
+    {
+        // threads already at the gate need the missing ones
+        fprintf(stderr, "scale: could only start %d of %d sessions\n", started, n);
+        for (int i = started; i < n; i++)
+        {
+            sessions[i].result = -1;
+            pthread_barrier_wait(&start_gate);
+        }
+    }
+    pthread_barrier_wait(&start_gate);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&start_gate);
+    return 0;
+}
+
+int scale_run(const TSimConfig *base, TBootSession *proto, const int *counts, int steps, const TScaleTopo *topo,
+              double hub_kbs, FILE *out)
+{
+    TScaleSession *sessions = NULL;
+    TSim reference[2];
+    double *wall = NULL, *overhead = NULL, *cpu = NULL, *lock = NULL;
+    int max_n = 2;
+    int failed_total = 0;
+    TSched *sched = (topo != NULL) ? sched_create(hub_kbs) : NULL;
+
+    for (int i = 0; i < steps; i++)
+        if (counts[i] > max_n)
+            max_n = counts[i];
+
+    sessions = calloc(max_n, sizeof(TScaleSession));
+    wall = calloc(max_n, sizeof(double));
+    overhead = calloc(max_n, sizeof(double));
+    cpu = calloc(max_n, sizeof(double));
+    lock = calloc(max_n, sizeof(double));
+    if (sessions == NULL || wall == NULL || overhead == NULL || cpu == NULL || lock == NULL)
+    {
+        fprintf(stderr, "scale: out of memory for %d sessions\n", max_n);
+        free(sessions), free(wall), free(overhead), free(cpu), free(lock);
+        sched_destroy(sched);
+        return -1;
+    }
+
+    // each geometry flashed alone first, its flash is what every
+    // session of that geometry has to end up with
+    for (int g = 0; g < 2; g++)
+    {
+        if (scale_step(&sessions[g], g, 1, base, proto, NULL, NULL) != 0 || sessions[g].result != 0 || sessions[g].sim.write_errors > 0)
+        {
+            fprintf(stderr, "scale: reference session failed on %s\n", sessions[g].cfg.dev_dsc);
+            for (int k = 0; k <= g; k++)
+                sim_close(&sessions[k].sim);
+            free(sessions), free(wall), free(overhead), free(cpu), free(lock);
+            sched_destroy(sched);
+            return -1;
+        }
+        reference[g] = sessions[g].sim;
+    }
+
+    fprintf(out, "scale: solo %s %.1f ms, %s %.1f ms, %u + %u bytes\n",
+            reference[0].cfg.dev_dsc, sessions[0].wall_ms, reference[1].cfg.dev_dsc, sessions[1].wall_ms,
+            reference[0].bytes_written, reference[1].bytes_written);
+    fprintf(out, "%5s %6s %9s %9s %21s %19s %11s %6s %9s %5s\n", "n", "failed", "wall ms", "KB/s",
+            "session ms p50/p99/max", "overhead ms p50/p99", "cpu ms/sess", "cpu %", "lock p99",
+            (topo == NULL) ? "" : "hubs");
+
+    for (int run = 0; run < steps * ((topo != NULL) ? 2 : 1); run++)
+    {
+        int n = counts[(topo != NULL) ? run / 2 : run];
+        int scheduled = (topo != NULL) && (run & 1);
+        int failed = 0;
+        uint64_t bytes = 0;
+        double cpu_ms = process_cpu_ms();
+        double start_ms = time_now_ms();
+        double step_ms = 0.0;
+        double cpu_mean = 0.0;
+
+        if (scale_step(sessions, 0, n, base, proto, topo, scheduled ? sched : NULL) != 0)
+        {
+            fprintf(stderr, "scale: could not set up %d devices\n", n);
+            failed_total++;
+            break;
+        }
+        step_ms = time_now_ms() - start_ms;
+        cpu_ms = process_cpu_ms() - cpu_ms;
+
+        for (int i = 0; i < n; i++)
+        {
+            TScaleSession *s = &sessions[i];
+
+            s->mismatch = (sim_compare(&s->sim, &reference[i & 1]) != 0);
+            if (s->result != 0 || s->sim.write_errors > 0 || s->mismatch)
+                failed++;
+            bytes += s->sim.bytes_written;
+            wall[i] = s->wall_ms;
+            overhead[i] = s->wall_ms - s->sim.device_ms;
+            cpu[i] = s->cpu_ms;
+            lock[i] = s->lock_ms;
+            cpu_mean += s->cpu_ms / n;
+            sim_close(&s->sim);
+        }
+
+        fprintf(out, "%5d %6d %9.1f %9.1f %7.1f %6.1f %6.1f %9.1f %9.1f %11.2f %5.1f%% %9.3f %5s\n", n, failed, step_ms,
+                (step_ms > 0.0) ? (double)bytes / step_ms * 1000.0 / 1024.0 : 0.0,
+                percentile(wall, n, 50), percentile(wall, n, 99), percentile(wall, n, 100),
+                percentile(overhead, n, 50), percentile(overhead, n, 99),
+                cpu_mean, (step_ms > 0.0) ? cpu_ms / step_ms * 100.0 : 0.0, percentile(lock, n, 99),
+                (topo == NULL) ? "" : scheduled ? "sched" : "free");
+        failed_total += failed;
+    }
+    sched_report(sched, out);
+    sched_destroy(sched);
+
+    sim_close(&reference[0]);
+    sim_close(&reference[1]);
+    free(sessions), free(wall), free(overhead), free(cpu), free(lock);
+    return (failed_total == 0) ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,371 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Sched.h"
+#include "Types.h"
+#include "Utils.h"
+
+#ifdef _WIN32
+
+// no worker threads on Windows, every stream runs as it comes
+TSched *sched_create(double hub_kbs)
+{
+    return NULL;
+}
+
+void sched_destroy(TSched *sched)
+{
+}
+
+void sched_acquire(TSched *sched, const TUsbTopo *topo, TSchedTicket *ticket)
+{
+    memset(ticket, 0, sizeof(TSchedTicket));
+}
+
+void sched_sample(TSched *sched, TSchedTicket *ticket, uint32_t bytes)
+{
+}
+
+void sched_release(TSched *sched, TSchedTicket *ticket, uint32_t bytes)
+{
+}
+
+void sched_report(TSched *sched, FILE *out)
+{
+}
+
+#else
+
+#include <pthread.h>
+
+/*
+ * Topology aware stream scheduler
+ *
+ * Devices below one hub share its transaction translator, devices on
+ * one root port share its link. Every hub and root port is a group
+ * with a bandwidth budget. A group admits as many data streams as the
+ * budget holds streams of its solo rate, the rest wait, so erases and
+ * streams on other groups go on meanwhile. The first SCHED_SOLO_BYTES
+ * of a group's first stream run alone to measure the solo rate. A
+ * stream slower than SCHED_CONTENDED of it was contended, what it got
+ * times its peers is what the group really moves and becomes the
+ * budget, but only when it ran with more peers than the last cap that
+ * ran clean, and never below that cap. SCHED_PROBE clean streams on a
+ * full group let the budget grow by a stream. A budget given to
+ * sched_create() is fixed. A NULL scheduler admits everything.
+ */
+
+struct TSchedGroup
+{
+    char name[32];
+    int active;
+    int peak;        // most streams at once since the last release
+    double budget_kbs;
+    double solo_kbs; // 0 until a stream ran alone
+    int clean;       // full group streams in a row that kept up
+    int clean_cap;   // last cap SCHED_PROBE full streams kept up at
+    uint32_t streams;
+    uint32_t contended;
+    double wait_ms;
+};
+
+struct TSched
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    TSchedGroup groups[SCHED_MAX_GROUPS];
+    int count;
+    double hub_kbs;
+    int fixed;
+};
+
+TSched *sched_create(double hub_kbs)
+{
+    TSched *sched = calloc(1, sizeof(TSched));
+
+    if (sched == NULL)
+        return NULL;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->wake, NULL);
+    sched->fixed = (hub_kbs > 0.0);
+    sched->hub_kbs = sched->fixed ? hub_kbs : SCHED_HUB_KBS;
+    return sched;
+}
+
+void sched_destroy(TSched *sched)
+{
+    if (sched == NULL)
+        return;
+    pthread_cond_destroy(&sched->wake);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched);
+}
+
+// streams on the busiest group of a ticket, called with the lock held
+static int ticket_peers(const TSchedTicket *ticket)
+{
+    int peers = 0;
+
+    for (int i = 0; i < ticket->count; i++)
+    {
+        if (ticket->groups[i]->peak > peers)
+            peers = ticket->groups[i]->peak;
+    }
+    return peers;
+}
+
+static int group_cap(const TSchedGroup *group)
+{
+    int cap = 0;
+
+    if (group->solo_kbs <= 0.0)
+        return 1;
+    cap = (int)(group->budget_kbs / group->solo_kbs + 0.5);
+    return (cap < 1) ? 1 : cap;
+}
+
+// called with the lock held
+static TSchedGroup *find_group(TSched *sched, const char *name)
+{
+    TSchedGroup *group = NULL;
+
+    for (int i = 0; i < sched->count; i++)
+    {
+        if (strcmp(sched->groups[i].name, name) == 0)
+            return &sched->groups[i];
+    }
+    if (sched->count == SCHED_MAX_GROUPS)
+        return NULL;
+    group = &sched->groups[sched->count++];
+    memset(group, 0, sizeof(TSchedGroup));
+    strncpy(group->name, name, sizeof(group->name) - 1);
+    group->budget_kbs = sched->hub_kbs;
+    return group;
+}
+
+/*
+ * Wait for a slot on the device's root port and parent hub. A device
+ * the groups ran out for is not held back.
+ */
+void sched_acquire(TSched *sched, const TUsbTopo *topo, TSchedTicket *ticket)
+{
+    char root[32], hub[32];
+    double queued_ms = time_now_ms();
+    int full = 0;
+
+    memset(ticket, 0, sizeof(TSchedTicket));
+    if (sched == NULL)
+        return;
+
+    usb_topo_name(topo, 1, root, sizeof(root));
+    usb_topo_name(topo, topo->depth - 1, hub, sizeof(hub));
+
+    pthread_mutex_lock(&sched->lock);
+    ticket->groups[0] = find_group(sched, root);
+    if (ticket->groups[0] != NULL)
+        ticket->count = 1;
+    if (topo->depth > 1 && strcmp(root, hub) != 0)
+    {
+        ticket->groups[ticket->count] = find_group(sched, hub);
+        if (ticket->groups[ticket->count] != NULL)
+            ticket->count++;
+    }
+
+    do
+    {
+        full = 0;
+        for (int i = 0; i < ticket->count; i++)
+            full |= (ticket->groups[i]->active >= group_cap(ticket->groups[i]));
+        if (full)
+            pthread_cond_wait(&sched->wake, &sched->lock);
+    } while (full);
+
+    ticket->start_ms = time_now_ms();
+    for (int i = 0; i < ticket->count; i++)
+    {
+        TSchedGroup *group = ticket->groups[i];
+        group->active++;
+        if (group->active > group->peak)
+            group->peak = group->active;
+        group->wait_ms += ticket->start_ms - queued_ms;
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/*
+ * The stream moved bytes so far, a group still measuring its solo
+ * rate takes it from a stream that ran alone and opens
+ */
+void sched_sample(TSched *sched, TSchedTicket *ticket, uint32_t bytes)
+{
+    double ms = 0.0;
+    int alone = 0;
+
+    if (sched == NULL || ticket->count == 0 || ticket->sampled)
+        return;
+    ticket->sampled = 1;
+    ms = time_now_ms() - ticket->start_ms;
+    if (ms <= 0.0)
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    alone = (ticket_peers(ticket) == 1);
+    for (int i = 0; i < ticket->count && alone; i++)
+    {
+        TSchedGroup *group = ticket->groups[i];
+        if (group->solo_kbs <= 0.0)
+            group->solo_kbs = (double)bytes / ms * 1000.0 / 1024.0;
+    }
+    pthread_cond_broadcast(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/*
+ * Give the slot back, the bytes the stream moved feed the measurement
+ */
+void sched_release(TSched *sched, TSchedTicket *ticket, uint32_t bytes)
+{
+    double ms = 0.0, kbs = 0.0;
+
+    if (sched == NULL || ticket->count == 0)
+        return;
+
+    ms = time_now_ms() - ticket->start_ms;
+    kbs = (ms > 0.0) ? (double)bytes / ms * 1000.0 / 1024.0 : 0.0;
+
+    pthread_mutex_lock(&sched->lock);
+    ticket->peers = ticket_peers(ticket);
+    for (int i = 0; i < ticket->count && bytes > 0; i++)
+    {
+        TSchedGroup *group = ticket->groups[i];
+        int cap = group_cap(group);
+
+        group->streams++;
+        if (ticket->peers == 1)
+            group->solo_kbs = (group->solo_kbs > 0.0) ? 0.7 * group->solo_kbs + 0.3 * kbs : kbs;
+
+        if (sched->fixed || group->solo_kbs <= 0.0)
+            continue;
+        if (kbs < SCHED_CONTENDED * group->solo_kbs)
+        {
+            group->contended++;
+            group->clean = 0;
+            // no more peers than a cap that ran clean, a slow device or noise
+            if (ticket->peers > group->clean_cap && kbs * ticket->peers < group->budget_kbs)
+                group->budget_kbs = kbs * ticket->peers;
+        }
+        else if (ticket->peers >= cap && ++group->clean >= SCHED_PROBE)
+        {
+            // kept up with the group full, try one stream more
+            group->clean_cap = cap;
+            group->budget_kbs = group->solo_kbs * (cap + 1);
+            group->clean = 0;
+        }
+        if (group->budget_kbs < group->solo_kbs * group->clean_cap)
+            group->budget_kbs = group->solo_kbs * group->clean_cap;
+        if (group->budget_kbs < group->solo_kbs)
+            group->budget_kbs = group->solo_kbs;
+    }
+    for (int i = 0; i < ticket->count; i++)
+    {
+        TSchedGroup *group = ticket->groups[i];
+        group->active--;
+        group->peak = group->active;
+    }
+    pthread_cond_broadcast(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+    ticket->count = 0;
+}
+
+void sched_report(TSched *sched, FILE *out)
+{
+    if (sched == NULL)
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    for (int i = 0; i < sched->count; i++)
+    {
+        TSchedGroup *group = &sched->groups[i];
+        fprintf(out, "sched: %-12s cap %2d, budget %7.1f KB/s, solo %6.1f KB/s, %u streams, %u contended, waited %.1f ms\n",
+                group->name, group_cap(group), group->budget_kbs, group->solo_kbs, group->streams, group->contended,
+                group->wait_ms);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+#endif
+
+static int sched_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TSchedShim *shim = tp->ctx;
+    int kind = frame_classify(&shim->frame, (uint8_t *)data);
+    int result = 0;
+
+    if (kind != cmdNON && kind != cmdHEX)
+        sched_shim_end(shim);
+    if ((kind == cmdWRITE || kind == cmdPACKED) && shim->sched != NULL)
+    {
+        double queued_ms = time_now_ms();
+        sched_acquire(shim->sched, &shim->topo, &shim->ticket);
+        shim->wait_ms += time_now_ms() - queued_ms;
+        shim->streams++;
+    }
+
+    result = shim->inner->write(shim->inner, data, length, transferred, timeout);
+    if (kind == cmdHEX)
+    {
+        shim->bytes += length;
+        if (shim->bytes >= SCHED_SOLO_BYTES)
+            sched_sample(shim->sched, &shim->ticket, shim->bytes);
+        if (shim->frame.remaining <= 0)
+            sched_shim_end(shim);
+    }
+    return result;
+}
+
+static int sched_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TSchedShim *shim = tp->ctx;
+    return shim->inner->read(shim->inner, data, length, transferred, timeout);
+}
+
+/*
+ * Wrap inner in a transport tp that schedules its data streams on the
+ * device's hub, NULL sched passes everything straight through
+ */
+void sched_transport(TTransport *tp, TSchedShim *shim, TTransport *inner, TSched *sched, const TUsbTopo *topo)
+{
+    memset(shim, 0, sizeof(TSchedShim));
+    shim->inner = inner;
+    shim->sched = sched;
+    shim->topo = *topo;
+    tp->write = sched_write;
+    tp->read = sched_read;
+    tp->close = NULL;
+    tp->ctx = shim;
+}
+
+/*
+ * Stream over, or the session gave up in the middle of one
+ */
+void sched_shim_end(TSchedShim *shim)
+{
+    sched_release(shim->sched, &shim->ticket, shim->bytes);
+    shim->bytes = 0;
+}
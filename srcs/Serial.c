@@ -0,0 +1,217 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#endif
+
+#include "Serial.h"
+
+/*
+ * Serial trigger
+ *
+ * The application listens on its UART and jumps to the bootloader
+ * when it sees the trigger, after which the board re-enumerates as
+ * the 0x2dbc:0x0001 HID bootloader.
+ */
+
+/*
+ * Expand \r \n \t \\ and \xHH in a trigger given on the command line
+ */
+size_t serial_unescape(const char *in, char *out, size_t len)
+{
+    size_t i = 0;
+
+    while (*in != '\0' && i < len)
+    {
+        if (*in == '\\' && in[1] != '\0')
+        {
+            in++;
+            if (*in == 'x' && in[1] != '\0' && in[2] != '\0')
+            {
+                char hex[3] = {in[1], in[2], '\0'};
+                out[i++] = (char)strtol(hex, NULL, 16);
+                in += 3;
+                continue;
+            }
+            out[i++] = (*in == 'r') ? '\r' : (*in == 'n') ? '\n' : (*in == 't') ? '\t' : *in;
+            in++;
+            continue;
+        }
+        out[i++] = *in++;
+    }
+    return i;
+}
+
+#ifdef _WIN32
+
+int serial_send_trigger(const char *port, int baud, const char *trigger, size_t len)
+{
+    char name[64];
+    DCB dcb = {0};
+    DWORD written = 0;
+    HANDLE h;
+
+    // COM10 and above need the device namespace prefix
+    snprintf(name, sizeof(name), "\\\\.\\%s", port);
+    h = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Could not open serial port %s\n", port);
+        return -1;
+    }
+
+    dcb.DCBlength = sizeof(dcb);
+    GetCommState(h, &dcb);
+    dcb.BaudRate = baud;
+    dcb.ByteSize = 8;
+    dcb.Parity = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    if (!SetCommState(h, &dcb) || !WriteFile(h, trigger, (DWORD)len, &written, NULL) || written != len)
+    {
+        fprintf(stderr, "Could not send trigger on %s\n", port);
+        CloseHandle(h);
+        return -1;
+    }
+    FlushFileBuffers(h);
+    CloseHandle(h);
+    return 0;
+}
+
+int serial_open_pty(char *slave_name, size_t len)
+{
+    fprintf(stderr, "Pseudo terminals are not available on Windows\n");
+    return -1;
+}
+
+#else
+
+static speed_t baud_to_speed(int baud)
+{
+    switch (baud)
+    {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+#ifdef B460800
+    case 460800:
+        return B460800;
+#endif
+#ifdef B921600
+    case 921600:
+        return B921600;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Open port raw 8N1 at baud, write the trigger and wait until it
+ * has left the uart, returns 0 once the last byte is on the wire
+ */
+int serial_send_trigger(const char *port, int baud, const char *trigger, size_t len)
+{
+    struct termios tio;
+    speed_t speed = baud_to_speed(baud);
+    int fd = -1;
+
+    if (speed == 0)
+    {
+        fprintf(stderr, "Unsupported baud rate %d\n", baud);
+        return -1;
+    }
+
+    // without carrier a blocking open waits for DCD, CLOCAL is set below
+    fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open serial port %s: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    if (tcgetattr(fd, &tio) != 0)
+    {
+        fprintf(stderr, "%s is not a serial port: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (tcsetattr(fd, TCSANOW, &tio) != 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0)
+    {
+        fprintf(stderr, "Could not set up serial port %s: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (write(fd, trigger, len) != (ssize_t)len)
+    {
+        fprintf(stderr, "Could not send trigger on %s: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    tcdrain(fd);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Create a pseudo terminal pair, the slave stands in for the
+ * application uart. Returns the master fd, the slave path in slave_name.
+ */
+int serial_open_pty(char *slave_name, size_t len)
+{
+    struct termios tio;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || ptsname(fd) == NULL)
+    {
+        fprintf(stderr, "Could not create a pseudo terminal: %s\n", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    snprintf(slave_name, len, "%s", ptsname(fd));
+
+    // raw on the master side too, so the trigger arrives byte for byte
+    if (tcgetattr(fd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+#endif
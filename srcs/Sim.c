@@ -0,0 +1,707 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "Sim.h"
+#include "Pack.h"
+#include "Verify.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Simulated MikroC USB HID bootloader
+ *
+ * Follows the same packet protocol as the firmware: 64 byte reports,
+ * [STX][cmd] commands answered with one IN report, cmdWRITE followed
+ * by raw data reports, cmdPACKED by packed ones (see Pack.c) when
+ * uiBootRev says so, cmdCRC answered with CRCs of flash spans,
+ * cmdREBOOT drops the device off the bus.
+ * Flash is modelled as erase-to-0xFF / program-clears-bits so writes
+ * to unerased memory are counted, and every transfer is delayed by a
+ * latency model or by latencies recorded from real hardware.
+ */
+
+#define SIM_STARTFLASH 0x1D000000
+#define SIM_STARTCONF 0x1FC00000
+#define SIM_CONF_SIZE 0x10000
+
+static const char *kind_names[SIM_KINDS] = {
+    [cmdNON] = "NON",
+    [cmdSYNC] = "SYNC",
+    [cmdINFO] = "INFO",
+    [cmdBOOT] = "BOOT",
+    [cmdREBOOT] = "REBOOT",
+    [cmdWRITE] = "WRITE",
+    [cmdPACKED] = "PACKED",
+    [cmdCRC] = "CRC",
+    [cmdERASE] = "ERASE",
+    [cmdHEX] = "DATA"};
+
+const char *frame_kind_name(int kind)
+{
+    if (kind < 0 || kind >= SIM_KINDS || kind_names[kind] == NULL)
+        return "NON";
+    return kind_names[kind];
+}
+
+int frame_kind_from_name(const char *name)
+{
+    for (int i = 0; i < SIM_KINDS; i++)
+    {
+        if (kind_names[i] != NULL && strcmp(kind_names[i], name) == 0)
+            return i;
+    }
+    return cmdNON;
+}
+
+static int is_command(const uint8_t *report)
+{
+    return report[0] == 0x0f && report[1] != cmdNON && report[1] < SIM_KINDS &&
+           report[1] != cmdHEX && kind_names[report[1]] != NULL;
+}
+
+/*
+ * Classify one OUT report, returns its TCmd or cmdHEX for data.
+ * The WRITE size field is 16 bit, so for regions above 64K the
+ * count runs out early, after that only a report that looks like
+ * a command ends the data stream.
+ */
+int frame_classify(TFrameTracker *frame, const uint8_t *report)
+{
+    if (frame->data_mode && (frame->remaining > 0 || !is_command(report)))
+    {
+        // a packed report says how much it decodes to
+        frame->remaining -= frame->packed ? (report[0] | (report[1] << 8)) : MAX_INTERRUPT_OUT_TRANSFER_SIZE;
+
+        // the device acknowledges the data, packed or not, as a write
+        if (frame->remaining <= 0 && frame->asked_count > 0 && frame->asked[frame->asked_count - 1] == cmdPACKED)
+            frame->asked[frame->asked_count - 1] = cmdWRITE;
+        return cmdHEX;
+    }
+
+    frame->data_mode = 0;
+    if (!is_command(report))
+        return cmdNON;
+
+    if (frame->asked_count == FRAME_ASKED)
+    {
+        // never answered, a REBOOT or a lost report
+        memmove(frame->asked, frame->asked + 1, (FRAME_ASKED - 1) * sizeof(int));
+        frame->asked_count--;
+    }
+    frame->asked[frame->asked_count++] = report[1];
+
+    if (report[1] == cmdWRITE)
+    {
+        frame->data_mode = 1;
+        frame->packed = 0;
+        frame->remaining = report[6] | (report[7] << 8);
+    }
+    else if (report[1] == cmdPACKED)
+    {
+        frame->data_mode = 1;
+        frame->packed = 1;
+        memcpy(&frame->remaining, report + 6, 4);
+    }
+    return report[1];
+}
+
+void sim_default_config(TSimConfig *cfg, uint32_t mcu_size)
+{
+    memset(cfg, 0, sizeof(TSimConfig));
+    cfg->mcu_size = mcu_size;
+    cfg->erase_block = 0x4000;
+    cfg->write_block = 0x800;
+    cfg->boot_rev = 1;
+    cfg->boot_start = SIM_STARTFLASH + ((mcu_size - __BOOT_FLASH_SIZE) / 0x4000) * 0x4000;
+    snprintf(cfg->dev_dsc, sizeof(cfg->dev_dsc), "PIC32MZ%uEFH", mcu_size / 1024);
+
+    // full speed interrupt endpoint, typical PIC32MZ flash timing
+    cfg->frame_ms = 1.0;
+    cfg->cmd_ms = 1.0;
+    cfg->erase_page_ms = 20.0;
+    cfg->row_write_ms = 1.0;
+    cfg->unpack_kb_ms = 0.05;
+    cfg->crc_kb_ms = 0.02;
+
+    // application reset, bootloader start and host enumeration
+    cfg->enum_ms = 500.0;
+    cfg->app_ms = 300.0;
+}
+
+/*
+ * Same geometry, nothing takes any time, for dry runs
+ */
+void sim_zero_latency(TSimConfig *cfg)
+{
+    cfg->frame_ms = cfg->cmd_ms = cfg->erase_page_ms = cfg->row_write_ms = 0.0;
+    cfg->unpack_kb_ms = cfg->crc_kb_ms = cfg->weak = 0.0;
+    cfg->enum_ms = cfg->app_ms = 0.0;
+}
+
+/*
+ * Parse a device spec, a model name optionally followed by overrides:
+ *   mz2048
+ *   mz1024,erase=25,row=1.2,frame=0.125,cmd=0.5,rev=2,enum=300,app=250
+ *   mz2048,fallback=1
+ */
+int sim_parse_spec(TSimConfig *cfg, const char *spec)
+{
+    char buf[256];
+    char *save = NULL;
+    char *tok = NULL;
+
+    sim_default_config(cfg, MZ2048);
+    if (spec == NULL || spec[0] == '\0')
+        return 0;
+
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        char *eq = strchr(tok, '=');
+        double value = 0.0;
+
+        if (eq == NULL)
+        {
+            if (strcmp(tok, "mz2048") == 0)
+                sim_default_config(cfg, MZ2048);
+            else if (strcmp(tok, "mz1024") == 0)
+                sim_default_config(cfg, MZ1024);
+            else
+            {
+                fprintf(stderr, "Unknown simulated device %s\n", tok);
+                return -1;
+            }
+            continue;
+        }
+
+        *eq = '\0';
+        value = strtod(eq + 1, NULL);
+        if (strcmp(tok, "erase") == 0)
+            cfg->erase_page_ms = value;
+        else if (strcmp(tok, "row") == 0)
+            cfg->row_write_ms = value;
+        else if (strcmp(tok, "frame") == 0)
+            cfg->frame_ms = value;
+        else if (strcmp(tok, "cmd") == 0)
+            cfg->cmd_ms = value;
+        else if (strcmp(tok, "rev") == 0)
+            cfg->boot_rev = (uint16_t)value;
+        else if (strcmp(tok, "unpack") == 0)
+            cfg->unpack_kb_ms = value;
+        else if (strcmp(tok, "crc") == 0)
+            cfg->crc_kb_ms = value;
+        else if (strcmp(tok, "weak") == 0)
+            cfg->weak = value;
+        else if (strcmp(tok, "enum") == 0)
+            cfg->enum_ms = value;
+        else if (strcmp(tok, "app") == 0)
+            cfg->app_ms = value;
+        else if (strcmp(tok, "fallback") == 0)
+            cfg->fallback = (value != 0.0);
+        else
+        {
+            fprintf(stderr, "Unknown simulated device option %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sim_free_config(TSimConfig *cfg)
+{
+    for (int i = 0; i < SIM_KINDS; i++)
+    {
+        free(cfg->out[i].ms);
+        free(cfg->in[i].ms);
+        cfg->out[i].ms = cfg->in[i].ms = NULL;
+        cfg->out[i].count = cfg->in[i].count = 0;
+    }
+}
+
+/*
+ * The command the next IN report answers, the oldest one not answered
+ * yet, or the last one again when the host reads once more
+ */
+int frame_answer(TFrameTracker *frame)
+{
+    if (frame->asked_count > 0)
+    {
+        frame->answered = frame->asked[0];
+        frame->asked_count--;
+        memmove(frame->asked, frame->asked + 1, frame->asked_count * sizeof(int));
+    }
+    return frame->answered;
+}
+
+/*
+ * INFO record in the device layout, fields sit on 4 byte boundaries
+ * the way bootInfo_buffer() expects them
+ */
+static void sim_build_info(TSim *sim, uint8_t *buf)
+{
+    TSimConfig *cfg = &sim->cfg;
+
+    if (cfg->have_info)
+    {
+        memcpy(buf, cfg->info, MAX_INTERRUPT_IN_TRANSFER_SIZE);
+        return;
+    }
+
+    memset(buf, 0, MAX_INTERRUPT_IN_TRANSFER_SIZE);
+    buf[0] = 56;
+    buf[1] = bifMCUTYPE;
+    buf[2] = mtPIC32;
+    buf[4] = bifMCUSIZE;
+    memcpy(buf + 8, &cfg->mcu_size, 4);
+    buf[12] = bifERASEBLOCK;
+    memcpy(buf + 14, &cfg->erase_block, 2);
+    buf[16] = bifWRITEBLOCK;
+    memcpy(buf + 18, &cfg->write_block, 2);
+    buf[20] = bifBOOTREV;
+    memcpy(buf + 22, &cfg->boot_rev, 2);
+    buf[24] = bifBOOTSTART;
+    memcpy(buf + 28, &cfg->boot_start, 4);
+    buf[32] = bifDEVDSC;
+    memcpy(buf + 33, cfg->dev_dsc, strlen(cfg->dev_dsc));
+}
+
+int sim_open(TSim *sim, const TSimConfig *cfg)
+{
+    memset(sim, 0, sizeof(TSim));
+    sim->cfg = *cfg;
+
+    // a recorded INFO record decides the geometry
+    if (cfg->have_info)
+    {
+        TBootInfo info = {0};
+        bootInfo_buffer(&info, cfg->info);
+        sim->cfg.mcu_size = info.ulMcuSize.fValue;
+        sim->cfg.erase_block = info.uiEraseBlock.fValue.intVal;
+        sim->cfg.write_block = info.uiWriteBlock.fValue.intVal;
+        sim->cfg.boot_rev = info.uiBootRev.fValue.intVal;
+        sim->cfg.boot_start = info.ulBootStart.fValue;
+    }
+
+    sim->flash = malloc(sim->cfg.mcu_size);
+    sim->conf = malloc(SIM_CONF_SIZE);
+    if (sim->flash == NULL || sim->conf == NULL)
+    {
+        sim_close(sim);
+        return -1;
+    }
+    memset(sim->flash, 0xff, sim->cfg.mcu_size);
+    memset(sim->conf, 0xff, SIM_CONF_SIZE);
+    return 0;
+}
+
+void sim_close(TSim *sim)
+{
+    free(sim->flash);
+    free(sim->conf);
+    sim->flash = sim->conf = NULL;
+}
+
+/*
+ * Map a physical address range to simulated memory, NULL outside flash
+ */
+static uint8_t *sim_map(TSim *sim, uint32_t address, uint32_t length)
+{
+    address &= V2P;
+    if (address >= SIM_STARTFLASH && address + length <= SIM_STARTFLASH + sim->cfg.mcu_size)
+        return sim->flash + (address - SIM_STARTFLASH);
+    if (address >= SIM_STARTCONF && address + length <= SIM_STARTCONF + SIM_CONF_SIZE)
+        return sim->conf + (address - SIM_STARTCONF);
+    return NULL;
+}
+
+static double next_latency(TLatencySeries *series, double model_ms)
+{
+    double ms = 0.0;
+    if (series->count == 0)
+        return model_ms;
+    ms = series->ms[series->next];
+    series->next = (series->next + 1) % series->count;
+    return ms;
+}
+
+/*
+ * Queue the answer to cmd, [STX][cmd] and zeros to be filled in,
+ * latency of device work once the report is in
+ */
+static uint8_t *sim_respond(TSim *sim, int cmd, double latency)
+{
+    TSimAnswer *answer = &sim->answers[(sim->answer_head + sim->answer_count) % SIM_ANSWERS];
+
+    memset(answer->data, 0, sizeof(answer->data));
+    answer->data[0] = 0x0f;
+    answer->data[1] = (uint8_t)cmd;
+    answer->cmd = cmd;
+    answer->latency = next_latency(&sim->cfg.in[cmd], latency);
+    answer->due_ms = 0.0;
+    sim->answer_count++;
+    return answer->data;
+}
+
+/*
+ * The device works through its commands in order, an answer queued by
+ * the report just taken is ready its latency after that report came in
+ * or after the answer before it
+ */
+static void sim_schedule(TSim *sim)
+{
+    TSimAnswer *answer = NULL;
+    double start = time_now_ms();
+
+    if (sim->answer_count == 0)
+        return;
+    answer = &sim->answers[(sim->answer_head + sim->answer_count - 1) % SIM_ANSWERS];
+    if (answer->due_ms > 0.0)
+        return;
+    if (sim->answer_count > 1)
+    {
+        double busy = sim->answers[(sim->answer_head + sim->answer_count - 2) % SIM_ANSWERS].due_ms;
+        if (busy > start)
+            start = busy;
+    }
+    answer->due_ms = start + answer->latency;
+}
+
+static int sim_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TSim *sim = tp->ctx;
+    uint8_t *report = (uint8_t *)data;
+    uint32_t address = 0;
+    uint16_t count = 0;
+    double latency = sim->cfg.frame_ms;
+    int kind = cmdNON;
+
+    *transferred = 0;
+    if (sim->rebooted)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (sim->answer_count == SIM_ANSWERS)
+    {
+        // the firmware is stuck handing over an answer, the report is NAKed
+        sleep_ms(timeout);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    kind = frame_classify(&sim->frame, report);
+    sim->reports++;
+
+    switch (kind)
+    {
+    case cmdHEX:
+    {
+        uint8_t plain[PACK_MAX_SPAN];
+        const uint8_t *src = report;
+        int decoded = length;
+        uint8_t *dst = NULL;
+
+        if (sim->frame.packed)
+        {
+            // the reference decoder at the device's speed
+            decoded = unpack_report(report, plain, sizeof(plain));
+            if (decoded < 0)
+            {
+                sim->write_errors++;
+                decoded = 0;
+            }
+            src = plain;
+            latency += decoded / 1024.0 * sim->cfg.unpack_kb_ms;
+        }
+
+        dst = sim_map(sim, sim->write_addr, decoded);
+        if (dst != NULL)
+        {
+            for (int i = 0; i < decoded; i++)
+            {
+                if ((dst[i] & src[i]) != src[i])
+                    sim->write_errors++;
+                dst[i] &= src[i];
+            }
+            sim->bytes_written += decoded;
+        }
+        else
+        {
+            sim->write_errors++;
+        }
+
+        // full rows committed, a marginal one keeps a bit it should have cleared
+        if (sim->cfg.write_block > 0)
+        {
+            uint32_t rows = (sim->write_addr + decoded) / sim->cfg.write_block - sim->write_addr / sim->cfg.write_block;
+
+            latency += rows * sim->cfg.row_write_ms;
+            for (uint32_t r = 0; r < rows && dst != NULL && sim->cfg.weak > 0.0; r++)
+            {
+                int i = (int)(rand_next(&sim->weak_state) % decoded);
+                uint8_t zeros = (uint8_t)~src[i];
+
+                if ((rand_next(&sim->weak_state) >> 11) * (1.0 / 9007199254740992.0) < sim->cfg.weak && zeros != 0)
+                {
+                    dst[i] |= zeros & (uint8_t)-zeros;
+                    sim->weak_bits++;
+                }
+            }
+        }
+        sim->write_addr += decoded;
+
+        // data for this write is complete, the device acknowledges
+        if (sim->frame.remaining <= 0 && sim->frame.remaining > -MAX_INTERRUPT_OUT_TRANSFER_SIZE)
+            sim_respond(sim, cmdWRITE, sim->cfg.row_write_ms);
+    }
+    break;
+    case cmdINFO:
+        sim_build_info(sim, sim_respond(sim, kind, sim->cfg.cmd_ms));
+        break;
+    case cmdSYNC:
+    case cmdBOOT:
+        sim_respond(sim, kind, sim->cfg.cmd_ms);
+        break;
+    case cmdERASE:
+    {
+        uint32_t page = sim->cfg.erase_block;
+        memcpy(&address, report + 2, 4);
+        memcpy(&count, report + 6, 2);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint8_t *dst = sim_map(sim, address + i * page, page);
+            if (dst == NULL)
+            {
+                // config flash is smaller than a program page
+                dst = sim_map(sim, address, SIM_CONF_SIZE);
+                if (dst != NULL)
+                    memset(dst, 0xff, SIM_CONF_SIZE);
+                continue;
+            }
+            memset(dst, 0xff, page);
+        }
+        sim->erased_pages += count;
+        sim_respond(sim, kind, count * sim->cfg.erase_page_ms);
+    }
+    break;
+    case cmdWRITE:
+        memcpy(&sim->write_addr, report + 2, 4);
+        break;
+    case cmdCRC:
+    {
+        uint16_t span = 0;
+        uint8_t *answer = NULL;
+        memcpy(&address, report + 2, 4);
+        memcpy(&count, report + 6, 2);
+        memcpy(&span, report + 8, 2);
+
+        // a bootloader before BOOT_REV_CRC does not answer
+        if (sim->cfg.boot_rev < BOOT_REV_CRC)
+            break;
+        if (count > VERIFY_PER_REPORT)
+            count = VERIFY_PER_REPORT;
+        answer = sim_respond(sim, kind, sim->cfg.cmd_ms + count * span / 1024.0 * sim->cfg.crc_kb_ms);
+        memcpy(answer + 2, &count, 2);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint8_t *src = sim_map(sim, address + i * span, span);
+            uint32_t crc = (src != NULL) ? crc32_update(0, src, span) : 0;
+            memcpy(answer + 4 + 4 * i, &crc, 4);
+        }
+        sim->crc_bytes += (uint32_t)count * span;
+    }
+    break;
+    case cmdPACKED:
+        // a bootloader before BOOT_REV_PACKED does not know the command
+        if (sim->cfg.boot_rev < BOOT_REV_PACKED)
+        {
+            sim->frame.data_mode = 0;
+            break;
+        }
+        memcpy(&sim->write_addr, report + 2, 4);
+        break;
+    case cmdREBOOT:
+        sim->rebooted = 1;
+        sim->reboot_ms = time_now_ms();
+        break;
+    default:
+        break;
+    }
+
+    latency = next_latency(&sim->cfg.out[kind], latency);
+    sleep_ms(latency);
+    sim->device_ms += latency;
+    sim_schedule(sim);
+
+    *transferred = length;
+    return 0;
+}
+
+static int sim_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TSim *sim = tp->ctx;
+    TSimAnswer *answer = &sim->answers[sim->answer_head];
+    double wait = 0.0;
+
+    *transferred = 0;
+    if (sim->rebooted)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (sim->answer_count == 0)
+    {
+        // nothing to answer, the host sits out its timeout
+        sleep_ms(timeout);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    wait = answer->due_ms - time_now_ms();
+    if (wait > timeout)
+    {
+        // still busy when the host gives up, the answer stays queued
+        sleep_ms(timeout);
+        sim->device_ms += timeout;
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    if (wait > 0.0)
+        sleep_ms(wait);
+    sim->device_ms += answer->latency;
+
+    memcpy(data, answer->data, (length < MAX_INTERRUPT_IN_TRANSFER_SIZE) ? length : MAX_INTERRUPT_IN_TRANSFER_SIZE);
+    sim->answer_head = (sim->answer_head + 1) % SIM_ANSWERS;
+    sim->answer_count--;
+    *transferred = length;
+    return 0;
+}
+
+void sim_transport(TTransport *tp, TSim *sim)
+{
+    tp->write = sim_write;
+    tp->read = sim_read;
+    tp->close = NULL;
+    tp->ctx = sim;
+}
+
+void sim_report(TSim *sim, FILE *out)
+{
+    fprintf(out, "sim: %s, %u reports, %u pages erased, %u bytes written, %u write errors, device time %.1f ms\n",
+            sim->cfg.dev_dsc, sim->reports, sim->erased_pages, sim->bytes_written, sim->write_errors, sim->device_ms);
+    if (sim->cfg.weak > 0.0 || sim->crc_bytes > 0)
+        fprintf(out, "sim: %u weak bits programmed, %u bytes CRCed\n", sim->weak_bits, sim->crc_bytes);
+}
+
+/*
+ * 0 when both devices hold the same program and config flash
+ */
+int sim_compare(const TSim *a, const TSim *b)
+{
+    if (a->cfg.mcu_size != b->cfg.mcu_size)
+        return -1;
+    if (memcmp(a->flash, b->flash, a->cfg.mcu_size) != 0 || memcmp(a->conf, b->conf, SIM_CONF_SIZE) != 0)
+        return 1;
+    return 0;
+}
+
+/*
+ * After cmdREBOOT the application enumerates app_ms later when the
+ * reset instruction in config flash is programmed and no write hit
+ * unerased flash, otherwise the bootloader is back on the bus. Returns
+ * SIM_BOOT_APP or SIM_BOOT_LOADER with the enumeration time in
+ * *arrived_ms, LIBUSB_ERROR_TIMEOUT when that is past deadline_ms.
+ */
+int sim_wait_boot(TSim *sim, double deadline_ms, double *arrived_ms)
+{
+    static const uint8_t erased[4] = {0xff, 0xff, 0xff, 0xff};
+    int app = 0;
+    double arrival = 0.0;
+
+    if (!sim->rebooted)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    app = !sim->cfg.fallback && sim->write_errors == 0 && memcmp(sim->conf, erased, 4) != 0;
+    arrival = sim->reboot_ms + (app ? sim->cfg.app_ms : sim->cfg.enum_ms);
+    if (arrival > deadline_ms)
+    {
+        sleep_ms(deadline_ms - time_now_ms());
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    sleep_ms(arrival - time_now_ms());
+    *arrived_ms = arrival;
+    return app ? SIM_BOOT_APP : SIM_BOOT_LOADER;
+}
+
+/*
+ * The board is reset into its bootloader again, flash keeps what was
+ * written and the statistics go on counting
+ */
+void sim_reset(TSim *sim)
+{
+    memset(&sim->frame, 0, sizeof(TFrameTracker));
+    sim->answer_head = 0;
+    sim->answer_count = 0;
+    sim->write_addr = 0;
+    sim->rebooted = 0;
+    sim->reboot_ms = 0.0;
+}
+
+/*
+ * Stand in for the application listening on its uart: read fd (the
+ * master of a pty pair) until the trigger shows up, then come back
+ * as the bootloader enum_ms later. Returns 0 with the arrival time in
+ * *arrived_ms, LIBUSB_ERROR_TIMEOUT when no trigger came by deadline_ms.
+ */
+int sim_wait_trigger(TSim *sim, int fd, const char *trigger, size_t len, double deadline_ms, double *arrived_ms)
+{
+#ifdef _WIN32
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#else
+    char seen[256];
+    size_t count = 0;
+
+    if (len == 0 || len > sizeof(seen))
+        return LIBUSB_ERROR_INVALID_PARAM;
+
+    for (;;)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        double remaining = deadline_ms - time_now_ms();
+        ssize_t n = 0;
+
+        if (remaining <= 0.0 || poll(&pfd, 1, (int)remaining + 1) <= 0)
+            return LIBUSB_ERROR_TIMEOUT;
+
+        // keep the tail that could still start a trigger
+        if (count == sizeof(seen))
+        {
+            memmove(seen, seen + count - (len - 1), len - 1);
+            count = len - 1;
+        }
+        n = read(fd, seen + count, sizeof(seen) - count);
+        if (n <= 0)
+            return LIBUSB_ERROR_IO;
+        count += (size_t)n;
+
+        for (size_t i = 0; i + len <= count; i++)
+        {
+            if (memcmp(seen + i, trigger, len) == 0)
+            {
+                double arrival = time_now_ms() + sim->cfg.enum_ms;
+                if (arrival > deadline_ms)
+                {
+                    sleep_ms(deadline_ms - time_now_ms());
+                    return LIBUSB_ERROR_TIMEOUT;
+                }
+                sleep_ms(sim->cfg.enum_ms);
+                *arrived_ms = arrival;
+                return 0;
+            }
+        }
+    }
+#endif
+}
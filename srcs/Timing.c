@@ -0,0 +1,287 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "Timing.h"
+#include "Types.h"
+#include "HexFile.h"
+#include "Utils.h"
+#include "Calib.h"
+
+/*
+ * Adaptive transfer timeouts
+ *
+ * TIMEOUT_MS is sized for the slowest thing a bootloader does, so a
+ * board that died mid session takes five seconds to notice. Latencies
+ * of each transfer kind are learned per device model instead and a
+ * transfer gets TIMING_MARGIN times the p99 of its kind, erases scaled
+ * by the page count, never more than the caller asked for. Profiles
+ * persist in $XDG_STATE_HOME/mikro_hb, one file per model:
+ *
+ *   # mikro_hb timing profile 1
+ *   OUT SYNC 3 1.02 0.98 1.10
+ *   IN ERASE 2 20.1 20.3
+ *
+ * Transfers go one at a time through TTransport, so the number in
+ * flight is not something to tune yet, only the timeouts are.
+ */
+
+#define TIMING_MAGIC "# mikro_hb timing profile 1"
+
+static void series_add(TTimingSeries *series, double ms)
+{
+    series->ms[series->next] = ms;
+    series->next = (series->next + 1) % TIMING_SAMPLES;
+    if (series->count < TIMING_SAMPLES)
+        series->count++;
+    series->fresh++;
+}
+
+static double series_timeout(TTimingSeries *series)
+{
+    double sorted[TIMING_SAMPLES];
+
+    if (series->count < TIMING_MIN_SAMPLES)
+        return 0.0;
+
+    // the percentile sort is cheap but not per data report cheap
+    if (series->timeout_ms == 0.0 || series->fresh >= TIMING_MIN_SAMPLES)
+    {
+        memcpy(sorted, series->ms, series->count * sizeof(double));
+        series->timeout_ms = percentile(sorted, series->count, 99) * TIMING_MARGIN + TIMING_SLACK_MS;
+        series->fresh = 0;
+    }
+    return series->timeout_ms;
+}
+
+/*
+ * Timeout for the next transfer, learned or the caller's
+ */
+static unsigned int timing_timeout(TTiming *timing, TTimingSeries *series, double scale, unsigned int timeout)
+{
+    double learned = series_timeout(series);
+
+    if (learned == 0.0 || timing->path[0] == '\0')
+        return timeout;
+
+    learned = (learned - TIMING_SLACK_MS) * scale + TIMING_SLACK_MS;
+    if (learned >= timeout)
+        return timeout;
+    timing->adapted++;
+    return (unsigned int)(learned + 0.5);
+}
+
+static void timing_load(TTiming *timing)
+{
+    char line[4096];
+    FILE *fp = fopen(timing->path, "r");
+
+    if (fp == NULL)
+        return;
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, TIMING_MAGIC, strlen(TIMING_MAGIC)) != 0)
+    {
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char dir[8], kind[16];
+        int count = 0, used = 0;
+        char *p = line;
+        TTimingSeries *series = NULL;
+
+        if (sscanf(p, "%7s %15s %d%n", dir, kind, &count, &used) != 3)
+            continue;
+        series = (strcmp(dir, "IN") == 0) ? &timing->in[frame_kind_from_name(kind)] : &timing->out[frame_kind_from_name(kind)];
+        p += used;
+        for (int i = 0; i < count; i++)
+        {
+            double ms = 0.0;
+            if (sscanf(p, "%lf%n", &ms, &used) != 1)
+                break;
+            series_add(series, ms);
+            p += used;
+        }
+    }
+    fclose(fp);
+}
+
+// series nothing was learned for yet start at ms
+static void timing_seed(TTimingSeries *series, double ms)
+{
+    if (series->count > 0 || ms <= 0.0)
+        return;
+    for (int i = 0; i < TIMING_MIN_SAMPLES; i++)
+        series_add(series, ms);
+}
+
+static void timing_save_series(FILE *fp, const char *dir, int kind, TTimingSeries *series)
+{
+    // oldest first, so a reload keeps the ring order
+    int start = (series->count < TIMING_SAMPLES) ? 0 : series->next;
+
+    if (series->count == 0)
+        return;
+    fprintf(fp, "%s %s %d", dir, frame_kind_name(kind), series->count);
+    for (int i = 0; i < series->count; i++)
+        fprintf(fp, " %.3f", series->ms[(start + i) % TIMING_SAMPLES]);
+    fprintf(fp, "\n");
+}
+
+/*
+ * Pick up the model from an INFO response and load what is known about it
+ */
+static void timing_model(TTiming *timing, const char *info)
+{
+    TBootInfo bootinfo = {0};
+    TCalProfile calib;
+    char name[MAX_STRING_FIELD_LENGTH + 1];
+
+    bootInfo_buffer(&bootinfo, info);
+    memcpy(timing->model, bootinfo.sDevDsc.fValue, MAX_STRING_FIELD_LENGTH);
+    timing->model[MAX_STRING_FIELD_LENGTH] = '\0';
+    timing->mcu_size = bootinfo.ulMcuSize.fValue;
+
+    for (int i = 0; i <= MAX_STRING_FIELD_LENGTH; i++)
+    {
+        char c = timing->model[i];
+        name[i] = (c == '\0') ? '\0' : (isalnum((unsigned char)c) ? c : '_');
+        if (c == '\0')
+            break;
+    }
+    snprintf(timing->path, sizeof(timing->path), "%s/%s-%x.timing", timing->dir, name, timing->mcu_size);
+
+    // what was learned before INFO belongs to no model yet
+    memset(timing->out, 0, sizeof(timing->out));
+    memset(timing->in, 0, sizeof(timing->in));
+    timing_load(timing);
+
+    // a calibrated board starts out on what --calibrate measured
+    if (calib_load(&calib, timing->dir, &bootinfo) == 0)
+    {
+        timing_seed(&timing->in[cmdERASE], calib.erase_page_p99_ms);
+        timing_seed(&timing->in[cmdWRITE], calib.row_p99_ms);
+        timing_seed(&timing->out[cmdHEX], calib.report_p99_ms);
+    }
+}
+
+static int timing_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TTiming *timing = tp->ctx;
+    int kind = frame_classify(&timing->frame, (uint8_t *)data);
+    unsigned int limit = timing_timeout(timing, &timing->out[kind], 1.0, timeout);
+    double start = time_now_ms();
+    int result = timing->inner->write(timing->inner, data, length, transferred, limit);
+
+    if (kind == cmdERASE)
+        timing->erase_pages = (uint8_t)data[6] | ((uint8_t)data[7] << 8);
+
+    if (result >= 0)
+        series_add(&timing->out[kind], time_now_ms() - start);
+    else if (result == LIBUSB_ERROR_TIMEOUT && limit < timeout)
+        timing->expired++;
+    return result;
+}
+
+static int timing_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TTiming *timing = tp->ctx;
+    int kind = frame_answer(&timing->frame);
+    double pages = (kind == cmdERASE && timing->erase_pages > 0) ? timing->erase_pages : 1.0;
+    unsigned int limit = timing_timeout(timing, &timing->in[kind], pages, timeout);
+    double start = time_now_ms();
+    int result = timing->inner->read(timing->inner, data, length, transferred, limit);
+
+    if (result >= 0)
+    {
+        series_add(&timing->in[kind], (time_now_ms() - start) / pages);
+        if (kind == cmdINFO && timing->path[0] == '\0')
+            timing_model(timing, data);
+    }
+    else if (result == LIBUSB_ERROR_TIMEOUT && limit < timeout)
+    {
+        timing->expired++;
+    }
+    return result;
+}
+
+/*
+ * Wrap inner in a transport tp with learned timeouts, dir NULL =
+ * the per user state directory
+ */
+int timing_open(TTransport *tp, TTiming *timing, TTransport *inner, const char *dir)
+{
+    memset(timing, 0, sizeof(TTiming));
+    if (dir != NULL)
+    {
+        snprintf(timing->dir, sizeof(timing->dir), "%s", dir);
+        if (make_dir_path(dir) != 0)
+        {
+            fprintf(stderr, "Could not create %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    }
+    else if (user_dir("XDG_STATE_HOME", ".local/state", timing->dir, sizeof(timing->dir)) != 0)
+    {
+        fprintf(stderr, "No directory for timing profiles\n");
+        return -1;
+    }
+    timing->inner = inner;
+
+    tp->write = timing_write;
+    tp->read = timing_read;
+    tp->close = NULL;
+    tp->ctx = timing;
+    return 0;
+}
+
+/*
+ * Save the profile with this session's samples merged in
+ */
+int timing_close(TTiming *timing)
+{
+    FILE *fp = NULL;
+
+    if (timing->path[0] == '\0')
+        return 0;
+    fp = fopen(timing->path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not save timing profile %s: %s\n", timing->path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%s\n", TIMING_MAGIC);
+    for (int kind = 0; kind < SIM_KINDS; kind++)
+    {
+        timing_save_series(fp, "OUT", kind, &timing->out[kind]);
+        timing_save_series(fp, "IN", kind, &timing->in[kind]);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void report_timeout(FILE *out, const char *name, TTimingSeries *series, const char *unit)
+{
+    double timeout = series_timeout(series);
+
+    if (timeout == 0.0)
+        fprintf(out, ", %s learning (%d/%d)", name, series->count, TIMING_MIN_SAMPLES);
+    else
+        fprintf(out, ", %s %.0f ms%s", name, timeout, unit);
+}
+
+void timing_report(TTiming *timing, FILE *out)
+{
+    if (timing->path[0] == '\0')
+        return;
+    fprintf(out, "timing: %s (%x), %u transfers on learned timeouts, %u expired", timing->model, timing->mcu_size,
+            timing->adapted, timing->expired);
+    report_timeout(out, "SYNC", &timing->in[cmdSYNC], "");
+    report_timeout(out, "ERASE", &timing->in[cmdERASE], " per page");
+    report_timeout(out, "DATA", &timing->out[cmdHEX], "");
+    fprintf(out, "\n");
+}
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Trace.h"
+#include "Types.h"
+#include "Utils.h"
+
+/*
+ * Timeline trace in the Chrome trace-event format
+ *
+ * Every session gets its own track (a "process" in the viewer) with
+ * three lanes: the setupChiptoBoot() state machine, usb transfers
+ * from submit to completion, and host work such as hex parsing and
+ * progress output. Load the file in Perfetto or chrome://tracing to
+ * see where the wire sits idle.
+ */
+
+static const char *state_names[SIM_KINDS] = {
+    [cmdNON] = "conditioning",
+    [cmdSYNC] = "cmdSYNC",
+    [cmdINFO] = "cmdINFO",
+    [cmdBOOT] = "cmdBOOT",
+    [cmdREBOOT] = "cmdREBOOT",
+    [cmdWRITE] = "cmdWRITE",
+    [cmdERASE] = "cmdERASE",
+    [cmdCRC] = "cmdCRC verify",
+    [cmdHEX] = "cmdHEX burst"};
+
+static const char *transfer_names[2][SIM_KINDS] = {
+    {[cmdNON] = "OUT", [cmdSYNC] = "OUT SYNC", [cmdINFO] = "OUT INFO", [cmdBOOT] = "OUT BOOT",
+     [cmdREBOOT] = "OUT REBOOT", [cmdWRITE] = "OUT WRITE",
+     [cmdPACKED] = "OUT PACKED", [cmdCRC] = "OUT CRC", [cmdERASE] = "OUT ERASE", [cmdHEX] = "OUT DATA"},
+    {[cmdNON] = "IN", [cmdSYNC] = "IN SYNC", [cmdINFO] = "IN INFO", [cmdBOOT] = "IN BOOT",
+     [cmdREBOOT] = "IN REBOOT", [cmdWRITE] = "IN WRITE", [cmdCRC] = "IN CRC", [cmdERASE] = "IN ERASE", [cmdHEX] = "IN DATA"}};
+
+void trace_open(TTrace *trace)
+{
+    memset(trace, 0, sizeof(TTrace));
+    trace->origin_ms = time_now_ms();
+}
+
+/*
+ * Add a track for one session, call before the session's thread starts
+ */
+TTraceTrack *trace_add_track(TTrace *trace, const char *name)
+{
+    TTraceTrack *track = NULL;
+
+    if (trace->track_count >= TRACE_MAX_TRACKS)
+        return NULL;
+    track = calloc(1, sizeof(TTraceTrack));
+    if (track == NULL)
+        return NULL;
+
+    track->trace = trace;
+    track->id = trace->track_count + 1;
+    snprintf(track->name, sizeof(track->name), "%s", name);
+    trace->tracks[trace->track_count++] = track;
+    return track;
+}
+
+void trace_span(TTraceTrack *track, int lane, const char *cat, const char *name, double start_ms, double end_ms, const char *args)
+{
+    TTraceEvent *event = NULL;
+
+    if (track == NULL)
+        return;
+    if (track->count == track->capacity)
+    {
+        int capacity = (track->capacity == 0) ? 1024 : track->capacity * 2;
+        TTraceEvent *events = realloc(track->events, capacity * sizeof(TTraceEvent));
+        if (events == NULL)
+            return;
+        track->events = events;
+        track->capacity = capacity;
+    }
+
+    event = &track->events[track->count++];
+    event->name = name;
+    event->cat = cat;
+    event->lane = lane;
+    event->start_ms = start_ms;
+    event->end_ms = end_ms;
+    snprintf(event->args, sizeof(event->args), "%s", (args != NULL) ? args : "");
+}
+
+/*
+ * State machine transition, closes the running state span and opens
+ * one for cmd, cmdDONE only closes
+ */
+void trace_state(TTraceTrack *track, int cmd, int region)
+{
+    double now = time_now_ms();
+
+    if (track == NULL)
+        return;
+    if (track->state != NULL)
+    {
+        char args[32];
+        snprintf(args, sizeof(args), "\"region\":%d", track->state_region);
+        trace_span(track, TRACE_LANE_SESSION, "state", track->state, track->state_ms, now, args);
+    }
+
+    track->state = NULL;
+    if (cmd >= 0 && cmd < SIM_KINDS && state_names[cmd] != NULL)
+    {
+        track->state = state_names[cmd];
+        track->state_region = region;
+        track->state_ms = now;
+    }
+}
+
+static void trace_transfer(TTraceUsb *usb, int in, int kind, double start, int result, int length)
+{
+    char args[48];
+    const char *name = transfer_names[in][kind];
+
+    snprintf(args, sizeof(args), "\"result\":%d,\"length\":%d", result, length);
+    trace_span(usb->track, TRACE_LANE_USB, "usb", (name != NULL) ? name : transfer_names[in][cmdNON],
+               start, time_now_ms(), args);
+}
+
+static int trace_usb_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TTraceUsb *usb = tp->ctx;
+    double start = time_now_ms();
+    int kind = frame_classify(&usb->frame, (uint8_t *)data);
+    int result = usb->inner->write(usb->inner, data, length, transferred, timeout);
+
+    trace_transfer(usb, 0, kind, start, result, (result >= 0) ? *transferred : 0);
+    return result;
+}
+
+static int trace_usb_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    TTraceUsb *usb = tp->ctx;
+    double start = time_now_ms();
+    int result = usb->inner->read(usb->inner, data, length, transferred, timeout);
+
+    trace_transfer(usb, 1, frame_answer(&usb->frame), start, result, (result >= 0) ? *transferred : 0);
+    return result;
+}
+
+/*
+ * Wrap inner in a transport tp that traces onto track
+ */
+void trace_transport(TTransport *tp, TTraceUsb *usb, TTransport *inner, TTraceTrack *track)
+{
+    memset(usb, 0, sizeof(TTraceUsb));
+    usb->inner = inner;
+    usb->track = track;
+
+    tp->write = trace_usb_write;
+    tp->read = trace_usb_read;
+    tp->close = NULL;
+    tp->ctx = usb;
+}
+
+static void write_meta(FILE *fp, int pid, int tid, const char *what, const char *name, int *first)
+{
+    char escaped[128];
+
+    json_escape(name, escaped, sizeof(escaped));
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *first ? "" : ",", what, pid, tid, escaped);
+    *first = 0;
+}
+
+/*
+ * Write every track as a JSON trace-event file, times in us from trace_open
+ */
+int trace_write(TTrace *trace, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    int first = 1;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not create trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int t = 0; t < trace->track_count; t++)
+    {
+        TTraceTrack *track = trace->tracks[t];
+
+        // a session that ended early still shows its last state
+        trace_state(track, cmdDONE, 0);
+
+        write_meta(fp, track->id, 0, "process_name", track->name, &first);
+        write_meta(fp, track->id, TRACE_LANE_SESSION, "thread_name", "session", &first);
+        write_meta(fp, track->id, TRACE_LANE_USB, "thread_name", "usb", &first);
+        write_meta(fp, track->id, TRACE_LANE_HOST, "thread_name", "host", &first);
+
+        for (int i = 0; i < track->count; i++)
+        {
+            TTraceEvent *event = &track->events[i];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":%d,\"tid\":%d,\"args\":{%s}}",
+                    event->name, event->cat, (event->start_ms - trace->origin_ms) * 1000.0,
+                    (event->end_ms - event->start_ms) * 1000.0, track->id, event->lane, event->args);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return 0;
+}
+
+void trace_close(TTrace *trace)
+{
+    for (int t = 0; t < trace->track_count; t++)
+    {
+        free(trace->tracks[t]->events);
+        free(trace->tracks[t]);
+        trace->tracks[t] = NULL;
+    }
+    trace->track_count = 0;
+}
@@ -9,6 +9,9 @@
     #endif
 #endif
 
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -21,22 +24,24 @@
 #include <linux/types.h>
 #include <linux/input.h>
 #include <linux/hidraw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 #endif
 
 #include "USB.h"
 #include "Types.h"
 #include "HexFile.h"
+#include "Utils.h"
 
 // 1 = print out info relating to usb transfers
 #define DEBUG 1
 
 // Set to 1 to enable debug printf statements
-// Set to 0 to hide USB packet dumps (file logging still works if DEBUG == 1)
+// Set to 0 to hide USB packet dumps (use --record for a full session capture)
 #define DEBUG_PRINT 0
 
-static FILE *packet_log = NULL;
-static int packet_counter = 0;
-
 static const int CONTROL_REQUEST_TYPE_IN = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
 static const int CONTROL_REQUEST_TYPE_OUT = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
 
@@ -52,14 +57,77 @@ static const int HID_REPORT_TYPE_FEATURE = 0x03;
 
 static const int TIMEOUT_MS = 5000;
 
+// Assumes interrupt endpoint 2 IN and OUT:
+static const int INTERRUPT_IN_ENDPOINT = 0x81;
+static const int INTERRUPT_OUT_ENDPOINT = 0x01;
+
+static int usb_write(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    return libusb_interrupt_transfer(tp->ctx, INTERRUPT_OUT_ENDPOINT, data, length, transferred, timeout);
+}
+
+static int usb_read(TTransport *tp, char *data, int length, int *transferred, unsigned int timeout)
+{
+    return libusb_interrupt_transfer(tp->ctx, INTERRUPT_IN_ENDPOINT, data, length, transferred, timeout);
+}
+
+/*
+ * Transport over a claimed libusb device handle
+ */
+void usb_transport(TTransport *tp, libusb_device_handle *devh)
+{
+    tp->write = usb_write;
+    tp->read = usb_read;
+    tp->close = NULL;
+    tp->ctx = devh;
+}
+
+/*
+ * Read the answer to a command sent earlier.
+ * Returns - zero on success, libusb error code on failure.
+ */
+int boot_interrupt_answer(TTransport *tp, char *data_in)
+{
+    int bytes_transferred;
+    int i = 0;
+    int result = tp->read(
+        tp,
+        data_in,
+        MAX_INTERRUPT_OUT_TRANSFER_SIZE,
+        &bytes_transferred,
+        TIMEOUT_MS);
+
+    if (result >= 0)
+    {
+        if (bytes_transferred > 0)
+        {
+#if DEBUG == 1 && DEBUG_PRINT == 1
+            // printf("Data received via interrupt transfer:\n");
+            for (i = 0; i < bytes_transferred; i++)
+            {
+                printf("%02x ", data_in[i] & 0xff);
+            }
+            printf("\n");
+#endif
+        }
+        else
+        {
+            error_report("No data received in interrupt transfer (%d)\n", result);
+            return -1;
+        }
+    }
+    else
+    {
+        error_report("mcu rebooted! %d\n", result); //"Error receiving data via interrupt transfer %d\n", result);
+        return result;
+    }
+    return 0;
+}
+
 // Use interrupt transfers to to write data to the device and receive data from the device.
 // Returns - zero on success, libusb error code on failure.
-int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *data_out, uint8_t out_only)
+int boot_interrupt_transfers(TTransport *tp, char *data_in, char *data_out, uint8_t out_only)
 {
-    // Assumes interrupt endpoint 2 IN and OUT:
-    static const int INTERRUPT_IN_ENDPOINT = 0x81;
-    static const int INTERRUPT_OUT_ENDPOINT = 0x01;
-
     // With firmware support, transfers can be > the endpoint's max packet size.
     int bytes_transferred;
     int i = 0;
@@ -67,9 +135,8 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
 
     // Write data to the device.
 
-    result = libusb_interrupt_transfer(
-        devh,
-        INTERRUPT_OUT_ENDPOINT,
+    result = tp->write(
+        tp,
         data_out,
         MAX_INTERRUPT_OUT_TRANSFER_SIZE,
         &bytes_transferred,
@@ -77,27 +144,6 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
 
     if (result >= 0 | out_only == 1)
     {
-#if DEBUG == 1
-        // Open log file on first packet
-        if (packet_log == NULL)
-        {
-            packet_log = fopen("our_packets.txt", "w");
-        }
-        
-        // Log packet to file (same format as dissect file - 128 hex chars per line)
-        if (packet_log != NULL)
-        {
-            // Only log 64 bytes (128 hex chars) to match PCAP format
-            int bytes_to_log = (bytes_transferred > 64) ? 64 : bytes_transferred;
-            for (i = 0; i < bytes_to_log; i++)
-            {
-                fprintf(packet_log, "%02x", data_out[i] & 0xff);
-            }
-            fprintf(packet_log, "\n");
-            fflush(packet_log);
-        }
-#endif
-        
 #if DEBUG == 2
         //  printf("Data sent via interrupt transfer:\n");
         for (i = 0; i < bytes_transferred; i++)
@@ -111,48 +157,605 @@ int boot_interrupt_transfers(libusb_device_handle *devh, char *data_in, char *da
             return result;
 
         // Read data from the device.
+        return boot_interrupt_answer(tp, data_in);
+    }
+    else
+    {
+        if (out_only != 2)
+            error_report("Error sending data via interrupt transfer %d\n", result);
+        else
+            error_report("Device has been re-booted! %d\n", result);
+
+        return result;
+    }
+    return 0;
+}
+
+/*
+ * Device selectors
+ *
+ * Opening by vid:pid has libusb enumerate every device on every bus
+ * and takes whichever bootloader comes first. Launched from a udev
+ * rule or a fixture controller, the caller already knows which node
+ * it means, so a selector can name it directly:
+ *
+ *   any                    first bootloader found, full enumeration
+ *   bus:address            as lsusb shows it, full enumeration
+ *   /dev/bus/usb/BBB/DDD   the usbfs node, opened and wrapped
+ *   fd:N                   an inherited usbfs fd, wrapped, stays the caller's
+ *   port:1-4.2             the sysfs port path, resolved to its node
+ *   serial:SN              the USB serial number, looked up in sysfs
+ *
+ * Nodes and fds go through libusb_wrap_sys_device() and nothing else
+ * on the bus is touched, ports and serial numbers are resolved from
+ * sysfs first and fall back to enumeration where there is none.
+ * Whatever is opened has to be a bootloader or it is closed again.
+ */
+enum
+{
+    USB_SEL_ANY,
+    USB_SEL_BUSADDR,
+    USB_SEL_NODE,
+    USB_SEL_FD,
+    USB_SEL_PORT,
+    USB_SEL_SERIAL,
+    USB_SEL_BAD
+};
+
+#define USB_SYSFS_DEVICES "/sys/bus/usb/devices"
+
+// usbfs fds opened here for a wrapped handle, closed with it
+#define USB_MAX_WRAPPED 64
+
+static int usb_selector_kind(const char *selector, unsigned int *bus, unsigned int *address, int *fd)
+{
+    char *end = NULL;
+
+    if (selector == NULL || selector[0] == '\0' || strcmp(selector, "any") == 0)
+        return USB_SEL_ANY;
+    if (selector[0] == '/')
+        return USB_SEL_NODE;
+    if (strncmp(selector, "fd:", 3) == 0)
+    {
+        long n = strtol(selector + 3, &end, 10);
+        if (end == selector + 3 || *end != '\0' || n < 0)
+            return USB_SEL_BAD;
+        *fd = (int)n;
+        return USB_SEL_FD;
+    }
+    if (strncmp(selector, "port:", 5) == 0 && selector[5] != '\0')
+        return USB_SEL_PORT;
+    if (strncmp(selector, "serial:", 7) == 0 && selector[7] != '\0')
+        return USB_SEL_SERIAL;
+    if (sscanf(selector, "%u:%u", bus, address) == 2)
+        return USB_SEL_BUSADDR;
+    return USB_SEL_BAD;
+}
+
+static int usb_is_bootloader(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+
+    return libusb_get_device_descriptor(dev, &desc) == 0 && desc.idVendor == BOOTLOADER_VID &&
+           desc.idProduct == BOOTLOADER_PID;
+}
+
+#ifndef _WIN32
 
-        result = libusb_interrupt_transfer(
-            devh,
-            INTERRUPT_IN_ENDPOINT,
-            data_in,
-            MAX_INTERRUPT_OUT_TRANSFER_SIZE,
-            &bytes_transferred,
-            TIMEOUT_MS);
+static struct
+{
+    libusb_device_handle *devh;
+    int fd;
+} usb_wrapped[USB_MAX_WRAPPED];
+static pthread_mutex_t usb_wrapped_lock = PTHREAD_MUTEX_INITIALIZER;
 
-        if (result >= 0)
+static void usb_wrapped_add(libusb_device_handle *devh, int fd)
+{
+    pthread_mutex_lock(&usb_wrapped_lock);
+    for (int i = 0; i < USB_MAX_WRAPPED; i++)
+    {
+        if (usb_wrapped[i].devh == NULL)
         {
-            if (bytes_transferred > 0)
-            {
-#if DEBUG == 1 && DEBUG_PRINT == 1
-                // printf("Data received via interrupt transfer:\n");
-                for (i = 0; i < bytes_transferred; i++)
-                {
-                    printf("%02x ", data_in[i] & 0xff);
-                }
-                printf("\n");
-#endif
-            }
-            else
-            {
-                fprintf(stderr, "No data received in interrupt transfer (%d)\n", result);
-                return -1;
-            }
+            usb_wrapped[i].devh = devh;
+            usb_wrapped[i].fd = fd;
+            break;
         }
-        else
+    }
+    pthread_mutex_unlock(&usb_wrapped_lock);
+}
+
+// the fd opened for devh, -1 for one not wrapped here
+static int usb_wrapped_take(libusb_device_handle *devh)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&usb_wrapped_lock);
+    for (int i = 0; i < USB_MAX_WRAPPED; i++)
+    {
+        if (usb_wrapped[i].devh == devh)
         {
-            fprintf(stderr, "mcu rebooted! %d\n", result); //"Error receiving data via interrupt transfer %d\n", result);
-            return result;
+            fd = usb_wrapped[i].fd;
+            usb_wrapped[i].devh = NULL;
+            break;
         }
     }
+    pthread_mutex_unlock(&usb_wrapped_lock);
+    return fd;
+}
+
+/*
+ * Handle on a usbfs fd, NULL when libusb won't take it or it is not a
+ * bootloader
+ */
+static libusb_device_handle *usb_wrap(libusb_context *ctx, int fd, const char *name)
+{
+    libusb_device_handle *devh = NULL;
+    int result = libusb_wrap_sys_device(ctx, (intptr_t)fd, &devh);
+
+    if (result < 0)
+    {
+        fprintf(stderr, "%s: libusb_wrap_sys_device error %d\n", name, result);
+        return NULL;
+    }
+    if (!usb_is_bootloader(libusb_get_device(devh)))
+    {
+        fprintf(stderr, "%s is not a %04x:%04x bootloader\n", name, BOOTLOADER_VID, BOOTLOADER_PID);
+        libusb_close(devh);
+        return NULL;
+    }
+    return devh;
+}
+
+static libusb_device_handle *usb_wrap_node(libusb_context *ctx, const char *node)
+{
+    libusb_device_handle *devh = NULL;
+    int fd = open(node, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", node, strerror(errno));
+        return NULL;
+    }
+    devh = usb_wrap(ctx, fd, node);
+    if (devh == NULL)
+        close(fd);
     else
+        usb_wrapped_add(devh, fd);
+    return devh;
+}
+
+// first line of a sysfs attribute, -1 when there is none
+static int usb_sysfs_read(const char *dir, const char *attr, char *out, size_t len)
+{
+    char path[512];
+    FILE *fp = NULL;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", USB_SYSFS_DEVICES, dir, attr);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if (fgets(out, (int)len, fp) == NULL)
+        out[0] = '\0';
+    fclose(fp);
+    out[strcspn(out, "\r\n")] = '\0';
+    return 0;
+}
+
+// usbfs node of a sysfs device directory
+static int usb_sysfs_node(const char *dir, char *node, size_t len)
+{
+    char busnum[16], devnum[16];
+
+    if (usb_sysfs_read(dir, "busnum", busnum, sizeof(busnum)) != 0 ||
+        usb_sysfs_read(dir, "devnum", devnum, sizeof(devnum)) != 0)
+        return -1;
+    snprintf(node, len, "/dev/bus/usb/%03d/%03d", atoi(busnum), atoi(devnum));
+    return 0;
+}
+
+/*
+ * usbfs node of a port: or serial: selector from sysfs, -1 when sysfs
+ * does not know it
+ */
+static int usb_sysfs_lookup(int kind, const char *selector, char *node, size_t len)
+{
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+    int found = -1;
+
+    if (kind == USB_SEL_PORT)
+        return usb_sysfs_node(selector + 5, node, len);
+
+    // device directories only, interfaces carry a ':'
+    if ((dir = opendir(USB_SYSFS_DEVICES)) == NULL)
+        return -1;
+    while (found != 0 && (entry = readdir(dir)) != NULL)
     {
-        if (out_only != 2)
-            fprintf(stderr, "Error sending data via interrupt transfer %d\n", result);
+        char serial[256];
+
+        if (entry->d_name[0] == '.' || strchr(entry->d_name, ':') != NULL)
+            continue;
+        if (usb_sysfs_read(entry->d_name, "serial", serial, sizeof(serial)) == 0 && strcmp(serial, selector + 7) == 0)
+            found = usb_sysfs_node(entry->d_name, node, len);
+    }
+    closedir(dir);
+    return found;
+}
+
+#endif
+
+// libusb_close() and the usbfs fd opened for it, if any
+static void usb_close_handle(libusb_device_handle *devh)
+{
+#ifndef _WIN32
+    int fd = usb_wrapped_take(devh);
+
+    libusb_close(devh);
+    if (fd >= 0)
+        close(fd);
+#else
+    libusb_close(devh);
+#endif
+}
+
+/*
+ * 1 when the selector names its device without an enumeration, so a
+ * libusb context for it can be set up with device discovery off, -1
+ * for one that is not a selector at all
+ */
+int usb_selector_direct(const char *selector)
+{
+    unsigned int bus = 0, address = 0;
+    int fd = -1;
+    int kind = usb_selector_kind(selector, &bus, &address, &fd);
+
+    if (kind == USB_SEL_BAD)
+        return -1;
+#ifdef _WIN32
+    return 0;
+#else
+    char node[64];
+
+    if (kind == USB_SEL_NODE || kind == USB_SEL_FD)
+        return 1;
+    if (kind == USB_SEL_PORT || kind == USB_SEL_SERIAL)
+        return usb_sysfs_lookup(kind, selector, node, sizeof(node)) == 0;
+    return 0;
+#endif
+}
+
+// port chain of an enumerated device as usb_topo_name() writes it
+static int usb_port_matches(libusb_device *dev, const char *port)
+{
+    TUsbTopo topo;
+    char name[32];
+    int depth = 0;
+
+    memset(&topo, 0, sizeof(topo));
+    topo.bus = libusb_get_bus_number(dev);
+    depth = libusb_get_port_numbers(dev, topo.ports, USB_MAX_PORT_DEPTH);
+    topo.depth = (depth > 0) ? depth : 0;
+    usb_topo_name(&topo, topo.depth, name, sizeof(name));
+    return strcmp(name, port) == 0;
+}
+
+/*
+ * The bootloader a selector names, by enumerating every device
+ */
+static libusb_device_handle *usb_enumerate(libusb_context *ctx, int kind, const char *selector, unsigned int bus,
+                                           unsigned int address)
+{
+    libusb_device_handle *devh = NULL;
+    libusb_device **list = NULL;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+
+    for (ssize_t i = 0; i < count && devh == NULL; i++)
+    {
+        struct libusb_device_descriptor desc;
+        unsigned char serial[256];
+
+        if (kind == USB_SEL_BUSADDR &&
+            (libusb_get_bus_number(list[i]) != bus || libusb_get_device_address(list[i]) != address))
+            continue;
+        if (kind == USB_SEL_PORT && !usb_port_matches(list[i], selector + 5))
+            continue;
+        if (!usb_is_bootloader(list[i]) || libusb_open(list[i], &devh) < 0)
+        {
+            devh = NULL;
+            continue;
+        }
+        // the serial number is only read from an open device
+        if (kind == USB_SEL_SERIAL &&
+            (libusb_get_device_descriptor(list[i], &desc) < 0 || desc.iSerialNumber == 0 ||
+             libusb_get_string_descriptor_ascii(devh, desc.iSerialNumber, serial, sizeof(serial)) < 0 ||
+             strcmp((char *)serial, selector + 7) != 0))
+        {
+            libusb_close(devh);
+            devh = NULL;
+        }
+    }
+    if (list != NULL)
+        libusb_free_device_list(list, 1);
+    return devh;
+}
+
+/*
+ * Open and claim the bootloader interface.
+ * selector: one of the forms above, NULL or "" = any
+ * Returns NULL when no matching device could be opened and claimed.
+ */
+libusb_device_handle *usb_open_bootloader(libusb_context *ctx, const char *selector)
+{
+    libusb_device_handle *devh = NULL;
+    unsigned int bus = 0, address = 0;
+    int fd = -1;
+    int kind = usb_selector_kind(selector, &bus, &address, &fd);
+    int result = 0;
+
+    if (kind == USB_SEL_BAD)
+    {
+        fprintf(stderr, "Unknown device selector %s\n", selector);
+        return NULL;
+    }
+    if (kind == USB_SEL_ANY)
+    {
+        devh = libusb_open_device_with_vid_pid(ctx, BOOTLOADER_VID, BOOTLOADER_PID);
+    }
+#ifndef _WIN32
+    else if (kind == USB_SEL_NODE)
+    {
+        devh = usb_wrap_node(ctx, selector);
+    }
+    else if (kind == USB_SEL_FD)
+    {
+        devh = usb_wrap(ctx, fd, selector);
+    }
+    else if (kind == USB_SEL_PORT || kind == USB_SEL_SERIAL)
+    {
+        char node[64];
+
+        if (usb_sysfs_lookup(kind, selector, node, sizeof(node)) == 0)
+            devh = usb_wrap_node(ctx, node);
         else
-            fprintf(stderr, "Device has been re-booted! %d\n", result);
+            devh = usb_enumerate(ctx, kind, selector, bus, address);
+    }
+#endif
+    else
+    {
+        devh = usb_enumerate(ctx, kind, selector, bus, address);
+    }
 
-        return result;
+    if (devh == NULL)
+        return NULL;
+
+    // The HID has been detected.
+    // Detach the hidusb driver from the HID to enable using libusb.
+    // Note: This is Linux-specific and not needed on Windows
+#ifndef _WIN32
+    libusb_detach_kernel_driver(devh, INTERFACE_NUMBER);
+#endif
+    result = libusb_claim_interface(devh, INTERFACE_NUMBER);
+    if (result < 0)
+    {
+        fprintf(stderr, "libusb_claim_interface error %d\n", result);
+        usb_close_handle(devh);
+        return NULL;
     }
+    return devh;
+}
+
+/*
+ * Bus and port chain of an open device, depth 0 when the platform
+ * does not tell
+ */
+int usb_topology(libusb_device_handle *devh, TUsbTopo *topo)
+{
+    libusb_device *dev = libusb_get_device(devh);
+    int depth = 0;
+
+    memset(topo, 0, sizeof(TUsbTopo));
+    if (dev == NULL)
+        return -1;
+    topo->bus = libusb_get_bus_number(dev);
+    depth = libusb_get_port_numbers(dev, topo->ports, USB_MAX_PORT_DEPTH);
+    topo->depth = (depth > 0) ? depth : 0;
     return 0;
 }
+
+/*
+ * "bus-port.port..." of the first depth ports, "bus" for depth 0
+ */
+void usb_topo_name(const TUsbTopo *topo, int depth, char *out, size_t len)
+{
+    int n = snprintf(out, len, "%u", topo->bus);
+
+    if (depth > topo->depth)
+        depth = topo->depth;
+    for (int i = 0; i < depth && n > 0 && (size_t)n < len; i++)
+        n += snprintf(out + n, len - n, "%c%u", (i == 0) ? '-' : '.', topo->ports[i]);
+}
+
+/*
+ * Release the interface and close a handle from usb_open_bootloader
+ */
+void usb_close_bootloader(libusb_device_handle *devh)
+{
+    if (devh == NULL)
+        return;
+    libusb_release_interface(devh, INTERFACE_NUMBER);
+    usb_close_handle(devh);
+}
+
+// dev sits on port, any port with depth 0
+static int usb_on_port(libusb_device *dev, const TUsbTopo *port)
+{
+    uint8_t ports[USB_MAX_PORT_DEPTH];
+    int depth = 0;
+
+    if (port->depth == 0)
+        return 1;
+    depth = libusb_get_port_numbers(dev, ports, USB_MAX_PORT_DEPTH);
+    return libusb_get_bus_number(dev) == port->bus && depth == port->depth &&
+           memcmp(ports, port->ports, depth) == 0;
+}
+
+static int usb_wait_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    TUsbWait *w = (TUsbWait *)user_data;
+
+    if (!usb_on_port(dev, &w->port))
+        return 0;
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && !w->arrived)
+    {
+        w->arrived_ms = time_now_ms();
+        w->arrived = 1;
+    }
+    else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && !w->left)
+    {
+        w->left_ms = time_now_ms();
+        w->left = 1;
+    }
+    return 0;
+}
+
+static int usb_present(libusb_context *ctx, uint16_t vid, uint16_t pid, const TUsbTopo *port)
+{
+    libusb_device **list = NULL;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    int found = 0;
+
+    for (ssize_t i = 0; i < count && !found; i++)
+    {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) == 0 && desc.idVendor == vid && desc.idProduct == pid &&
+            usb_on_port(list[i], port))
+            found = 1;
+    }
+    if (list != NULL)
+        libusb_free_device_list(list, 1);
+    return found;
+}
+
+/*
+ * Start watching vid:pid, a device already on the bus counts as arrived
+ */
+int usb_wait_arm(TUsbWait *w, libusb_context *ctx, uint16_t vid, uint16_t pid)
+{
+    return usb_wait_arm_port(w, ctx, vid, pid, NULL);
+}
+
+/*
+ * The same for one port, several boards of one model flashed at once
+ * each wait for their own
+ */
+int usb_wait_arm_port(TUsbWait *w, libusb_context *ctx, uint16_t vid, uint16_t pid, const TUsbTopo *port)
+{
+    memset(w, 0, sizeof(TUsbWait));
+    w->ctx = ctx;
+    w->vid = vid;
+    w->pid = pid;
+    if (port != NULL)
+        w->port = *port;
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+        libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                         LIBUSB_HOTPLUG_ENUMERATE, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY,
+                                         usb_wait_callback, w, &w->handle) == LIBUSB_SUCCESS)
+    {
+        w->hotplug = 1;
+        return 0;
+    }
+
+    w->present = usb_present(ctx, vid, pid, &w->port);
+    if (w->present)
+    {
+        w->arrived_ms = time_now_ms();
+        w->arrived = 1;
+    }
+    return 0;
+}
+
+// without hotplug, arrival and removal are presence changes between polls
+static void usb_wait_poll(TUsbWait *w)
+{
+    int present = usb_present(w->ctx, w->vid, w->pid, &w->port);
+
+    if (present && !w->present && !w->arrived)
+    {
+        w->arrived_ms = time_now_ms();
+        w->arrived = 1;
+    }
+    else if (!present && w->present && !w->left)
+    {
+        w->left_ms = time_now_ms();
+        w->left = 1;
+    }
+    w->present = present;
+}
+
+static int usb_wait_seen(TUsbWait *w, libusb_hotplug_event event)
+{
+    return (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) ? w->arrived : w->left;
+}
+
+/*
+ * Block until event has been seen on any of waits (all on one context)
+ * or deadline_ms (time_now_ms clock) passes. Returns the index of the
+ * first wait that saw it, LIBUSB_ERROR_TIMEOUT otherwise.
+ */
+int usb_wait_first(TUsbWait **waits, int count, libusb_hotplug_event event, double deadline_ms)
+{
+    for (;;)
+    {
+        double remaining = 0.0;
+        int first = -1;
+
+        // several may have fired in one batch of events, report the earliest
+        for (int i = 0; i < count; i++)
+        {
+            if (!usb_wait_seen(waits[i], event))
+                continue;
+            if (first < 0 ||
+                (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? waits[i]->arrived_ms < waits[first]->arrived_ms
+                                                             : waits[i]->left_ms < waits[first]->left_ms))
+                first = i;
+        }
+        if (first >= 0)
+            return first;
+
+        remaining = deadline_ms - time_now_ms();
+        if (remaining <= 0.0)
+            return LIBUSB_ERROR_TIMEOUT;
+
+        if (waits[0]->hotplug)
+        {
+            struct timeval tv;
+            tv.tv_sec = (long)(remaining / 1000.0);
+            tv.tv_usec = (long)((remaining - tv.tv_sec * 1000.0) * 1000.0);
+            libusb_handle_events_timeout_completed(waits[0]->ctx, &tv, NULL);
+            continue;
+        }
+
+        // no hotplug support, look at the bus every USB_WAIT_POLL_MS
+        sleep_ms(remaining < USB_WAIT_POLL_MS ? remaining : USB_WAIT_POLL_MS);
+        for (int i = 0; i < count; i++)
+            usb_wait_poll(waits[i]);
+    }
+}
+
+/*
+ * Block until event has been seen or deadline_ms passes, returns 0 on
+ * the event, LIBUSB_ERROR_TIMEOUT otherwise
+ */
+int usb_wait_for(TUsbWait *w, libusb_hotplug_event event, double deadline_ms)
+{
+    int result = usb_wait_first(&w, 1, event, deadline_ms);
+    return (result < 0) ? result : 0;
+}
+
+void usb_wait_disarm(TUsbWait *w)
+{
+    if (w->hotplug)
+        libusb_hotplug_deregister_callback(w->ctx, w->handle);
+    w->hotplug = 0;
+}
@@ -1,6 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+#include <windows.h>
+#include <direct.h>
+#include <errno.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <errno.h>
+#define make_dir(path) mkdir(path, 0755)
+#endif
 
 #include "Types.h"
 #include "Utils.h"
@@ -60,4 +77,453 @@ uint32_t transform_2words_long(uint16_t a, uint16_t b)
     uint16_t temp16 = a;
     uint32_t temp32 = (a & 0xffff) << 16;
     return temp32 |= b;
-}
\ No newline at end of file
+}
+/*
+ * Monotonic time in milliseconds, only differences are meaningful
+ */
+double time_now_ms(void)
+{
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+/*
+ * Sleep for a fractional number of milliseconds
+ */
+void sleep_ms(double ms)
+{
+    if (ms <= 0.0)
+        return;
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    Sleep((DWORD)(ms + 0.5));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ms / 1000.0);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000.0);
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+#endif
+}
+
+/*
+ * mkdir -p, returns 0 when path is a directory afterwards
+ */
+int make_dir_path(const char *path)
+{
+    char buf[512];
+
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; *p != '\0'; p++)
+    {
+        if (*p == '/' || *p == '\\')
+        {
+            char c = *p;
+            *p = '\0';
+            make_dir(buf);
+            *p = c;
+        }
+    }
+    if (make_dir(buf) != 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+/*
+ * Per user mikro_hb directory, created when missing:
+ *   $xdg_env/mikro_hb, else $HOME/home_default/mikro_hb
+ *   (%LOCALAPPDATA%\mikro_hb on Windows)
+ * returns 0 with the path in out
+ */
+int user_dir(const char *xdg_env, const char *home_default, char *out, size_t len)
+{
+    const char *base = getenv(xdg_env);
+
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    if (base == NULL || base[0] == '\0')
+        base = getenv("LOCALAPPDATA");
+    if (base == NULL)
+        return -1;
+    snprintf(out, len, "%s\\mikro_hb", base);
+#else
+    if (base != NULL && base[0] != '\0')
+    {
+        snprintf(out, len, "%s/mikro_hb", base);
+    }
+    else
+    {
+        const char *home = getenv("HOME");
+        if (home == NULL)
+            return -1;
+        snprintf(out, len, "%s/%s/mikro_hb", home, home_default);
+    }
+#endif
+    return make_dir_path(out);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest rank percentile, p in 0..100, sorts values in place
+ */
+double percentile(double *values, int count, double p)
+{
+    int rank = 0;
+
+    if (count <= 0)
+        return 0.0;
+    qsort(values, count, sizeof(double), compare_double);
+    rank = (int)ceil(p / 100.0 * count) - 1;
+    if (rank < 0)
+        rank = 0;
+    if (rank >= count)
+        rank = count - 1;
+    return values[rank];
+}
+
+/*
+ * xorshift64*, reproducible from a seed on every platform
+ */
+uint64_t rand_next(uint64_t *state)
+{
+    if (*state == 0)
+        *state = 0x9e3779b97f4a7c15ULL;
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * FNV-1a 64 bit hash, pass FNV1A_64_INIT as hash for the first block
+ * and the previous result to continue over several blocks
+ */
+uint64_t fnv1a_64(const void *data, size_t len, uint64_t hash)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * CRC-32 (IEEE 802.3, reflected 0xEDB88320) as the PIC32 DMA CRC
+ * computes it, pass 0 for the first block and the previous result to
+ * continue
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    static const uint32_t nibble[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    const uint8_t *bytes = data;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ nibble[crc & 0x0f];
+        crc = (crc >> 4) ^ nibble[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+/*
+ * Hash the contents of a file into hash, returns -1 if it can't be read
+ */
+int fnv1a_64_file(const char *path, uint64_t *hash)
+{
+    uint8_t buf[4096];
+    size_t n = 0;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        *hash = fnv1a_64(buf, n, *hash);
+
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Minimal json helpers for the flat, one line objects used by the
+ * daemon and the profile files, no nesting beyond arrays of strings
+ * and flat objects.
+ */
+static const char *json_find_value(const char *json, const char *key)
+{
+    size_t key_len = strlen(key);
+    const char *p = json;
+
+    while ((p = strchr(p, '"')) != NULL)
+    {
+        p++;
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '"')
+        {
+            p += key_len + 1;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == ':')
+            {
+                p++;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                return p;
+            }
+        }
+        // skip the rest of this string
+        while (*p != '\0' && *p != '"')
+        {
+            if (*p == '\\' && p[1] != '\0')
+                p++;
+            p++;
+        }
+        if (*p == '\0')
+            break;
+        p++;
+    }
+    return NULL;
+}
+
+// copy the json string starting at p (on the opening quote), returns end or NULL
+static const char *json_copy_string(const char *p, char *out, size_t len)
+{
+    size_t i = 0;
+
+    if (*p != '"')
+        return NULL;
+    p++;
+    while (*p != '\0' && *p != '"')
+    {
+        char c = *p;
+        if (c == '\\' && p[1] != '\0')
+        {
+            p++;
+            c = (*p == 'n') ? '\n' : (*p == 't') ? '\t' : *p;
+        }
+        if (i + 1 < len)
+            out[i++] = c;
+        p++;
+    }
+    if (len > 0)
+        out[i] = '\0';
+    return (*p == '"') ? p + 1 : NULL;
+}
+
+int json_get_string(const char *json, const char *key, char *out, size_t len)
+{
+    const char *p = json_find_value(json, key);
+    if (p == NULL || json_copy_string(p, out, len) == NULL)
+        return -1;
+    return 0;
+}
+
+int json_get_long(const char *json, const char *key, long *out)
+{
+    const char *p = json_find_value(json, key);
+    char *end = NULL;
+    if (p == NULL)
+        return -1;
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0)
+    {
+        *out = (*p == 't');
+        return 0;
+    }
+    *out = strtol(p, &end, 0);
+    return (end == p) ? -1 : 0;
+}
+
+int json_get_double(const char *json, const char *key, double *out)
+{
+    const char *p = json_find_value(json, key);
+    char *end = NULL;
+    if (p == NULL)
+        return -1;
+    *out = strtod(p, &end);
+    return (end == p) ? -1 : 0;
+}
+
+/*
+ * Fetch entry index of an array of strings, returns -1 past the end
+ */
+int json_get_string_at(const char *json, const char *key, int index, char *out, size_t len)
+{
+    const char *p = json_find_value(json, key);
+    if (p == NULL || *p != '[')
+        return -1;
+    p++;
+
+    for (int i = 0;; i++)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p != '"')
+            return -1;
+        if (i == index)
+            return (json_copy_string(p, out, len) != NULL) ? 0 : -1;
+
+        char skip[2];
+        p = json_copy_string(p, skip, sizeof(skip));
+        if (p == NULL)
+            return -1;
+    }
+}
+
+// past the json value at p, a string, a flat object or array or a scalar
+static const char *json_skip_value(const char *p)
+{
+    char skip[2];
+    int depth = 0;
+
+    while (*p != '\0')
+    {
+        if (*p == '"')
+        {
+            p = json_copy_string(p, skip, sizeof(skip));
+            if (p == NULL)
+                return NULL;
+            if (depth == 0)
+                return p;
+            continue;
+        }
+        if (*p == '{' || *p == '[')
+            depth++;
+        else if (*p == '}' || *p == ']')
+        {
+            if (depth == 0)
+                return p;
+            if (--depth == 0)
+                return p + 1;
+        }
+        else if (*p == ',' && depth == 0)
+            return p;
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Copy the object value of key, braces included, -1 without key, -2
+ * when it is not an object or does not fit
+ */
+int json_get_object(const char *json, const char *key, char *out, size_t len)
+{
+    const char *p = json_find_value(json, key);
+    const char *end = NULL;
+
+    if (p == NULL)
+        return -1;
+    if (*p != '{' || (end = json_skip_value(p)) == NULL || (size_t)(end - p) >= len)
+        return -2;
+    memcpy(out, p, end - p);
+    out[end - p] = '\0';
+    return 0;
+}
+
+/*
+ * Name of member index of a flat object, -1 past the last one
+ */
+int json_key_at(const char *json, int index, char *out, size_t len)
+{
+    const char *p = json;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p != '{')
+        return -1;
+    p++;
+
+    for (int i = 0;; i++)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p != '"')
+            return -1;
+        p = json_copy_string(p, out, len);
+        if (p == NULL)
+            return -1;
+        if (i == index)
+            return 0;
+        while (*p == ' ' || *p == '\t' || *p == ':')
+            p++;
+        p = json_skip_value(p);
+        if (p == NULL)
+            return -1;
+    }
+}
+
+/*
+ * Escape a string for use inside json quotes, control characters
+ * included, a string that does not fit is cut between characters
+ */
+void json_escape(const char *in, char *out, size_t len)
+{
+    size_t i = 0;
+    for (; *in != '\0' && i + 2 < len; in++)
+    {
+        unsigned char c = (unsigned char)*in;
+        if (c < 0x20 && c != '\n' && c != '\t')
+        {
+            if (i + 7 > len)
+                break;
+            i += snprintf(out + i, len - i, "\\u%04x", c);
+            continue;
+        }
+        if (c == '"' || c == '\\' || c == '\n' || c == '\t')
+            out[i++] = '\\';
+        out[i++] = (c == '\n') ? 'n' : (c == '\t') ? 't' : *in;
+    }
+    out[i] = '\0';
+}
+
+/*
+ * Errors of a session go to stderr, the first one since error_clear()
+ * on this thread is kept too, so the job server can send it back
+ */
+static __thread char first_error[256];
+
+void error_report(const char *fmt, ...)
+{
+    char line[sizeof(first_error)];
+    size_t len = 0;
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    fputs(line, stderr);
+
+    if (first_error[0] != '\0')
+        return;
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+    memcpy(first_error, line, len + 1);
+}
+
+void error_clear(void)
+{
+    first_error[0] = '\0';
+}
+
+// "" when there was none
+const char *error_first(void)
+{
+    return first_error;
+}
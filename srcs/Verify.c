@@ -0,0 +1,232 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Verify.h"
+#include "Inject.h"
+#include "HexFile.h"
+#include "Utils.h"
+
+/*
+ * Verify and repair
+ *
+ * The bootloader has no read back, a bootloader reporting uiBootRev
+ * >= BOOT_REV_CRC answers
+ *
+ *   [0x0f][cmdCRC][address 4][count 2][span 2]
+ *
+ * with [0x0f][cmdCRC][count 2] and count CRC-32s of consecutive spans
+ * of flash. The host CRCs every data byte as it goes out, so streamed
+ * and packed sessions are covered too, pages the device disagrees on
+ * are erased and written again, raw, from the image. A streamed
+ * program image is gone by then, its mismatches fail the session.
+ */
+
+void verify_reset(TVerify *verify)
+{
+    memset(verify, 0, sizeof(TVerify));
+}
+
+/*
+ * A region starts going out, size bytes at address checked span bytes
+ * at a time
+ */
+void verify_region(TVerify *verify, int region, uint32_t address, uint32_t size, uint32_t span)
+{
+    uint32_t pages = (span > 0) ? (size + span - 1) / span : 0;
+
+    verify->first = verify->count;
+    if (verify->count + (int)pages > VERIFY_MAX_PAGES)
+    {
+        verify->overflow = 1;
+        return;
+    }
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        TVerifyPage *page = &verify->pages[verify->count++];
+        memset(page, 0, sizeof(TVerifyPage));
+        page->address = address + i * span;
+        page->span = span;
+        page->region = (uint8_t)region;
+        page->bad = 1;
+    }
+}
+
+// data for offset of the region being written went out
+void verify_feed(TVerify *verify, uint32_t offset, const char *data, uint32_t len)
+{
+    while (len > 0 && !verify->overflow && verify->first < verify->count)
+    {
+        uint32_t span = verify->pages[verify->first].span;
+        int index = verify->first + (int)(offset / span);
+        uint32_t chunk = span - offset % span;
+        TVerifyPage *page = NULL;
+
+        if (index >= verify->count)
+            return;
+        page = &verify->pages[index];
+        if (chunk > len)
+            chunk = len;
+        page->crc = crc32_update(page->crc, data, chunk);
+        page->filled += chunk;
+        data += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+static int verify_command(TBootSession *session, int cmd, uint32_t address, uint16_t count, uint16_t span, uint8_t out_only)
+{
+    char *out = session->data_out;
+
+    memset(out, 0, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+    out[0] = 0x0f;
+    out[1] = (char)cmd;
+    memcpy(out + 2, &address, sizeof(uint32_t));
+    memcpy(out + 6, &count, sizeof(uint16_t));
+    if (cmd == cmdCRC)
+        memcpy(out + 8, &span, sizeof(uint16_t));
+    return boot_interrupt_transfers(session->transport, session->data_in, out, out_only);
+}
+
+/*
+ * Ask for the CRCs of the pages still marked bad, clears the ones that
+ * match, returns how many are still bad or -1 on a transfer error
+ */
+static int verify_check(TBootSession *session, TVerify *verify)
+{
+    uint8_t erased[MAX_INTERRUPT_OUT_TRANSFER_SIZE];
+    int bad = 0;
+
+    memset(erased, 0xff, sizeof(erased));
+
+    for (int i = 0; i < verify->count;)
+    {
+        TVerifyPage *first = &verify->pages[i];
+        int n = 1;
+        uint16_t count = 0;
+
+        if (!first->bad)
+        {
+            i++;
+            continue;
+        }
+        // a run of neighbouring pages in one request
+        while (i + n < verify->count && n < VERIFY_PER_REPORT && verify->pages[i + n].bad &&
+               verify->pages[i + n].span == first->span &&
+               verify->pages[i + n].address == first->address + n * first->span)
+            n++;
+
+        if (verify_command(session, cmdCRC, first->address, (uint16_t)n, (uint16_t)first->span, 0) != 0)
+            return -1;
+        memcpy(&count, session->data_in + 2, sizeof(uint16_t));
+        if ((uint8_t)session->data_in[1] != cmdCRC || count != n)
+        {
+            error_report("verify: no CRCs for %08x\n", first->address);
+            return -1;
+        }
+
+        for (int k = 0; k < n; k++)
+        {
+            TVerifyPage *page = &verify->pages[i + k];
+            uint32_t crc = 0;
+
+            // the erased rest of a page that was not sent in full
+            while (page->filled < page->span)
+            {
+                uint32_t chunk = page->span - page->filled;
+                if (chunk > sizeof(erased))
+                    chunk = sizeof(erased);
+                page->crc = crc32_update(page->crc, erased, chunk);
+                page->filled += chunk;
+            }
+            memcpy(&crc, session->data_in + 4 + 4 * k, sizeof(uint32_t));
+            page->bad = (crc != page->crc);
+            bad += page->bad;
+            verify->checked++;
+        }
+        i += n;
+    }
+    return bad;
+}
+
+/*
+ * Erase and write one page from the image, raw
+ */
+static int verify_rewrite(TBootSession *session, TVerifyPage *page)
+{
+    THexImage *image = session->image;
+    const uint8_t *src = NULL;
+
+    if (page->region == 2)
+        src = image->conf;
+    else if (page->region == 1)
+        src = image->boot;
+    else if (image->prg != NULL)
+        src = overlay_source(session->overlay, image->prg, page->address - _PIC32Mn_STARTFLASH);
+    if (src == NULL)
+    {
+        error_report("verify: %08x differs and the streamed image is gone, flash again without --stream\n",
+                page->address);
+        return -1;
+    }
+
+    if (verify_command(session, cmdERASE, page->address, 1, 0, 0) != 0 ||
+        verify_command(session, cmdWRITE, page->address, (uint16_t)page->span, 0, 1) != 0)
+        return -1;
+    for (uint32_t sent = 0; sent < page->span; sent += MAX_INTERRUPT_OUT_TRANSFER_SIZE)
+    {
+        // the device acknowledges the last report of the write
+        uint8_t out_only = (sent + MAX_INTERRUPT_OUT_TRANSFER_SIZE < page->span) ? 1 : 0;
+        memcpy(session->data_out, src + sent, MAX_INTERRUPT_OUT_TRANSFER_SIZE);
+        if (boot_interrupt_transfers(session->transport, session->data_in, session->data_out, out_only) != 0)
+            return -1;
+    }
+    session->verify_state.rewritten++;
+    return 0;
+}
+
+/*
+ * CRC everything written this session, rewrite what differs, up to
+ * VERIFY_ROUNDS times. 0 when the device holds the image
+ */
+int verify_repair(TBootSession *session)
+{
+    TVerify *verify = &session->verify_state;
+    double start = time_now_ms();
+    int bad = 0;
+
+    if (verify->overflow)
+    {
+        if (!session->quiet)
+            printf("verify: more than %d pages, not verified\n", VERIFY_MAX_PAGES);
+        return 0;
+    }
+
+    trace_state(session->trace, cmdCRC, 3);
+    for (int round = 0;; round++)
+    {
+        bad = verify_check(session, verify);
+        if (bad <= 0 || round == VERIFY_ROUNDS)
+            break;
+        for (int i = 0; i < verify->count; i++)
+        {
+            if (verify->pages[i].bad && verify_rewrite(session, &verify->pages[i]) != 0)
+                return -1;
+        }
+    }
+    verify->ms = time_now_ms() - start;
+
+    if (bad < 0)
+        return -1;
+    if (!session->quiet)
+        printf("\nverify: %u pages checked, %u rewritten, %.1f ms\n", verify->checked, verify->rewritten, verify->ms);
+    fflush(stdout);
+    for (int i = 0; i < verify->count && bad > 0; i++)
+    {
+        if (verify->pages[i].bad)
+            error_report("verify: %08x still differs after %d rewrites\n", verify->pages[i].address, VERIFY_ROUNDS);
+    }
+    return (bad == 0) ? 0 : -1;
+}
@@ -0,0 +1,393 @@
+// OS Detection
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+    #ifndef _WIN32
+        #define _WIN32
+    #endif
+#elif defined(__linux__)
+    #ifdef _WIN32
+        #undef _WIN32
+    #endif
+#endif
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Watch.h"
+#include "Utils.h"
+
+/*
+ * Watch mode
+ *
+ * During development the same board is rebuilt and flashed dozens of
+ * times an hour. With --watch the process stays up after the first
+ * session, the transport with its shims, the INFO record of the board
+ * and the conditioned image it holds are kept. inotify on the
+ * directories of the hex files tells when a build is done (a close
+ * after writing or a rename into place, then WATCH_SETTLE_MS without
+ * another one), the files are conditioned again for the kept record
+ * and compared with the image on the board one erase page at a time.
+ * Only the runs of program pages that differ are erased and written,
+ * the boot page and config only when they differ.
+ *
+ * The board has to be back in its bootloader for that, through the
+ * serial trigger or a reset, each build waits --enum-timeout for it.
+ * A build the board did not come back for is compared with the same
+ * image next time, a session that failed leaves the board holding
+ * something unknown and the next build flashes everything.
+ */
+
+/*
+ * Compare image with old, the one the board holds, one erase page at
+ * a time. The program pages that differ go into runs of at most
+ * REGION_RUN_BYTES. Returns the REGION_* bits to flash, 0 = nothing
+ * changed, REGION_ALL and no runs when they do not fit in
+ * REGION_MAX_RUNS.
+ */
+int watch_diff(const THexImage *old, const THexImage *image, const TBootInfo *bootinfo, TPageRun *runs, int *run_count,
+               uint32_t *changed)
+{
+    uint32_t erase = bootinfo->uiEraseBlock.fValue.intVal;
+    uint32_t limit = bootinfo->ulMcuSize.fValue - 0x10000;
+    uint32_t end = (old->prg_mem_count > image->prg_mem_count) ? old->prg_mem_count : image->prg_mem_count;
+    uint32_t run_pages = 0;
+    int regions = 0;
+
+    *run_count = 0;
+    *changed = 0;
+    if (erase == 0)
+        return REGION_ALL;
+    run_pages = (erase < REGION_RUN_BYTES) ? REGION_RUN_BYTES / erase : 1;
+
+    // a build that shrank gets the pages it no longer covers erased
+    end = ((end + erase - 1) / erase) * erase;
+    if (end > limit)
+        end = limit;
+    for (uint32_t offset = 0; offset < end; offset += erase)
+    {
+        TPageRun *last = (*run_count > 0) ? &runs[*run_count - 1] : NULL;
+
+        if (memcmp(old->prg + offset, image->prg + offset, erase) == 0)
+            continue;
+        (*changed)++;
+        if (last != NULL && last->offset + last->pages * erase == offset && last->pages < run_pages)
+        {
+            last->pages++;
+            continue;
+        }
+        if (*run_count == REGION_MAX_RUNS)
+        {
+            *run_count = 0;
+            return REGION_ALL;
+        }
+        runs[*run_count].offset = offset;
+        runs[*run_count].pages = 1;
+        (*run_count)++;
+    }
+
+    if (*run_count > 0)
+        regions |= REGION_PROGRAM;
+    if (memcmp(old->boot, image->boot, image->boot_size) != 0)
+        regions |= REGION_BOOTPAGE;
+    if (memcmp(old->conf, image->conf, bootinfo->uiWriteBlock.fValue.intVal * 3) != 0)
+        regions |= REGION_CONFIG;
+    return regions;
+}
+
+#ifdef _WIN32
+
+int watch_run(TWatchTarget *target, TBootSession *proto, FILE *out)
+{
+    (void)target;
+    (void)proto;
+    (void)out;
+    fprintf(stderr, "--watch needs inotify, not available on Windows\n");
+    return -1;
+}
+
+#else
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+typedef struct
+{
+    int fd;
+    int wd[MAX_HEX_FILES];
+    const char *name[MAX_HEX_FILES];
+    int count;
+} TWatchFiles;
+
+typedef struct
+{
+    TBootInfo bootinfo;   // the images are conditioned for this record
+    int have_bootinfo;
+    THexImage flashed;    // what the board holds, prg NULL = not known
+    THexImage next;       // the build being flashed
+    TPageRun runs[REGION_MAX_RUNS];
+    int regions;          // --regions, what a full flash covers
+    int full;             // this session flashes all of it
+} TWatch;
+
+static void watch_drop(THexImage *image)
+{
+    free_hex_image(image);
+    memset(image, 0, sizeof(THexImage));
+}
+
+static int watch_same_geometry(const TBootInfo *a, const TBootInfo *b)
+{
+    return a->ulMcuSize.fValue == b->ulMcuSize.fValue && a->uiEraseBlock.fValue.intVal == b->uiEraseBlock.fValue.intVal &&
+           a->uiWriteBlock.fValue.intVal == b->uiWriteBlock.fValue.intVal;
+}
+
+/*
+ * The build conditioned ahead for the kept INFO record. The first
+ * session, or a board of another geometry, conditions for the record
+ * just read and flashes everything.
+ */
+static THexImage *watch_image(TBootSession *session, void *ctx)
+{
+    TWatch *watch = ctx;
+
+    if (watch->have_bootinfo && watch->next.file_size > 0 && watch_same_geometry(&watch->bootinfo, &session->bootinfo))
+        return &watch->next;
+
+    watch->bootinfo = session->bootinfo;
+    watch->have_bootinfo = 1;
+    watch_drop(&watch->flashed);
+    watch_drop(&watch->next);
+    condition_hexfile_data(session->paths, session->path_count, &watch->bootinfo, &watch->next);
+    session->runs = NULL;
+    session->run_count = 0;
+    session->regions = watch->regions;
+    watch->full = 1;
+    return &watch->next;
+}
+
+static int watch_files_open(TWatchFiles *files, char **paths, int count)
+{
+    files->fd = inotify_init1(IN_CLOEXEC);
+    if (files->fd < 0)
+    {
+        fprintf(stderr, "watch: inotify: %s\n", strerror(errno));
+        return -1;
+    }
+    files->count = count;
+    for (int i = 0; i < count; i++)
+    {
+        // the directory, a build may write a new file and rename it over the old one
+        char dir[256];
+        const char *slash = strrchr(paths[i], '/');
+
+        if (slash == NULL)
+            snprintf(dir, sizeof(dir), ".");
+        else if (slash == paths[i])
+            snprintf(dir, sizeof(dir), "/");
+        else
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - paths[i]), paths[i]);
+        files->name[i] = (slash != NULL) ? slash + 1 : paths[i];
+        files->wd[i] = inotify_add_watch(files->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (files->wd[i] < 0)
+        {
+            fprintf(stderr, "watch: %s: %s\n", dir, strerror(errno));
+            close(files->fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 1 when one of the events in buf is about a watched file
+static int watch_files_match(const TWatchFiles *files, const char *buf, ssize_t len)
+{
+    const char *p = buf;
+
+    while (p < buf + len)
+    {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+
+        for (int i = 0; i < files->count; i++)
+        {
+            if (event->wd == files->wd[i] && event->len > 0 && strcmp(event->name, files->name[i]) == 0)
+                return 1;
+        }
+        p += sizeof(struct inotify_event) + event->len;
+    }
+    return 0;
+}
+
+/*
+ * Block until a build wrote one of the files and left them alone for
+ * WATCH_SETTLE_MS, *change_ms is when its first write was seen
+ */
+static int watch_files_wait(TWatchFiles *files, double *change_ms)
+{
+    uint32_t buf[1024];
+    int timeout = -1;
+
+    *change_ms = 0.0;
+    for (;;)
+    {
+        struct pollfd pfd = {files->fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        ssize_t n = 0;
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return -1;
+        if (ready == 0)
+            return 0;
+
+        n = read(files->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (watch_files_match(files, (const char *)buf, n))
+        {
+            if (*change_ms == 0.0)
+                *change_ms = time_now_ms();
+            timeout = WATCH_SETTLE_MS;
+        }
+    }
+}
+
+/*
+ * Flash proto's hex files over proto->transport, the board opened by
+ * the caller, then again whenever they are rebuilt. Returns only when
+ * the files can no longer be watched.
+ */
+int watch_run(TWatchTarget *target, TBootSession *proto, FILE *out)
+{
+    TWatch watch;
+    TWatchFiles files;
+    TTransport *tp = proto->transport;
+    int build = 0;
+
+    memset(&watch, 0, sizeof(TWatch));
+    watch.regions = proto->regions;
+    if (watch_files_open(&files, proto->paths, proto->path_count) != 0)
+        return -1;
+
+    for (;;)
+    {
+        TBootSession session = *proto;
+        double change_ms = 0.0, settled_ms = 0.0, parsed_ms = 0.0, open_ms = 0.0, running_ms = 0.0;
+        uint32_t changed = 0;
+        int result = 0;
+
+        session.image_source = watch_image;
+        session.image_ctx = &watch;
+        watch.full = (watch.flashed.prg == NULL);
+        if (build > 0)
+        {
+            if (watch_files_wait(&files, &change_ms) != 0)
+                break;
+            settled_ms = time_now_ms();
+
+            // conditioned for the kept record while the board is still running
+            watch_drop(&watch.next);
+            if (condition_hexfile_data(proto->paths, proto->path_count, &watch.bootinfo, &watch.next) == 0)
+            {
+                fprintf(stderr, "watch: the build could not be conditioned, waiting for the next one\n");
+                continue;
+            }
+            parsed_ms = time_now_ms();
+            if (watch.flashed.prg != NULL)
+            {
+                session.regions = watch_diff(&watch.flashed, &watch.next, &watch.bootinfo, watch.runs, &session.run_count,
+                                             &changed);
+                session.runs = watch.runs;
+                if (session.run_count == 0 && session.regions == REGION_ALL)
+                {
+                    session.regions = watch.regions;
+                    watch.full = 1;
+                }
+                if (session.regions == 0)
+                {
+                    fprintf(out, "watch: build %d flashes nothing, the image is what the board holds\n", build);
+                    continue;
+                }
+            }
+
+            tp = target->open(target->ctx);
+            if (tp == NULL)
+            {
+                fprintf(stderr, "watch: board not in its bootloader, waiting for the next build\n");
+                continue;
+            }
+        }
+        open_ms = time_now_ms();
+
+        session.transport = tp;
+        result = setupChiptoBoot(&session);
+        release_boot_session(&session);
+        if (result != 0)
+        {
+            target->close(target->ctx);
+            watch_drop(&watch.flashed);
+            fprintf(stderr, "watch: build %d failed, the next one flashes everything\n", build);
+            build++;
+            continue;
+        }
+
+        running_ms = session.reboot_ms;
+        if (target->running != NULL && target->running(target->ctx, session.reboot_ms, &running_ms) != 0)
+            running_ms = 0.0;
+        target->close(target->ctx);
+
+        // the board holds this build now
+        watch_drop(&watch.flashed);
+        watch.flashed = watch.next;
+        memset(&watch.next, 0, sizeof(THexImage));
+
+        if (build == 0)
+        {
+            fprintf(out, "watch: build 0 flashed in %.1f ms, watching %d file%s\n", session.reboot_ms - open_ms, files.count,
+                    (files.count == 1) ? "" : "s");
+            fflush(out);
+            build++;
+            continue;
+        }
+
+        fprintf(out, "watch: build %d", build);
+        if (watch.full)
+        {
+            fprintf(out, " flashed in full");
+        }
+        else
+        {
+            uint32_t erase = watch.bootinfo.uiEraseBlock.fValue.intVal;
+
+            fprintf(out, ", %u of %u program pages in %d run%s%s%s", changed, (watch.flashed.prg_mem_count + erase - 1) / erase,
+                    session.run_count, (session.run_count == 1) ? "" : "s",
+                    (session.regions & REGION_BOOTPAGE) ? ", bootpage" : "", (session.regions & REGION_CONFIG) ? ", config" : "");
+        }
+        if (running_ms > 0.0)
+            fprintf(out, ", change to running %.1f ms", running_ms - change_ms);
+        else
+            fprintf(out, ", application did not start");
+        fprintf(out, " (settle %.1f, parse %.1f, bootloader %.1f, flash %.1f", settled_ms - change_ms, parsed_ms - settled_ms,
+                open_ms - parsed_ms, session.reboot_ms - open_ms);
+        if (target->running != NULL && running_ms > 0.0)
+            fprintf(out, ", start %.1f", running_ms - session.reboot_ms);
+        fprintf(out, ")\n");
+        fflush(out);
+        build++;
+    }
+
+    close(files.fd);
+    watch_drop(&watch.flashed);
+    watch_drop(&watch.next);
+    return -1;
+}
+
+#endif